@@ -23,6 +23,8 @@ classdef lightCollector
     tEnd (1,1) double {mustBeFinite} = 1e-12 % [s] End of the detection time interval
     nTimeBins (1,1) double {mustBeInteger, mustBeNonnegative} = 0 % Number of bins between tStart and tEnd. If zero, the measurement is not time-resolved.
 
+    collectedPhotonsFile (1,:) char = '' % If not empty, a binary record of every collected photon is written to this file. Read it with MCmatlab.readCollectedPhotons.
+
     %% Calculated properties
     image = NaN
     X = NaN
@@ -16,6 +16,8 @@ classdef lightSource
 
     emitterLength (1,1) double {mustBeNonnegative} = 0                       % [cm] Length of isotropic emitter (line or point)
 
+    relativePower (1,1) double {mustBeNonnegative, mustBeFinite} = 1 % [-] Power of this light source relative to the other light sources in model.MC.lightSource, if there are several
+
     focalPlaneIntensityDistribution (1,1) MCmatlab.sourceIntensityDistribution
     angularIntensityDistribution (1,1) MCmatlab.sourceIntensityDistribution
 
@@ -46,10 +46,17 @@ function model = combineModels(modelArray,simType)
 
   % Verify that the relevant MC.LC input properties are identical
   LCprops = {'x','y','z','theta','phi','f','diam','fieldSize','NA','res','tStart','tEnd','nTimeBins'};
+  for iModel = 2:numel(modelArray)
+    if numel(modelArray(iModel).MC.LC) ~= numel(modelArray(1).MC.LC)
+      error('Error: The numbers of light collectors are not identical, so the objects cannot be combined.');
+    end
+  end
   for iProp = 1:numel(LCprops)
     allEqual = true;
     for iModel = 2:numel(modelArray)
-      allEqual = allEqual && isequaln(modelArray(iModel).MC.LC.(LCprops{iProp}),modelArray(1).MC.LC.(LCprops{iProp}));
+      for iLC = 1:numel(modelArray(1).MC.LC)
+        allEqual = allEqual && isequaln(modelArray(iModel).MC.LC(iLC).(LCprops{iProp}),modelArray(1).MC.LC(iLC).(LCprops{iProp}));
+      end
     end
     if ~allEqual
       error('Error: The light collector %s properties are not identical, so the objects cannot be combined.',LCprops{iProp});
@@ -89,8 +96,11 @@ function model = combineModels(modelArray,simType)
         model.MC.P = model.MC.P + modelArray(iModel).MC.P;
       end
 
-      model.MC.LC.image   = model.MC.LC.image   + w/w1*modelArray(iModel).MC.LC.image;
+      for iLC = 1:numel(model.MC.LC)
+        model.MC.LC(iLC).image = model.MC.LC(iLC).image + w/w1*modelArray(iModel).MC.LC(iLC).image;
+      end
       model.MC.NFR        = model.MC.NFR        + w/w1*modelArray(iModel).MC.NFR;
+      model.MC.jacobian   = model.MC.jacobian   + w/w1*modelArray(iModel).MC.jacobian;
       model.MC.farField   = model.MC.farField   + w/w1*modelArray(iModel).MC.farField;
       model.MC.NI_xpos    = model.MC.NI_xpos    + w/w1*modelArray(iModel).MC.NI_xpos;
       model.MC.NI_xneg    = model.MC.NI_xneg    + w/w1*modelArray(iModel).MC.NI_xneg;
@@ -98,6 +108,10 @@ function model = combineModels(modelArray,simType)
       model.MC.NI_yneg    = model.MC.NI_yneg    + w/w1*modelArray(iModel).MC.NI_yneg;
       model.MC.NI_zpos    = model.MC.NI_zpos    + w/w1*modelArray(iModel).MC.NI_zpos;
       model.MC.NI_zneg    = model.MC.NI_zneg    + w/w1*modelArray(iModel).MC.NI_zneg;
+      model.MC.NFR_rz     = model.MC.NFR_rz     + w/w1*modelArray(iModel).MC.NFR_rz;
+      model.MC.NI_zpos_r  = model.MC.NI_zpos_r  + w/w1*modelArray(iModel).MC.NI_zpos_r;
+      model.MC.NI_zneg_r  = model.MC.NI_zneg_r  + w/w1*modelArray(iModel).MC.NI_zneg_r;
+      model.MC.NFR_grid   = model.MC.NFR_grid   + w/w1*modelArray(iModel).MC.NFR_grid;
     end
 
     if ~lightSourcesAndPowersEqual
@@ -108,8 +122,11 @@ function model = combineModels(modelArray,simType)
     end
 
     % Renormalize outputs
-    model.MC.LC.image   = model.MC.LC.image  *w1/wTot;
+    for iLC = 1:numel(model.MC.LC)
+      model.MC.LC(iLC).image = model.MC.LC(iLC).image*w1/wTot;
+    end
     model.MC.NFR        = model.MC.NFR       *w1/wTot;
+    model.MC.jacobian   = model.MC.jacobian  *w1/wTot;
     model.MC.farField   = model.MC.farField  *w1/wTot;
     model.MC.NI_xpos    = model.MC.NI_xpos   *w1/wTot;
     model.MC.NI_xneg    = model.MC.NI_xneg   *w1/wTot;
@@ -117,6 +134,10 @@ function model = combineModels(modelArray,simType)
     model.MC.NI_yneg    = model.MC.NI_yneg   *w1/wTot;
     model.MC.NI_zpos    = model.MC.NI_zpos   *w1/wTot;
     model.MC.NI_zneg    = model.MC.NI_zneg   *w1/wTot;
+    model.MC.NFR_rz     = model.MC.NFR_rz    *w1/wTot;
+    model.MC.NI_zpos_r  = model.MC.NI_zpos_r *w1/wTot;
+    model.MC.NI_zneg_r  = model.MC.NI_zneg_r *w1/wTot;
+    model.MC.NFR_grid   = model.MC.NFR_grid  *w1/wTot;
   elseif strcmp(simType,'FMC')
     %% Combine FMC
     % Verify that all MC objects are identical
@@ -147,10 +168,17 @@ function model = combineModels(modelArray,simType)
 
     % Verify that the relevant FMC.LC input properties are identical
     LCprops = {'x','y','z','theta','phi','f','diam','fieldSize','NA','res','tStart','tEnd','nTimeBins'};
+    for iModel = 2:numel(modelArray)
+      if numel(modelArray(iModel).FMC.LC) ~= numel(modelArray(1).FMC.LC)
+        error('Error: The numbers of FMC light collectors are not identical, so the objects cannot be combined.');
+      end
+    end
     for iProp = 1:numel(LCprops)
       allEqual = true;
       for iModel = 2:numel(modelArray)
-        allEqual = allEqual && isequaln(modelArray(iModel).FMC.LC.(LCprops{iProp}),modelArray(1).FMC.LC.(LCprops{iProp}));
+        for iLC = 1:numel(modelArray(1).FMC.LC)
+          allEqual = allEqual && isequaln(modelArray(iModel).FMC.LC(iLC).(LCprops{iProp}),modelArray(1).FMC.LC(iLC).(LCprops{iProp}));
+        end
       end
       if ~allEqual
         error('Error: The FMC light collector %s properties are not identical, so the objects cannot be combined.',LCprops{iProp});
@@ -169,8 +197,11 @@ function model = combineModels(modelArray,simType)
       model.FMC.nPhotonsCollected = model.FMC.nPhotonsCollected + modelArray(iModel).FMC.nPhotonsCollected;
       model.FMC.examplePaths = cat(2,model.FMC.examplePaths,modelArray(iModel).FMC.examplePaths);
 
-      model.FMC.LC.image   = model.FMC.LC.image   + w/w1*modelArray(iModel).FMC.LC.image;
+      for iLC = 1:numel(model.FMC.LC)
+        model.FMC.LC(iLC).image = model.FMC.LC(iLC).image + w/w1*modelArray(iModel).FMC.LC(iLC).image;
+      end
       model.FMC.NFR        = model.FMC.NFR        + w/w1*modelArray(iModel).FMC.NFR;
+      model.FMC.jacobian   = model.FMC.jacobian   + w/w1*modelArray(iModel).FMC.jacobian;
       model.FMC.farField   = model.FMC.farField   + w/w1*modelArray(iModel).FMC.farField;
       model.FMC.NI_xpos    = model.FMC.NI_xpos    + w/w1*modelArray(iModel).FMC.NI_xpos;
       model.FMC.NI_xneg    = model.FMC.NI_xneg    + w/w1*modelArray(iModel).FMC.NI_xneg;
@@ -178,13 +209,20 @@ function model = combineModels(modelArray,simType)
       model.FMC.NI_yneg    = model.FMC.NI_yneg    + w/w1*modelArray(iModel).FMC.NI_yneg;
       model.FMC.NI_zpos    = model.FMC.NI_zpos    + w/w1*modelArray(iModel).FMC.NI_zpos;
       model.FMC.NI_zneg    = model.FMC.NI_zneg    + w/w1*modelArray(iModel).FMC.NI_zneg;
+      model.FMC.NFR_rz     = model.FMC.NFR_rz     + w/w1*modelArray(iModel).FMC.NFR_rz;
+      model.FMC.NI_zpos_r  = model.FMC.NI_zpos_r  + w/w1*modelArray(iModel).FMC.NI_zpos_r;
+      model.FMC.NI_zneg_r  = model.FMC.NI_zneg_r  + w/w1*modelArray(iModel).FMC.NI_zneg_r;
+      model.FMC.NFR_grid   = model.FMC.NFR_grid   + w/w1*modelArray(iModel).FMC.NFR_grid;
     end
 
     wTot = model.FMC.nPhotons; % Weight total
 
     % Renormalize outputs
-    model.FMC.LC.image   = model.FMC.LC.image  *w1/wTot;
+    for iLC = 1:numel(model.FMC.LC)
+      model.FMC.LC(iLC).image = model.FMC.LC(iLC).image*w1/wTot;
+    end
     model.FMC.NFR        = model.FMC.NFR       *w1/wTot;
+    model.FMC.jacobian   = model.FMC.jacobian  *w1/wTot;
     model.FMC.farField   = model.FMC.farField  *w1/wTot;
     model.FMC.NI_xpos    = model.FMC.NI_xpos   *w1/wTot;
     model.FMC.NI_xneg    = model.FMC.NI_xneg   *w1/wTot;
@@ -192,5 +230,9 @@ function model = combineModels(modelArray,simType)
     model.FMC.NI_yneg    = model.FMC.NI_yneg   *w1/wTot;
     model.FMC.NI_zpos    = model.FMC.NI_zpos   *w1/wTot;
     model.FMC.NI_zneg    = model.FMC.NI_zneg   *w1/wTot;
+    model.FMC.NFR_rz     = model.FMC.NFR_rz    *w1/wTot;
+    model.FMC.NI_zpos_r  = model.FMC.NI_zpos_r *w1/wTot;
+    model.FMC.NI_zneg_r  = model.FMC.NI_zneg_r *w1/wTot;
+    model.FMC.NFR_grid   = model.FMC.NFR_grid  *w1/wTot;
   end
 end
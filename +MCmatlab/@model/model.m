@@ -175,7 +175,7 @@ classdef model
     plotMediaProperties(nFig,model,simType)
     inferno(m)
 
-    MCmatlab(model,simType)
+    MCmatlab(model,simType,resumeFile,continuePrevious)
     MCmatlab_CUDA(model,simType)
   end
 
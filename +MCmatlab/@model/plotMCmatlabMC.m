@@ -48,6 +48,7 @@ function model = plotMCmatlabMC(model,varargin)
 % 10: Boundary Irradiances
 % 11: Emitter distribution
 % 12-20: Same as incident light but for fluorescence, 17 unused
+% 50-63: Collected light of the second and later light collectors (60-73 for fluorescence)
 % 21: Temperature plot during heat sim
 % 22: Thermal media properties
 % 23: Temperature sensor locations
@@ -97,7 +98,6 @@ if MCorFMC.nPhotons == 0
   error('Error: No photons were successfully simulated. Check your model file to ensure photons launch within the simulation cuboid.');
 end
 
-LC = MCorFMC.LC;
 
 %% Plot emitter distribution
 P_in = 1;
@@ -132,22 +132,32 @@ h_f.Name = 'Media properties';
 
 if ~isscalar(MCorFMC.NFR)
   NA = MCorFMC.NA;
+  roi = MCorFMC.NFRroi;
+  fullRange = [1 G.nx 1 G.ny 1 G.nz];
+  roi(isnan(roi)) = fullRange(isnan(roi)); % NFR may only cover a region of interest of the cuboid
+  xROI = G.x(roi(1):roi(2));
+  yROI = G.y(roi(3):roi(4));
+  zROI = G.z(roi(5):roi(6));
   %% Make absorption plot
   h_f = MCmatlab.NdimSliderPlot(NA,...
     'nFig',3 + figNumOffset,...
-    'axisValues',{G.x,G.y,G.z,MCorFMC.wavelength},...
+    'axisValues',{xROI,yROI,zROI,MCorFMC.wavelength},...
     'axisLabels',{'x [cm]','y [cm]','z [cm]',lambdatext,['Normalized ' fluorescenceOrNothing 'absorbed power per unit volume [W/cm^3/W.incident]']},...
     'plotLimits',[0 NaN],...
     'axisEqual',true,...
     'reversedAxes',3);
   h_f.Name = ['Normalized ' fluorescenceOrNothing 'absorption'];
   
-  fprintf(['%.3g%% of ' fluorescenceOrIncident 'light was absorbed within the cuboid.\n'],100*G.dx*G.dy*G.dz*sum(NA(:))/P_in);
+  if any(~isnan(MCorFMC.NFRroi))
+    fprintf(['%.3g%% of ' fluorescenceOrIncident 'light was absorbed within the region of interest.\n'],100*G.dx*G.dy*G.dz*sum(NA(:))/P_in);
+  else
+    fprintf(['%.3g%% of ' fluorescenceOrIncident 'light was absorbed within the cuboid.\n'],100*G.dx*G.dy*G.dz*sum(NA(:))/P_in);
+  end
   
   %% Make fluence rate plot
   h_f = MCmatlab.NdimSliderPlot(MCorFMC.NFR,...
     'nFig',4 + figNumOffset,...
-    'axisValues',{G.x,G.y,G.z,MCorFMC.wavelength},...
+    'axisValues',{xROI,yROI,zROI,MCorFMC.wavelength},...
     'axisLabels',{'x [cm]','y [cm]','z [cm]',lambdatext,['Normalized ' fluorescenceOrNothing 'fluence rate [W/cm^2/W.incident]']},...
     'plotLimits',[0 NaN],...
     'axisEqual',true,...
@@ -155,6 +165,28 @@ if ~isscalar(MCorFMC.NFR)
   h_f.Name = ['Normalized ' fluorescenceOrNothing 'fluence rate'];
 end
 
+%% Make scoring grid fluence rate plot
+if any(MCorFMC.scoringGridRes) && ~isscalar(MCorFMC.NFR_grid)
+  if MCorFMC.scoringGridNTimeBins > 0
+    axisValues = {MCorFMC.x_grid,MCorFMC.y_grid,MCorFMC.z_grid,MCorFMC.t_grid,MCorFMC.wavelength};
+    axisLabels = {'x [cm]','y [cm]','z [cm]','t [s]',lambdatext,['Normalized time-resolved ' fluorescenceOrNothing 'fluence rate on the scoring grid [W/cm^2/W.incident]']};
+  else
+    axisValues = {MCorFMC.x_grid,MCorFMC.y_grid,MCorFMC.z_grid,MCorFMC.wavelength};
+    axisLabels = {'x [cm]','y [cm]','z [cm]',lambdatext,['Normalized ' fluorescenceOrNothing 'fluence rate on the scoring grid [W/cm^2/W.incident]']};
+  end
+  h_f = MCmatlab.NdimSliderPlot(MCorFMC.NFR_grid,...
+    'nFig',9 + figNumOffset,...
+    'axisValues',axisValues,...
+    'axisLabels',axisLabels,...
+    'plotLimits',[0 NaN],...
+    'axisEqual',true,...
+    'reversedAxes',3);
+  h_f.Name = ['Normalized ' fluorescenceOrNothing 'fluence rate, scoring grid'];
+  if MCorFMC.scoringGridNTimeBins > 0
+    fprintf('Time-resolved scoring grid data plotted. Note that first time bin includes all\n  photons at earlier times and last time bin includes all photons at later times.\n');
+  end
+end
+
 %% Plot example paths
 if MCorFMC.nExamplePaths > 0
   [h_f,h_a] = MCmatlab.NdimSliderPlot(G.M_raw,...
@@ -224,74 +256,100 @@ if MCorFMC.useLightCollector
   box on;grid on;grid minor;
 
   arrowlength = sqrt((G.nx*G.dx)^2+(G.ny*G.dy)^2+(G.nz*G.dz)^2)/5;
-  Zvec = [sin(LC.theta)*cos(LC.phi) , sin(LC.theta)*sin(LC.phi) , cos(LC.theta)];
-  Xvec = [sin(LC.phi) , -cos(LC.phi) , 0];
-  Yvec = cross(Zvec,Xvec);
-  FPC = [LC.x , LC.y , LC.z]; % Focal Plane Center
-  FPC_X = FPC + arrowlength*Xvec;
-  line(h_a,[FPC(1) FPC_X(1)],[FPC(2) FPC_X(2)],[FPC(3) FPC_X(3)],'Linewidth',2,'Color','r')
-  text(h_a,FPC_X(1),FPC_X(2),FPC_X(3),'X','HorizontalAlignment','center','FontSize',18)
-  FPC_Y = FPC + arrowlength*Yvec;
-  line(h_a,[FPC(1) FPC_Y(1)],[FPC(2) FPC_Y(2)],[FPC(3) FPC_Y(3)],'Linewidth',2,'Color','r')
-  text(h_a,FPC_Y(1),FPC_Y(2),FPC_Y(3),'Y','HorizontalAlignment','center','FontSize',18)
-
-  if isfinite(LC.f)
-    fieldperimeter = LC.fieldSize/2*(cos(linspace(0,2*pi,100).')*Xvec + sin(linspace(0,2*pi,100).')*Yvec) + FPC;
-    h1 = line(h_a,fieldperimeter(:,1),fieldperimeter(:,2),fieldperimeter(:,3),'Color','b','LineWidth',2);
-    LCC = FPC - Zvec*LC.f; % Light Collector Center
-    detectoraperture = LC.diam/2*(cos(linspace(0,2*pi,100).')*Xvec + sin(linspace(0,2*pi,100).')*Yvec) + LCC;
-    h2 = line(h_a,detectoraperture(:,1),detectoraperture(:,2),detectoraperture(:,3),'Color','r','LineWidth',2);
-    legend(h_a,[h1 h2],'Imaged area','Lens aperture','Location','northeast');
-  else
-    LCC = FPC;
-    detectoraperture = LC.diam/2*(cos(linspace(0,2*pi,100).')*Xvec + sin(linspace(0,2*pi,100).')*Yvec) + LCC;
-    h2 = line(h_a,detectoraperture(:,1),detectoraperture(:,2),detectoraperture(:,3),'Color','r','LineWidth',2);
-    legend(h_a,h2,'Fiber aperture','Location','northeast');
-  end
-
-  
-  if LC.res > 1
-    detFraction = 100*mean(mean(sum(MCorFMC.LC.image(:,:,:),3)))*LC.fieldSize^2;
-  else
-    detFraction = 100*sum(MCorFMC.LC.image(:));
-  end
-  fprintf(['%.3g%% of ' fluorescenceOrIncident 'light ends up on the detector.\n'],detFraction/P_in);
+  nLC = numel(MCorFMC.LC);
+  for iLC = 1:nLC
+    LC = MCorFMC.LC(iLC);
+    Zvec = [sin(LC.theta)*cos(LC.phi) , sin(LC.theta)*sin(LC.phi) , cos(LC.theta)];
+    Xvec = [sin(LC.phi) , -cos(LC.phi) , 0];
+    Yvec = cross(Zvec,Xvec);
+    FPC = [LC.x , LC.y , LC.z]; % Focal Plane Center
+    FPC_X = FPC + arrowlength*Xvec;
+    line(h_a,[FPC(1) FPC_X(1)],[FPC(2) FPC_X(2)],[FPC(3) FPC_X(3)],'Linewidth',2,'Color','r')
+    text(h_a,FPC_X(1),FPC_X(2),FPC_X(3),'X','HorizontalAlignment','center','FontSize',18)
+    FPC_Y = FPC + arrowlength*Yvec;
+    line(h_a,[FPC(1) FPC_Y(1)],[FPC(2) FPC_Y(2)],[FPC(3) FPC_Y(3)],'Linewidth',2,'Color','r')
+    text(h_a,FPC_Y(1),FPC_Y(2),FPC_Y(3),'Y','HorizontalAlignment','center','FontSize',18)
+    if nLC > 1
+      text(h_a,FPC(1),FPC(2),FPC(3),num2str(iLC),'HorizontalAlignment','right','VerticalAlignment','bottom','FontSize',14)
+    end
 
-  if detFraction == 0
-    warning('No light was collected on the detector. Are you sure that your light collector is oriented the right way and that the light escapes through media that have refractive index 1? Otherwise the photons will not be counted. Depending on your geometry, you could maybe add a layer of air on top of your simulation, or set matchedInterfaces = true, which will set all refractive indices to 1.');
+    if isfinite(LC.f)
+      fieldperimeter = LC.fieldSize/2*(cos(linspace(0,2*pi,100).')*Xvec + sin(linspace(0,2*pi,100).')*Yvec) + FPC;
+      h1 = line(h_a,fieldperimeter(:,1),fieldperimeter(:,2),fieldperimeter(:,3),'Color','b','LineWidth',2);
+      LCC = FPC - Zvec*LC.f; % Light Collector Center
+      detectoraperture = LC.diam/2*(cos(linspace(0,2*pi,100).')*Xvec + sin(linspace(0,2*pi,100).')*Yvec) + LCC;
+      h2 = line(h_a,detectoraperture(:,1),detectoraperture(:,2),detectoraperture(:,3),'Color','r','LineWidth',2);
+      if iLC == 1
+        legend(h_a,[h1 h2],'Imaged area','Lens aperture','Location','northeast');
+      end
+    else
+      LCC = FPC;
+      detectoraperture = LC.diam/2*(cos(linspace(0,2*pi,100).')*Xvec + sin(linspace(0,2*pi,100).')*Yvec) + LCC;
+      h2 = line(h_a,detectoraperture(:,1),detectoraperture(:,2),detectoraperture(:,3),'Color','r','LineWidth',2);
+      if iLC == 1
+        legend(h_a,h2,'Fiber aperture','Location','northeast');
+      end
+    end
   end
 
-  %% Plot image
-  if LC.res > 1 || LC.nTimeBins > 0
-    if LC.res == 1
-        axisDims = 3;
-        axisEqual = false;
+  for iLC = 1:nLC
+    LC = MCorFMC.LC(iLC);
+    if nLC > 1
+      LCtext = sprintf(' on light collector %d',iLC);
     else
-        axisDims = [1 2];
-        axisEqual = true;
+      LCtext = '';
     end
-    [h_f,h_a] = MCmatlab.NdimSliderPlot(MCorFMC.LC.image,...
-      'nFig',8 + figNumOffset,...
-      'axisValues',{MCorFMC.LC.X,MCorFMC.LC.Y,MCorFMC.LC.t,MCorFMC.wavelength},...
-      'axisLabels',{'X [cm]','Y [cm]','t [s]',lambdatext,'Normalized power [W/W.incident]'},...
-      'plotLimits',[0 NaN],...
-      'axisDims',axisDims,...
-      'axisEqual',axisEqual);
-    if simFluorescence
-      h_f.Name = 'Collected fluorescence light';
+    if LC.res > 1
+      detFraction = 100*mean(mean(sum(LC.image(:,:,:),3)))*LC.fieldSize^2;
     else
-      h_f.Name = 'Collected light';
+      detFraction = 100*sum(LC.image(:));
     end
-    if LC.res > 1 && LC.nTimeBins > 0
-      title(h_a,{'Normalized time-resolved fluence rate in the image plane','at 1x magnification [W/cm^2/W.incident]'});
-      fprintf('Time-resolved light collector data plotted. Note that first time bin includes all\n  photons at earlier times and last time bin includes all photons at later times.\n');
-    elseif LC.res > 1
-      title(h_a,{['Normalized ' fluorescenceOrNothing 'fluence rate in the image plane'],' at 1x magnification [W/cm^2/W.incident]'});
-    elseif LC.nTimeBins > 0
-      title(h_a,'Normalized time-resolved power on the detector [W/W.incident]');
-      fprintf('Time-resolved light collector data plotted. Note that first time bin includes all\n  photons at earlier times and last time bin includes all photons at later times.\n');
-    else
-      title(h_a,'Normalized power on the detector [W/W.incident]');
+    fprintf(['%.3g%% of ' fluorescenceOrIncident 'light ends up on the detector%s.\n'],detFraction/P_in,LCtext);
+
+    if detFraction == 0
+      warning('No light was collected on the detector%s. Are you sure that your light collector is oriented the right way and that the light escapes through media that have refractive index 1? Otherwise the photons will not be counted. Depending on your geometry, you could maybe add a layer of air on top of your simulation, or set matchedInterfaces = true, which will set all refractive indices to 1.',LCtext);
+    end
+
+    %% Plot image
+    if LC.res > 1 || LC.nTimeBins > 0
+      if LC.res == 1
+          axisDims = 3;
+          axisEqual = false;
+      else
+          axisDims = [1 2];
+          axisEqual = true;
+      end
+      if iLC == 1
+        nFig = 8 + figNumOffset;
+      else
+        nFig = 48 + figNumOffset + iLC; % Figures 50 to 63 (60 to 73 for fluorescence) for the light collectors after the first
+      end
+      [h_f,h_a] = MCmatlab.NdimSliderPlot(LC.image,...
+        'nFig',nFig,...
+        'axisValues',{LC.X,LC.Y,LC.t,MCorFMC.wavelength},...
+        'axisLabels',{'X [cm]','Y [cm]','t [s]',lambdatext,'Normalized power [W/W.incident]'},...
+        'plotLimits',[0 NaN],...
+        'axisDims',axisDims,...
+        'axisEqual',axisEqual);
+      if simFluorescence
+        h_f.Name = 'Collected fluorescence light';
+      else
+        h_f.Name = 'Collected light';
+      end
+      if nLC > 1
+        h_f.Name = sprintf('%s, light collector %d',h_f.Name,iLC);
+      end
+      if LC.res > 1 && LC.nTimeBins > 0
+        title(h_a,{'Normalized time-resolved fluence rate in the image plane','at 1x magnification [W/cm^2/W.incident]'});
+        fprintf('Time-resolved light collector data plotted. Note that first time bin includes all\n  photons at earlier times and last time bin includes all photons at later times.\n');
+      elseif LC.res > 1
+        title(h_a,{['Normalized ' fluorescenceOrNothing 'fluence rate in the image plane'],' at 1x magnification [W/cm^2/W.incident]'});
+      elseif LC.nTimeBins > 0
+        title(h_a,'Normalized time-resolved power on the detector [W/W.incident]');
+        fprintf('Time-resolved light collector data plotted. Note that first time bin includes all\n  photons at earlier times and last time bin includes all photons at later times.\n');
+      else
+        title(h_a,'Normalized power on the detector [W/W.incident]');
+      end
     end
   end
 end
@@ -312,7 +370,9 @@ if ~isnan(MCorFMC.farField)
 end
 
 %% Plot normalized boundary irradiances
-if MCorFMC.boundaryType ~= 0
+if MCorFMC.boundaryType ~= 0 && any(~isnan(MCorFMC.NIroi))
+  fprintf('The boundary irradiances are not plotted since NIroi is set. They are available in the NI arrays.\n');
+elseif MCorFMC.boundaryType ~= 0
   plotCuboidSurfaces(10 + figNumOffset,model,simFluorescence);
 end
 
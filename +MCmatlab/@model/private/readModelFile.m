@@ -0,0 +1,61 @@
+function s = readModelFile(fileName)
+  %   Reads a model or result file of the standalone MCmatlab executable
+  %   (see MCmatlab_standalone.c for the file format) into a struct.
+  %
+  %   See also writeModelFile, runMonteCarlo
+
+  %%%%%
+  %   Copyright 2017, 2018 by Dominik Marti and Anders K. Hansen
+  %
+  %   This file is part of MCmatlab.
+  %
+  %   MCmatlab is free software: you can redistribute it and/or modify
+  %   it under the terms of the GNU General Public License as published by
+  %   the Free Software Foundation, either version 3 of the License, or
+  %   (at your option) any later version.
+  %
+  %   MCmatlab is distributed in the hope that it will be useful,
+  %   but WITHOUT ANY WARRANTY; without even the implied warranty of
+  %   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  %   GNU General Public License for more details.
+  %
+  %   You should have received a copy of the GNU General Public License
+  %   along with MCmatlab.  If not, see <https://www.gnu.org/licenses/>.
+  %%%%%
+
+  fid = fopen(fileName,'r');
+  if fid == -1
+    error('Error: Could not open %s for reading',fileName);
+  end
+  magic = fread(fid,[1 4],'*char');
+  version = fread(fid,1,'uint32');
+  if ~strcmp(magic,'MCMD') || version ~= 1
+    fclose(fid);
+    error('Error: %s is not an MCmatlab model or result file',fileName);
+  end
+  s = readNode(fid);
+  fclose(fid);
+end
+
+function x = readNode(fid)
+  if fread(fid,1,'uint8')
+    x = struct();
+    nFields = fread(fid,1,'uint32');
+    for iField = 1:nFields
+      nameLength = fread(fid,1,'uint32');
+      name = fread(fid,[1 nameLength],'*char');
+      x.(name) = readNode(fid);
+    end
+  else
+    classID = fread(fid,1,'uint8');
+    nDims = fread(fid,1,'uint32');
+    dims = fread(fid,[1 nDims],'uint64');
+    precisions = {'','','','*uint8','*uint8','','double','*single','*int8','*uint8','*int16','*uint16','*int32','*uint32','*int64','*uint64'};
+    x = reshape(fread(fid,prod(dims),precisions{classID+1}),dims);
+    if classID == 3
+      x = logical(x);
+    elseif classID == 4
+      x = char(x);
+    end
+  end
+end
@@ -0,0 +1,93 @@
+function writeModelFile(fileName,s)
+  %   Writes the struct s, which may contain numeric, logical and char
+  %   arrays, structs and objects, to a model file for the standalone
+  %   MCmatlab executable (see MCmatlab_standalone.c for the file format).
+  %   Objects are written with their public properties, and struct arrays
+  %   and object arrays with their first element. Function handles, cell
+  %   arrays and other values that the Monte Carlo code does not use are
+  %   skipped.
+  %
+  %   See also readModelFile, runMonteCarlo
+
+  %%%%%
+  %   Copyright 2017, 2018 by Dominik Marti and Anders K. Hansen
+  %
+  %   This file is part of MCmatlab.
+  %
+  %   MCmatlab is free software: you can redistribute it and/or modify
+  %   it under the terms of the GNU General Public License as published by
+  %   the Free Software Foundation, either version 3 of the License, or
+  %   (at your option) any later version.
+  %
+  %   MCmatlab is distributed in the hope that it will be useful,
+  %   but WITHOUT ANY WARRANTY; without even the implied warranty of
+  %   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  %   GNU General Public License for more details.
+  %
+  %   You should have received a copy of the GNU General Public License
+  %   along with MCmatlab.  If not, see <https://www.gnu.org/licenses/>.
+  %%%%%
+
+  fid = fopen(fileName,'w');
+  if fid == -1
+    error('Error: Could not open %s for writing',fileName);
+  end
+  fwrite(fid,'MCMD','char');
+  fwrite(fid,1,'uint32'); % File version
+  writeNode(fid,s);
+  fclose(fid);
+end
+
+function writeNode(fid,x)
+  if isobject(x) || isstruct(x)
+    x = x(1);
+    if isstruct(x)
+      names = fieldnames(x);
+    else
+      names = properties(x);
+    end
+    values = cell(size(names));
+    for iField = 1:numel(names)
+      values{iField} = x.(names{iField});
+    end
+    isWritten = cellfun(@isWritable,values);
+    names = names(isWritten);
+    values = values(isWritten);
+    fwrite(fid,1,'uint8');
+    fwrite(fid,numel(names),'uint32');
+    for iField = 1:numel(names)
+      fwrite(fid,numel(names{iField}),'uint32');
+      fwrite(fid,names{iField},'char');
+      writeNode(fid,values{iField});
+    end
+  else
+    if isstring(x)
+      x = char(x);
+    end
+    [classID,precision] = getClassID(x);
+    fwrite(fid,0,'uint8');
+    fwrite(fid,classID,'uint8');
+    fwrite(fid,ndims(x),'uint32');
+    fwrite(fid,size(x),'uint64');
+    fwrite(fid,real(x(:)),precision);
+  end
+end
+
+function tf = isWritable(x)
+  tf = ((isobject(x) || isstruct(x)) && ~isempty(x)) || isstring(x) || ~isempty(getClassID(x));
+end
+
+function [classID,precision] = getClassID(x)
+  % Class IDs as in MATLAB's matrix.h
+  classes = {'logical','char','double','single','int8','uint8','int16','uint16','int32','uint32','int64','uint64'};
+  classIDs = [3 4 6 7 8 9 10 11 12 13 14 15];
+  precisions = {'uint8','uint8','double','single','int8','uint8','int16','uint16','int32','uint32','int64','uint64'};
+  iClass = find(strcmp(class(x),classes),1);
+  if isobject(x) || issparse(x) || isempty(iClass)
+    classID = [];
+    precision = '';
+  else
+    classID = classIDs(iClass);
+    precision = precisions{iClass};
+  end
+end
@@ -66,6 +66,91 @@ function model = runMonteCarlo(model,varargin)
 
   checkMCinputFields(model,simType);
 
+  iResume = find(strcmp(varargin,'resume'),1);
+  if isempty(iResume)
+    resumeFile = '';
+  else % runMonteCarlo(model,...,'resume',fileName) continues the simulation from a checkpoint file
+    if numel(varargin) == iResume || ~(ischar(varargin{iResume+1}) || isstring(varargin{iResume+1}))
+      error('Error: ''resume'' must be followed by the name of a checkpoint file');
+    end
+    resumeFile = char(varargin{iResume+1});
+    if ~isfile(resumeFile)
+      error('Error: The checkpoint file %s does not exist',resumeFile);
+    end
+    if useGPU
+      error('Error: Resuming from a checkpoint is not supported when running on the GPU.');
+    end
+    if simType == 1 && model.MC.FRdepIterations > 0
+      error('Error: Resuming from a checkpoint is not supported with FRdepIterations > 0.');
+    end
+    if simType == 2
+      MCorFMC = model.FMC;
+    else
+      MCorFMC = model.MC;
+    end
+    if MCorFMC.useLightCollector && ~isempty([MCorFMC.LC.collectedPhotonsFile])
+      error('Error: Resuming from a checkpoint is not supported when writing a collected photons file.');
+    end
+  end
+
+  continuePrevious = any(strcmp(varargin,'continue')); % runMonteCarlo(model,...,'continue') adds nPhotonsRequested photons (or simulationTimeRequested minutes) to the previous result
+  if continuePrevious
+    if simType == 2
+      MCorFMC = model.FMC;
+    else
+      MCorFMC = model.MC;
+    end
+    if isnan(MCorFMC.nPhotons) || numel(MCorFMC.nPhotonsPerWavelength) ~= numel(MCorFMC.wavelength) || any(isnan(MCorFMC.nPhotonsPerWavelength))
+      error('Error: ''continue'' requires the model to contain the results of a previous simulation with the same wavelengths.');
+    end
+    if useGPU
+      error('Error: Continuing a simulation is not supported when running on the GPU.');
+    end
+    if simType == 1 && model.MC.FRdepIterations > 0
+      error('Error: Continuing a simulation is not supported with FRdepIterations > 0.');
+    end
+    if ~isempty(resumeFile) || ~isempty(MCorFMC.checkpointFile)
+      error('Error: Continuing a simulation is not supported together with checkpointing.');
+    end
+    if MCorFMC.useLightCollector && ~isempty([MCorFMC.LC.collectedPhotonsFile])
+      error('Error: Continuing a simulation is not supported when writing a collected photons file.');
+    end
+    previousExamplePaths = MCorFMC.examplePaths;
+  end
+
+  iWorkers = find(strcmp(varargin,'workers'),1);
+  if isempty(iWorkers)
+    nWorkers = 1;
+  else % runMonteCarlo(model,...,'workers',N) splits the simulation over N processes of the standalone MCmatlab executable
+    if numel(varargin) == iWorkers || ~isnumeric(varargin{iWorkers+1}) || ~isscalar(varargin{iWorkers+1}) || varargin{iWorkers+1} < 1 || rem(varargin{iWorkers+1},1)
+      error('Error: ''workers'' must be followed by a positive integer number of worker processes');
+    end
+    nWorkers = varargin{iWorkers+1};
+    if simType == 2
+      MCorFMC = model.FMC;
+    else
+      MCorFMC = model.MC;
+    end
+    if useGPU
+      error('Error: Running several workers is not supported when running on the GPU.');
+    end
+    if simType == 1 && model.MC.FRdepIterations > 0
+      error('Error: Running several workers is not supported with FRdepIterations > 0.');
+    end
+    if ~isempty(resumeFile) || ~isempty(MCorFMC.checkpointFile) || continuePrevious
+      error('Error: Running several workers is not supported together with checkpointing or continuing a simulation.');
+    end
+    if MCorFMC.useLightCollector && ~isempty([MCorFMC.LC.collectedPhotonsFile])
+      error('Error: Running several workers is not supported when writing a collected photons file.');
+    end
+    if MCorFMC.useLightCollector && numel(MCorFMC.LC) > 1
+      error('Error: Running several workers is not supported with several light collectors.');
+    end
+    if simType == 1 && numel(model.MC.LS) > 1
+      error('Error: Running several workers is not supported with several light sources.');
+    end
+  end
+
   %% Get initial temperature, fractional damage and fluence rate
   T = NaN([G.nx G.ny G.nz],'single');
   T(:) = model.HS.T; % model.HS.T may be scalar or 3D
@@ -96,12 +181,12 @@ function model = runMonteCarlo(model,varargin)
       end
       model = getOpticalMediaProperties(model,simType); % Also performs splitting of mediaProperties and M_raw, if necessary
       if useGPU
-        model = MCmatlab_CUDA(model,simType);
+        model = storeMCoutputs(model,simType,MCmatlab_CUDA(model,simType));
       else
         if forceSingleThreaded % Multithreading doesn't work properly on Linux older than R2020b for some reason
-          model = MCmatlab_singlethreaded(model,simType);
+          model = storeMCoutputs(model,simType,MCmatlab_singlethreaded(model,simType));
         else
-          model = MCmatlab(model,simType);
+          model = storeMCoutputs(model,simType,MCmatlab(model,simType));
         end
       end
       if i<nIterations; model.MC.FR = model.MC.P*model.MC.NFR; end
@@ -166,12 +251,21 @@ function model = runMonteCarlo(model,varargin)
       if max(model.FMC.sourceDistribution(:)) == 0; error('Error: No fluorescence emitters'); end
     end
     if useGPU
-      model = MCmatlab_CUDA(model,simType);
+      model = storeMCoutputs(model,simType,MCmatlab_CUDA(model,simType));
+    elseif nWorkers > 1
+      model = runWorkers(model,simType,nWorkers);
     else
       if forceSingleThreaded % Multithreading doesn't work properly on Linux older than R2020b for some reason
-        model = MCmatlab_singlethreaded(model,simType);
+        model = storeMCoutputs(model,simType,MCmatlab_singlethreaded(model,simType,resumeFile,continuePrevious));
       else
-        model = MCmatlab(model,simType);
+        model = storeMCoutputs(model,simType,MCmatlab(model,simType,resumeFile,continuePrevious));
+      end
+    end
+    if continuePrevious && MCorFMC.nExamplePaths > 0 && ~isscalar(previousExamplePaths) % The paths of the previous simulation are kept
+      if simType == 2
+        model.FMC.examplePaths = cat(2,previousExamplePaths,model.FMC.examplePaths);
+      else
+        model.MC.examplePaths = cat(2,previousExamplePaths,model.MC.examplePaths);
       end
     end
   end
@@ -179,15 +273,32 @@ function model = runMonteCarlo(model,varargin)
   if simType == 2
     % Add positions of the centers of the pixels in the light collector
     % image and the time array
-    if model.FMC.useLightCollector && model.FMC.LC.res > 1
-      model.FMC.LC.X = linspace(model.FMC.LC.fieldSize*(1/model.FMC.LC.res-1),model.FMC.LC.fieldSize*(1-1/model.FMC.LC.res),model.FMC.LC.res)/2;
-      model.FMC.LC.Y = model.FMC.LC.X;
+    if model.FMC.useLightCollector
+      for iLC = 1:numel(model.FMC.LC)
+        if model.FMC.LC(iLC).res > 1
+          model.FMC.LC(iLC).X = linspace(model.FMC.LC(iLC).fieldSize*(1/model.FMC.LC(iLC).res-1),model.FMC.LC(iLC).fieldSize*(1-1/model.FMC.LC(iLC).res),model.FMC.LC(iLC).res)/2;
+          model.FMC.LC(iLC).Y = model.FMC.LC(iLC).X;
+        end
+        if model.FMC.LC(iLC).nTimeBins > 0
+          if model.FMC.matchedInterfaces
+            warning('Time tagging is on, but matchedInterfaces is true, which sets all refractive indices to 1.');
+          end
+          model.FMC.LC(iLC).t = (-1/2:(model.FMC.LC(iLC).nTimeBins+1/2))*(model.FMC.LC(iLC).tEnd-model.FMC.LC(iLC).tStart)/model.FMC.LC(iLC).nTimeBins + model.FMC.LC(iLC).tStart;
+        end
+      end
+    end
+
+    % Add radial bin centers of the axisymmetric outputs
+    if model.FMC.axisymmetric
+      model.FMC.r = ((1:floor(min(G.nx,G.ny)/2)) - 1/2)*G.dx;
     end
-    if model.FMC.useLightCollector && model.FMC.LC.nTimeBins > 0
-      if model.FMC.matchedInterfaces
-        warning('Time tagging is on, but matchedInterfaces is true, which sets all refractive indices to 1.');
+
+    % Add bin centers of the scoring grid
+    if any(model.FMC.scoringGridRes)
+      [model.FMC.x_grid,model.FMC.y_grid,model.FMC.z_grid] = getScoringGridCenters(model.FMC,G);
+      if model.FMC.scoringGridNTimeBins > 0
+        model.FMC.t_grid = (-1/2:(model.FMC.scoringGridNTimeBins+1/2))*(model.FMC.scoringGridTEnd-model.FMC.scoringGridTStart)/model.FMC.scoringGridNTimeBins + model.FMC.scoringGridTStart;
       end
-      model.FMC.LC.t = (-1/2:(model.FMC.LC.nTimeBins+1/2))*(model.FMC.LC.tEnd-model.FMC.LC.tStart)/model.FMC.LC.nTimeBins + model.FMC.LC.tStart;
     end
 
     % Add angles of the centers of the far field pixels
@@ -198,15 +309,32 @@ function model = runMonteCarlo(model,varargin)
   else
     % Add positions of the centers of the pixels in the light collector
     % image and the time array
-    if model.MC.useLightCollector && model.MC.LC.res > 1
-      model.MC.LC.X = linspace(model.MC.LC.fieldSize*(1/model.MC.LC.res-1),model.MC.LC.fieldSize*(1-1/model.MC.LC.res),model.MC.LC.res)/2;
-      model.MC.LC.Y = model.MC.LC.X;
+    if model.MC.useLightCollector
+      for iLC = 1:numel(model.MC.LC)
+        if model.MC.LC(iLC).res > 1
+          model.MC.LC(iLC).X = linspace(model.MC.LC(iLC).fieldSize*(1/model.MC.LC(iLC).res-1),model.MC.LC(iLC).fieldSize*(1-1/model.MC.LC(iLC).res),model.MC.LC(iLC).res)/2;
+          model.MC.LC(iLC).Y = model.MC.LC(iLC).X;
+        end
+        if model.MC.LC(iLC).nTimeBins > 0
+          if model.MC.matchedInterfaces
+            warning('Time tagging is on, but matchedInterfaces is true, which sets all refractive indices to 1.');
+          end
+          model.MC.LC(iLC).t = (-1/2:(model.MC.LC(iLC).nTimeBins+1/2))*(model.MC.LC(iLC).tEnd-model.MC.LC(iLC).tStart)/model.MC.LC(iLC).nTimeBins + model.MC.LC(iLC).tStart;
+        end
+      end
+    end
+
+    % Add radial bin centers of the axisymmetric outputs
+    if model.MC.axisymmetric
+      model.MC.r = ((1:floor(min(G.nx,G.ny)/2)) - 1/2)*G.dx;
     end
-    if model.MC.useLightCollector && model.MC.LC.nTimeBins > 0
-      if model.MC.matchedInterfaces
-        warning('Time tagging is on, but matchedInterfaces is true, which sets all refractive indices to 1.');
+
+    % Add bin centers of the scoring grid
+    if any(model.MC.scoringGridRes)
+      [model.MC.x_grid,model.MC.y_grid,model.MC.z_grid] = getScoringGridCenters(model.MC,G);
+      if model.MC.scoringGridNTimeBins > 0
+        model.MC.t_grid = (-1/2:(model.MC.scoringGridNTimeBins+1/2))*(model.MC.scoringGridTEnd-model.MC.scoringGridTStart)/model.MC.scoringGridNTimeBins + model.MC.scoringGridTStart;
       end
-      model.MC.LC.t = (-1/2:(model.MC.LC.nTimeBins+1/2))*(model.MC.LC.tEnd-model.MC.LC.tStart)/model.MC.LC.nTimeBins + model.MC.LC.tStart;
     end
 
     % Add angles of the centers of the far field pixels
@@ -258,6 +386,99 @@ function checkMCinputFields(model,simType)
   if MCorFMC.depositionCriteria.onlyCollected && ~MCorFMC.useLightCollector
     error('Error: depositionCriteria.onlyCollected is true, but no light collector is defined');
   end
+  if MCorFMC.useLightCollector && ~isempty([MCorFMC.LC.collectedPhotonsFile]) && MCorFMC.useGPU
+    error('Error: lightCollector.collectedPhotonsFile is not supported when running on the GPU.');
+  end
+  if ~isempty(MCorFMC.checkpointFile) && MCorFMC.useGPU
+    error('Error: checkpointFile is not supported when running on the GPU.');
+  end
+  if MCorFMC.floatAccumulators && MCorFMC.useGPU
+    error('Error: floatAccumulators is not supported when running on the GPU.');
+  end
+  if MCorFMC.calcTelemetry && MCorFMC.useGPU
+    error('Error: calcTelemetry is not supported when running on the GPU.');
+  end
+  if MCorFMC.axisymmetric
+    if abs(G.dx - G.dy) > 1e-9*G.dx
+      error('Error: axisymmetric = true requires the voxel sizes dx and dy to be equal.');
+    end
+    if MCorFMC.boundaryType == 3
+      error('Error: axisymmetric = true is not supported with cyclic boundaries (boundaryType == 3).');
+    end
+    DC = MCorFMC.depositionCriteria;
+    if DC.evaluateOnlyAtEndOfLife && ...
+       (DC.minScatterings ~= 0 || ~isinf(DC.maxScatterings) || ...
+        DC.minRefractions ~= 0 || ~isinf(DC.maxRefractions) || ...
+        DC.minReflections ~= 0 || ~isinf(DC.maxReflections) || ...
+        DC.minInterfaceTransitions ~= 0 || ~isinf(DC.maxInterfaceTransitions) || ...
+        DC.onlyCollected)
+      error('Error: axisymmetric = true is not supported with restrictive deposition criteria that are evaluated only at the end of life.');
+    end
+  end
+  if any(MCorFMC.scoringGridRes)
+    if ~all(MCorFMC.scoringGridRes)
+      error('Error: scoringGridRes must be nonzero along all three axes, or [0 0 0] for no scoring grid.');
+    end
+    extent = getScoringGridExtent(MCorFMC,G);
+    if any(~isfinite(extent)) || any(extent(2:2:6) <= extent(1:2:5))
+      error('Error: scoringGridExtent must be finite and have xmax > xmin, ymax > ymin and zmax > zmin.');
+    end
+    if MCorFMC.mirrorSymmetry
+      error('Error: The scoring grid (scoringGridRes) is not supported with mirrorSymmetry.');
+    end
+    if MCorFMC.scoringGridNTimeBins > 0 && MCorFMC.scoringGridTEnd <= MCorFMC.scoringGridTStart
+      error('Error: scoringGridTEnd must be larger than scoringGridTStart.');
+    end
+    DC = MCorFMC.depositionCriteria;
+    if DC.evaluateOnlyAtEndOfLife && ...
+       (DC.minScatterings ~= 0 || ~isinf(DC.maxScatterings) || ...
+        DC.minRefractions ~= 0 || ~isinf(DC.maxRefractions) || ...
+        DC.minReflections ~= 0 || ~isinf(DC.maxReflections) || ...
+        DC.minInterfaceTransitions ~= 0 || ~isinf(DC.maxInterfaceTransitions) || ...
+        DC.onlyCollected)
+      error('Error: The scoring grid (scoringGridRes) is not supported with restrictive deposition criteria that are evaluated only at the end of life.');
+    end
+  end
+  if any(~isnan(MCorFMC.NFRroi))
+    roi = MCorFMC.NFRroi;
+    fullRange = [1 G.nx 1 G.ny 1 G.nz];
+    roi(isnan(roi)) = fullRange(isnan(roi));
+    if any(roi ~= round(roi)) || any(roi(1:2:5) < 1) || any(roi(2:2:6) > [G.nx G.ny G.nz]) || any(roi(2:2:6) < roi(1:2:5))
+      error('Error: NFRroi must contain integer voxel indices inside the cuboid with ixmax >= ixmin, iymax >= iymin and izmax >= izmin.');
+    end
+    if MCorFMC.mirrorSymmetry
+      error('Error: NFRroi is not supported with mirrorSymmetry.');
+    end
+    if simType == 1 && model.MC.FRdepIterations > 0
+      error('Error: NFRroi is not supported with FRdepIterations > 0, since the fluence rate is needed in the whole cuboid.');
+    end
+  end
+  if any(~isnan(MCorFMC.NIroi))
+    roi = MCorFMC.NIroi;
+    if any(roi(~isnan(roi)) ~= round(roi(~isnan(roi)))) || any(roi(2:2:6) < roi(1:2:5))
+      error('Error: NIroi must contain integer voxel indices with ixmax >= ixmin, iymax >= iymin and izmax >= izmin.');
+    end
+    if MCorFMC.boundaryType ~= 2 && (any(roi(1:2:5) < 1) || any(roi(2:2:6) > [G.nx G.ny G.nz]))
+      error('Error: NIroi must be inside the cuboid, except for the x and y ranges with boundaryType 2.');
+    end
+  end
+  if MCorFMC.mirrorSymmetry
+    if bitand(MCorFMC.mirrorSymmetry,1) && mod(G.nx,2)
+      error('Error: mirrorSymmetry in x requires nx to be even.');
+    end
+    if bitand(MCorFMC.mirrorSymmetry,2) && mod(G.ny,2)
+      error('Error: mirrorSymmetry in y requires ny to be even.');
+    end
+    if MCorFMC.boundaryType == 3
+      error('Error: mirrorSymmetry is not supported with cyclic boundaries (boundaryType == 3).');
+    end
+    if MCorFMC.useLightCollector
+      error('Error: mirrorSymmetry is not supported with a light collector.');
+    end
+  end
+  if MCorFMC.calcJacobian && ~MCorFMC.useLightCollector
+    error('Error: calcJacobian is true, but no light collector is defined');
+  end
   if MCorFMC.farFieldRes && MCorFMC.boundaryType == 0
     error('Error: If boundaryType == 0, no photons can escape to be registered in the far field. Set farFieldRes to zero or change boundaryType.');
   end
@@ -266,6 +487,9 @@ function checkMCinputFields(model,simType)
     if isscalar(model.MC.NFR)
       error('Error: normalizedFluenceRate matrix not calculated for excitation light');
     end
+    if any(~isnan(model.MC.NFRroi))
+      error('Error: Fluorescence requires the excitation normalizedFluenceRate in the whole cuboid, so MC.NFRroi must not be set.');
+    end
     DC = model.MC.depositionCriteria;
     if DC.minScatterings ~= 0 || ~isinf(DC.maxScatterings) || ...
        DC.minRefractions ~= 0 || ~isinf(DC.maxRefractions) || ...
@@ -285,66 +509,78 @@ function checkMCinputFields(model,simType)
         error('Error: model.MC.sourceDistribution must be real, finite and non-negative');
       end
     else % Not distributed source
-      if isnan(MCorFMC.LS.sourceType)
-        error('Error: No sourceType defined');
+      if isempty(MCorFMC.LS) || numel(MCorFMC.LS) > 16
+        error('Error: model.MC.lightSource must contain between 1 and 16 light sources');
       end
-      if MCorFMC.LS.sourceType == 4 && (isnan(MCorFMC.LS.FPID.radialDistr(1)) || isnan(MCorFMC.LS.AID.radialDistr(1)))
-        error('Error: lightSource.focalPlaneIntensityDistribution.radialDistr and lightSource.angularIntensityDistribution.radialDistr must both be specified when sourceType is 4');
+      if sum([MCorFMC.LS.relativePower]) <= 0
+        error('Error: At least one light source must have a relativePower above zero');
       end
-      if MCorFMC.LS.sourceType == 3
-        if isnan(MCorFMC.LS.FPID.radialWidth) || isnan(MCorFMC.LS.AID.radialWidth)
-          error('Error: lightSource.focalPlaneIntensityDistribution.radialWidth and lightSource.angularIntensityDistribution.radialWidth must both be specified when sourceType is 3');
-        end
+      if any([MCorFMC.LS.sourceType] == 2) && ~all([MCorFMC.LS.sourceType] == 2)
+        error('Error: Infinite plane waves (sourceType 2) cannot be combined with other types of light sources');
       end
-      if MCorFMC.LS.sourceType == 4
-        if isnan(MCorFMC.LS.FPID.radialWidth)
-          error('Error: lightSource.focalPlaneIntensityDistribution.radialWidth must be specified when sourceType is 4');
-        end      
-        if ~isequal(MCorFMC.LS.AID.radialDistr, 2) && isnan(MCorFMC.LS.FPID.radialWidth) % If non-Lambertian source
-          error('Error: lightSource.angularIntensityDistribution.radialWidth must be specified when sourceType is 4 and the source is non-Lambertian');
+      for iLS = 1:numel(MCorFMC.LS)
+        LS = MCorFMC.LS(iLS);
+        if isnan(LS.sourceType)
+          error('Error: No sourceType defined');
         end
-      end
-      if MCorFMC.LS.sourceType == 5
-        if isnan(MCorFMC.LS.FPID.XDistr(1))
-          error('Error: lightSource.focalPlaneIntensityDistribution.XDistr must be specified when sourceType is 5');
+        if LS.sourceType == 4 && (isnan(LS.FPID.radialDistr(1)) || isnan(LS.AID.radialDistr(1)))
+          error('Error: lightSource.focalPlaneIntensityDistribution.radialDistr and lightSource.angularIntensityDistribution.radialDistr must both be specified when sourceType is 4');
         end
-        if isnan(MCorFMC.LS.FPID.XWidth)
-          error('Error: lightSource.focalPlaneIntensityDistribution.Xwidth must be specified when sourceType is 5');
-        end
-        if isnan(MCorFMC.LS.FPID.YDistr(1))
-          error('Error: lightSource.focalPlaneIntensityDistribution.YDistr must be specified when sourceType is 5');
-        end
-        if isnan(MCorFMC.LS.FPID.YWidth)
-          error('Error: lightSource.focalPlaneIntensityDistribution.YWidth must be specified when sourceType is 5');
-        end
-        if isnan(MCorFMC.LS.AID.XDistr(1))
-          error('Error: lightSource.angularIntensityDistribution.XDistr must be specified when sourceType is 5');
+        if LS.sourceType == 3
+          if isnan(LS.FPID.radialWidth) || isnan(LS.AID.radialWidth)
+            error('Error: lightSource.focalPlaneIntensityDistribution.radialWidth and lightSource.angularIntensityDistribution.radialWidth must both be specified when sourceType is 3');
+          end
         end
-        if MCorFMC.LS.AID.XDistr(1) ~= 2 && isnan(MCorFMC.LS.AID.XWidth)
-          error('Error: lightSource.angularIntensityDistribution.Xwidth must be specified when sourceType is 5 and the distribution is non-Lambertian');
+        if LS.sourceType == 4
+          if isnan(LS.FPID.radialWidth)
+            error('Error: lightSource.focalPlaneIntensityDistribution.radialWidth must be specified when sourceType is 4');
+          end      
+          if ~isequal(LS.AID.radialDistr, 2) && isnan(LS.FPID.radialWidth) % If non-Lambertian source
+            error('Error: lightSource.angularIntensityDistribution.radialWidth must be specified when sourceType is 4 and the source is non-Lambertian');
+          end
         end
-        if isnan(MCorFMC.LS.AID.YDistr(1))
-          error('Error: lightSource.angularIntensityDistribution.YDistr must be specified when sourceType is 5');
+        if LS.sourceType == 5
+          if isnan(LS.FPID.XDistr(1))
+            error('Error: lightSource.focalPlaneIntensityDistribution.XDistr must be specified when sourceType is 5');
+          end
+          if isnan(LS.FPID.XWidth)
+            error('Error: lightSource.focalPlaneIntensityDistribution.Xwidth must be specified when sourceType is 5');
+          end
+          if isnan(LS.FPID.YDistr(1))
+            error('Error: lightSource.focalPlaneIntensityDistribution.YDistr must be specified when sourceType is 5');
+          end
+          if isnan(LS.FPID.YWidth)
+            error('Error: lightSource.focalPlaneIntensityDistribution.YWidth must be specified when sourceType is 5');
+          end
+          if isnan(LS.AID.XDistr(1))
+            error('Error: lightSource.angularIntensityDistribution.XDistr must be specified when sourceType is 5');
+          end
+          if LS.AID.XDistr(1) ~= 2 && isnan(LS.AID.XWidth)
+            error('Error: lightSource.angularIntensityDistribution.Xwidth must be specified when sourceType is 5 and the distribution is non-Lambertian');
+          end
+          if isnan(LS.AID.YDistr(1))
+            error('Error: lightSource.angularIntensityDistribution.YDistr must be specified when sourceType is 5');
+          end
+          if LS.AID.YDistr(1) ~= 2 && isnan(LS.AID.YWidth)
+            error('Error: lightSource.angularIntensityDistribution.YWidth must be specified when sourceType is 5 and the distribution is non-Lambertian');
+          end
+          if xor(LS.AID.XDistr == 2,LS.AID.YDistr == 2)
+            error('Error: lightSource.angularIntensityDistribution.XDistr and lightSource.angularIntensityDistribution.YDistr must either both be set to cosine (Lambertian), or neither');
+          end
         end
-        if MCorFMC.LS.AID.YDistr(1) ~= 2 && isnan(MCorFMC.LS.AID.YWidth)
-          error('Error: lightSource.angularIntensityDistribution.YWidth must be specified when sourceType is 5 and the distribution is non-Lambertian');
+        if size(LS.FPID.radialDistr,1) > 1 || size(LS.FPID.XDistr,1) > 1 || size(LS.FPID.YDistr,1) > 1 ||...
+            size(LS.AID.radialDistr,1) > 1 || size(LS.AID.XDistr,1) > 1 || size(LS.AID.YDistr,1) > 1
+          error('Error: Beam distribution functions must be scalars or row-vectors, not column-vectors');
         end
-        if xor(MCorFMC.LS.AID.XDistr == 2,MCorFMC.LS.AID.YDistr == 2)
-          error('Error: lightSource.angularIntensityDistribution.XDistr and lightSource.angularIntensityDistribution.YDistr must either both be set to cosine (Lambertian), or neither');
+        if (numel(LS.FPID.radialDistr) > 1 && numel(LS.FPID.radialDistr) < 1000) ||...
+            (numel(LS.FPID.XDistr)      > 1 && numel(LS.FPID.XDistr)      < 1000) ||...
+            (numel(LS.FPID.YDistr)      > 1 && numel(LS.FPID.YDistr)      < 1000) ||...
+            (numel(LS.AID.radialDistr) > 1 && numel(LS.AID.radialDistr) < 1000) ||...
+            (numel(LS.AID.XDistr)      > 1 && numel(LS.AID.XDistr)      < 1000) ||...
+            (numel(LS.AID.YDistr)      > 1 && numel(LS.AID.YDistr)      < 1000)
+          error('Error: Beam definition distributions must have 1000 elements (or more, if necessary)');
         end
       end
-      if size(MCorFMC.LS.FPID.radialDistr,1) > 1 || size(MCorFMC.LS.FPID.XDistr,1) > 1 || size(MCorFMC.LS.FPID.YDistr,1) > 1 ||...
-          size(MCorFMC.LS.AID.radialDistr,1) > 1 || size(MCorFMC.LS.AID.XDistr,1) > 1 || size(MCorFMC.LS.AID.YDistr,1) > 1
-        error('Error: Beam distribution functions must be scalars or row-vectors, not column-vectors');
-      end
-      if (numel(MCorFMC.LS.FPID.radialDistr) > 1 && numel(MCorFMC.LS.FPID.radialDistr) < 1000) ||...
-          (numel(MCorFMC.LS.FPID.XDistr)      > 1 && numel(MCorFMC.LS.FPID.XDistr)      < 1000) ||...
-          (numel(MCorFMC.LS.FPID.YDistr)      > 1 && numel(MCorFMC.LS.FPID.YDistr)      < 1000) ||...
-          (numel(MCorFMC.LS.AID.radialDistr) > 1 && numel(MCorFMC.LS.AID.radialDistr) < 1000) ||...
-          (numel(MCorFMC.LS.AID.XDistr)      > 1 && numel(MCorFMC.LS.AID.XDistr)      < 1000) ||...
-          (numel(MCorFMC.LS.AID.YDistr)      > 1 && numel(MCorFMC.LS.AID.YDistr)      < 1000)
-        error('Error: Beam definition distributions must have 1000 elements (or more, if necessary)');
-      end
     end
   end
 
@@ -353,23 +589,109 @@ function checkMCinputFields(model,simType)
     if MCorFMC.boundaryType == 0
       error('Error: If boundaryType == 0, no photons can escape to be registered on the light collector. Disable light collector or change boundaryType.');
     end
-    if isfinite(MCorFMC.LC.f)
-      xLCC = MCorFMC.LC.x - MCorFMC.LC.f*sin(MCorFMC.LC.theta)*cos(MCorFMC.LC.phi); % x position of Light Collector Center
-      yLCC = MCorFMC.LC.y - MCorFMC.LC.f*sin(MCorFMC.LC.theta)*sin(MCorFMC.LC.phi); % y position
-      zLCC = MCorFMC.LC.z - MCorFMC.LC.f*cos(MCorFMC.LC.theta);                     % z position
-    else
-      xLCC = MCorFMC.LC.x;
-      yLCC = MCorFMC.LC.y;
-      zLCC = MCorFMC.LC.z;
-      if MCorFMC.LC.res ~= 1
-        error('Error: lightCollector.res must be 1 when lightCollector.f is Inf');
+    if isempty(MCorFMC.LC) || numel(MCorFMC.LC) > 16
+      error('Error: lightCollector must contain between 1 and 16 light collectors');
+    end
+    if numel(MCorFMC.LC) > 1 && ~isempty([MCorFMC.LC.collectedPhotonsFile])
+      error('Error: lightCollector.collectedPhotonsFile is not supported with several light collectors');
+    end
+    for iLC = 1:numel(MCorFMC.LC)
+      LC = MCorFMC.LC(iLC);
+      if isfinite(LC.f)
+        xLCC = LC.x - LC.f*sin(LC.theta)*cos(LC.phi); % x position of Light Collector Center
+        yLCC = LC.y - LC.f*sin(LC.theta)*sin(LC.phi); % y position
+        zLCC = LC.z - LC.f*cos(LC.theta);             % z position
+      else
+        xLCC = LC.x;
+        yLCC = LC.y;
+        zLCC = LC.z;
+        if LC.res ~= 1
+          error('Error: lightCollector.res must be 1 when lightCollector.f is Inf');
+        end
+      end
+
+      if (abs(xLCC)               < G.nx*G.dx/2 && ...
+          abs(yLCC)               < G.ny*G.dy/2 && ...
+          abs(zLCC - G.nz*G.dz/2) < G.nz*G.dz/2)
+        error('Error: Light collector center (%.4f,%.4f,%.4f) is inside cuboid',xLCC,yLCC,zLCC);
       end
     end
+  end
+end
+
+function model = runWorkers(model,simType,nWorkers)
+  % Runs the simulation in nWorkers processes of the standalone executable, which must first be compiled from
+  % +MCmatlab/src/MCmatlab_standalone.c as described in that file. The executable splits the photons between the workers and
+  % combines their outputs.
+  executable = fullfile(fileparts(mfilename('fullpath')),'private','MCmatlab_standalone');
+  if ispc
+    executable = [executable '.exe'];
+  end
+  if ~isfile(executable)
+    error('Error: %s was not found. Compile it from +MCmatlab/src/MCmatlab_standalone.c as described in that file.',executable);
+  end
+  if simType == 2
+    MCname = 'FMC';
+  else
+    MCname = 'MC';
+  end
 
-    if (abs(xLCC)               < G.nx*G.dx/2 && ...
-        abs(yLCC)               < G.ny*G.dy/2 && ...
-        abs(zLCC - G.nz*G.dz/2) < G.nz*G.dz/2)
-      error('Error: Light collector center (%.4f,%.4f,%.4f) is inside cuboid',xLCC,yLCC,zLCC);
+  modelFile = [tempname '.mcmd'];
+  resultFile = [tempname '.mcmd'];
+  writeModelFile(modelFile,struct('G',model.G,MCname,model.(MCname),'simType',simType));
+  status = system(sprintf('"%s" coordinate "%s" "%s" %d',executable,modelFile,resultFile,nWorkers),'-echo');
+  delete(modelFile);
+  if status ~= 0
+    error('Error: The standalone MCmatlab workers failed.');
+  end
+  result = readModelFile(resultFile);
+  delete(resultFile);
+  model = storeMCoutputs(model,simType,result);
+end
+
+function extent = getScoringGridExtent(MCorFMC,G)
+  % The region covered by the scoring grid, [xmin xmax ymin ymax zmin zmax], with NaN elements replaced by the cuboid boundaries
+  extent = MCorFMC.scoringGridExtent;
+  cuboidExtent = [-G.Lx/2 G.Lx/2 -G.Ly/2 G.Ly/2 0 G.Lz];
+  extent(isnan(extent)) = cuboidExtent(isnan(extent));
+end
+
+function [x,y,z] = getScoringGridCenters(MCorFMC,G)
+  extent = getScoringGridExtent(MCorFMC,G);
+  res = MCorFMC.scoringGridRes;
+  x = extent(1) + ((1:res(1)) - 1/2)*(extent(2) - extent(1))/res(1);
+  y = extent(3) + ((1:res(2)) - 1/2)*(extent(4) - extent(3))/res(2);
+  z = extent(5) + ((1:res(3)) - 1/2)*(extent(6) - extent(5))/res(3);
+end
+
+function model = storeMCoutputs(model,simType,outputs)
+  % Copies the outputs returned by the mex function (or the standalone workers) into the model. Outputs that were not calculated are
+  % empty and leave the model's properties unchanged.
+  if simType == 2
+    MCname = 'FMC';
+  else
+    MCname = 'MC';
+  end
+  outputNames = fieldnames(outputs);
+  for iOutput = 1:numel(outputNames)
+    if isempty(outputs.(outputNames{iOutput}))
+      continue;
+    elseif strcmp(outputNames{iOutput},'image') % With several light collectors, the images are returned after each other in a matrix with one column per wavelength
+      images = reshape(outputs.image,[],numel(model.(MCname).wavelength));
+      iStart = 0;
+      for iLC = 1:numel(model.(MCname).LC)
+        LC = model.(MCname).LC(iLC);
+        if LC.nTimeBins > 0 && isscalar(model.(MCname).sourceDistribution) % Light from distributed sources is not time-resolved
+          nT = LC.nTimeBins + 2;
+        else
+          nT = 1;
+        end
+        L_LC = LC.res^2*nT;
+        model.(MCname).LC(iLC).image = reshape(images(iStart+(1:L_LC),:),[LC.res LC.res nT size(images,2)]);
+        iStart = iStart + L_LC;
+      end
+    else
+      model.(MCname).(outputNames{iOutput}) = outputs.(outputNames{iOutput});
     end
   end
-end
\ No newline at end of file
+end
@@ -18,6 +18,9 @@ function model = simulateHeatDistribution(model)
   if isscalar(model.MC.NFR)
     error('Error: MC.NFR was not calculated');
   end
+  if any(~isnan(model.MC.NFRroi)) || (~isscalar(model.FMC.NFR) && any(~isnan(model.FMC.NFRroi)))
+    error('Error: The heat simulation requires the normalized fluence rate in the whole cuboid, so NFRroi must not be set');
+  end
 
   model.G = model.G.updateGeometry;
   G = model.G;
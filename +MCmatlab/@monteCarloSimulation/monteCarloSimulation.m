@@ -11,7 +11,14 @@ classdef monteCarloSimulation
     simulationTimeRequested (1,1) double {mustBePositive} = 0.1 % [min] Time duration of the simulation
     nPhotonsRequested (1,1) double {mustBeFinitePositiveIntegerOrNaN} = NaN % # of photons to launch
     requestCollectedPhotons (1,1) logical = false % If true, the photon # in nPhotonsRequested is interpreted as collected photons rather than launched photons
+    photonAllocation (1,1) double {mustBeInteger, mustBeInRange(photonAllocation,0,2)} = 0 % For multiple wavelengths, how the photons (or simulation time) are distributed among the wavelengths. 0: Equally, 1: In proportion to the spectral power, 2: Adaptively, based on the noise and speed of each wavelength measured in a pilot pass
+    parallelWavelengths (1,1) logical = false % For multiple wavelengths on the CPU, if true, all wavelengths are simulated concurrently instead of one after another. Requires memory for one set of output accumulators per wavelength.
+    useSpectralFastPath (1,1) logical = false % For multiple wavelengths on the CPU, if true and only the absorption coefficients depend on wavelength, each photon path is traced once for all wavelengths, carrying one weight per wavelength. Not used with deposition criteria evaluated at the end of life or with a collected photons file.
+    checkpointFile (1,:) char = '' % If not empty, the state of the simulation is saved in this file every checkpointInterval minutes and when the simulation is aborted, so that it can be resumed with runMonteCarlo(model,...,'resume',fileName). Not available on the GPU.
+    checkpointInterval (1,1) double {mustBePositive} = 10 % [min] Time between checkpoints
     calcNormalizedFluenceRate (1,1) logical = true % If true, the 3D normalized fluence rate output array will be calculated. Set to false if you have a light collector and you're only interested in the image output.
+    floatAccumulators (1,1) logical = false % If true, the normalized fluence rate is accumulated in single precision during the simulation, which halves the memory it needs. Not available on the GPU.
+    calcTelemetry (1,1) logical = false % If true, the numbers of steps, boundary crossings, scatterings, interface events, roulette outcomes, launch rejections, escapes, collections and record reallocations of the transport are counted and returned in the telemetry property. Not available on the GPU.
     nExamplePaths (1,1) double {mustBeInteger, mustBeNonnegative} = 0 % This number of photons will have their paths stored and shown after completion, for illustrative purposes
     farFieldRes (1,1) double {mustBeInteger, mustBeNonnegative} = 0 % If nonzero, photons that "escape" will have their energies tracked in a 2D angle distribution (theta,phi) array with theta and phi resolutions equal to this number. An "escaping" photon is one that hits the top cuboid boundary (if boundaryType == 2) or any cuboid boundary (if boundaryType == 1) where the medium has refractive index 1.
 
@@ -25,20 +32,44 @@ classdef monteCarloSimulation
     FRinitial (:,:,:) double {mustBeFiniteNonnegativeArrayOrNaNScalar} = NaN % [W/cm^2] Initial guess for the intensity distribution, to be used for fluence rate dependent simulations
     FRdepIterations (1,1) double {mustBeInteger, mustBeNonnegative} = 0
 
-    lightSource (1,:) MCmatlab.lightSource {mustBeScalarOrEmpty} = MCmatlab.lightSource
+    lightSource (1,:) MCmatlab.lightSource = MCmatlab.lightSource % May be an array of up to 16 light sources, for example the emitters of an LED array. Each launches a share of the photons proportional to its relativePower.
 
     useLightCollector (1,1) logical = false
-    lightCollector (1,1) MCmatlab.lightCollector
+    lightCollector (1,:) MCmatlab.lightCollector = MCmatlab.lightCollector % May be an array of up to 16 light collectors, for example the detection fibers of a multi-fiber probe. Each has its own image.
 
     depositionCriteria (1,1) MCmatlab.depositionCriteria
 
+    axisymmetric (1,1) logical = false % If true, the normalized fluence rate and the z boundary irradiances are additionally scored in rings around the z axis (x = y = 0). Requires dx == dy. Use for geometries and light sources that are rotationally symmetric around the z axis.
+
+    scoringGridRes (1,3) double {mustBeInteger, mustBeNonnegative} = [0 0 0] % [nx ny nz] If nonzero, the normalized fluence rate is additionally scored on a separate scoring grid with this number of bins along x, y and z (NFR_grid). The scoring grid is independent of the voxel grid and can, for example, be much coarser.
+    scoringGridExtent (1,6) double = NaN(1,6) % [cm] [xmin xmax ymin ymax zmin zmax] Region covered by the scoring grid. NaN elements are set to the corresponding cuboid boundaries. Absorption outside the region is not scored in NFR_grid.
+    scoringGridNTimeBins (1,1) double {mustBeInteger, mustBeNonnegative} = 0 % Number of time bins between scoringGridTStart and scoringGridTEnd. If nonzero, NFR_grid is time-resolved, with time as the fourth dimension.
+    scoringGridTStart (1,1) double {mustBeFinite} = 0 % [s] Start of the time interval of the time-resolved scoring grid
+    scoringGridTEnd (1,1) double {mustBeFinite} = 1e-10 % [s] End of the time interval of the time-resolved scoring grid
+
+    NFRroi (1,6) double = NaN(1,6) % [ixmin ixmax iymin iymax izmin izmax] Region of interest in voxel indices. If set, the normalized fluence rate and the Jacobian are only stored and returned for the voxels inside it, which reduces the memory use. NaN elements are set to the full range along that axis.
+    NIroi (1,6) double = NaN(1,6) % [ixmin ixmax iymin iymax izmin izmax] Region of interest in voxel indices for the normalized boundary irradiances. Each NI array is only stored and returned for the boundary pixels that the region extends over. NaN elements are set to the full range of the array along that axis.
+
+    mirrorSymmetry (1,1) double {mustBeInteger, mustBeInRange(mirrorSymmetry,0,3)} = 0 % 0: None, 1: Geometry and light source are mirror symmetric around the x = 0 plane, 2: Mirror symmetric around the y = 0 plane, 3: Mirror symmetric around both planes. Only the x >= 0 half (or x >= 0, y >= 0 quadrant) is simulated.
+
+    useLayeredFastPath (1,1) logical = false % If true and the media only vary along z (planar layers), photons are transported from layer interface to layer interface instead of from voxel to voxel, which is considerably faster. Not used on the GPU, with mirrorSymmetry or with calcJacobian.
+
+    quasiRandomLaunch (1,1) logical = false % If true, the random numbers used for launching photons (start positions and directions) are taken from a scrambled Sobol low-discrepancy sequence, which reduces the noise contributed by the light source sampling.
+
+    clipLightSources (1,1) logical = false % If true, light sources that extend beyond the region in which photons are allowed to travel are sampled only in the part that launches photons inside it, with the photon weight set to the probability of that part, instead of relaunching the photons that start outside. The outputs are then normalized to the full power of the light source rather than to the part of it that enters the region.
+
+    calcJacobian (1,1) logical = false % If true, the derivative of the normalized power collected by the light collector with respect to the absorption coefficient of each voxel is calculated. Requires useLightCollector = true.
+
     sourceDistribution single = NaN
 
     %% Calculated properties
     simulationTime = NaN
     nPhotons = NaN
     nPhotonsCollected = NaN
+    nPhotonsPerWavelength = NaN % Number of photons launched at each wavelength, used when continuing the simulation with runMonteCarlo(model,'continue')
     nThreads = NaN
+    phaseTimes = NaN % [s] Struct with the wall-clock times of the setup, transport, normalization and output copy phases of the most recent run
+    telemetry = NaN % Struct with the event counters of the transport in the most recent run if calcTelemetry is true
 
     mediaProperties = NaN % Wavelength- and splitting-dependent
     CDFs = {} % Cumulative distribution functions for custom phase functions (not Henyey Greenstein)
@@ -49,6 +80,7 @@ classdef monteCarloSimulation
     examplePaths = NaN
 
     normalizedFluenceRate = 0
+    jacobian = NaN % [W/W.incident/cm^-1] Derivative of the normalized collected power with respect to the absorption coefficient of each voxel
     FR = 0
 
     farField = NaN
@@ -61,6 +93,17 @@ classdef monteCarloSimulation
     normalizedIrradiance_yneg = NaN
     normalizedIrradiance_zpos = NaN
     normalizedIrradiance_zneg = NaN
+
+    r = NaN % [cm] Radial bin centers of the axisymmetric outputs
+    normalizedFluenceRate_rz = NaN % Normalized fluence rate as function of (r,z) if axisymmetric is true
+    normalizedIrradiance_zpos_r = NaN % Normalized irradiance on the positive z boundary as function of r if axisymmetric is true
+    normalizedIrradiance_zneg_r = NaN
+
+    x_grid = NaN % [cm] Bin centers of the scoring grid along x
+    y_grid = NaN % [cm] Bin centers of the scoring grid along y
+    z_grid = NaN % [cm] Bin centers of the scoring grid along z
+    t_grid = NaN % [s] Bin centers of the time axis of the scoring grid if scoringGridNTimeBins is nonzero. The first and last bins include all earlier and later times.
+    normalizedFluenceRate_grid = NaN % Normalized fluence rate on the scoring grid if scoringGridRes is nonzero
   end
 
   properties (Dependent)
@@ -82,6 +125,10 @@ classdef monteCarloSimulation
     NI_yneg
     NI_zpos
     NI_zneg
+    NFR_rz
+    NI_zpos_r
+    NI_zneg_r
+    NFR_grid
   end
 
   methods
@@ -97,10 +144,17 @@ classdef monteCarloSimulation
 
     function NA = get.normalizedAbsorption(obj)
       if numel(obj.NFR) > 1
+        M = obj.M;
+        roi = obj.NFRroi;
+        if any(~isnan(roi)) % NFR only covers the region of interest
+          fullRange = [1 size(M,1) 1 size(M,2) 1 size(M,3)];
+          roi(isnan(roi)) = fullRange(isnan(roi));
+          M = M(roi(1):roi(2),roi(3):roi(4),roi(5):roi(6));
+        end
         NA = NaN(size(obj.NFR));
         for iWavelength = 1:numel(obj.wavelength)
           mua_vec = [obj.mediaProperties.mua(:,iWavelength)];
-          NA(:,:,:,iWavelength) = mua_vec(obj.M).*obj.NFR(:,:,:,iWavelength);
+          NA(:,:,:,iWavelength) = mua_vec(M).*obj.NFR(:,:,:,iWavelength);
         end
       else
         NA = 0;
@@ -144,6 +198,14 @@ classdef monteCarloSimulation
     function obj = set.NI_zpos(obj,x);     obj.normalizedIrradiance_zpos = x; end  
     function x   = get.NI_zneg(obj  ); x = obj.normalizedIrradiance_zneg; end
     function obj = set.NI_zneg(obj,x);     obj.normalizedIrradiance_zneg = x; end  
+    function x   = get.NFR_rz(obj  ); x = obj.normalizedFluenceRate_rz; end
+    function obj = set.NFR_rz(obj,x);     obj.normalizedFluenceRate_rz = x; end
+    function x   = get.NI_zpos_r(obj  ); x = obj.normalizedIrradiance_zpos_r; end
+    function obj = set.NI_zpos_r(obj,x);     obj.normalizedIrradiance_zpos_r = x; end
+    function x   = get.NI_zneg_r(obj  ); x = obj.normalizedIrradiance_zneg_r; end
+    function obj = set.NI_zneg_r(obj,x);     obj.normalizedIrradiance_zneg_r = x; end
+    function x   = get.NFR_grid(obj  ); x = obj.normalizedFluenceRate_grid; end
+    function obj = set.NFR_grid(obj,x);     obj.normalizedFluenceRate_grid = x; end
   end
 end
 
@@ -1,12 +1,18 @@
 function plotRadialReflectanceTransmittance(model)
-  [X,Y] = ndgrid(model.G.x,model.G.y);
-  R = sqrt(X.^2 + Y.^2);
-  Runq = unique(R(:));
-  Refl = NaN(size(Runq));
-  Tran = NaN(size(Runq));
-  for i = 1:numel(Runq)
-    Refl(i) = mean(model.MC.NI_zneg(R == Runq(i)));
-    Tran(i) = mean(model.MC.NI_zpos(R == Runq(i)));
+  if model.MC.axisymmetric % The radial irradiances have been scored directly during the simulation
+    Runq = model.MC.r(:);
+    Refl = model.MC.NI_zneg_r;
+    Tran = model.MC.NI_zpos_r;
+  else
+    [X,Y] = ndgrid(model.G.x,model.G.y);
+    R = sqrt(X.^2 + Y.^2);
+    Runq = unique(R(:));
+    Refl = NaN(size(Runq));
+    Tran = NaN(size(Runq));
+    for i = 1:numel(Runq)
+      Refl(i) = mean(model.MC.NI_zneg(R == Runq(i)));
+      Tran(i) = mean(model.MC.NI_zpos(R == Runq(i)));
+    end
   end
   Refl = [flipud(Refl(Runq ~= 0)) ; Refl];
   Tran = [flipud(Tran(Runq ~= 0)) ; Tran];
@@ -0,0 +1,59 @@
+function CP = readCollectedPhotons(fileName)
+  % CP = MCmatlab.readCollectedPhotons(fileName) reads a collected photons
+  % file written during a Monte Carlo simulation in which
+  % lightCollector.collectedPhotonsFile was set. CP is a struct array with
+  % one element per wavelength, containing one row per collected photon in
+  % each of the fields:
+  %   r                    [cm]  Position at which the photon escaped the cuboid (x,y,z)
+  %   u                    [-]   Direction of the photon when it escaped (ux,uy,uz)
+  %   weight               [-]   Photon packet weight
+  %   t                    [s]   Time of arrival at the light collector
+  %   scatterings, refractions, reflections, interfaceTransitions
+  %                        [-]   Event counters as counted by the deposition criteria
+  %   pathlengths          [cm]  Distance travelled in each of the media in model.MC.mediaProperties (or model.FMC.mediaProperties)
+  % and the scalar field normFactor. sum(CP(iL).weight)/CP(iL).normFactor
+  % is the normalized power registered on the light collector at wavelength
+  % iL, the same as the image of a fiber tip light collector. The weights
+  % may be rescaled before summing to apply time gates, changes of
+  % absorption coefficients (multiplying by exp(-pathlengths*dmua)) or
+  % changes of light collector geometry.
+
+  fid = fopen(fileName,'r');
+  if fid == -1
+    error('Error: Could not open %s',fileName);
+  end
+  closeFile = onCleanup(@() fclose(fid));
+  if ~strcmp(fread(fid,[1 4],'*char'),'MCPD')
+    error('Error: %s is not an MCmatlab collected photons file',fileName);
+  end
+  headerInts = fread(fid,3,'uint32');
+  if headerInts(1) ~= 1
+    error('Error: Unsupported collected photons file version %d',headerInts(1));
+  end
+  nM = headerInts(2);
+  nL = headerInts(3);
+  nRecords = NaN(nL,1);
+  normFactors = NaN(nL,1);
+  for iL = 1:nL
+    nRecords(iL) = fread(fid,1,'uint64');
+    normFactors(iL) = fread(fid,1,'double');
+  end
+
+  recordSize = 12 + nM; % In 4-byte elements
+  CP = struct('r',cell(nL,1));
+  for iL = 1:nL % Records are stored in increasing wavelength order
+    data = fread(fid,[recordSize nRecords(iL)],'*uint32').';
+    floats = typecast(reshape(data,[],1),'single');
+    floats = reshape(floats,size(data));
+    CP(iL).r = double(floats(:,1:3));
+    CP(iL).u = double(floats(:,4:6));
+    CP(iL).weight = double(floats(:,7));
+    CP(iL).t = double(floats(:,8));
+    CP(iL).scatterings = double(data(:,9));
+    CP(iL).refractions = double(data(:,10));
+    CP(iL).reflections = double(data(:,11));
+    CP(iL).interfaceTransitions = double(data(:,12));
+    CP(iL).pathlengths = double(floats(:,13:end));
+    CP(iL).normFactor = normFactors(iL);
+  end
+end
@@ -101,6 +101,7 @@
   #define ATAN2(x,y) atan2f(x,y)
   #define EXP(x)     expf(x)
   #define EXPM1(x)   expm1f(x)
+  #define ERFC(x)    erfcf(x)
   #define LOG(x)     logf(x)
   #define SQRT(x)    sqrtf(x)
   #define FLOOR(x)   floorf(x)
@@ -118,6 +119,7 @@
   #define ATAN2(x,y) atan2(x,y)
   #define EXP(x)     exp(x)
   #define EXPM1(x)   expm1(x)
+  #define ERFC(x)    erfc(x)
   #define LOG(x)     log(x)
   #define SQRT(x)    sqrt(x)
   #define FLOOR(x)   floor(x)
@@ -154,6 +156,9 @@
   #define ISFINITE(x) (mxIsFinite(x))
   #define ISNAN(x) (mxIsNaN(x))
 #endif
+#ifndef PRNGSTREAMOFFSET
+  #define PRNGSTREAMOFFSET 0 // Stream index mixed into the random number seeds. The standalone worker (MCmatlab_standalone.c) sets it, so that workers started at the same time use different streams
+#endif
 
 #define PI          ACOS(-1.0f)
 #define C           (FLOATORDBL)29979245800 // speed of light in vacuum in cm/s
@@ -162,6 +167,7 @@
 #define SIGN(x)     ((x)>=0? 1:-1)
 #define INITIALPATHSSIZE 2000
 #define INITIALRECORDSIZE 1000
+#define DEPOSITIONCACHESIZE 8192 // Number of entries in each thread's deposition cache when MC.floatAccumulators is true. Must be a power of 2
 #define KILLRANGE   5 // Must be odd integer
     /* KILLRANGE determines the region that photons are allowed to stay 
      * alive in in multiples of the cuboid size (if outside, the probability
@@ -169,6 +175,17 @@
      * launching an infinite plane wave without boundaries, photons will be
      * launched in this whole extended region. */
 #define CDFSIZE     201 // Each custom phase function CDF contains this many elements (has to be one plus the value set in getOpticalMediaProperties.m)
+#define COLLECTEDPHOTONSBUFFERSIZE 1024 // Number of collected photon records each thread buffers before writing them to the collected photons file
+#define COLLECTEDPHOTONRECORDFIXEDSIZE 12 // Number of 4-byte elements in a collected photon record before the per-medium pathlengths
+#define PILOTFRACTION 0.1 // Fraction of the photon or time budget spent on the pilot pass when photonAllocation is 2
+#define PILOTMINPHOTONS 10000 // Minimum number of photons per wavelength in the pilot pass
+#define WAVELENGTHBATCHSIZE 100 // Number of photons a thread simulates at one wavelength before the wavelength scheduler picks the next wavelength
+#define NQMCDIMS    8 // Number of quasi-random dimensions available to launchPhoton when quasiRandomLaunch is true
+#define MAXLIGHTCOLLECTORS 16 // Maximum number of light collectors in a simulation (has to be the same as in runMonteCarlo.m)
+#define MAXLIGHTSOURCES 16 // Maximum number of light sources in a simulation (has to be the same as in runMonteCarlo.m)
+#define NOUTPUTARRAYS 14 // Number of accumulator arrays in struct outputs
+#define CHECKPOINTVERSION 1 // Format version of the checkpoint files
+#define NCHECKPOINTHEADERINTS 8 // Number of ints identifying the simulation at the start of a checkpoint file
 
 #include "MCmatlablib.c"
 
@@ -179,13 +196,22 @@ void threadInitAndLoop(struct source *B_global, struct geometry *G_global,
           struct lightCollector *LC_global, struct paths *Pa, struct outputs *O_global, struct depositionCriteria *DC_global, long nM, size_t size_smallArrays,
           long long simulationTimeStart, long long microSecondsOrGPUCycles, unsigned long long nPhotonsRequested,
           int iL, int nL, bool requestCollectedPhotons,
-          bool *abortingPtr, bool silentMode, struct debug *D) {
+          bool *abortingPtr, bool silentMode, struct wavelengthScheduler *WS, struct checkpoint *CP, struct debug *D) {
   struct photon P_var;
   struct photon *P = &P_var;
 
-  P->recordSize    = DC_global->evaluateCriteriaAtEndOfLife? INITIALRECORDSIZE: 0; // If we're supposed to deposit weight retroactively, we start the record at a size of 1000 elements - it will be dynamically expanded later if needed
-  P->j_record      = DC_global->evaluateCriteriaAtEndOfLife? (long *)malloc(P->recordSize*sizeof(long)): NULL;
-  P->weight_record = DC_global->evaluateCriteriaAtEndOfLife? (FLOATORDBL *)malloc(P->recordSize*sizeof(FLOATORDBL)): NULL;
+  bool useRecord = DC_global->evaluateCriteriaAtEndOfLife || O_global->J;
+  P->recordSize        = useRecord? INITIALRECORDSIZE: 0; // If we're supposed to deposit weight retroactively or calculate the Jacobian, we start the record at a size of 1000 elements - it will be dynamically expanded later if needed
+  P->j_record          = useRecord? (long *)malloc(P->recordSize*sizeof(long)): NULL;
+  P->weight_record     = useRecord? (FLOATORDBL *)malloc(P->recordSize*sizeof(FLOATORDBL)): NULL;
+  P->pathlength_record = useRecord? (FLOATORDBL *)malloc(P->recordSize*sizeof(FLOATORDBL)): NULL;
+  P->pathlengths = NULL;
+  P->spectralWeights = G_global->nSpectral? (FLOATORDBL *)malloc(G_global->nSpectral*sizeof(FLOATORDBL)): NULL;
+  P->collectedPhotonsBuffer = NULL;
+  P->collectedPhotonsBufferElems = 0;
+  P->depositionCache = O_global->NFR_float? (struct depositionCacheEntry *)calloc(DEPOSITIONCACHESIZE,sizeof(struct depositionCacheEntry)): NULL;
+  memset(&P->telemetry,0,sizeof(struct telemetry));
+  P->rejectedLaunchesInARow = 0;
 
   #ifdef __NVCC__ // If compiling for CUDA
   // Copy structs from global device memory to shared device memory, which is orders of magnitude faster since it is on-chip
@@ -193,8 +219,8 @@ void threadInitAndLoop(struct source *B_global, struct geometry *G_global,
   struct source *B = &B_var;
   __shared__ struct geometry G_var;
   struct geometry *G = &G_var;
-  __shared__ struct lightCollector LC_var;
-  struct lightCollector *LC = &LC_var;
+  __shared__ struct lightCollector LC_var[MAXLIGHTCOLLECTORS];
+  struct lightCollector *LC = LC_var;
   __shared__ struct outputs O_var;
   struct outputs *O = &O_var;
   __shared__ struct depositionCriteria DC_var;
@@ -204,22 +230,24 @@ void threadInitAndLoop(struct source *B_global, struct geometry *G_global,
     // Copy contents of structs and smallArrays (not deep copies, pointers still point to global device memory)
     B_var = *B_global;
     G_var = *G_global;
-    LC_var = *LC_global;
+    for(int iLC=0;iLC<G_global->nLC;iLC++) LC_var[iLC] = LC_global[iLC];
     O_var = *O_global;
     DC_var = *DC_global;
     memcpy(smallArrays,G->muav,size_smallArrays);
     // Set all array pointers to the correct new locations in the shared memory version of smallArrays
-    long CDFarraySize = B->FPIDdist1? B->FPIDdist1 - G->CDFs: (FLOATORDBL *)G->CDFidxv - G->CDFs;
+    FLOATORDBL *CDFs_global = G->CDFs;
     G->muav = smallArrays;
     G->musv = G->muav + nM;
     G->gv = G->musv + nM;
     G->RIv = G->gv + nM;
     G->CDFs = G->RIv + nM;
-    B->FPIDdist1 = G->CDFs + CDFarraySize;
-    B->AIDdist1 = B->FPIDdist1 + B->L_FPID1;
-    B->FPIDdist2 = B->AIDdist1 + B->L_AID1;
-    B->AIDdist2 = B->FPIDdist2 + B->L_FPID2;
-    G->CDFidxv = (unsigned char *)(B->AIDdist2 + B->L_AID2);
+    for(int iLS=0;iLS<B->nLS;iLS++) if(B->beams[iLS].FPIDdist1) { // The intensity distributions of the light sources follow the CDFs
+      B->beams[iLS].FPIDdist1 = G->CDFs + (B->beams[iLS].FPIDdist1 - CDFs_global);
+      B->beams[iLS].AIDdist1 = G->CDFs + (B->beams[iLS].AIDdist1 - CDFs_global);
+      B->beams[iLS].FPIDdist2 = G->CDFs + (B->beams[iLS].FPIDdist2 - CDFs_global);
+      B->beams[iLS].AIDdist2 = G->CDFs + (B->beams[iLS].AIDdist2 - CDFs_global);
+    }
+    G->CDFidxv = (unsigned char *)(G->CDFs + ((FLOATORDBL *)G->CDFidxv - CDFs_global));
   }
   __syncthreads(); // All threads in the block wait for the copy to have finished
   
@@ -238,15 +266,51 @@ void threadInitAndLoop(struct source *B_global, struct geometry *G_global,
   // Check for failed memory allocations and initialize the PRNG
   if(P->recordSize && !P->j_record) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
   if(P->recordSize && !P->weight_record) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
-  dsfmt_init_gen_rand(&P->PRNGstate,(unsigned long)simulationTimeStart + THREADNUM); // Seed the photon's random number generator
+  if(P->recordSize && !P->pathlength_record) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+  if(G->nSpectral && !P->spectralWeights) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+  if(O->NFR_float && !P->depositionCache) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+  if(O->collectedPhotonsFile) {
+    P->pathlengths = (FLOATORDBL *)malloc(nM*sizeof(FLOATORDBL));
+    P->collectedPhotonsBuffer = (float *)malloc(COLLECTEDPHOTONSBUFFERSIZE*O->collectedPhotonsRecordSize*sizeof(float));
+    if(!P->pathlengths || !P->collectedPhotonsBuffer) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+  }
+  if(CP && THREADNUM < CP->nPRNGstates) P->PRNGstate = CP->PRNGstates[THREADNUM]; // Continue the thread's random number sequence from where it was when the thread last returned
+  else dsfmt_init_gen_rand(&P->PRNGstate,(unsigned long)simulationTimeStart + THREADNUM + ((unsigned long)PRNGSTREAMOFFSET << 16)); // Seed the photon's random number generator
   int pctProgressThisWavelength = 0;      // Simulation progress in percent
   int pctProgress = 0;
+  bool simulationTimed = nPhotonsRequested == ULLONG_MAX;
+  int iLbatch = -1; // With the wavelength scheduler, the wavelength of the current batch of photons
+  int photonsLeftInBatch = 0;
+  long long batchTimeStart = 0;
   // Launch major loop
-  while(pctProgressThisWavelength < 100 && (requestCollectedPhotons? O->nPhotonsCollected: O->nPhotons) + THREADNUM < nPhotonsRequested && !*abortingPtr) { // "+ THREADNUM" ensures that we avoid race conditions that might launch more than nPhotonsRequested photons
+  while(WS? pctProgress < 100 && !*abortingPtr:
+            pctProgressThisWavelength < 100 && (requestCollectedPhotons? O->nPhotonsCollected: O->nPhotons) + THREADNUM < nPhotonsRequested && !*abortingPtr) { // "+ THREADNUM" ensures that we avoid race conditions that might launch more than nPhotonsRequested photons
+    if(WS) { // Each thread simulates batches of photons at the wavelength that is furthest behind its share of the budget
+      if(!photonsLeftInBatch || (!simulationTimed && (requestCollectedPhotons? O->nPhotonsCollected: O->nPhotons) + THREADNUM >= WS->nPhotonsRequested[iLbatch])) {
+        long long newtime = getMicroSeconds();
+        if(iLbatch >= 0 && simulationTimed) atomicAddWrapper(&WS->threadTime[iLbatch],(double)(newtime - batchTimeStart));
+        batchTimeStart = newtime;
+        iLbatch = getNextWavelength(WS,simulationTimed,requestCollectedPhotons);
+        if(iLbatch < 0) break; // All wavelengths are done
+        photonsLeftInBatch = WAVELENGTHBATCHSIZE;
+        B = &WS->B[iLbatch];
+        G = &WS->G[iLbatch];
+        O = O_global = &WS->O[iLbatch];
+      }
+      photonsLeftInBatch--;
+    }
   #endif
-    launchPhoton(P,B,G,Pa,DC,abortingPtr,D);
+    if(P->pathlengths) for(long iM=0;iM<nM;iM++) P->pathlengths[iM] = 0;
+    if(launchPhoton(P,B,G,Pa,DC,abortingPtr,&O_global->nLaunches,D)) { // We have to store the photon number in the global memory so it's visible to all blocks. With clipLightSources, photons launched with zero weight are also counted.
+      atomicAddWrapperULL(&O_global->nPhotons,1);
+      if(G->calcTelemetry) {
+        P->telemetry.photons++;
+        if(!P->alive) P->telemetry.launchRejections++;
+      }
+    }
+    if(P->alive && B->clipLightSources && !O_global->launchedInside) O_global->launchedInside = true;
     if(P->alive) getNewVoxelProperties(P,G,D);
-    if(P->alive) atomicAddWrapperULL(&O_global->nPhotons,1); // We have to store the photon number in the global memory so it's visible to all blocks
+    for(int iLs=0;iLs<G->nSpectral;iLs++) P->spectralWeights[iLs] = P->weight;
 
     while(P->alive) { // keep doing scattering events
       while(P->alive && P->stepLeft>0) { // keep propagating
@@ -256,11 +320,19 @@ void threadInitAndLoop(struct source *B_global, struct geometry *G_global,
           if(P->alive) getNewVoxelProperties(P,G,D);
         }
       }
-      if(P->alive) checkRoulette(P); // photon may die here
+      if(P->alive) checkRoulette(P,G); // photon may die here
       if(P->alive) scatterPhoton(P,G,Pa,DC,D);
     }
+    if(G->calcTelemetry) P->telemetry.collections += P->killed_escaped_collected == 2;
     if(DC->evaluateCriteriaAtEndOfLife && depositionCriteriaMet(P,DC)) {
-      for(long i=0;i<P->recordElems;i++) atomicAddWrapper(&O->NFR[P->j_record[i]],P->weight*P->weight_record[i]);
+      for(long i=0;i<P->recordElems;i++) depositNFR(P,O,P->j_record[i],P->weight/P->launchWeight*P->weight_record[i]);
+    }
+    if(O->J && P->killed_escaped_collected == 2 && depositionCriteriaMet(P,DC)) {
+      if(G->nSpectral) { // In the spectral fast path, O is the array of the outputs of all the wavelengths
+        for(int iLs=0;iLs<G->nSpectral;iLs++) for(long i=0;i<P->recordElems;i++) atomicAddWrapper(&O[iLs].J[P->j_record[i]],P->spectralWeights[iLs]*P->pathlength_record[i]);
+      } else {
+        for(long i=0;i<P->recordElems;i++) atomicAddWrapper(&O->J[P->j_record[i]],P->weight*P->pathlength_record[i]);
+      }
     }
     
     #ifdef __NVCC__ // If compiling for CUDA
@@ -279,11 +351,12 @@ void threadInitAndLoop(struct source *B_global, struct geometry *G_global,
     }
     
     #ifndef __NVCC__
-      // Check progress
+      // Check progress. With the wavelength scheduler, the progress is that of all wavelengths together, and iL = 0, nL = 1.
+      double photonsProgressThisWavelength = WS? getSchedulerPhotonProgress(WS,requestCollectedPhotons): (double)(requestCollectedPhotons? O->nPhotonsCollected: O->nPhotons)/nPhotonsRequested;
       int pctTimeProgressThisWavelength = (int)(100.0*(getMicroSeconds() - simulationTimeStart)/microSecondsOrGPUCycles);
-      int pctPhotonsProgressThisWavelength = (int)(100.0*(requestCollectedPhotons? O->nPhotonsCollected: O->nPhotons)/nPhotonsRequested);
+      int pctPhotonsProgressThisWavelength = (int)(100.0*photonsProgressThisWavelength);
       int pctTimeProgress = (int)(100.0*(iL + (double)(getMicroSeconds() - simulationTimeStart)/microSecondsOrGPUCycles)/nL);
-      int pctPhotonsProgress = (int)(100.0*(iL + (double)(requestCollectedPhotons? O->nPhotonsCollected: O->nPhotons)/nPhotonsRequested)/nL);
+      int pctPhotonsProgress = (int)(100.0*(iL + photonsProgressThisWavelength)/nL);
 
       #ifdef _OPENMP
       #pragma omp master
@@ -307,14 +380,244 @@ void threadInitAndLoop(struct source *B_global, struct geometry *G_global,
       }
       pctProgressThisWavelength = max(pctTimeProgressThisWavelength,pctPhotonsProgressThisWavelength);
       pctProgress = max(pctTimeProgress,pctPhotonsProgress);
+      if(CP && getMicroSeconds() >= CP->nextTime) break; // Return so that a checkpoint can be taken
     #endif
   }
 
+  #ifndef __NVCC__
+  if(WS && iLbatch >= 0 && simulationTimed) atomicAddWrapper(&WS->threadTime[iLbatch],(double)(getMicroSeconds() - batchTimeStart));
+  if(CP) CP->PRNGstates[THREADNUM] = P->PRNGstate;
+  if(P->collectedPhotonsBuffer) flushCollectedPhotonsBuffer(P,O);
+  if(P->depositionCache) flushDepositionCache(P);
+  if(O_global->telemetry) { // Add the thread's event counters to those of the other threads
+    unsigned long long *threadCounters = (unsigned long long *)&P->telemetry;
+    for(int k=0;k<NTELEMETRYCOUNTERS;k++) atomicAddWrapperULL((unsigned long long *)O_global->telemetry + k,threadCounters[k]);
+  }
+  #endif
   free(P->j_record); // Will do nothing if P->j_record == NULL
   free(P->weight_record); // Will do nothing if P->weight_record == NULL
+  free(P->pathlength_record); // Will do nothing if P->pathlength_record == NULL
+  free(P->pathlengths);
+  free(P->spectralWeights);
+  free(P->collectedPhotonsBuffer);
+  free(P->depositionCache);
+}
+
+#ifndef __NVCC__
+void runThreads(struct source *B, struct geometry *G, struct lightCollector *LC, struct paths *Pa, struct outputs *O, struct depositionCriteria *DC, long nM,
+          long long simulationTimeStart, long long microSeconds, unsigned long long nPhotonsRequested, int iL, int nL, bool requestCollectedPhotons,
+          bool *abortingPtr, bool silentMode, struct wavelengthScheduler *WS, struct checkpoint *CP, double nThreads, struct debug *D) {
+  // Runs threadInitAndLoop on nThreads threads. If a checkpoint snapshot is waiting to be written, one extra thread writes it meanwhile.
+  bool writeConcurrently = CP && CP->pending;
+  #ifdef _OPENMP
+  #pragma omp parallel num_threads((long)nThreads + writeConcurrently)
+  #endif
+  {
+    if(writeConcurrently && THREADNUM == (long)nThreads) writeCheckpoint(CP);
+    else threadInitAndLoop(B,G,LC,Pa,O,DC,nM,0,simulationTimeStart,microSeconds,nPhotonsRequested,iL,nL,requestCollectedPhotons,abortingPtr,silentMode,WS,CP,D);
+  }
+  if(B->clipLightSources) for(int iO=0;iO<(WS? WS->nL: 1);iO++) { // If no photon was launched inside the launch region, the launches are not counted, so that the simulation fails as if the photons had been relaunched
+    struct outputs *O_this = WS? &WS->O[iO]: O;
+    if(!O_this->launchedInside) O_this->nPhotons = 0;
+  }
+  if(CP) {
+    if(CP->pending) writeCheckpoint(CP); // If the extra thread was not started, e.g., without OpenMP
+    CP->nPRNGstates = (int)nThreads;
+  }
+}
+
+bool checkpointAfterChunk(struct checkpoint *CP, bool aborting, int const *header, int iL, double const *progress, double budgetFraction,
+          double const *allocationFractions, int nL, unsigned int QMCseed, struct paths *Pa, struct MATLABoutputs *O_MATLAB,
+          FLOATORDBL const *threadTime, struct outputs *O, int nO, struct geometry const *G, struct lightCollector const *LC) {
+  // Called when runThreads has returned. If the threads returned because a checkpoint was due, a snapshot of the state of the simulation is
+  // serialized into CP->buffer, to be written while the threads continue, and true is returned. If the simulation was aborted, the snapshot
+  // is written right away. progress contains the cumulative number of photons and collected photons and the cumulative simulation time of
+  // the finished wavelengths, and the time in microseconds spent on the current wavelength (or on all wavelengths, if they are simulated together).
+  if(!CP || !CP->fileName) return false; // Without a checkpoint file, CP is only used to continue the PRNG sequences when resuming
+  bool due = !aborting && getMicroSeconds() >= CP->nextTime;
+  if(!due && !aborting) return false;
+  CP->bufferElems = 0;
+  appendToCheckpoint(CP,"MCCP",4);
+  appendToCheckpoint(CP,header,NCHECKPOINTHEADERINTS*sizeof(int));
+  appendToCheckpoint(CP,&iL,sizeof(int));
+  appendToCheckpoint(CP,progress,4*sizeof(double));
+  appendToCheckpoint(CP,&budgetFraction,sizeof(double));
+  appendToCheckpoint(CP,allocationFractions,nL*sizeof(double));
+  appendToCheckpoint(CP,&QMCseed,sizeof(unsigned int));
+  appendToCheckpoint(CP,&CP->nPRNGstates,sizeof(int));
+  appendToCheckpoint(CP,CP->PRNGstates,CP->nPRNGstates*sizeof(PRNG_t));
+  appendToCheckpoint(CP,&Pa->pathsElems,sizeof(long));
+  appendToCheckpoint(CP,&Pa->nExamplePhotonPathsFinished,sizeof(long));
+  appendToCheckpoint(CP,Pa->data,4*Pa->pathsElems*sizeof(FLOATORDBL));
+  float *MATLABarrays[NOUTPUTARRAYS];
+  long MATLABlengths[NOUTPUTARRAYS];
+  getMATLABoutputArrays(O_MATLAB,G,LC,nL,MATLABarrays,MATLABlengths);
+  for(int k=0;k<NOUTPUTARRAYS;k++) if(MATLABarrays[k]) appendToCheckpoint(CP,MATLABarrays[k],MATLABlengths[k]*sizeof(float)); // Contains the results of the finished wavelengths
+  if(threadTime) appendToCheckpoint(CP,threadTime,nL*sizeof(FLOATORDBL));
+  appendOutputsToCheckpoint(CP,O,nO,G,LC);
+  CP->pending = true;
+  CP->nextTime = getMicroSeconds() + CP->interval;
+  if(aborting) writeCheckpoint(CP);
+  return due;
+}
+#endif
+
+void setWavelengthDependentProperties(struct geometry *G, struct source *B, int iL, int nM, long L, float const *S_PDF, mxArray *MatlabMC, int nThreads) {
+  mxArray *mediaProperties = mxGetPropertyShared(MatlabMC,0,"mediaProperties");
+  for(long idx=0;idx<nM;idx++) {
+    G->muav[idx]    = (FLOATORDBL)   mxGetPr(mxGetField(mediaProperties,0,"mua"))[idx + iL*nM];
+    G->musv[idx]    = (FLOATORDBL)   mxGetPr(mxGetField(mediaProperties,0,"mus"))[idx + iL*nM];
+    G->gv[idx]      = (FLOATORDBL)     mxGetPr(mxGetField(mediaProperties,0,"g"))[idx + iL*nM];
+    G->RIv[idx]     = (FLOATORDBL)     mxGetPr(mxGetField(mediaProperties,0,"n"))[idx + iL*nM];
+    G->CDFidxv[idx] = (unsigned char)mxGetPr(mxGetField(mediaProperties,0,"CDFidx"))[idx + iL*nM];
+  }
+
+  if(S_PDF) {
+    // The cumulative sum is calculated in two passes over blocks of the cuboid, one per thread. Each thread first sums its block of the PDF,
+    // and after the block sums have been accumulated, each thread fills in its block of S starting from the sum of the preceding blocks.
+    FLOATORDBL *S = B->S;
+    float const *S_PDF_iL = S_PDF + (unsigned long long)iL*L;
+    FLOATORDBL *blockSums = (FLOATORDBL *)malloc((nThreads+1)*sizeof(FLOATORDBL));
+    if(!blockSums) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+    blockSums[0] = 0;
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(nThreads)
+    #endif
+    {
+      #ifdef _OPENMP
+      int iBlock = omp_get_thread_num(), nBlocks = omp_get_num_threads();
+      #else
+      int iBlock = 0, nBlocks = 1;
+      #endif
+      long blockStart = (long)((double)L*iBlock/nBlocks), blockEnd = (long)((double)L*(iBlock+1)/nBlocks);
+      FLOATORDBL sum = 0;
+      for(long idx=blockStart;idx<blockEnd;idx++) sum += (FLOATORDBL)S_PDF_iL[idx];
+      blockSums[iBlock+1] = sum;
+      #ifdef _OPENMP
+      #pragma omp barrier
+      #pragma omp single
+      #endif
+      for(int k=1;k<=nBlocks;k++) blockSums[k] += blockSums[k-1];
+      sum = blockSums[iBlock];
+      for(long idx=blockStart;idx<blockEnd;idx++) S[idx+1] = sum += (FLOATORDBL)S_PDF_iL[idx];
+    }
+    free(blockSums);
+    FLOATORDBL S_total = S[L];
+    B->power        = (FLOATORDBL)(S_total*G->d[0]*G->d[1]*G->d[2]);
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(nThreads) schedule(static)
+    #endif
+    for(long idx=1;idx<(L+1);idx++) S[idx] /= S_total;
+  } else {
+    B->power        = (FLOATORDBL)mxGetPr(mxGetPropertyShared(MatlabMC,0,"spectrum"))[iL];
+  }
+}
+
+long getBeamDistsLength(mxArray const *MatlabLS, int iLS, long L_dists[4]) { // Lengths of the FPID and AID arrays of light source iLS, and their total
+  int sourceType = (int)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"sourceType"));
+  mxArray *MatlabSourceFPID = mxGetPropertyShared(MatlabLS,iLS,"FPID");
+  mxArray *MatlabSourceAID = mxGetPropertyShared(MatlabLS,iLS,"AID");
+  long L[4] = {sourceType >= 4? (long)mxGetN(mxGetPropertyShared(MatlabSourceFPID,0,sourceType == 4? "radialDistr": "XDistr")): 0,
+               sourceType >= 4? (long)mxGetN(mxGetPropertyShared(MatlabSourceAID,0,sourceType == 4? "radialDistr": "XDistr")): 0,
+               sourceType == 5? (long)mxGetN(mxGetPropertyShared(MatlabSourceFPID,0,"YDistr")): 0,
+               sourceType == 5? (long)mxGetN(mxGetPropertyShared(MatlabSourceAID,0,"YDistr")): 0}; // FPID1, AID1, FPID2, AID2
+  if(L_dists) for(int k=0;k<4;k++) L_dists[k] = L[k];
+  return L[0] + L[1] + L[2] + L[3];
+}
+
+void setBeamProperties(struct beam *LS, mxArray const *MatlabLS, int iLS, FLOATORDBL *dists) { // Fills LS with the properties of light source iLS, storing its intensity distributions at dists
+  long idx;
+  int sourceType = (int)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"sourceType"));
+  mxArray *MatlabSourceFPID = mxGetPropertyShared(MatlabLS,iLS,"FPID");
+  mxArray *MatlabSourceAID = mxGetPropertyShared(MatlabLS,iLS,"AID");
+  long L_dists[4];
+  getBeamDistsLength(MatlabLS,iLS,L_dists);
+  long L_FPID1 = L_dists[0], L_AID1 = L_dists[1], L_FPID2 = L_dists[2], L_AID2 = L_dists[3];
+  FLOATORDBL *FPIDdist1 = dists;
+  FLOATORDBL *AIDdist1 = FPIDdist1 + L_FPID1;
+  FLOATORDBL *FPIDdist2 = AIDdist1 + L_AID1;
+  FLOATORDBL *AIDdist2 = FPIDdist2 + L_FPID2;
+  if(sourceType >= 4) {
+    double *MatlabFPIDdist1 = mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,sourceType == 4? "radialDistr": "XDistr"));
+    if(L_FPID1 == 1) {
+      *FPIDdist1 = -1 - (FLOATORDBL)MatlabFPIDdist1[0];
+    } else {
+      FPIDdist1[0] = 0;
+      for(idx=1;idx<L_FPID1;idx++) FPIDdist1[idx] = FPIDdist1[idx-1] + (sourceType == 4? idx-1: 1)*(FLOATORDBL)MatlabFPIDdist1[idx-1] + (sourceType == 4? idx: 1)*(FLOATORDBL)MatlabFPIDdist1[idx];
+      for(idx=1;idx<L_FPID1;idx++) FPIDdist1[idx] /= FPIDdist1[L_FPID1-1];
+    }
+    
+    double *MatlabAIDdist1 = mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,sourceType == 4? "radialDistr": "XDistr"));
+    if(L_AID1 == 1) {
+      *AIDdist1 = -1 - (FLOATORDBL)MatlabAIDdist1[0];
+    } else {
+      AIDdist1[0] = 0;
+      for(idx=1;idx<L_AID1;idx++) AIDdist1[idx] = AIDdist1[idx-1] + (sourceType == 4? idx-1: 1)*(FLOATORDBL)MatlabAIDdist1[idx-1] + (sourceType == 4? idx: 1)*(FLOATORDBL)MatlabAIDdist1[idx];
+      for(idx=1;idx<L_AID1;idx++) AIDdist1[idx] /= AIDdist1[L_AID1-1];
+    }
+    
+    if(sourceType == 5) {
+      double *MatlabFPIDdist2 = mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,"YDistr"));
+      if(L_FPID2 == 1) {
+        *FPIDdist2 = -1 - (FLOATORDBL)MatlabFPIDdist2[0];
+      } else {
+        FPIDdist2[0] = 0;
+        for(idx=1;idx<L_FPID2;idx++) FPIDdist2[idx] = FPIDdist2[idx-1] + (FLOATORDBL)MatlabFPIDdist2[idx-1] + (FLOATORDBL)MatlabFPIDdist2[idx];
+        for(idx=1;idx<L_FPID2;idx++) FPIDdist2[idx] /= FPIDdist2[L_FPID2-1];
+      }
+    
+      double *MatlabAIDdist2 = mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,"YDistr"));
+      if(L_AID2 == 1) {
+        *AIDdist2 = -1 - (FLOATORDBL)MatlabAIDdist2[0];
+      } else {
+        AIDdist2[0] = 0;
+        for(idx=1;idx<L_AID2;idx++) AIDdist2[idx] = AIDdist2[idx-1] + (FLOATORDBL)MatlabAIDdist2[idx-1] + (FLOATORDBL)MatlabAIDdist2[idx];
+        for(idx=1;idx<L_AID2;idx++) AIDdist2[idx] /= AIDdist2[L_AID2-1];
+      }
+    }
+  }
+
+  FLOATORDBL tb = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"theta"));
+  FLOATORDBL pb = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"phi"));
+  FLOATORDBL psib = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"psi"));
+
+  FLOATORDBL u[3] = {SIN(tb)*COS(pb),SIN(tb)*SIN(pb),COS(tb)}; // Temporary array
+  
+  FLOATORDBL w[3] = {1,0,0};
+  FLOATORDBL v[3] = {0,0,1};
+  if(u[2]!=1) unitcrossprod(u,v,w);
+  axisrotate(w,u,psib,v);
+  unitcrossprod(u,v,w);
+  
+  struct beam LS_var = {
+    sourceType,
+    (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"emitterLength")),
+    FPIDdist1,
+    L_FPID1,
+    (FLOATORDBL)(sourceType == 5? *mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,"XWidth")): *mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,"radialWidth"))),
+    FPIDdist2,
+    L_FPID2,
+    (FLOATORDBL)(sourceType == 5? *mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,"YWidth")): 0),
+    AIDdist1,
+    L_AID1,
+    (FLOATORDBL)(sourceType == 5? *mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,"XWidth")): *mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,"radialWidth"))),
+    AIDdist2,
+    L_AID2,
+    (FLOATORDBL)(sourceType == 5? *mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,"YWidth")): 0),
+    {(FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"xFocus")),
+     (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"yFocus")),
+     (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"zFocus"))},
+    {u[0],u[1],u[2]},
+    {v[0],v[1],v[2]}, // normal vector to beam center axis
+    {w[0],w[1],w[2]},
+    1, // aliasProbability and alias are set in initLightSourceAliasTable
+    iLS
+  };
+  *LS = LS_var;
 }
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
+  long long mexFunctionStart = getMicroSeconds();
   struct debug D_var = {{0.0,0.0,0.0},{0,0,0}};
   struct debug *D = &D_var;
   
@@ -324,10 +627,20 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
   
   bool silentMode = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"silentMode"));
   bool calcNFR    = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"calcNFR")); // Are we supposed to calculate the NFR matrix?
+  bool floatAccumulators = calcNFR && mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"floatAccumulators")); // Should the NFR be accumulated in single precision to save memory?
+  #ifdef __NVCC__
+  floatAccumulators = false; // Only supported on the CPU
+  #endif
+  bool calcTelemetry = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"calcTelemetry")); // Should the event counters of the transport be returned? Only supported on the CPU, which is checked in MATLAB
 
-  mxArray *MatlabLS = mxGetProperty(MatlabMC,0,"LS");
-  float *S_PDF = (float *)mxGetData(mxGetProperty(MatlabMC,0,"sourceDistribution"));  // Power emitted by the individual voxels per unit volume. Can be percieved as an unnormalized probability density function of the 3D source distribution
+  mxArray *MatlabLS = mxGetPropertyShared(MatlabMC,0,"LS");
+  float *S_PDF = (float *)mxGetData(mxGetPropertyShared(MatlabMC,0,"sourceDistribution"));  // Power emitted by the individual voxels per unit volume. Can be percieved as an unnormalized probability density function of the 3D source distribution
   if(ISNAN(*S_PDF)) S_PDF = NULL;
+  char *resumeFileName = nrhs > 2? mxArrayToString(prhs[2]): NULL; // If not empty, the simulation is resumed from this checkpoint file
+  if(resumeFileName && !*resumeFileName) {
+    mxFree(resumeFileName);
+    resumeFileName = NULL;
+  }
 
   // Variables for timekeeping and number of photons
   bool            simulationTimed = mxIsNaN(*mxGetPr(mxGetPropertyShared(MatlabMC,0,"nPhotonsRequested")));
@@ -336,6 +649,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
   double          simulationTimeRequested = simulationTimed? *mxGetPr(mxGetPropertyShared(MatlabMC,0,"simulationTimeRequested")): INFINITY;
   unsigned long long nPhotonsRequested = simulationTimed? ULLONG_MAX: (unsigned long long)*mxGetPr(mxGetPropertyShared(MatlabMC,0,"nPhotonsRequested"));
   double          nThreads = 1; // Will be updated later with the correct number
+  int             nHostThreads = 1; // Number of CPU threads used for the setup and the normalization of the outputs
+  #ifdef _OPENMP
+  nHostThreads = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"useAllCPUs"))? omp_get_num_procs(): max(omp_get_num_procs()-1,1);
+  #endif
+  long long       transportTime = 0, normalizationTime = 0, outputCopyTime = 0; // [us] Time spent in the photon transport, the normalization of the outputs and copying the outputs, for phaseTimes
 
   if(!silentMode) {
     // Display progress indicator
@@ -348,11 +666,6 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
 
   // Find out how much total memory to allocate for the small arrays (the array that for GPUs would be stored in GPU shared memory)
   mxArray *mediaProperties = mxGetPropertyShared(MatlabMC,0,"mediaProperties");
-  double *muaMATLAB    = mxGetPr(mxGetField(mediaProperties,0,"mua"));
-  double *musMATLAB    = mxGetPr(mxGetField(mediaProperties,0,"mus"));
-  double *gMATLAB      = mxGetPr(mxGetField(mediaProperties,0,"g"));
-  double *nMATLAB      = mxGetPr(mxGetField(mediaProperties,0,"n"));
-  double *CDFidxMATLAB = mxGetPr(mxGetField(mediaProperties,0,"CDFidx"));
   int nL = (int)mxGetN(mxGetField(mediaProperties,0,"mua")); // Number of wavelengths (Lambdas)
   int nM = (int)mxGetM(mxGetField(mediaProperties,0,"mua")); // Number of media
 
@@ -360,14 +673,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
   double nPhotonsCollectedCumulative = 0;
   double simulationTimeCumulative = 0;
   mwSize const *dimPtr = mxGetDimensions(mxGetPropertyShared(MatlabMC,0,"M"));
-  int sourceType = S_PDF? -1: (int)*mxGetPr(mxGetPropertyShared(MatlabLS,0,"sourceType"));
-  FLOATORDBL emitterLength = S_PDF? 0: (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLS,0,"emitterLength"));
-  mxArray *MatlabSourceFPID = S_PDF? 0: mxGetPropertyShared(MatlabLS,0,"FPID");
-  mxArray *MatlabSourceAID = S_PDF? 0: mxGetPropertyShared(MatlabLS,0,"AID");
-  long L_FPID1 = sourceType >= 4? (long)mxGetN(mxGetPropertyShared(MatlabSourceFPID,0,sourceType == 4? "radialDistr": "XDistr")): 0;
-  long L_AID1 = sourceType >= 4? (long)mxGetN(mxGetPropertyShared(MatlabSourceAID,0,sourceType == 4? "radialDistr": "XDistr")): 0;
-  long L_FPID2 = sourceType == 5? (long)mxGetN(mxGetPropertyShared(MatlabSourceFPID,0,"YDistr")): 0;
-  long L_AID2 = sourceType == 5? (long)mxGetN(mxGetPropertyShared(MatlabSourceAID,0,"YDistr")): 0;
+  int nLS = S_PDF? 1: (int)mxGetNumberOfElements(MatlabLS); // Number of light sources
+  if(nLS > MAXLIGHTSOURCES) mexErrMsgIdAndTxt("MCmatlab:TooManyLightSources","Error: At most %d light sources are supported",MAXLIGHTSOURCES);
+  long L_beamDists = 0; // Total number of elements in the intensity distribution arrays of all the light sources
+  for(int iLS=0;iLS<nLS && !S_PDF;iLS++) L_beamDists += getBeamDistsLength(MatlabLS,iLS,NULL);
 
   // Geometry struct definition
   long L = (long)(dimPtr[0]*dimPtr[1]*dimPtr[2]); // Total number of voxels in cuboid
@@ -382,14 +691,57 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
   G->n[2] = (long)dimPtr[2];
   G->farFieldRes = (long)*mxGetPr(mxGetPropertyShared(MatlabMC,0,"farFieldRes"));
   G->boundaryType = (int)*mxGetPr(mxGetPropertyShared(MatlabMC,0,"boundaryType"));
-  G->M = (unsigned char *)malloc(L*sizeof(unsigned char)); // M
+  G->mirrorSymmetry = (int)*mxGetPr(mxGetPropertyShared(MatlabMC,0,"mirrorSymmetry")); // Even nx and/or ny is checked in MATLAB
+  #ifdef __NVCC__
+  G->calcTelemetry = false;
+  #else
+  G->calcTelemetry = calcTelemetry;
+  #endif
+  G->nr = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"axisymmetric"))? min(G->n[0],G->n[1])/2: 0; // The rings must fit inside the cuboid. dx == dy is checked in MATLAB.
+  double *gridRes = mxGetPr(mxGetPropertyShared(MatlabMC,0,"scoringGridRes"));
+  double *gridExtent = mxGetPr(mxGetPropertyShared(MatlabMC,0,"scoringGridExtent")); // [xmin xmax ymin ymax zmin zmax] in cm, NaN for the cuboid boundary
+  for(idx=0;idx<3;idx++) {
+    double cuboidMin = idx < 2? -G->n[idx]*G->d[idx]/2: 0; // The cuboid is centered on x = y = 0 and starts at z = 0
+    double gridMin = mxIsNaN(gridExtent[2*idx    ])? cuboidMin                        : gridExtent[2*idx    ];
+    double gridMax = mxIsNaN(gridExtent[2*idx + 1])? cuboidMin + G->n[idx]*G->d[idx]: gridExtent[2*idx + 1];
+    G->gridRes[idx] = (long)gridRes[idx]; // All or none of the resolutions being nonzero and gridMax > gridMin is checked in MATLAB
+    G->gridStart[idx] = (FLOATORDBL)((gridMin - cuboidMin)/G->d[idx]);
+    G->gridStep[idx] = G->gridRes[idx]? (FLOATORDBL)((gridMax - gridMin)/G->d[idx]/G->gridRes[idx]): 1;
+  }
+  long gridNTimeBins = (long)*mxGetPr(mxGetPropertyShared(MatlabMC,0,"scoringGridNTimeBins"));
+  G->gridNt = gridNTimeBins? gridNTimeBins + 2: 1; // tEnd > tStart is checked in MATLAB
+  G->gridTStart = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabMC,0,"scoringGridTStart"));
+  G->gridTEnd = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabMC,0,"scoringGridTEnd"));
+  // Regions of interest. NFR and the Jacobian are only stored in the voxels of MC.NFRroi and the NI arrays only in the boundary pixels
+  // that MC.NIroi extends over. The elements of both are 1-based voxel index ranges [ixmin ixmax iymin iymax izmin izmax], with NaN
+  // elements meaning the full range of the array. For boundaryType 2, the range of NI_zneg extends (KILLRANGE-1)/2 cuboid widths beyond
+  // the cuboid on each side, and the indices are clamped to it. Ranges inside the cuboid are checked in MATLAB.
+  double *NFRroi = mxGetPr(mxGetPropertyShared(MatlabMC,0,"NFRroi"));
+  double *NIroi = mxGetPr(mxGetPropertyShared(MatlabMC,0,"NIroi"));
+  for(idx=0;idx<3;idx++) {
+    G->roiStart[idx] = mxIsNaN(NFRroi[2*idx])? 0: (long)NFRroi[2*idx] - 1;
+    G->roiSize[idx] = (mxIsNaN(NFRroi[2*idx + 1])? G->n[idx]: (long)NFRroi[2*idx + 1]) - G->roiStart[idx];
+  }
+  for(idx=0;idx<6;idx++) {
+    bool calcNI = G->boundaryType == 1 || (idx >= 4 && G->boundaryType == 3) || (idx == 5 && G->boundaryType == 2);
+    for(int iAxis=0;iAxis<2;iAxis++) {
+      int xyz = idx < 2? iAxis + 1: (idx < 4? 2*iAxis: iAxis); // The axes of NI_x* are y and z, those of NI_y* are x and z and those of NI_z* are x and y
+      long offset = G->boundaryType == 2? G->n[xyz]*(KILLRANGE-1)/2: 0; // Index of the first cuboid voxel in the uncropped array
+      long fullSize = G->n[xyz] + 2*offset;
+      long start = mxIsNaN(NIroi[2*xyz    ])? 0       : max(0,(long)NIroi[2*xyz] - 1 + offset);
+      long end   = mxIsNaN(NIroi[2*xyz + 1])? fullSize: min(fullSize,(long)NIroi[2*xyz + 1] + offset);
+      G->NIstart[idx][iAxis] = start;
+      G->NIsize[idx][iAxis] = calcNI && end > start? end - start: 0;
+    }
+  }
+  G->M = (unsigned char *)mxGetData(mxGetPropertyShared(MatlabMC,0,"M")); // Used in place. The media indices are 1-based as in MATLAB, so the media property arrays are indexed with G->M[j] - 1
+  G->nSpectral = 0;
+  G->spectralMuav = NULL;
   G->interfaceNormals = (float *)mxGetData(mxGetPropertyShared(MatlabMC,0,"interfaceNormals"));
-  unsigned char *M_matlab = (unsigned char *)mxGetData(mxGetPropertyShared(MatlabMC,0,"M"));
-  for(idx=0;idx<L;idx++) G->M[idx] = M_matlab[idx] - 1; // Convert from MATLAB 1-based indexing to C 0-based indexing
 
   mxArray *MatlabCDFs = mxGetPropertyShared(MatlabMC,0,"CDFs");
   long CDFarraySize = (long)mxGetNumberOfElements(MatlabCDFs);
-  size_t size_smallArrays = (nM*4 + CDFarraySize + L_FPID1 + L_AID1 + L_FPID2 + L_AID2)*sizeof(FLOATORDBL) + nM*sizeof(unsigned char);
+  size_t size_smallArrays = (nM*4 + CDFarraySize + L_beamDists)*sizeof(FLOATORDBL) + nM*sizeof(unsigned char);
   char *smallArrays = (char *)malloc(size_smallArrays); // Because smallArrays contain different data types, we just use pointer to char (1 byte) here, and make it the correct types in the derived pointers
   G->muav = (FLOATORDBL *)smallArrays;
   G->musv = G->muav + nM;
@@ -399,7 +751,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
   for(idx=0;idx<CDFarraySize;idx++) G->CDFs[idx] = (FLOATORDBL)mxGetPr(MatlabCDFs)[idx];
 
   // Fill depositionCriteria struct
-  mxArray *MatlabDC = mxGetProperty(MatlabMC,0,"depositionCriteria");
+  mxArray *MatlabDC = mxGetPropertyShared(MatlabMC,0,"depositionCriteria");
   struct depositionCriteria DC_var = {
     infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"minScatterings"))),
     infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"maxScatterings"))),
@@ -409,8 +761,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
     infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"maxReflections"))),
     infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"minInterfaceTransitions"))),
     infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"maxInterfaceTransitions"))),
-    infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"minSubmediaIdx")))-1, // -1 is to convert from MATLAB indexing to C-style indexing
-    infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"maxSubmediaIdx")))-1, // -1 is to convert from MATLAB indexing to C-style indexing
+    infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"minSubmediaIdx"))), // 1-based, like G->M
+    infCast(*mxGetPr(mxGetPropertyShared(MatlabDC,0,"maxSubmediaIdx"))), // 1-based, like G->M
     mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabDC,0,"onlyCollected")),
     mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabDC,0,"evaluateOnlyAtEndOfLife"))
   };
@@ -423,29 +775,93 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
     DC->evaluateCriteriaAtEndOfLife = false; // If there are no restrictive deposition criteria, there's no need to deposit retroactively
   }
 
-  // Light Collector struct definition
+  // Light Collector struct definitions. MC.LC may be an array of light collectors, whose images are stored after each other in the image
+  // output. Each escaping photon is tested against all of them.
   mxArray *MatlabLC      = mxGetPropertyShared(MatlabMC,0,"LC");
   bool useLightCollector = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"useLightCollector"));
-  
-  FLOATORDBL theta     = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"theta"));
-  FLOATORDBL phi       = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"phi"));
-  FLOATORDBL f         = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"f"));
-  long   nTimeBins = S_PDF? 0: (long)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"nTimeBins"));
-
-  struct lightCollector LC_var = {
-    {(FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"x")) - (mxIsFinite(f)? f*SIN(theta)*COS(phi):0), // r field, xyz coordinates of center of light collector
-     (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"y")) - (mxIsFinite(f)? f*SIN(theta)*SIN(phi):0),
-     (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"z")) - (mxIsFinite(f)? f*COS(theta)         :0)},
-    theta,
-    phi,
-    f,
-    (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"diam")),
-    (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,0,mxIsFinite(f)?"fieldSize":"NA")),
-    {(long)*mxGetPr(mxGetPropertyShared(MatlabLC,0,"res")), nTimeBins? nTimeBins+2: 1},
-    (FLOATORDBL)(S_PDF? 0: *mxGetPr(mxGetPropertyShared(MatlabLC,0,"tStart"))),
-    (FLOATORDBL)(S_PDF? 0: *mxGetPr(mxGetPropertyShared(MatlabLC,0,"tEnd")))
-  };
-  struct lightCollector *LC = &LC_var;
+  bool calcJacobian      = useLightCollector && mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"calcJacobian"));
+  G->nLC = useLightCollector? (int)mxGetNumberOfElements(MatlabLC): 0;
+  if(G->nLC > MAXLIGHTCOLLECTORS) mexErrMsgIdAndTxt("MCmatlab:TooManyLightCollectors","Error: At most %d light collectors are supported",MAXLIGHTCOLLECTORS);
+
+  struct lightCollector LC_var[MAXLIGHTCOLLECTORS];
+  struct lightCollector *LC = LC_var;
+  long imageStart = 0;
+  for(int iLC=0;iLC<G->nLC;iLC++) {
+    FLOATORDBL theta     = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"theta"));
+    FLOATORDBL phi       = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"phi"));
+    FLOATORDBL f         = (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"f"));
+    long   nTimeBins = S_PDF? 0: (long)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"nTimeBins"));
+
+    struct lightCollector LC_iLC = {
+      {(FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"x")) - (mxIsFinite(f)? f*SIN(theta)*COS(phi):0), // r field, xyz coordinates of center of light collector
+       (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"y")) - (mxIsFinite(f)? f*SIN(theta)*SIN(phi):0),
+       (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"z")) - (mxIsFinite(f)? f*COS(theta)         :0)},
+      theta,
+      phi,
+      f,
+      (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"diam")),
+      (FLOATORDBL)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,mxIsFinite(f)?"fieldSize":"NA")),
+      {(long)*mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"res")), nTimeBins? nTimeBins+2: 1},
+      (FLOATORDBL)(S_PDF? 0: *mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"tStart"))),
+      (FLOATORDBL)(S_PDF? 0: *mxGetPr(mxGetPropertyShared(MatlabLC,iLC,"tEnd"))),
+      {{0}}, // basis, set below
+      imageStart // The image follows the images of the previous light collectors
+    };
+    for(int k=0;k<3;k++) { // Column k of the basis matrix is the (x,y,z) unit vector k transformed into the light collector frame
+      FLOATORDBL e[3] = {k == 0,k == 1,k == 2},E[3];
+      xyztoXYZ(e,theta,phi,E);
+      for(int m=0;m<3;m++) LC_iLC.basis[m][k] = E[m];
+    }
+    LC[iLC] = LC_iLC;
+    imageStart += LC_iLC.res[0]*LC_iLC.res[0]*LC_iLC.res[1];
+  }
+
+  // Spectral fast path. If the scattering coefficients, anisotropies, phase functions and refractive indices are the same at all wavelengths
+  // and the source distribution (if any) has the same shape at all wavelengths, the photon paths are statistically the same at all
+  // wavelengths and only the absorption differs. Each path is then traced only once, carrying one weight per wavelength. Not used with
+  // deposition criteria evaluated at the end of the photon's life, with a collected photons file or on the GPU.
+  bool spectralFastPath = false;
+  #ifndef __NVCC__
+  spectralFastPath = nL > 1 && mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"useSpectralFastPath")) && !DC->evaluateCriteriaAtEndOfLife &&
+                     !(useLightCollector && mxGetNumberOfElements(mxGetPropertyShared(MatlabLC,0,"collectedPhotonsFile")));
+  char const *wavelengthIndependentProperties[4] = {"mus","g","n","CDFidx"};
+  for(int iP=0;iP<4 && spectralFastPath;iP++) {
+    double *values = mxGetPr(mxGetField(mediaProperties,0,wavelengthIndependentProperties[iP]));
+    for(idx=nM;idx<nM*nL && spectralFastPath;idx++) spectralFastPath = values[idx] == values[idx%nM] || (mxIsNaN(values[idx]) && mxIsNaN(values[idx%nM])); // g is NaN for custom phase functions
+  }
+  if(S_PDF && spectralFastPath) { // The source distributions must be proportional to each other
+    double S_PDFsum0 = 0;
+    for(idx=0;idx<L;idx++) S_PDFsum0 += S_PDF[idx];
+    for(int iL=1;iL<nL && spectralFastPath;iL++) {
+      double S_PDFsum = 0;
+      for(idx=0;idx<L;idx++) S_PDFsum += S_PDF[iL*L + idx];
+      for(idx=0;idx<L && spectralFastPath;idx++) spectralFastPath = fabs(S_PDF[iL*L + idx]*S_PDFsum0 - S_PDF[idx]*S_PDFsum) <= 1e-5*(S_PDF[iL*L + idx]*S_PDFsum0 + S_PDF[idx]*S_PDFsum);
+    }
+  }
+  if(spectralFastPath) {
+    G->nSpectral = nL;
+    G->spectralMuav = (FLOATORDBL *)malloc(nM*nL*sizeof(FLOATORDBL));
+    if(!G->spectralMuav) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+    for(idx=0;idx<nM*nL;idx++) G->spectralMuav[(idx%nM)*nL + idx/nM] = (FLOATORDBL)mxGetPr(mxGetField(mediaProperties,0,"mua"))[idx];
+  }
+  #endif
+
+  // Layered fast path. If M only varies along z, photons are not stopped at every voxel boundary but only at the layer interfaces and the
+  // cuboid boundaries. Not used for the Jacobian (which needs the pathlength in every voxel), with mirror symmetry or on the GPU. The
+  // spectral fast path takes precedence if the voxel-binned fluence rate is calculated, since the layered fast path's sampling of the point
+  // at which to score a step's absorbed weight depends on the absorption coefficient.
+  G->layerStart = G->layerEnd = NULL;
+  #ifndef __NVCC__
+  bool layered = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"useLayeredFastPath")) && !calcJacobian && !G->mirrorSymmetry && !(spectralFastPath && (calcNFR || G->nr));
+  for(idx=0;idx<L && layered;idx++) layered = G->M[idx] == G->M[idx - idx%(G->n[0]*G->n[1])];
+  if(layered) {
+    G->layerStart = (long *)malloc(G->n[2]*sizeof(long));
+    G->layerEnd   = (long *)malloc(G->n[2]*sizeof(long));
+    if(!G->layerStart || !G->layerEnd) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+    for(idx=0;idx<G->n[2];idx++) G->layerStart[idx] = (idx && G->M[idx*G->n[0]*G->n[1]] == G->M[(idx-1)*G->n[0]*G->n[1]])? G->layerStart[idx-1]: idx;
+    for(idx=G->n[2]-1;idx>=0;idx--) G->layerEnd[idx] = (idx < G->n[2]-1 && G->M[idx*G->n[0]*G->n[1]] == G->M[(idx+1)*G->n[0]*G->n[1]])? G->layerEnd[idx+1]: idx+1;
+  }
+  #endif
 
   // Paths definitions (example photon trajectories)
   struct paths Pa_var;
@@ -457,71 +873,107 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
   Pa->data = Pa->nExamplePaths? (FLOATORDBL *)malloc(4*Pa->pathsSize*sizeof(FLOATORDBL)): NULL;
   if(Pa->pathsSize && !Pa->data) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
 
-  // Prepare output MATLAB arrays and the temporary struct to store output data in
-  plhs[0] = mxDuplicateArray(prhs[0]);
-  
-  mxArray *MCout = mxGetPropertyShared(plhs[0],0,simFluorescence? "FMC": "MC");
-  mxArray *LCout = mxGetPropertyShared(MCout,0,"LC");
-  
-  mwSize outDimPtr[4] = {dimPtr[0], dimPtr[1], dimPtr[2], (mwSize)nL};
-  if(calcNFR)           mxSetPropertyShared(MCout,0,"NFR",mxCreateNumericArray(4,outDimPtr,mxSINGLE_CLASS,mxREAL));
-  if(useLightCollector) {
+  // Prepare output MATLAB arrays and the temporary struct to store output data in. Only the outputs are allocated and returned, in a
+  // struct that runMonteCarlo copies into the model. The inputs are read in place. Outputs that are not calculated are left empty.
+  char const *outputNames_MATLAB[] = {"NFR","jacobian","NFR_rz","NI_zpos_r","NI_zneg_r","NFR_grid","image","farField","NI_xpos","NI_xneg","NI_ypos","NI_yneg",
+                                      "NI_zpos","NI_zneg","examplePaths","nPhotons","nPhotonsCollected","nPhotonsPerWavelength","nThreads","simulationTime","phaseTimes","telemetry"};
+  plhs[0] = mxCreateStructMatrix(1,1,sizeof(outputNames_MATLAB)/sizeof(outputNames_MATLAB[0]),outputNames_MATLAB);
+  mxArray *MCout = plhs[0];
+
+  mwSize outDimPtr[4] = {(mwSize)G->roiSize[0], (mwSize)G->roiSize[1], (mwSize)G->roiSize[2], (mwSize)nL};
+  if(calcNFR)           mxSetField(MCout,0,"NFR",mxCreateNumericArray(4,outDimPtr,mxSINGLE_CLASS,mxREAL));
+  if(calcJacobian)      mxSetField(MCout,0,"jacobian",mxCreateNumericArray(4,outDimPtr,mxSINGLE_CLASS,mxREAL));
+  if(G->nr) {
+    mwSize NFR_rzSize[3] = {(mwSize)G->nr,(mwSize)G->n[2],(mwSize)nL};
+    mxSetField(MCout,0,"NFR_rz", mxCreateNumericArray(3,NFR_rzSize,mxSINGLE_CLASS,mxREAL));
+    if(G->boundaryType == 1) mxSetField(MCout,0,"NI_zpos_r", mxCreateNumericMatrix(G->nr,nL,mxSINGLE_CLASS,mxREAL));
+    if(G->boundaryType != 0) mxSetField(MCout,0,"NI_zneg_r", mxCreateNumericMatrix(G->nr,nL,mxSINGLE_CLASS,mxREAL));
+  }
+  if(getGridLength(G)) { // If time-resolved, the time axis is the fourth dimension and the wavelength axis the fifth
+    mwSize NFR_gridSize[5] = {(mwSize)G->gridRes[0],(mwSize)G->gridRes[1],(mwSize)G->gridRes[2],(mwSize)(G->gridNt > 1? G->gridNt: nL),(mwSize)nL};
+    mxSetField(MCout,0,"NFR_grid", mxCreateNumericArray(G->gridNt > 1? 5: 4,NFR_gridSize,mxSINGLE_CLASS,mxREAL));
+  }
+  if(useLightCollector) { // With several light collectors, the images are returned after each other in a matrix with one column per wavelength
     mwSize LCsize[4] = {(mwSize)LC->res[0],(mwSize)LC->res[0],(mwSize)LC->res[1],(mwSize)nL};
-    mxSetPropertyShared(LCout,0,"image", mxCreateNumericArray(4,LCsize,mxSINGLE_CLASS,mxREAL));
+    if(G->nLC > 1) mxSetField(MCout,0,"image", mxCreateNumericMatrix(getImageLength(G,LC),nL,mxSINGLE_CLASS,mxREAL));
+    else           mxSetField(MCout,0,"image", mxCreateNumericArray(4,LCsize,mxSINGLE_CLASS,mxREAL));
   }
   if(G->farFieldRes)    {
     mwSize FFsize[3] = {(mwSize)G->farFieldRes,(mwSize)G->farFieldRes,(mwSize)nL};
-    mxSetPropertyShared(MCout,0,"farField", mxCreateNumericArray(3,FFsize,mxSINGLE_CLASS,mxREAL));
-  }
-  if(G->boundaryType == 1) {
-    mwSize NI_xSize[3] = {(mwSize)G->n[1],(mwSize)G->n[2],(mwSize)nL};
-    mwSize NI_ySize[3] = {(mwSize)G->n[0],(mwSize)G->n[2],(mwSize)nL};
-    mwSize NI_zSize[3] = {(mwSize)G->n[0],(mwSize)G->n[1],(mwSize)nL};
-    mxSetPropertyShared(MCout,0,"NI_xpos", mxCreateNumericArray(3,NI_xSize,mxSINGLE_CLASS,mxREAL));
-    mxSetPropertyShared(MCout,0,"NI_xneg", mxCreateNumericArray(3,NI_xSize,mxSINGLE_CLASS,mxREAL));
-    mxSetPropertyShared(MCout,0,"NI_ypos", mxCreateNumericArray(3,NI_ySize,mxSINGLE_CLASS,mxREAL));
-    mxSetPropertyShared(MCout,0,"NI_yneg", mxCreateNumericArray(3,NI_ySize,mxSINGLE_CLASS,mxREAL));
-    mxSetPropertyShared(MCout,0,"NI_zpos", mxCreateNumericArray(3,NI_zSize,mxSINGLE_CLASS,mxREAL));
-    mxSetPropertyShared(MCout,0,"NI_zneg", mxCreateNumericArray(3,NI_zSize,mxSINGLE_CLASS,mxREAL));
-  } else if(G->boundaryType == 2) {
-    mwSize NI_zSize[3] = {(mwSize)(KILLRANGE*G->n[0]),(mwSize)(KILLRANGE*G->n[1]),(mwSize)nL};
-    mxSetPropertyShared(MCout,0,"NI_zneg", mxCreateNumericArray(3,NI_zSize,mxSINGLE_CLASS,mxREAL));
-  } else if(G->boundaryType == 3) {
-    mwSize NI_zSize[3] = {(mwSize)G->n[0],(mwSize)G->n[1],(mwSize)nL};
-    mxSetPropertyShared(MCout,0,"NI_zpos", mxCreateNumericArray(3,NI_zSize,mxSINGLE_CLASS,mxREAL));
-    mxSetPropertyShared(MCout,0,"NI_zneg", mxCreateNumericArray(3,NI_zSize,mxSINGLE_CLASS,mxREAL));
+    mxSetField(MCout,0,"farField", mxCreateNumericArray(3,FFsize,mxSINGLE_CLASS,mxREAL));
+  }
+  char const *NInames[6] = {"NI_xpos","NI_xneg","NI_ypos","NI_yneg","NI_zpos","NI_zneg"};
+  for(idx=0;idx<6;idx++) if(getNIlength(G,idx)) {
+    mwSize NIsize[3] = {(mwSize)G->NIsize[idx][0],(mwSize)G->NIsize[idx][1],(mwSize)nL};
+    mxSetField(MCout,0,NInames[idx], mxCreateNumericArray(3,NIsize,mxSINGLE_CLASS,mxREAL));
   }
 
   struct MATLABoutputs O_MATLAB_var = {
-    calcNFR? (float *)mxGetPr(mxGetPropertyShared(MCout,0,"NFR")): NULL,
-    useLightCollector? (float *)mxGetPr(mxGetPropertyShared(LCout,0,"image")): NULL,
-    G->farFieldRes? (float *)mxGetPr(mxGetPropertyShared(MCout,0,"farField")): NULL,
-    G->boundaryType == 1? (float *)mxGetPr(mxGetPropertyShared(MCout,0,"NI_xpos")): NULL,
-    G->boundaryType == 1? (float *)mxGetPr(mxGetPropertyShared(MCout,0,"NI_xneg")): NULL,
-    G->boundaryType == 1? (float *)mxGetPr(mxGetPropertyShared(MCout,0,"NI_ypos")): NULL,
-    G->boundaryType == 1? (float *)mxGetPr(mxGetPropertyShared(MCout,0,"NI_yneg")): NULL,
-    G->boundaryType == 1 || G->boundaryType == 3?
-                          (float *)mxGetPr(mxGetPropertyShared(MCout,0,"NI_zpos")): NULL,
-    G->boundaryType != 0? (float *)mxGetPr(mxGetPropertyShared(MCout,0,"NI_zneg")): NULL
+    calcNFR? (float *)mxGetPr(mxGetField(MCout,0,"NFR")): NULL,
+    useLightCollector? (float *)mxGetPr(mxGetField(MCout,0,"image")): NULL,
+    G->farFieldRes? (float *)mxGetPr(mxGetField(MCout,0,"farField")): NULL,
+    getNIlength(G,0)? (float *)mxGetPr(mxGetField(MCout,0,"NI_xpos")): NULL,
+    getNIlength(G,1)? (float *)mxGetPr(mxGetField(MCout,0,"NI_xneg")): NULL,
+    getNIlength(G,2)? (float *)mxGetPr(mxGetField(MCout,0,"NI_ypos")): NULL,
+    getNIlength(G,3)? (float *)mxGetPr(mxGetField(MCout,0,"NI_yneg")): NULL,
+    getNIlength(G,4)? (float *)mxGetPr(mxGetField(MCout,0,"NI_zpos")): NULL,
+    getNIlength(G,5)? (float *)mxGetPr(mxGetField(MCout,0,"NI_zneg")): NULL,
+    calcJacobian? (float *)mxGetPr(mxGetField(MCout,0,"jacobian")): NULL,
+    G->nr? (float *)mxGetPr(mxGetField(MCout,0,"NFR_rz")): NULL,
+    G->nr && G->boundaryType == 1? (float *)mxGetPr(mxGetField(MCout,0,"NI_zpos_r")): NULL,
+    G->nr && G->boundaryType != 0? (float *)mxGetPr(mxGetField(MCout,0,"NI_zneg_r")): NULL,
+    getGridLength(G)? (float *)mxGetPr(mxGetField(MCout,0,"NFR_grid")): NULL
   };
   struct MATLABoutputs *O_MATLAB = &O_MATLAB_var;
+  mxArray *nPhotonsPerWavelengthOut = mxCreateDoubleMatrix(1,nL,mxREAL);
   
   struct outputs O_var = {
     0, // nPhotons
     0, // nPhotonsCollected
-    calcNFR? (FLOATORDBL *)calloc(G->n[0]*G->n[1]*G->n[2],sizeof(FLOATORDBL)): NULL,
-    useLightCollector? (FLOATORDBL *)calloc(LC->res[0]*LC->res[0]*LC->res[1],sizeof(FLOATORDBL)): NULL,
+    0, // nLaunches
+    calcNFR && !floatAccumulators? (FLOATORDBL *)calloc(getNFRlength(G),sizeof(FLOATORDBL)): NULL,
+    floatAccumulators? (float *)calloc(getNFRlength(G),sizeof(float)): NULL,
+    useLightCollector? (FLOATORDBL *)calloc(getImageLength(G,LC),sizeof(FLOATORDBL)): NULL,
     G->farFieldRes? (FLOATORDBL *)calloc(G->farFieldRes*G->farFieldRes,sizeof(FLOATORDBL)): NULL,
-    G->boundaryType == 1? (FLOATORDBL *)calloc(G->n[1]*G->n[2],sizeof(FLOATORDBL)): NULL,
-    G->boundaryType == 1? (FLOATORDBL *)calloc(G->n[1]*G->n[2],sizeof(FLOATORDBL)): NULL,
-    G->boundaryType == 1? (FLOATORDBL *)calloc(G->n[0]*G->n[2],sizeof(FLOATORDBL)): NULL,
-    G->boundaryType == 1? (FLOATORDBL *)calloc(G->n[0]*G->n[2],sizeof(FLOATORDBL)): NULL,
-    G->boundaryType == 1 || G->boundaryType == 3?
-                          (FLOATORDBL *)calloc(G->n[0]*G->n[1],sizeof(FLOATORDBL)): NULL,
-    G->boundaryType != 0? (FLOATORDBL *)calloc(G->n[0]*G->n[1]*(G->boundaryType == 2? KILLRANGE*KILLRANGE: 1),sizeof(FLOATORDBL)): NULL
+    getNIlength(G,0)? (FLOATORDBL *)calloc(getNIlength(G,0),sizeof(FLOATORDBL)): NULL,
+    getNIlength(G,1)? (FLOATORDBL *)calloc(getNIlength(G,1),sizeof(FLOATORDBL)): NULL,
+    getNIlength(G,2)? (FLOATORDBL *)calloc(getNIlength(G,2),sizeof(FLOATORDBL)): NULL,
+    getNIlength(G,3)? (FLOATORDBL *)calloc(getNIlength(G,3),sizeof(FLOATORDBL)): NULL,
+    getNIlength(G,4)? (FLOATORDBL *)calloc(getNIlength(G,4),sizeof(FLOATORDBL)): NULL,
+    getNIlength(G,5)? (FLOATORDBL *)calloc(getNIlength(G,5),sizeof(FLOATORDBL)): NULL,
+    calcJacobian? (FLOATORDBL *)calloc(getROIlength(G),sizeof(FLOATORDBL)): NULL,
+    G->nr? (FLOATORDBL *)calloc(G->nr*G->n[2],sizeof(FLOATORDBL)): NULL,
+    G->nr && G->boundaryType == 1? (FLOATORDBL *)calloc(G->nr,sizeof(FLOATORDBL)): NULL,
+    G->nr && G->boundaryType != 0? (FLOATORDBL *)calloc(G->nr,sizeof(FLOATORDBL)): NULL,
+    getGridLength(G)? (FLOATORDBL *)calloc(getGridLength(G),sizeof(FLOATORDBL)): NULL,
+    calcTelemetry? (struct telemetry *)calloc(1,sizeof(struct telemetry)): NULL,
+    NULL, // collectedPhotonsFile
+    COLLECTEDPHOTONRECORDFIXEDSIZE + nM, // collectedPhotonsRecordSize
+    0, // nCollectedPhotonsRecorded
+    false // launchedInside
   };
   struct outputs *O = &O_var;
 
+  // Collected photons file. The header consists of the characters "MCPD", the format version, the number of media and the number of
+  // wavelengths, followed by the number of records and the normalization factor of each wavelength. These last two are filled in
+  // after each wavelength has been simulated. The records then follow, grouped by wavelength.
+  char *collectedPhotonsFileName = useLightCollector? mxArrayToString(mxGetPropertyShared(MatlabLC,0,"collectedPhotonsFile")): NULL;
+  if(collectedPhotonsFileName && *collectedPhotonsFileName) {
+    if(resumeFileName) mexErrMsgIdAndTxt("MCmatlab:CheckpointError","Error: Resuming from a checkpoint is not supported when writing a collected photons file"); // The file would be truncated, losing the records written before the checkpoint
+    O->collectedPhotonsFile = fopen(collectedPhotonsFileName,"wb");
+    if(!O->collectedPhotonsFile) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: Could not open %s for writing",collectedPhotonsFileName);
+    unsigned int headerInts[3] = {1,(unsigned int)nM,(unsigned int)nL}; // Format version, number of media, number of wavelengths
+    fwrite("MCPD",1,4,O->collectedPhotonsFile);
+    fwrite(headerInts,sizeof(unsigned int),3,O->collectedPhotonsFile);
+    for(idx=0;idx<nL;idx++) {
+      unsigned long long nRecords = 0;
+      double normfactor = 0;
+      fwrite(&nRecords,sizeof(unsigned long long),1,O->collectedPhotonsFile);
+      fwrite(&normfactor,sizeof(double),1,O->collectedPhotonsFile);
+    }
+  }
+  mxFree(collectedPhotonsFileName);
+
   // Beam struct definition
   FLOATORDBL power        = 0;
   FLOATORDBL *S           = NULL; // Cumulative distribution function
@@ -531,109 +983,339 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
     S[0] = 0;
   }
 
-  FLOATORDBL *FPIDdist1 = G->CDFs + CDFarraySize;
-  FLOATORDBL *AIDdist1 = FPIDdist1 + L_FPID1;
-  FLOATORDBL *FPIDdist2 = AIDdist1 + L_AID1;
-  FLOATORDBL *AIDdist2 = FPIDdist2 + L_FPID2;
-  if(sourceType >= 4) {
-    double *MatlabFPIDdist1 = mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,sourceType == 4? "radialDistr": "XDistr"));
-    if(L_FPID1 == 1) {
-      *FPIDdist1 = -1 - (FLOATORDBL)MatlabFPIDdist1[0];
-    } else {
-      FPIDdist1[0] = 0;
-      for(idx=1;idx<L_FPID1;idx++) FPIDdist1[idx] = FPIDdist1[idx-1] + (sourceType == 4? idx-1: 1)*(FLOATORDBL)MatlabFPIDdist1[idx-1] + (sourceType == 4? idx: 1)*(FLOATORDBL)MatlabFPIDdist1[idx];
-      for(idx=1;idx<L_FPID1;idx++) FPIDdist1[idx] /= FPIDdist1[L_FPID1-1];
+  struct source B_var = {
+    nLS,
+    {{0}},
+    S,
+    power,
+    mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"quasiRandomLaunch")),
+    mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"clipLightSources")),
+    (unsigned int)getMicroSeconds() ^ (unsigned int)(PRNGSTREAMOFFSET*2654435761u) // QMCseed
+  };
+  struct source *B = &B_var;
+  FLOATORDBL *beamDists = G->CDFs + CDFarraySize; // The intensity distributions of the light sources are stored after each other
+  if(!S) {
+    double relativePowers[MAXLIGHTSOURCES];
+    for(int iLS=0;iLS<nLS;iLS++) {
+      setBeamProperties(&B->beams[iLS],MatlabLS,iLS,beamDists);
+      beamDists += getBeamDistsLength(MatlabLS,iLS,NULL);
+      relativePowers[iLS] = *mxGetPr(mxGetPropertyShared(MatlabLS,iLS,"relativePower"));
     }
-    
-    double *MatlabAIDdist1 = mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,sourceType == 4? "radialDistr": "XDistr"));
-    if(L_AID1 == 1) {
-      *AIDdist1 = -1 - (FLOATORDBL)MatlabAIDdist1[0];
+    initLightSourceAliasTable(B,relativePowers);
+  }
+  G->CDFidxv = (unsigned char *)beamDists; // Array that describes which CDF array is the one that applies to a particular medium
+
+  if(B->quasiRandomLaunch) initSobolDirections(B);
+
+  // Photon allocation. The photon or time budget is split between the wavelengths either equally, in proportion to the spectral power,
+  // or adaptively in proportion to each wavelength's contribution to the noise of sum(NFR,4) as measured in a pilot pass. The adaptive
+  // allocation is the optimal (Neyman) allocation: The variance of the summed NFR, sum over iL of (p_iL*sigma_iL)^2/N_iL, is minimized for
+  // a fixed number of photons by N_iL ~ p_iL*sigma_iL and for a fixed time by N_iL ~ p_iL*sigma_iL/sqrt(c_iL), where p_iL is the
+  // normalization factor of each photon's weight, sigma_iL the standard deviation of the photon's contribution and c_iL the time per photon.
+  int photonAllocation = (int)*mxGetPr(mxGetPropertyShared(MatlabMC,0,"photonAllocation"));
+  double *allocationFractions = (double *)malloc(nL*sizeof(double)); // Fraction of the photon or time budget given to each wavelength
+  double *allocationWeights = (double *)malloc(nL*sizeof(double));
+  double *pilotCosts = (double *)malloc(nL*sizeof(double)); // Time per photon in the pilot pass
+  if(!allocationFractions || !allocationWeights || !pilotCosts) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+  for(int iL = 0; iL < nL; iL++) {
+    if(photonAllocation == 0) {
+      allocationWeights[iL] = 1;
+    } else if(S_PDF) { // Fluorescence emission power
+      allocationWeights[iL] = 0;
+      for(idx=0;idx<L;idx++) allocationWeights[iL] += S_PDF[iL*L + idx];
     } else {
-      AIDdist1[0] = 0;
-      for(idx=1;idx<L_AID1;idx++) AIDdist1[idx] = AIDdist1[idx-1] + (sourceType == 4? idx-1: 1)*(FLOATORDBL)MatlabAIDdist1[idx-1] + (sourceType == 4? idx: 1)*(FLOATORDBL)MatlabAIDdist1[idx];
-      for(idx=1;idx<L_AID1;idx++) AIDdist1[idx] /= AIDdist1[L_AID1-1];
+      allocationWeights[iL] = mxGetPr(mxGetPropertyShared(MatlabMC,0,"spectrum"))[iL];
     }
-    
-    if(sourceType == 5) {
-      double *MatlabFPIDdist2 = mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,"YDistr"));
-      if(L_FPID2 == 1) {
-        *FPIDdist2 = -1 - (FLOATORDBL)MatlabFPIDdist2[0];
-      } else {
-        FPIDdist2[0] = 0;
-        for(idx=1;idx<L_FPID2;idx++) FPIDdist2[idx] = FPIDdist2[idx-1] + (FLOATORDBL)MatlabFPIDdist2[idx-1] + (FLOATORDBL)MatlabFPIDdist2[idx];
-        for(idx=1;idx<L_FPID2;idx++) FPIDdist2[idx] /= FPIDdist2[L_FPID2-1];
-      }
-    
-      double *MatlabAIDdist2 = mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,"YDistr"));
-      if(L_AID2 == 1) {
-        *AIDdist2 = -1 - (FLOATORDBL)MatlabAIDdist2[0];
-      } else {
-        AIDdist2[0] = 0;
-        for(idx=1;idx<L_AID2;idx++) AIDdist2[idx] = AIDdist2[idx-1] + (FLOATORDBL)MatlabAIDdist2[idx-1] + (FLOATORDBL)MatlabAIDdist2[idx];
-        for(idx=1;idx<L_AID2;idx++) AIDdist2[idx] /= AIDdist2[L_AID2-1];
+    pilotCosts[iL] = 1;
+  }
+  double budgetFraction = 1; // Fraction of the budget left for the main pass
+  #ifndef __NVCC__ // The pilot pass is only available on the CPU, which is checked in MATLAB
+  if(photonAllocation == 2 && nL > 1 && !spectralFastPath && !resumeFileName) { // When resuming, the allocation is read from the checkpoint
+    if(!silentMode) {
+      printf("Running pilot pass for photon allocation...\n");
+      mexEvalString("drawnow; pause(.005);");
+    }
+    FILE *collectedPhotonsFile = O->collectedPhotonsFile;
+    long nExamplePaths = Pa->nExamplePaths;
+    O->collectedPhotonsFile = NULL; // Pilot photons are neither recorded in the collected photons file nor used as example paths
+    Pa->nExamplePaths = 0;
+    long L_NFR = getNFRlength(G);
+    long L_image = getImageLength(G,LC);
+    float *NFR_firstHalf = calcNFR? (float *)malloc(L_NFR*sizeof(float)): NULL; // Only used for the noise estimate, so single precision suffices
+    FLOATORDBL *image_firstHalf = O->image? (FLOATORDBL *)malloc(L_image*sizeof(FLOATORDBL)): NULL;
+    if((calcNFR && !NFR_firstHalf) || (O->image && !image_firstHalf)) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+    #ifdef _OPENMP
+    bool useAllCPUs = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"useAllCPUs"));
+    nThreads = useAllCPUs? omp_get_num_procs(): max(omp_get_num_procs()-1,1);
+    #endif
+    for(int iL = 0; iL < nL && !aborting; iL++) {
+      setWavelengthDependentProperties(G,B,iL,nM,L,S_PDF,MatlabMC,nHostThreads);
+      unsigned long long nPhotonsRequested_Pilot = simulationTimed? ULLONG_MAX: max((unsigned long long)(PILOTFRACTION*nPhotonsRequested/nL),PILOTMINPHOTONS);
+      double simulationTimeRequested_Pilot = PILOTFRACTION*simulationTimeRequested/nL;
+      long long pilotTimeStart = getMicroSeconds();
+      unsigned long long nPhotonsFirstHalf = 0;
+      for(int iHalf = 0; iHalf < 2 && !aborting; iHalf++) { // The pilot is run in two halves, from whose difference the noise is estimated
+        long long simulationTimeStart = getMicroSeconds();
+        #ifdef _OPENMP
+        #pragma omp parallel num_threads((long)nThreads)
+        #endif
+        {
+          threadInitAndLoop(B,G,LC,Pa,O,DC,nM,0,simulationTimeStart,(long long)(simulationTimeRequested_Pilot/2*60000000),iHalf? nPhotonsRequested_Pilot: nPhotonsRequested_Pilot/2,iL,nL,requestCollectedPhotons,&aborting,true,NULL,NULL,D);
+        }
+        transportTime += getMicroSeconds() - simulationTimeStart;
+        if(!iHalf) {
+          nPhotonsFirstHalf = O->nPhotons;
+          if(calcNFR) for(long k=0;k<L_NFR;k++) NFR_firstHalf[k] = (float)getNFRaccumulator(O,k);
+          if(O->image) memcpy(image_firstHalf,O->image,L_image*sizeof(FLOATORDBL));
+        }
       }
+      double nPhotons = (double)O->nPhotons;
+      simulationTimeCumulative += (getMicroSeconds() - pilotTimeStart)/60000000.0;
+      pilotCosts[iL] = nPhotons? (getMicroSeconds() - pilotTimeStart)/nPhotons: 1;
+      double noise = getPilotNoise(G,LC,O,NFR_firstHalf,image_firstHalf,nPhotonsFirstHalf);
+      long long normalizationStart = getMicroSeconds();
+      double normfactor = normalizeDepositionAndResetO(B,G,LC,O,O_MATLAB,iL,B->power,nHostThreads); // Only used to reset O, the outputs are overwritten in the main pass
+      normalizationTime += getMicroSeconds() - normalizationStart;
+      allocationWeights[iL] = nPhotons? SQRT(noise)*nPhotons/normfactor: 0; // p_iL*sigma_iL
     }
+    free(NFR_firstHalf);
+    free(image_firstHalf);
+    O->collectedPhotonsFile = collectedPhotonsFile;
+    Pa->nExamplePaths = nExamplePaths;
+    budgetFraction = 1 - PILOTFRACTION;
   }
-  G->CDFidxv = (unsigned char *)(AIDdist2 + L_AID2); // Array that describes which CDF array is the one that applies to a particular medium
+  #endif
+  getAllocationFractions(nL,allocationWeights,pilotCosts,simulationTimed,allocationFractions);
+  bool parallelWavelengths = false;
+  #ifndef __NVCC__
+  parallelWavelengths = nL > 1 && mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"parallelWavelengths")) && !O->collectedPhotonsFile && !aborting && !spectralFastPath; // The collected photons file is grouped by wavelength, so it requires the sequential simulation
+  #endif
 
-  FLOATORDBL tb = (FLOATORDBL)(S? 0: *mxGetPr(mxGetPropertyShared(MatlabLS,0,"theta")));
-  FLOATORDBL pb = (FLOATORDBL)(S? 0: *mxGetPr(mxGetPropertyShared(MatlabLS,0,"phi")));
-  FLOATORDBL psib = (FLOATORDBL)(S? 0: *mxGetPr(mxGetPropertyShared(MatlabLS,0,"psi")));
+  // Continuation of a previous simulation. The normalized outputs of the previous simulation are copied into the output arrays, and
+  // before each wavelength is simulated, its outputs are converted back into accumulator values by inverting the normalization. The new
+  // photons are added to the accumulators, and the outputs are normalized once with the total number of photons.
+  bool continuePrevious = nrhs > 3 && mxIsLogicalScalarTrue(prhs[3]);
+  double *nPhotonsPrevious = NULL; // Number of photons of each wavelength in the previous simulation
+  double *nPhotonsPerWavelength = mxGetPr(nPhotonsPerWavelengthOut);
+  if(continuePrevious) {
+    mxArray const *nPhotonsPreviousArray = mxGetPropertyShared(MatlabMC,0,"nPhotonsPerWavelength");
+    if(mxGetNumberOfElements(nPhotonsPreviousArray) != (size_t)nL) mexErrMsgIdAndTxt("MCmatlab:ContinueError","Error: The previous simulation does not have the same number of wavelengths");
+    nPhotonsPrevious = mxGetPr(nPhotonsPreviousArray);
+    float *MATLABarrays[NOUTPUTARRAYS];
+    long MATLABlengths[NOUTPUTARRAYS];
+    getMATLABoutputArrays(O_MATLAB,G,LC,nL,MATLABarrays,MATLABlengths);
+    char const *outputNames[NOUTPUTARRAYS] = {"NFR","image","farField","NI_xpos","NI_xneg","NI_ypos","NI_yneg","NI_zpos","NI_zneg","jacobian","NFR_rz","NI_zpos_r","NI_zneg_r","NFR_grid"};
+    for(int k=0;k<NOUTPUTARRAYS;k++) if(MATLABarrays[k]) {
+      if(k == 1) { // The images are stored in the light collectors, each with its own wavelength axis
+        for(int iLC=0;iLC<G->nLC;iLC++) {
+          long L_LC = LC[iLC].res[0]*LC[iLC].res[0]*LC[iLC].res[1];
+          mxArray const *previousArray = mxGetPropertyShared(MatlabLC,iLC,outputNames[k]);
+          if(!mxIsSingle(previousArray) || mxGetNumberOfElements(previousArray) != (size_t)(L_LC*nL))
+            mexErrMsgIdAndTxt("MCmatlab:ContinueError","Error: The %s output of the previous simulation does not match the model",outputNames[k]);
+          for(int iL=0;iL<nL;iL++) memcpy(MATLABarrays[k] + iL*getImageLength(G,LC) + LC[iLC].imageStart,(float *)mxGetData(previousArray) + iL*L_LC,L_LC*sizeof(float));
+        }
+        continue;
+      }
+      mxArray const *previousArray = mxGetPropertyShared(MatlabMC,0,outputNames[k]);
+      if(!mxIsSingle(previousArray) || mxGetNumberOfElements(previousArray) != (size_t)MATLABlengths[k])
+        mexErrMsgIdAndTxt("MCmatlab:ContinueError","Error: The %s output of the previous simulation does not match the model",outputNames[k]);
+      memcpy(MATLABarrays[k],mxGetData(previousArray),MATLABlengths[k]*sizeof(float));
+    }
+    for(int iL = 0; iL < nL; iL++) nPhotonsPerWavelength[iL] = nPhotonsPrevious[iL]; // Wavelengths that are not simulated because of an abort keep their previous outputs
+  }
 
-  FLOATORDBL u[3] = {SIN(tb)*COS(pb),SIN(tb)*SIN(pb),COS(tb)}; // Temporary array
-  
-  FLOATORDBL w[3] = {1,0,0};
-  FLOATORDBL v[3] = {0,0,1};
-  if(u[2]!=1) unitcrossprod(u,v,w);
-  axisrotate(w,u,psib,v);
-  unitcrossprod(u,v,w);
-  
-  struct source B_var = {
-    S? 0: sourceType,
-    S? 0: emitterLength,
-    S? 0: FPIDdist1,
-    S? 0: L_FPID1,
-    S? 0: (FLOATORDBL)(sourceType == 5? *mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,"XWidth")): *mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,"radialWidth"))),
-    S? 0: FPIDdist2,
-    S? 0: L_FPID2,
-    S? 0: (FLOATORDBL)(sourceType == 5? *mxGetPr(mxGetPropertyShared(MatlabSourceFPID,0,"YWidth")): 0),
-    S? 0: AIDdist1,
-    S? 0: L_AID1,
-    S? 0: (FLOATORDBL)(sourceType == 5? *mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,"XWidth")): *mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,"radialWidth"))),
-    S? 0: AIDdist2,
-    S? 0: L_AID2,
-    S? 0: (FLOATORDBL)(sourceType == 5? *mxGetPr(mxGetPropertyShared(MatlabSourceAID,0,"YWidth")): 0),
-    S,
-    power,
-    {(FLOATORDBL)(S? 0: *mxGetPr(mxGetPropertyShared(MatlabLS,0,"xFocus"))),
-     (FLOATORDBL)(S? 0: *mxGetPr(mxGetPropertyShared(MatlabLS,0,"yFocus"))),
-     (FLOATORDBL)(S? 0: *mxGetPr(mxGetPropertyShared(MatlabLS,0,"zFocus")))},
-    {u[0],u[1],u[2]},
-    {v[0],v[1],v[2]}, // normal vector to beam center axis
-    {w[0],w[1],w[2]}
-  };
-  struct source *B = &B_var;
+  // Checkpointing. If a checkpoint file is given, the threads return from threadInitAndLoop every checkpointInterval minutes, and a snapshot
+  // of the output accumulators, the normalized outputs of the finished wavelengths, the photon counters, the PRNG states, the example paths
+  // and the wavelength progress is serialized into memory. The snapshot is written to the file by an extra thread while the simulation
+  // continues. When resuming, this state is read back and the simulation continues from where the checkpoint was taken.
+  struct checkpoint *CP = NULL;
+  struct checkpointReader *R = NULL;
+  int startIL = 0; // Wavelength to start the sequential simulation at
+  long long elapsedRestored = 0; // [us] Time already spent on the wavelength being resumed, or on all wavelengths if they are simulated together
+  int checkpointHeader[NCHECKPOINTHEADERINTS] = {CHECKPOINTVERSION,simFluorescence,(int)G->n[0],(int)G->n[1],(int)G->n[2],nM,nL,(spectralFastPath? 2: parallelWavelengths? 1: 0) + (floatAccumulators? 4: 0)};
+  #ifndef __NVCC__ // Checkpointing is only available on the CPU, which is checked in MATLAB
+  struct checkpoint CP_var;
+  struct checkpointReader R_var;
+  char *checkpointFileName = mxArrayToString(mxGetPropertyShared(MatlabMC,0,"checkpointFile"));
+  if(*checkpointFileName || resumeFileName) {
+    CP = &CP_var;
+    #ifdef _OPENMP
+    CP_var.nPRNGstates = omp_get_num_procs(); // Temporarily the size of PRNGstates
+    #else
+    CP_var.nPRNGstates = 1;
+    #endif
+    CP->fileName = *checkpointFileName? checkpointFileName: NULL;
+    CP->interval = (long long)(*mxGetPr(mxGetPropertyShared(MatlabMC,0,"checkpointInterval"))*60000000);
+    CP->nextTime = CP->fileName? getMicroSeconds() + CP->interval: LLONG_MAX;
+    CP->PRNGstates = (PRNG_t *)malloc(CP->nPRNGstates*sizeof(PRNG_t));
+    CP->buffer = NULL;
+    CP->bufferSize = CP->bufferElems = 0;
+    CP->pending = CP->writeFailed = false;
+    if(!CP->PRNGstates) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+    if(resumeFileName) {
+      R = &R_var;
+      R->fileName = resumeFileName;
+      FILE *resumeFile = fopen(resumeFileName,"rb");
+      if(!resumeFile) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: Could not open %s for reading",resumeFileName);
+      fseek(resumeFile,0,SEEK_END);
+      R->size = (size_t)ftell(resumeFile);
+      R->pos = 0;
+      fseek(resumeFile,0,SEEK_SET);
+      R->data = (char *)malloc(R->size);
+      if(!R->data) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+      bool readSucceeded = fread(R->data,1,R->size,resumeFile) == R->size;
+      fclose(resumeFile);
+      if(!readSucceeded) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: Could not read %s",resumeFileName);
+      char magic[4];
+      int header[NCHECKPOINTHEADERINTS];
+      readFromCheckpoint(R,magic,4);
+      readFromCheckpoint(R,header,NCHECKPOINTHEADERINTS*sizeof(int));
+      if(memcmp(magic,"MCCP",4) || memcmp(header,checkpointHeader,NCHECKPOINTHEADERINTS*sizeof(int)))
+        mexErrMsgIdAndTxt("MCmatlab:CheckpointError","Error: %s is not a checkpoint file of this model and MCmatlab version",resumeFileName);
+      double progress[4];
+      readFromCheckpoint(R,&startIL,sizeof(int));
+      readFromCheckpoint(R,progress,4*sizeof(double));
+      nPhotonsCumulative = progress[0];
+      nPhotonsCollectedCumulative = progress[1];
+      simulationTimeCumulative = progress[2];
+      elapsedRestored = (long long)progress[3];
+      readFromCheckpoint(R,&budgetFraction,sizeof(double));
+      readFromCheckpoint(R,allocationFractions,nL*sizeof(double));
+      readFromCheckpoint(R,&B->QMCseed,sizeof(unsigned int));
+      int nPRNGstates;
+      readFromCheckpoint(R,&nPRNGstates,sizeof(int));
+      if(nPRNGstates < 0 || startIL < 0 || startIL >= nL) mexErrMsgIdAndTxt("MCmatlab:CheckpointError","Error: The checkpoint file %s is corrupt",resumeFileName);
+      if(nPRNGstates > CP->nPRNGstates) { // The checkpoint was taken with more threads than are available now. The surplus PRNG sequences are not continued.
+        free(CP->PRNGstates);
+        CP->PRNGstates = (PRNG_t *)malloc(nPRNGstates*sizeof(PRNG_t));
+        if(!CP->PRNGstates) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+      }
+      CP->nPRNGstates = nPRNGstates;
+      readFromCheckpoint(R,CP->PRNGstates,nPRNGstates*sizeof(PRNG_t));
+      readFromCheckpoint(R,&Pa->pathsElems,sizeof(long));
+      readFromCheckpoint(R,&Pa->nExamplePhotonPathsFinished,sizeof(long));
+      if(Pa->pathsElems > Pa->pathsSize) {
+        Pa->pathsSize = Pa->pathsElems;
+        Pa->data = (FLOATORDBL *)realloc(Pa->data,4*Pa->pathsSize*sizeof(FLOATORDBL));
+        if(!Pa->data) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+      }
+      readFromCheckpoint(R,Pa->data,4*Pa->pathsElems*sizeof(FLOATORDBL));
+      float *MATLABarrays[NOUTPUTARRAYS];
+      long MATLABlengths[NOUTPUTARRAYS];
+      getMATLABoutputArrays(O_MATLAB,G,LC,nL,MATLABarrays,MATLABlengths);
+      for(int k=0;k<NOUTPUTARRAYS;k++) if(MATLABarrays[k]) readFromCheckpoint(R,MATLABarrays[k],MATLABlengths[k]*sizeof(float));
+      // The wavelength scheduler's thread times and the output accumulators are read when the simulation is started
+      if(!silentMode) printf("Resuming from checkpoint in %s\n",resumeFileName);
+    } else CP->nPRNGstates = 0;
+  }
+  #endif
+  unsigned long long nPhotonsRequested_MainPass = simulationTimed? ULLONG_MAX: (unsigned long long)(budgetFraction*nPhotonsRequested);
 
-  for(int iL = 0; iL < nL && !aborting; iL++) {
-    for(idx=0;idx<nM;idx++) {
-      G->muav[idx]    = (FLOATORDBL)      muaMATLAB[idx + iL*nM];
-      G->musv[idx]    = (FLOATORDBL)      musMATLAB[idx + iL*nM];
-      G->gv[idx]      = (FLOATORDBL)        gMATLAB[idx + iL*nM];
-      G->RIv[idx]     = (FLOATORDBL)        nMATLAB[idx + iL*nM];
-      G->CDFidxv[idx] = (unsigned char)CDFidxMATLAB[idx + iL*nM];
+  // Parallel wavelengths. Instead of simulating the wavelengths one after another, all wavelengths are simulated in a single parallel
+  // region in which each photon is launched at the wavelength that is furthest behind its share of the budget. Each wavelength has its own
+  // media properties, source and output accumulators, and the normalizations are done in parallel afterwards. This avoids the thread
+  // startup and the idle threads at the end of every wavelength, at the cost of memory for nL sets of accumulators. The spectral fast path uses
+  // the same per-wavelength structs, but all wavelengths share each photon, so there is no scheduling and no photon allocation.
+  #ifndef __NVCC__
+  if((parallelWavelengths || spectralFastPath) && !aborting) {
+    struct wavelengthScheduler WS_var = {
+      nL,
+      (struct geometry *)malloc(nL*sizeof(struct geometry)),
+      (struct source *)malloc(nL*sizeof(struct source)),
+      (struct outputs *)malloc(nL*sizeof(struct outputs)),
+      (unsigned long long *)malloc(nL*sizeof(unsigned long long)),
+      allocationFractions,
+      (FLOATORDBL *)calloc(nL,sizeof(FLOATORDBL))
+    };
+    struct wavelengthScheduler *WS = &WS_var;
+    size_t size_wavelengthArrays = nM*4*sizeof(FLOATORDBL) + nM*sizeof(unsigned char);
+    char *wavelengthArrays = (char *)malloc(nL*size_wavelengthArrays); // The media property arrays (muav, musv, gv, RIv and CDFidxv) of all wavelengths
+    if(!WS->G || !WS->B || !WS->O || !WS->nPhotonsRequested || !WS->threadTime || !wavelengthArrays) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+    unsigned long long nPhotonsAllocated = 0;
+    for(int iL = 0; iL < nL; iL++) {
+      WS->G[iL] = *G;
+      WS->G[iL].muav = (FLOATORDBL *)(wavelengthArrays + iL*size_wavelengthArrays);
+      WS->G[iL].musv = WS->G[iL].muav + nM;
+      WS->G[iL].gv = WS->G[iL].musv + nM;
+      WS->G[iL].RIv = WS->G[iL].gv + nM;
+      WS->G[iL].CDFidxv = (unsigned char *)(WS->G[iL].RIv + nM); // G->CDFs and the beam distributions are the same for all wavelengths and are shared
+      WS->B[iL] = *B;
+      WS->B[iL].S = B->S && iL? (FLOATORDBL *)malloc((L+1)*sizeof(FLOATORDBL)): B->S;
+      if(B->S && !WS->B[iL].S) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+      if(WS->B[iL].S) WS->B[iL].S[0] = 0;
+      setWavelengthDependentProperties(&WS->G[iL],&WS->B[iL],iL,nM,L,S_PDF,MatlabMC,nHostThreads);
+      if(iL) allocateOutputsLike(&WS->O[iL],O,G,LC);
+      else WS->O[iL] = *O;
+      if(continuePrevious) denormalizeDepositionIntoO(&WS->B[iL],&WS->G[iL],LC,&WS->O[iL],O_MATLAB,iL,WS->B[iL].power,nPhotonsPrevious[iL]);
+      WS->nPhotonsRequested[iL] = simulationTimed? ULLONG_MAX: spectralFastPath? nPhotonsRequested/nL: iL == nL - 1? nPhotonsRequested_MainPass - nPhotonsAllocated:
+                                  photonAllocation == 0? nPhotonsRequested/nL: (unsigned long long)(nPhotonsRequested_MainPass*allocationFractions[iL]);
+      nPhotonsAllocated += WS->nPhotonsRequested[iL];
     }
 
-    if(S) {
-      for(idx=1;idx<(L+1);idx++) S[idx] = S[idx-1] + (FLOATORDBL)S_PDF[iL*L + idx-1];
-      B->power        = (FLOATORDBL)(S[L]*G->d[0]*G->d[1]*G->d[2]);
-      for(idx=1;idx<(L+1);idx++) S[idx] /= S[L];
-    } else {
-      B->power        = (FLOATORDBL)mxGetPr(mxGetPropertyShared(MatlabMC,0,"spectrum"))[iL];
+    if(!silentMode) {
+      printf("Calculating...   0%% done");
+      mexEvalString("drawnow; pause(.005);");
+    }
+    if(R) {
+      if(parallelWavelengths) readFromCheckpoint(R,WS->threadTime,nL*sizeof(FLOATORDBL));
+      readOutputsFromCheckpoint(R,WS->O,nL,G,LC);
+    }
+    long long simulationTimeStart = getMicroSeconds() - elapsedRestored;
+    #ifdef _OPENMP
+    bool useAllCPUs = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"useAllCPUs"));
+    nThreads = useAllCPUs? omp_get_num_procs(): max(omp_get_num_procs()-1,1);
+    #else
+    nThreads = 1;
+    #endif
+    bool checkpointTaken;
+    do {
+      long long transportStart = getMicroSeconds();
+      if(spectralFastPath) runThreads(&WS->B[0],&WS->G[0],LC,Pa,WS->O,DC,nM,simulationTimeStart,(long long)(simulationTimeRequested*60000000),WS->nPhotonsRequested[0],0,1,requestCollectedPhotons,&aborting,silentMode,NULL,CP,nThreads,D);
+      else runThreads(B,G,LC,Pa,O,DC,nM,simulationTimeStart,(long long)(budgetFraction*simulationTimeRequested*60000000),simulationTimed? ULLONG_MAX: nPhotonsRequested_MainPass,0,1,requestCollectedPhotons,&aborting,silentMode,WS,CP,nThreads,D);
+      transportTime += getMicroSeconds() - transportStart;
+      double progress[4] = {nPhotonsCumulative,nPhotonsCollectedCumulative,simulationTimeCumulative,(double)(getMicroSeconds() - simulationTimeStart)};
+      checkpointTaken = checkpointAfterChunk(CP,aborting,checkpointHeader,0,progress,budgetFraction,allocationFractions,nL,B->QMCseed,Pa,O_MATLAB,parallelWavelengths? WS->threadTime: NULL,WS->O,nL,G,LC);
+    } while(checkpointTaken);
+    simulationTimeCumulative += (getMicroSeconds() - simulationTimeStart)/60000000.0; // In minutes
+    unsigned long long nPhotonsSpectral = WS->O[0].nPhotons;
+    for(int iL = 0; iL < nL; iL++) {
+      if(spectralFastPath) WS->O[iL].nPhotons = nPhotonsSpectral; // Every photon was launched at all wavelengths
+      nPhotonsCumulative += (double)WS->O[iL].nPhotons;
+      nPhotonsCollectedCumulative += (double)WS->O[iL].nPhotonsCollected;
+      if(continuePrevious) WS->O[iL].nPhotons += (unsigned long long)nPhotonsPrevious[iL];
+      nPhotonsPerWavelength[iL] = (double)WS->O[iL].nPhotons;
+    }
+    if(!silentMode) {
+      if(!nPhotonsCumulative) printf("\nERROR: All photons launch outside simulation cuboid. Check your model definition.\n");
+      else {
+        printf("\b\b\b\b\b\b\b\b\b100%% done");
+        printf("\nSimulated %0.2e photons over %0.2e minutes at a rate of %0.2e photons per minute\n",nPhotonsCumulative, simulationTimeCumulative, nPhotonsCumulative/simulationTimeCumulative);
+      }
+      mexEvalString("drawnow; pause(.005);");
     }
+    long long normalizationStart = getMicroSeconds();
+    for(int iL = 0; iL < nL; iL++) normalizeDepositionAndResetO(&WS->B[iL],&WS->G[iL],LC,&WS->O[iL],O_MATLAB,iL,WS->B[iL].power,nHostThreads); // Convert data to relative fluence rate and save in O_MATLAB
+    normalizationTime += getMicroSeconds() - normalizationStart;
+    for(int iL = 1; iL < nL; iL++) {
+      freeOutputs(&WS->O[iL]);
+      if(WS->B[iL].S) free(WS->B[iL].S);
+    }
+    free(WS->G);
+    free(WS->B);
+    free(WS->O);
+    free(WS->nPhotonsRequested);
+    free(WS->threadTime);
+    free(wavelengthArrays);
+  }
+  #endif
+
+  for(int iL = startIL; iL < nL && !aborting && !parallelWavelengths && !spectralFastPath; iL++) {
+    setWavelengthDependentProperties(G,B,iL,nM,L,S_PDF,MatlabMC,nHostThreads);
 
     // ============================ MAJOR CYCLE ========================
-    unsigned long long nPhotonsRequested_ThisWavelength = simulationTimed? ULLONG_MAX: (unsigned long long)(iL == nL - 1? nPhotonsRequested - (requestCollectedPhotons? nPhotonsCollectedCumulative: nPhotonsCumulative): nPhotonsRequested/nL);
-    double simulationTimeRequested_ThisWavelength = simulationTimeRequested/nL;
+    unsigned long long nPhotonsRequested_ThisWavelength = simulationTimed? ULLONG_MAX: (unsigned long long)(iL == nL - 1? nPhotonsRequested_MainPass - (requestCollectedPhotons? nPhotonsCollectedCumulative: nPhotonsCumulative):
+                                                                                                   photonAllocation == 0? nPhotonsRequested/nL: nPhotonsRequested_MainPass*allocationFractions[iL]);
+    double simulationTimeRequested_ThisWavelength = budgetFraction*simulationTimeRequested*allocationFractions[iL];
     #ifdef __NVCC__ // If compiling for CUDA
     long GPUdevice = *(long *)mxGetPr(mxGetPropertyShared(MatlabMC,0,"GPUdevice"));
     gpuErrchk(cudaSetDevice(GPUdevice));
@@ -646,7 +1328,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
     if(!silentMode && iL == 0) printf("Using device %d: %s with CUDA compute capability %d.%d\n",GPUdevice,CDP.name,CDP.major,CDP.minor);
   
     size_t heapSizeLimit; gpuErrchk(cudaDeviceGetLimit(&heapSizeLimit,cudaLimitMallocHeapSize));
-    if(DC->evaluateCriteriaAtEndOfLife && heapSizeLimit < GPUHEAPMEMORYLIMIT) {
+    if((DC->evaluateCriteriaAtEndOfLife || O->J) && heapSizeLimit < GPUHEAPMEMORYLIMIT) {
       gpuErrchk(cudaDeviceReset());
       gpuErrchk(cudaDeviceSetLimit(cudaLimitMallocHeapSize,GPUHEAPMEMORYLIMIT));
     }
@@ -673,7 +1355,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
     long long prevtime = simulationTimeStart;
     do {
       // Run kernel
-      threadInitAndLoop<<<blocks, threadsPerBlock, size_smallArrays>>>(B_dev,G_dev,LC_dev,Pa_dev,O_dev,DC_dev,nM,size_smallArrays,prevtime,clock/1000*min((long long)KERNELTIME,timeLeft),nPhotonsRequested_ThisWavelength,0,0,requestCollectedPhotons,NULL,false,D_dev);
+      threadInitAndLoop<<<blocks, threadsPerBlock, size_smallArrays>>>(B_dev,G_dev,LC_dev,Pa_dev,O_dev,DC_dev,nM,size_smallArrays,prevtime,clock/1000*min((long long)KERNELTIME,timeLeft),nPhotonsRequested_ThisWavelength,0,0,requestCollectedPhotons,NULL,false,NULL,NULL,D_dev);
       gpuErrchk(cudaPeekAtLastError());
       gpuErrchk(cudaDeviceSynchronize());
       // Progress indicator
@@ -712,27 +1394,39 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
         }
       }
     } while(timeLeft > 0 && (requestCollectedPhotons? O->nPhotonsCollected: O->nPhotons) < nPhotonsRequested_ThisWavelength && !aborting && O->nPhotons); // The O->nPhotons is there to stop looping if launches failed
+    transportTime += getMicroSeconds() - simulationTimeStart;
     if(!silentMode && O->nPhotons) printf("\b\b\b\b\b\b\b\b\b%3d%% done",pctProgress);
   
+    long long outputCopyStart = getMicroSeconds();
     retrieveAndFreeDeviceStructs(G,G_dev,B,B_dev,LC,LC_dev,Pa,Pa_dev,O,O_dev,DC_dev,L,D,D_dev);
+    outputCopyTime += getMicroSeconds() - outputCopyStart;
   
     #else
   
-    if(!silentMode && iL == 0) {
+    if(!silentMode && iL == startIL) {
       printf("Calculating...   0%% done");
       mexEvalString("drawnow; pause(.005);");
     }
     long long simulationTimeStart = getMicroSeconds();
+    if(R && iL == startIL) {
+      simulationTimeStart -= elapsedRestored;
+      readOutputsFromCheckpoint(R,O,1,G,LC);
+    }
+    if(continuePrevious) denormalizeDepositionIntoO(B,G,LC,O,O_MATLAB,iL,B->power,nPhotonsPrevious[iL]);
     #ifdef _OPENMP
     bool useAllCPUs = mxIsLogicalScalarTrue(mxGetPropertyShared(MatlabMC,0,"useAllCPUs"));
     nThreads = useAllCPUs? omp_get_num_procs(): max(omp_get_num_procs()-1,1);
-    #pragma omp parallel num_threads((long)nThreads)
     #else
     nThreads = 1;
     #endif
-    {
-      threadInitAndLoop(B,G,LC,Pa,O,DC,nM,0,simulationTimeStart,(long long)(simulationTimeRequested_ThisWavelength*60000000),nPhotonsRequested_ThisWavelength,iL,nL,requestCollectedPhotons,&aborting,silentMode,D);
-    }
+    bool checkpointTaken;
+    do {
+      long long transportStart = getMicroSeconds();
+      runThreads(B,G,LC,Pa,O,DC,nM,simulationTimeStart,(long long)(simulationTimeRequested_ThisWavelength*60000000),nPhotonsRequested_ThisWavelength,iL,nL,requestCollectedPhotons,&aborting,silentMode,NULL,CP,nThreads,D);
+      transportTime += getMicroSeconds() - transportStart;
+      double progress[4] = {nPhotonsCumulative,nPhotonsCollectedCumulative,simulationTimeCumulative,(double)(getMicroSeconds() - simulationTimeStart)};
+      checkpointTaken = checkpointAfterChunk(CP,aborting,checkpointHeader,iL,progress,budgetFraction,allocationFractions,nL,B->QMCseed,Pa,O_MATLAB,NULL,O,1,G,LC);
+    } while(checkpointTaken);
     #endif
   
     double nPhotons = (double)O->nPhotons;
@@ -749,36 +1443,72 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
       }
       mexEvalString("drawnow; pause(.005);");
     }
-    normalizeDepositionAndResetO(B,G,LC,O,O_MATLAB,iL,B->power); // Convert data to relative fluence rate and save in O_MATLAB
+    if(continuePrevious) O->nPhotons += (unsigned long long)nPhotonsPrevious[iL];
+    nPhotonsPerWavelength[iL] = (double)O->nPhotons;
+    long long normalizationStart = getMicroSeconds();
+    double normfactor = normalizeDepositionAndResetO(B,G,LC,O,O_MATLAB,iL,B->power,nHostThreads); // Convert data to relative fluence rate and save in O_MATLAB
+    normalizationTime += getMicroSeconds() - normalizationStart;
+    if(O->collectedPhotonsFile) { // Fill in this wavelength's entries in the header and return to the end of the file
+      fseek(O->collectedPhotonsFile,16 + 16*iL,SEEK_SET);
+      fwrite(&O->nCollectedPhotonsRecorded,sizeof(unsigned long long),1,O->collectedPhotonsFile);
+      fwrite(&normfactor,sizeof(double),1,O->collectedPhotonsFile);
+      fseek(O->collectedPhotonsFile,0,SEEK_END);
+      O->nCollectedPhotonsRecorded = 0;
+    }
   }
+  if(O->collectedPhotonsFile) fclose(O->collectedPhotonsFile);
+  #ifndef __NVCC__
+  if(CP) {
+    if(CP->pending) writeCheckpoint(CP);
+    if(CP->writeFailed) printf("Warning: Could not write the checkpoint file %s\n",CP->fileName);
+    free(CP->PRNGstates);
+    free(CP->buffer);
+  }
+  if(R) free(R->data);
+  mxFree(checkpointFileName);
+  #endif
+  mxFree(resumeFileName);
 
-  mxArray *output = mxCreateDoubleMatrix(1,1,mxREAL);
-  *mxGetPr(output) = nPhotonsCumulative;
-  mxSetProperty(MCout,0,"nPhotons",output);
-  *mxGetPr(output) = nPhotonsCollectedCumulative;
-  mxSetProperty(MCout,0,"nPhotonsCollected",output);
-  *mxGetPr(output) = nThreads;
-  mxSetProperty(MCout,0,"nThreads",output);
-  *mxGetPr(output) = simulationTimeCumulative;
-  mxSetProperty(MCout,0,"simulationTime",output);
-  mxDestroyArray(output);
-  if(LC->res[0]*LC->res[1]*nL == 1) {
-    output = mxCreateNumericMatrix(1,1,mxSINGLE_CLASS,mxREAL);
-    *(float *)mxGetPr(output) = *O_MATLAB->image;
-    mxSetProperty(LCout,0,"image",output);
-    mxDestroyArray(output);
+  long long outputCopyStart = getMicroSeconds();
+  if(continuePrevious) { // The outputs are the totals of the previous and the new simulation
+    nPhotonsCumulative += *mxGetPr(mxGetPropertyShared(MatlabMC,0,"nPhotons"));
+    nPhotonsCollectedCumulative += *mxGetPr(mxGetPropertyShared(MatlabMC,0,"nPhotonsCollected"));
+    simulationTimeCumulative += *mxGetPr(mxGetPropertyShared(MatlabMC,0,"simulationTime"));
   }
+  mxSetField(MCout,0,"nPhotonsPerWavelength",nPhotonsPerWavelengthOut);
+  mxSetField(MCout,0,"nPhotons",mxCreateDoubleScalar(nPhotonsCumulative));
+  mxSetField(MCout,0,"nPhotonsCollected",mxCreateDoubleScalar(nPhotonsCollectedCumulative));
+  mxSetField(MCout,0,"nThreads",mxCreateDoubleScalar(nThreads));
+  mxSetField(MCout,0,"simulationTime",mxCreateDoubleScalar(simulationTimeCumulative));
 
   if(Pa->nExamplePaths) {
-    mxSetPropertyShared(MCout,0,"examplePaths",mxCreateNumericMatrix(4,Pa->pathsElems,mxDOUBLE_CLASS,mxREAL));
-    for(idx=0;idx<4*Pa->pathsElems;idx++) mxGetPr(mxGetPropertyShared(MCout,0,"examplePaths"))[idx] = Pa->data[idx];
+    mxSetField(MCout,0,"examplePaths",mxCreateNumericMatrix(4,Pa->pathsElems,mxDOUBLE_CLASS,mxREAL));
+    for(idx=0;idx<4*Pa->pathsElems;idx++) mxGetPr(mxGetField(MCout,0,"examplePaths"))[idx] = Pa->data[idx];
     free(Pa->data);
   }
 
+  if(O->telemetry) { // The event counters of this run, including the pilot pass, and the mean number of steps per photon
+    char const *telemetryNames[NTELEMETRYCOUNTERS + 1] = {"photons","steps","boundaryCrossings","scatterings","refractions","reflections","totalInternalReflections",
+                                                          "rouletteKills","rouletteSurvivals","launchRejections","escapes","timeLimitKills","collections","recordReallocations","meanStepsPerPhoton"};
+    mxArray *telemetry = mxCreateStructMatrix(1,1,NTELEMETRYCOUNTERS + 1,telemetryNames);
+    unsigned long long *counters = (unsigned long long *)O->telemetry;
+    for(int k=0;k<NTELEMETRYCOUNTERS;k++) mxSetField(telemetry,0,telemetryNames[k],mxCreateDoubleScalar((double)counters[k]));
+    mxSetField(telemetry,0,"meanStepsPerPhoton",mxCreateDoubleScalar(O->telemetry->photons? (double)O->telemetry->steps/O->telemetry->photons: NAN));
+    mxSetField(MCout,0,"telemetry",telemetry);
+    free(O->telemetry);
+  }
+  outputCopyTime += getMicroSeconds() - outputCopyStart;
+
   free(B->S);
+  free(allocationFractions);
+  free(allocationWeights);
+  free(pilotCosts);
   free(smallArrays);
-  free(G->M);
+  free(G->layerStart);
+  free(G->layerEnd);
+  free(G->spectralMuav);
   free(O->NFR);
+  free(O->NFR_float);
   free(O->image);
   free(O->FF);
   free(O->NI_xpos);
@@ -787,5 +1517,20 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, mxArray const *prhs[]) {
   free(O->NI_yneg);
   free(O->NI_zpos);
   free(O->NI_zneg);
+  free(O->J);
+  free(O->NFR_rz);
+  free(O->NI_zpos_r);
+  free(O->NI_zneg_r);
+  free(O->NFR_grid);
+
+  // Wall-clock time of the phases of this run. The setup is everything that is neither transport, normalization nor output copying, that is,
+  // reading the inputs, allocating and initializing the arrays, the cumulative source distribution, checkpoint reading and writing, and cleaning up.
+  char const *phaseNames[] = {"setup","transport","normalization","outputCopy"};
+  mxArray *phaseTimes = mxCreateStructMatrix(1,1,4,phaseNames);
+  mxSetField(phaseTimes,0,"setup",mxCreateDoubleScalar((getMicroSeconds() - mexFunctionStart - transportTime - normalizationTime - outputCopyTime)/1e6));
+  mxSetField(phaseTimes,0,"transport",mxCreateDoubleScalar(transportTime/1e6));
+  mxSetField(phaseTimes,0,"normalization",mxCreateDoubleScalar(normalizationTime/1e6));
+  mxSetField(phaseTimes,0,"outputCopy",mxCreateDoubleScalar(outputCopyTime/1e6));
+  mxSetField(MCout,0,"phaseTimes",phaseTimes);
 //   printf("\nDebug: %.18e %.18e %.18e %llu %llu %llu\n",D->dbls[0],D->dbls[1],D->dbls[2],D->ulls[0],D->ulls[1],D->ulls[2]);
 }
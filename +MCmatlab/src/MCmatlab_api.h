@@ -0,0 +1,96 @@
+/********************************************
+ *
+ * MCmatlab_api.h
+ * C interface to the MCmatlab Monte Carlo engine, for using it from C or C++ programs without MATLAB
+ *
+ * This file is part of MCmatlab.
+ *
+ * MCmatlab is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MCmatlab is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MCmatlab.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The interface is implemented in MCmatlab_standalone.c, which is compiled into a library by defining MCMATLAB_LIBRARY, see the
+ * compilation instructions in that file. The engine is the same code as in the MCmatlab mex function, and its inputs have the same names
+ * and meanings as the properties of model.G and model.MC or model.FMC in MATLAB (see the README). They are given as trees of objects,
+ * whose fields are numeric arrays or other objects, for example the simulation object with the fields "wavelength", "mediaProperties"
+ * (with the fields "mua", "mus", "g", "n" and "CDFidx"), "LS" (the light source), "LC" (the light collector) and "depositionCriteria".
+ * The trees can be built with the mc_object functions or read from a model file written by writeModelFile in MATLAB.
+ *
+ * Functions that return int return 0 on success and nonzero on failure, and functions that return pointers return NULL on failure.
+ * The error message is then available from mc_last_error. Memory allocated by the failed call is not necessarily freed. The functions
+ * must not be called from several threads at the same time, since the engine itself uses all the threads it is given.
+ *
+ * Example:
+ *   mcContext *ctx = mc_context_create_from_file("model.mcmd");
+ *   if(!ctx || mc_run(ctx,1e6,0)) fprintf(stderr,"%s\n",mc_last_error());
+ *   mcOutput NFR;
+ *   if(!mc_get_output(ctx,"NFR",&NFR)) ... // NFR.data is a float array of size NFR.dims[0]*NFR.dims[1]*NFR.dims[2]*NFR.dims[3]
+ *   mc_run(ctx,1e6,0); // Adds another million photons to the outputs
+ *   mc_context_destroy(ctx);
+ ********************************************/
+
+#ifndef MCMATLAB_API_H
+#define MCMATLAB_API_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mxArray_tag mcObject; // An object (or struct) with named fields, or a numeric array
+typedef struct mcContext mcContext; // A simulation and its outputs
+
+typedef enum { // Same numbering as MATLAB's mxClassID and the model files
+  MC_LOGICAL = 3, MC_CHAR = 4, MC_DOUBLE = 6, MC_SINGLE = 7, MC_INT8 = 8, MC_UINT8 = 9, MC_INT16 = 10, MC_UINT16 = 11,
+  MC_INT32 = 12, MC_UINT32 = 13, MC_INT64 = 14, MC_UINT64 = 15
+} mcClass;
+
+typedef struct {
+  mcClass classID; // MC_SINGLE for the output arrays, MC_DOUBLE for examplePaths
+  int nDims;
+  size_t const *dims; // Array dimensions in column-major order, as in MATLAB
+  void const *data; // Owned by the context and valid until the next mc_run or mc_context_destroy
+} mcOutput;
+
+// Building input objects. The set functions replace a field if it already exists and copy the data given to them.
+mcObject *mc_object_create(void);
+mcObject *mc_object_read(char const *fileName); // Reads a model or result file
+int mc_object_write(char const *fileName, mcObject const *object);
+int mc_object_set_array(mcObject *object, char const *name, mcClass classID, int nDims, size_t const *dims, void const *data);
+int mc_object_set_double(mcObject *object, char const *name, double value);
+int mc_object_set_logical(mcObject *object, char const *name, int value);
+int mc_object_set_string(mcObject *object, char const *name, char const *value);
+int mc_object_set_object(mcObject *object, char const *name, mcObject *child); // Takes ownership of child
+void mc_object_destroy(mcObject *object);
+
+// Simulations. simType is 1 for (excitation) Monte Carlo and 2 for fluorescence Monte Carlo.
+mcContext *mc_context_create(mcObject const *geometry, mcObject const *simulation, int simType);
+mcContext *mc_context_create_from_file(char const *modelFileName); // Model file with the fields G, MC or FMC and simType
+mcObject *mc_context_get_simulation(mcContext *ctx); // The simulation object of the context, which may be modified before mc_run
+void mc_context_set_stream(mcContext *ctx, unsigned long streamIndex); // Contexts with different stream indices use different random number streams, also if started at the same time
+void mc_context_set_threads(mcContext *ctx, int nThreads); // 0 (default) to use the number of threads given by useAllCPUs
+int mc_run(mcContext *ctx, double nPhotons, double simulationTime); // Simulates nPhotons photons or, if nPhotons is 0, for simulationTime minutes, or if both are 0, as requested in the simulation object. Later calls add to the outputs of the earlier calls
+int mc_get_output(mcContext const *ctx, char const *name, mcOutput *output); // Outputs such as "NFR", "NI_zneg", "image" or "examplePaths"
+double mc_get_scalar(mcContext const *ctx, char const *name); // "nPhotons", "nPhotonsCollected", "simulationTime" or "nThreads", NaN before the first run
+int mc_write_results(mcContext const *ctx, char const *resultFileName);
+void mc_context_destroy(mcContext *ctx);
+
+int mc_reduce_result_files(char const *resultFileName, int nResults, char const * const *workerResultFileNames); // Combines the results of separate runs of the same model
+void mc_interrupt(void); // Makes a running simulation stop early with the photons simulated so far. May be called from a signal handler
+char const *mc_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
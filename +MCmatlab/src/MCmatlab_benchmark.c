@@ -0,0 +1,584 @@
+/********************************************
+ *
+ * MCmatlab_benchmark.c, in the C programming language
+ * Benchmark of the MCmatlab Monte Carlo engine without MATLAB, for tracking the performance between releases
+ *
+ * This file is part of MCmatlab.
+ *
+ * MCmatlab is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MCmatlab is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MCmatlab.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The benchmark is a client of the C interface in MCmatlab_api.h, so it runs the same engine code as the mex function and the
+ * standalone executable. It builds a fixed set of models in C and simulates a fixed number of photons in each of them:
+ *   homogeneousSlab     A single scattering medium with cyclic side boundaries, illuminated by a pencil beam
+ *   standardTissue      Example 1: Air above "standard" tissue, pencil beam
+ *   bloodVessel         Example 4: Water, epidermis, dermis and a blood vessel at 532 nm, top-hat beam
+ *   curvedInterface     Example 17: Refraction and reflection at a water sphere in air, infinite plane wave
+ *   fluorescence3D      Fluorescence Monte Carlo in the geometry of Example 4, emitted from a 3D source distribution in the tissue
+ *   timeTagging         Example 6: Time-resolved imaging of a diagonal scatterer with a light collector
+ *   endOfLifeCriteria   The geometry of Example 4 with deposition criteria that are evaluated at the end of each photon's life
+ * The optical properties of the media of Example 4 are those of its calc_mua and calc_mus functions evaluated at 532 nm, and the
+ * interface normals of Example 17 are those of the sphere itself rather than calculated from the voxels.
+ *
+ * Every scenario is run with 1, 2, 4, ... threads up to the maximum number of threads, each time in a new simulation. For each run,
+ * the wall clock time of mc_run (which includes the setup and the normalization of the outputs) and the number of photons per second
+ * are reported, together with the speedup and parallel efficiency relative to the run with 1 thread. The peak memory use of the process
+ * during the runs of each scenario is reported in MB. On Linux, the peak is reset before each scenario, while on other systems it is the
+ * peak of the process so far.
+ *
+ * The accuracy of the single precision accumulators of MC.floatAccumulators is checked in a model in which a pencil beam hits a small,
+ * strongly absorbing cube (see buildHotAbsorber). The NFR of 3e6 photons (scaled with photonFactor) simulated with double precision
+ * accumulators is compared to that of a second run with double and a run with single precision accumulators, on maxThreads threads.
+ * The maximum and RMS relative differences in the voxels with at least 1% of the maximum NFR are reported. Since the runs use different
+ * random numbers, the difference between the two double precision runs is the noise floor of the comparison. All of it is written to
+ * stdout as JSON.
+ *
+ * Usage:
+ * MCmatlab_benchmark [photonFactor [maxThreads [scenarioName]]]
+ *   photonFactor (default 1) scales the number of photons of all scenarios, maxThreads (default 0) is the maximum number of threads,
+ *   0 for the number of processors, and scenarioName restricts the benchmark to a single scenario, or to the accuracy check if it is
+ *   floatAccumulators.
+ *
+ ** COMPILING
+ * On Linux or Mac, in the folder with the example files, run
+ * "gcc -Ofast -fno-finite-math-only -fopenmp -std=c11 -Wall -DMCMATLAB_LIBRARY -I./+MCmatlab/src/standalone -o MCmatlab_benchmark ./+MCmatlab/src/MCmatlab_benchmark.c ./+MCmatlab/src/MCmatlab_standalone.c -lm"
+ * On Windows with MinGW-w64, run
+ * "gcc -Ofast -fno-finite-math-only -fopenmp -std=c11 -Wall -DMCMATLAB_LIBRARY -I.\+MCmatlab\src\standalone -o MCmatlab_benchmark.exe .\+MCmatlab\src\MCmatlab_benchmark.c .\+MCmatlab\src\MCmatlab_standalone.c"
+ ********************************************/
+
+#define _POSIX_C_SOURCE 200809L // For clock_gettime
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <sys/resource.h>
+#endif
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+#include "MCmatlab_api.h"
+
+#define MAXMEDIA 4
+#ifndef M_PI
+  #define M_PI 3.14159265358979323846
+#endif
+
+static void check(int status) {
+  if(status) {
+    fflush(stdout);
+    fprintf(stderr,"%s\n",mc_last_error());
+    exit(EXIT_FAILURE);
+  }
+}
+
+static double getSeconds(void) {
+  #ifdef _WIN32
+  LARGE_INTEGER freq, counter;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart/freq.QuadPart;
+  #else
+  struct timespec time; clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec*1e-9;
+  #endif
+}
+
+// The peak resident memory of the process in MB, -1 if unknown. Not NaN, since -Ofast lets the compiler fold isnan to false
+static double getPeakMemory(void) {
+  #if defined(__linux__)
+  FILE *file = fopen("/proc/self/status","r");
+  char line[256];
+  double peak = -1;
+  while(file && fgets(line,sizeof(line),file)) if(!strncmp(line,"VmHWM:",6)) peak = atof(line + 6)/1024; // Given in kB
+  if(file) fclose(file);
+  return peak;
+  #elif defined(_WIN32)
+  return -1;
+  #else
+  struct rusage usage;
+  getrusage(RUSAGE_SELF,&usage);
+  return usage.ru_maxrss/1048576.0; // Given in bytes on Mac
+  #endif
+}
+
+static void resetPeakMemory(void) {
+  #if defined(__linux__)
+  FILE *file = fopen("/proc/self/clear_refs","w"); // Writing 5 resets the peak to the current memory use
+  if(file) {
+    fputs("5",file);
+    fclose(file);
+  }
+  #endif
+}
+
+// ============================ MODEL BUILDING ========================
+static void setObject(mcObject *object, char const *name, mcObject *child) {check(mc_object_set_object(object,name,child));}
+static void setDouble(mcObject *object, char const *name, double value) {check(mc_object_set_double(object,name,value));}
+static void setLogical(mcObject *object, char const *name, int value) {check(mc_object_set_logical(object,name,value));}
+static void setString(mcObject *object, char const *name, char const *value) {check(mc_object_set_string(object,name,value));}
+static void setNaNs(mcObject *object, char const *name, size_t n) {
+  double nans[6] = {NAN,NAN,NAN,NAN,NAN,NAN};
+  size_t dims[2] = {1,n};
+  check(mc_object_set_array(object,name,MC_DOUBLE,2,dims,nans));
+}
+
+typedef struct {
+  long n[3]; // Number of voxels
+  double L[3]; // [cm] Size of the cuboid
+  int nM; // Number of media
+  double mua[MAXMEDIA], mus[MAXMEDIA], g[MAXMEDIA], n_RI[MAXMEDIA];
+  unsigned char *M; // 1-based media indices
+} geometry;
+
+static geometry createGeometry(long nx, long ny, long nz, double Lx, double Ly, double Lz) {
+  geometry G = {{nx,ny,nz},{Lx,Ly,Lz},0,{0},{0},{0},{0},NULL};
+  G.M = (unsigned char *)malloc(nx*ny*nz);
+  if(!G.M) {
+    fprintf(stderr,"Error: Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return G;
+}
+
+static void addMedium(geometry *G, double mua, double mus, double g, double n) {
+  G->mua[G->nM] = mua;
+  G->mus[G->nM] = mus;
+  G->g[G->nM] = g;
+  G->n_RI[G->nM] = n;
+  G->nM++;
+}
+
+// Voxel center coordinates, with x and y centered on the cuboid and z starting at the top surface, as in MCmatlab
+static double X(geometry const *G, long i) {return (i - (G->n[0] - 1)/2.0)*G->L[0]/G->n[0];}
+static double Y(geometry const *G, long j) {return (j - (G->n[1] - 1)/2.0)*G->L[1]/G->n[1];}
+static double Z(geometry const *G, long k) {return (k + 0.5)*G->L[2]/G->n[2];}
+#define FOREACHVOXEL(G) for(long k=0;k<(G)->n[2];k++) for(long j=0;j<(G)->n[1];j++) for(long i=0;i<(G)->n[0];i++)
+#define VOXEL(G) (i + (G)->n[0]*(j + (G)->n[1]*k))
+
+static mcObject *createGeometryObject(geometry const *G) {
+  mcObject *object = mc_object_create();
+  setDouble(object,"dx",G->L[0]/G->n[0]);
+  setDouble(object,"dy",G->L[1]/G->n[1]);
+  setDouble(object,"dz",G->L[2]/G->n[2]);
+  return object;
+}
+
+static mcObject *createIntensityDistribution(double radialDistr, double radialWidth) {
+  mcObject *ID = mc_object_create();
+  setDouble(ID,"radialDistr",radialDistr);
+  setDouble(ID,"radialWidth",radialWidth);
+  setDouble(ID,"XDistr",0);
+  setDouble(ID,"XWidth",0);
+  setDouble(ID,"YDistr",0);
+  setDouble(ID,"YWidth",0);
+  return ID;
+}
+
+// A simulation object with the defaults of the monteCarloSimulation class, the media and interface normals of the geometry and a light
+// source of the given type. Interface normals are only used if the refractive indices differ.
+static mcObject *createSimulationObject(geometry const *G, float const *interfaceNormals, double sourceType, double zFocus) {
+  mcObject *MC = mc_object_create();
+  size_t dims[3] = {(size_t)G->n[0],(size_t)G->n[1],(size_t)G->n[2]};
+  check(mc_object_set_array(MC,"M",MC_UINT8,3,dims,G->M));
+  size_t normalDims[2] = {interfaceNormals? 2: 1,interfaceNormals? dims[0]*dims[1]*dims[2]: 1};
+  float nan = NAN;
+  check(mc_object_set_array(MC,"interfaceNormals",MC_SINGLE,2,normalDims,interfaceNormals? interfaceNormals: &nan));
+  check(mc_object_set_array(MC,"sourceDistribution",MC_SINGLE,2,(size_t[2]){1,1},&nan));
+
+  mcObject *mP = mc_object_create();
+  size_t mediaDims[2] = {(size_t)G->nM,1};
+  double CDFidx[MAXMEDIA] = {0};
+  check(mc_object_set_array(mP,"mua",MC_DOUBLE,2,mediaDims,G->mua));
+  check(mc_object_set_array(mP,"mus",MC_DOUBLE,2,mediaDims,G->mus));
+  check(mc_object_set_array(mP,"g",MC_DOUBLE,2,mediaDims,G->g));
+  check(mc_object_set_array(mP,"n",MC_DOUBLE,2,mediaDims,G->n_RI));
+  check(mc_object_set_array(mP,"CDFidx",MC_DOUBLE,2,mediaDims,CDFidx));
+  setObject(MC,"mediaProperties",mP);
+  check(mc_object_set_array(MC,"CDFs",MC_DOUBLE,2,(size_t[2]){0,0},NULL));
+  check(mc_object_set_array(MC,"spectrum",MC_DOUBLE,2,(size_t[2]){1,1},&(double){1}));
+
+  setDouble(MC,"nPhotonsRequested",NAN);
+  setDouble(MC,"simulationTimeRequested",0.1);
+  setLogical(MC,"silentMode",true);
+  setLogical(MC,"useAllCPUs",true);
+  setDouble(MC,"GPUdevice",0);
+  setLogical(MC,"requestCollectedPhotons",false);
+  setDouble(MC,"nExamplePaths",0);
+  setLogical(MC,"calcNFR",true);
+  setLogical(MC,"floatAccumulators",false);
+  setLogical(MC,"calcTelemetry",false);
+  setLogical(MC,"calcJacobian",false);
+  setDouble(MC,"farFieldRes",0);
+  setDouble(MC,"boundaryType",1);
+  setDouble(MC,"mirrorSymmetry",0);
+  setLogical(MC,"axisymmetric",false);
+  setNaNs(MC,"NFRroi",6);
+  setNaNs(MC,"NIroi",6);
+  check(mc_object_set_array(MC,"scoringGridRes",MC_DOUBLE,2,(size_t[2]){1,3},(double[3]){0,0,0}));
+  setNaNs(MC,"scoringGridExtent",6);
+  setDouble(MC,"scoringGridNTimeBins",0);
+  setDouble(MC,"scoringGridTStart",0);
+  setDouble(MC,"scoringGridTEnd",1e-9);
+  setLogical(MC,"parallelWavelengths",false);
+  setLogical(MC,"useSpectralFastPath",false);
+  setDouble(MC,"photonAllocation",0);
+  setString(MC,"checkpointFile","");
+  setDouble(MC,"checkpointInterval",10);
+  setLogical(MC,"useLayeredFastPath",false);
+  setLogical(MC,"quasiRandomLaunch",false);
+  setLogical(MC,"clipLightSources",false);
+
+  mcObject *LS = mc_object_create();
+  setDouble(LS,"sourceType",sourceType);
+  setDouble(LS,"emitterLength",0);
+  setDouble(LS,"relativePower",1);
+  setDouble(LS,"xFocus",0);
+  setDouble(LS,"yFocus",0);
+  setDouble(LS,"zFocus",zFocus);
+  setDouble(LS,"theta",0);
+  setDouble(LS,"phi",0);
+  setDouble(LS,"psi",0);
+  setObject(LS,"FPID",createIntensityDistribution(0,0));
+  setObject(LS,"AID",createIntensityDistribution(0,0));
+  setObject(MC,"LS",LS);
+
+  setLogical(MC,"useLightCollector",false);
+  mcObject *LC = mc_object_create();
+  setDouble(LC,"x",0);
+  setDouble(LC,"y",0);
+  setDouble(LC,"z",0);
+  setDouble(LC,"theta",0);
+  setDouble(LC,"phi",0);
+  setDouble(LC,"f",INFINITY);
+  setDouble(LC,"diam",0);
+  setDouble(LC,"fieldSize",0);
+  setDouble(LC,"NA",0.22);
+  setDouble(LC,"res",1);
+  setDouble(LC,"tStart",0);
+  setDouble(LC,"tEnd",0);
+  setDouble(LC,"nTimeBins",0);
+  setString(LC,"collectedPhotonsFile","");
+  setObject(MC,"LC",LC);
+
+  mcObject *DC = mc_object_create();
+  char const *criteria[] = {"Scatterings","Refractions","Reflections","InterfaceTransitions"};
+  for(int c=0;c<4;c++) {
+    char name[64];
+    snprintf(name,sizeof(name),"min%s",criteria[c]);
+    setDouble(DC,name,0);
+    snprintf(name,sizeof(name),"max%s",criteria[c]);
+    setDouble(DC,name,INFINITY);
+  }
+  setDouble(DC,"minSubmediaIdx",1);
+  setDouble(DC,"maxSubmediaIdx",G->nM);
+  setLogical(DC,"onlyCollected",false);
+  setLogical(DC,"evaluateOnlyAtEndOfLife",true);
+  setObject(MC,"depositionCriteria",DC);
+  return MC;
+}
+
+// ============================ SCENARIOS ========================
+static void buildHomogeneousSlab(mcObject **geometryObject, mcObject **simulation) {
+  geometry G = createGeometry(100,100,100,.2,.2,.1);
+  addMedium(&G,1,100,0.9,1);
+  memset(G.M,1,100*100*100);
+  *geometryObject = createGeometryObject(&G);
+  *simulation = createSimulationObject(&G,NULL,0,0);
+  setDouble(*simulation,"boundaryType",3); // Cyclic side boundaries make the slab laterally infinite
+  free(G.M);
+}
+
+static void buildStandardTissue(mcObject **geometryObject, mcObject **simulation) {
+  geometry G = createGeometry(101,101,150,.1,.1,.15);
+  addMedium(&G,1e-8,1e-8,1,1); // Air
+  addMedium(&G,1,100,0.9,1); // "Standard" tissue
+  FOREACHVOXEL(&G) G.M[VOXEL(&G)] = Z(&G,k) > 0.03? 2: 1;
+  *geometryObject = createGeometryObject(&G);
+  *simulation = createSimulationObject(&G,NULL,0,G.L[2]/2);
+  free(G.M);
+}
+
+static geometry createBloodVesselGeometry(void) {
+  geometry G = createGeometry(100,100,100,.1,.1,.1);
+  addMedium(&G,0.00036,10,1,1); // Water
+  addMedium(&G,16.57,375.9,0.9,1); // Epidermis
+  addMedium(&G,0.4585,356.5,0.9,1); // Dermis
+  addMedium(&G,230.5,93.98,0.9,1); // Blood
+  double zsurf = 0.01, epd_thick = 0.006, vesselradius = 0.01, vesseldepth = 0.04;
+  FOREACHVOXEL(&G) {
+    double x = X(&G,i), z = Z(&G,k);
+    G.M[VOXEL(&G)] = x*x + (z - (zsurf + vesseldepth))*(z - (zsurf + vesseldepth)) < vesselradius*vesselradius? 4:
+                     z > zsurf + epd_thick? 3: z > zsurf? 2: 1;
+  }
+  return G;
+}
+
+static void buildBloodVessel(mcObject **geometryObject, mcObject **simulation) {
+  geometry G = createBloodVesselGeometry();
+  *geometryObject = createGeometryObject(&G);
+  *simulation = createSimulationObject(&G,NULL,4,0);
+  mcObject *LS = mc_object_create(); // The source is replaced by a top-hat beam of radius 0.03 cm
+  setDouble(LS,"sourceType",4);
+  setDouble(LS,"emitterLength",0);
+  setDouble(LS,"relativePower",1);
+  setDouble(LS,"xFocus",0);
+  setDouble(LS,"yFocus",0);
+  setDouble(LS,"zFocus",0);
+  setDouble(LS,"theta",0);
+  setDouble(LS,"phi",0);
+  setDouble(LS,"psi",0);
+  setObject(LS,"FPID",createIntensityDistribution(0,0.03));
+  setObject(LS,"AID",createIntensityDistribution(0,0));
+  setObject(*simulation,"LS",LS);
+  free(G.M);
+}
+
+static void buildCurvedInterface(mcObject **geometryObject, mcObject **simulation) {
+  geometry G = createGeometry(201,201,101,.1,.1,.05);
+  addMedium(&G,1e-8,1e-8,1,1); // Air
+  addMedium(&G,0.00036,10,1,1.3); // Water
+  float *interfaceNormals = (float *)malloc(2*sizeof(float)*G.n[0]*G.n[1]*G.n[2]);
+  if(!interfaceNormals) {
+    fprintf(stderr,"Error: Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  double zCenter = Z(&G,G.n[2] - 1), radius = 0.04;
+  FOREACHVOXEL(&G) {
+    double x = X(&G,i), y = Y(&G,j), z = Z(&G,k) - zCenter, r = sqrt(x*x + y*y + z*z);
+    bool isWater = r < radius;
+    G.M[VOXEL(&G)] = isWater? 2: 1;
+    // Like the normals calculated in MATLAB, they point into the medium of the voxel, so inwards in the sphere and outwards in the air
+    double sign = isWater? -1: 1;
+    interfaceNormals[2*VOXEL(&G)    ] = (float)(r > 0? acos(sign*z/r): 0); // theta
+    interfaceNormals[2*VOXEL(&G) + 1] = (float)atan2(sign*y,sign*x); // phi
+  }
+  *geometryObject = createGeometryObject(&G);
+  *simulation = createSimulationObject(&G,interfaceNormals,2,G.L[2]);
+  free(interfaceNormals);
+  free(G.M);
+}
+
+static void buildFluorescence3D(mcObject **geometryObject, mcObject **simulation) {
+  geometry G = createBloodVesselGeometry();
+  *geometryObject = createGeometryObject(&G);
+  *simulation = createSimulationObject(&G,NULL,0,0);
+  // The emitters are distributed like the absorption of a beam that decays exponentially with depth in the tissue
+  float *sourceDistribution = (float *)malloc(sizeof(float)*G.n[0]*G.n[1]*G.n[2]);
+  if(!sourceDistribution) {
+    fprintf(stderr,"Error: Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  FOREACHVOXEL(&G) sourceDistribution[VOXEL(&G)] = G.M[VOXEL(&G)] == 1? 0: (float)(G.mua[G.M[VOXEL(&G)] - 1]*exp(-(Z(&G,k) - 0.01)/0.02));
+  check(mc_object_set_array(*simulation,"sourceDistribution",MC_SINGLE,2,(size_t[2]){(size_t)(G.n[0]*G.n[1]*G.n[2]),1},sourceDistribution));
+  free(sourceDistribution);
+  free(G.M);
+}
+
+static void buildTimeTagging(mcObject **geometryObject, mcObject **simulation) {
+  geometry G = createGeometry(20,20,20,.1,.1,.1);
+  addMedium(&G,1e-8,1e-8,1,1); // Air
+  addMedium(&G,1e-7,100,0,1); // Test scatterer
+  FOREACHVOXEL(&G) G.M[VOXEL(&G)] = j == k && (i == j || i == 0)? 2: 1; // The xyz diagonal and the yz diagonal of the first x slice
+  *geometryObject = createGeometryObject(&G);
+  *simulation = createSimulationObject(&G,NULL,2,G.L[2]/2);
+  setLogical(*simulation,"useLightCollector",true);
+  mcObject *LC = mc_object_create();
+  setDouble(LC,"x",0);
+  setDouble(LC,"y",0);
+  setDouble(LC,"z",G.L[2]/2);
+  setDouble(LC,"theta",atan(1/sqrt(2)));
+  setDouble(LC,"phi",-3*M_PI/4);
+  setDouble(LC,"f",.2);
+  setDouble(LC,"diam",.2);
+  setDouble(LC,"fieldSize",.2);
+  setDouble(LC,"NA",0.22);
+  setDouble(LC,"res",100);
+  setDouble(LC,"tStart",-1.5e-13);
+  setDouble(LC,"tEnd",5.5e-12);
+  setDouble(LC,"nTimeBins",100);
+  setString(LC,"collectedPhotonsFile","");
+  setObject(*simulation,"LC",LC);
+  free(G.M);
+}
+
+static void buildEndOfLifeCriteria(mcObject **geometryObject, mcObject **simulation) {
+  buildBloodVessel(geometryObject,simulation);
+  mcObject *DC = mc_object_create(); // Only photons that have entered the blood vessel are counted, as in Example 25
+  char const *criteria[] = {"Scatterings","Refractions","Reflections","InterfaceTransitions"};
+  for(int c=0;c<4;c++) {
+    char name[64];
+    snprintf(name,sizeof(name),"min%s",criteria[c]);
+    setDouble(DC,name,c == 3? 1: 0);
+    snprintf(name,sizeof(name),"max%s",criteria[c]);
+    setDouble(DC,name,INFINITY);
+  }
+  setDouble(DC,"minSubmediaIdx",4);
+  setDouble(DC,"maxSubmediaIdx",4);
+  setLogical(DC,"onlyCollected",false);
+  setLogical(DC,"evaluateOnlyAtEndOfLife",true);
+  setObject(*simulation,"depositionCriteria",DC);
+}
+
+typedef struct {
+  char const *name;
+  int simType; // 1 for Monte Carlo, 2 for fluorescence Monte Carlo
+  double nPhotons; // Before scaling with photonFactor
+  void (*build)(mcObject **geometryObject, mcObject **simulation);
+} scenario;
+
+static scenario const scenarios[] = {
+  {"homogeneousSlab",  1,2e5,buildHomogeneousSlab},
+  {"standardTissue",   1,2e5,buildStandardTissue},
+  {"bloodVessel",      1,2e5,buildBloodVessel},
+  {"curvedInterface",  1,5e5,buildCurvedInterface},
+  {"fluorescence3D",   2,2e5,buildFluorescence3D},
+  {"timeTagging",      1,1e6,buildTimeTagging},
+  {"endOfLifeCriteria",1,2e5,buildEndOfLifeCriteria},
+};
+#define NSCENARIOS (int)(sizeof(scenarios)/sizeof(scenarios[0]))
+
+// ============================ ACCURACY ========================
+// The single precision accumulators of MC.floatAccumulators are checked in a pencil beam model with a small, strongly absorbing cube at
+// the beam's entry point, whose voxels receive most of the deposits. The photons that leave the cube spread over the much larger
+// scattering medium around it, so the deposition cache entries of the hot voxels are evicted and flushed to the accumulators many times.
+static void buildHotAbsorber(mcObject **geometryObject, mcObject **simulation) {
+  geometry G = createGeometry(100,100,100,.1,.1,.1);
+  addMedium(&G,10,50,0.9,1); // Scattering medium
+  addMedium(&G,100,100,0.9,1); // Absorber
+  FOREACHVOXEL(&G) G.M[VOXEL(&G)] = fabs(X(&G,i)) < 0.002 && fabs(Y(&G,j)) < 0.002 && Z(&G,k) < 0.004? 2: 1;
+  *geometryObject = createGeometryObject(&G);
+  *simulation = createSimulationObject(&G,NULL,0,0);
+  free(G.M);
+}
+
+static float *runForNFR(mcObject *geometryObject, mcObject *simulation, bool floatAccumulators, double nPhotons, int nThreads, size_t *nVoxels) {
+  // Simulates nPhotons photons and returns a copy of the normalized fluence rate
+  setLogical(simulation,"floatAccumulators",floatAccumulators);
+  mcContext *ctx = mc_context_create(geometryObject,simulation,1);
+  if(!ctx) check(-1);
+  mc_context_set_threads(ctx,nThreads);
+  check(mc_run(ctx,nPhotons,0));
+  mcOutput NFR;
+  check(mc_get_output(ctx,"NFR",&NFR));
+  *nVoxels = NFR.dims[0]*NFR.dims[1]*NFR.dims[2]*NFR.dims[3];
+  float *copy = (float *)malloc(*nVoxels*sizeof(float));
+  if(!copy) {
+    fprintf(stderr,"Error: Out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(copy,NFR.data,*nVoxels*sizeof(float));
+  mc_context_destroy(ctx);
+  return copy;
+}
+
+static void printRelativeDifference(char const *name, float const *NFR, float const *NFR_ref, size_t nVoxels) {
+  // The maximum and RMS of the relative difference from NFR_ref in the voxels in which NFR_ref is at least 1% of its maximum
+  float maxNFR = 0;
+  for(size_t j=0;j<nVoxels;j++) if(NFR_ref[j] > maxNFR) maxNFR = NFR_ref[j];
+  double maxDifference = 0, sumSquares = 0;
+  long nHot = 0;
+  for(size_t j=0;j<nVoxels;j++) if(NFR_ref[j] >= maxNFR/100) {
+    double relativeDifference = fabs((double)NFR[j] - NFR_ref[j])/NFR_ref[j];
+    if(relativeDifference > maxDifference) maxDifference = relativeDifference;
+    sumSquares += relativeDifference*relativeDifference;
+    nHot++;
+  }
+  printf("\"%s\": {\"maxRelativeDifference\": %.3e, \"rmsRelativeDifference\": %.3e}",name,maxDifference,nHot? sqrt(sumSquares/nHot): 0);
+}
+
+static void runAccuracyCheck(double photonFactor, int maxThreads) {
+  // Compares the NFR of a run with single precision accumulators to that of a run with double precision accumulators. Since the runs use
+  // different random numbers, the difference between two runs with double precision accumulators is reported as well, as the noise floor.
+  mcObject *geometryObject, *simulation;
+  buildHotAbsorber(&geometryObject,&simulation);
+  double nPhotons = round(3e6*photonFactor);
+  size_t nVoxels;
+  float *NFR_double  = runForNFR(geometryObject,simulation,false,nPhotons,maxThreads,&nVoxels);
+  float *NFR_double2 = runForNFR(geometryObject,simulation,false,nPhotons,maxThreads,&nVoxels);
+  float *NFR_float   = runForNFR(geometryObject,simulation,true ,nPhotons,maxThreads,&nVoxels);
+  printf("  \"accuracy\": {\"name\": \"floatAccumulators\", \"nPhotons\": %.0f, ",nPhotons);
+  printRelativeDifference("floatVsDouble",NFR_float,NFR_double,nVoxels);
+  printf(", ");
+  printRelativeDifference("doubleVsDouble",NFR_double2,NFR_double,nVoxels);
+  printf("}\n");
+  fflush(stdout);
+  free(NFR_double);
+  free(NFR_double2);
+  free(NFR_float);
+  mc_object_destroy(geometryObject);
+  mc_object_destroy(simulation);
+}
+
+// ============================ BENCHMARK ========================
+static void runScenario(scenario const *s, double photonFactor, int maxThreads, bool isFirst) {
+  mcObject *geometryObject, *simulation;
+  s->build(&geometryObject,&simulation);
+  double nPhotons = round(s->nPhotons*photonFactor);
+  resetPeakMemory();
+
+  printf("%s\n    {\"name\": \"%s\", \"simType\": %d, \"nPhotons\": %.0f, \"runs\": [",isFirst? "": ",",s->name,s->simType,nPhotons);
+  double photonsPerSecond1 = NAN;
+  for(int nThreads=1;;nThreads = 2*nThreads < maxThreads? 2*nThreads: maxThreads) {
+    mcContext *ctx = mc_context_create(geometryObject,simulation,s->simType);
+    if(!ctx) check(-1);
+    mc_context_set_threads(ctx,nThreads);
+    double start = getSeconds();
+    check(mc_run(ctx,nPhotons,0));
+    double wallTime = getSeconds() - start;
+    double photonsPerSecond = mc_get_scalar(ctx,"nPhotons")/wallTime;
+    if(nThreads == 1) photonsPerSecond1 = photonsPerSecond;
+    printf("%s\n      {\"nThreads\": %d, \"wallTime\": %.4f, \"photonsPerSecond\": %.1f, \"speedup\": %.3f, \"efficiency\": %.3f}",
+           nThreads == 1? "": ",",(int)mc_get_scalar(ctx,"nThreads"),wallTime,photonsPerSecond,
+           photonsPerSecond/photonsPerSecond1,photonsPerSecond/photonsPerSecond1/nThreads);
+    fflush(stdout);
+    mc_context_destroy(ctx);
+    if(nThreads == maxThreads) break;
+  }
+  double peakMemory = getPeakMemory();
+  if(peakMemory < 0) printf("\n    ], \"peakMemoryMB\": null}");
+  else               printf("\n    ], \"peakMemoryMB\": %.1f}",peakMemory);
+  mc_object_destroy(geometryObject);
+  mc_object_destroy(simulation);
+}
+
+int main(int argc, char *argv[]) {
+  double photonFactor = argc > 1? atof(argv[1]): 1;
+  int maxThreads = argc > 2? atoi(argv[2]): 0;
+  char const *scenarioName = argc > 3? argv[3]: NULL;
+  int iScenario = -1;
+  for(int s=0;s<NSCENARIOS && scenarioName;s++) if(!strcmp(scenarioName,scenarios[s].name)) iScenario = s;
+  bool accuracyOnly = scenarioName && !strcmp(scenarioName,"floatAccumulators");
+  if(argc > 4 || !(photonFactor > 0) || maxThreads < 0 || (scenarioName && iScenario == -1 && !accuracyOnly)) {
+    fprintf(stderr,"Usage:\n  %s [photonFactor [maxThreads [scenarioName]]]\nScenarios:",argv[0]);
+    for(int s=0;s<NSCENARIOS;s++) fprintf(stderr," %s",scenarios[s].name);
+    fprintf(stderr," floatAccumulators\n");
+    return EXIT_FAILURE;
+  }
+  #ifdef _OPENMP
+  if(!maxThreads) maxThreads = omp_get_num_procs();
+  #else
+  maxThreads = 1;
+  #endif
+
+  printf("{\n  \"benchmark\": \"MCmatlab\",\n  \"photonFactor\": %g,\n  \"maxThreads\": %d,\n  \"scenarios\": [",photonFactor,maxThreads);
+  for(int s=0;s<NSCENARIOS && !accuracyOnly;s++) if(iScenario == -1 || s == iScenario) runScenario(&scenarios[s],photonFactor,maxThreads,s == 0 || s == iScenario);
+  printf("\n  ]%s\n",scenarioName && !accuracyOnly? "": ",");
+  if(!scenarioName || accuracyOnly) runAccuracyCheck(photonFactor,maxThreads);
+  printf("}\n");
+  return EXIT_SUCCESS;
+}
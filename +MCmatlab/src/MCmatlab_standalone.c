@@ -0,0 +1,780 @@
+/********************************************
+ *
+ * MCmatlab_standalone.c, in the C programming language
+ * Standalone executable form of the MCmatlab Monte Carlo engine, for distributing a simulation over several processes or computers
+ *
+ * This file is part of MCmatlab.
+ *
+ * MCmatlab is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MCmatlab is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MCmatlab.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * The executable contains the same code as the MCmatlab mex function. Instead of MATLAB arrays, mexFunction is given a model read from a
+ * model file, which runMonteCarlo(model,...,'workers',N) writes with writeModelFile. The model file contains the geometry and the
+ * (fluorescence) Monte Carlo simulation object exactly as they are passed to the mex function. The small part of the MATLAB C API that
+ * MCmatlab.c uses is implemented in this file, and the replacement mex.h is in the standalone folder. On top of that, this file
+ * implements the C interface declared in MCmatlab_api.h, so that the engine can also be compiled into a library for use in other
+ * programs. The executable is a client of that interface.
+ *
+ * Usage:
+ * MCmatlab_standalone worker <modelFile> <resultFile> [streamIndex [nPhotons [nThreads]]]
+ *   Runs the simulation of the model file and writes the outputs to the result file. Workers with different stream indices use
+ *   different random number streams. If nPhotons is given and nonzero, it replaces the model's nPhotonsRequested. If nThreads is given
+ *   and nonzero, that many threads are used. Only the worker with stream index 0 stores example paths and prints progress.
+ * MCmatlab_standalone reduce <resultFile> <workerResultFile1> [<workerResultFile2> ...]
+ *   Combines the result files of several workers into one, as if all photons had been simulated in a single run.
+ * MCmatlab_standalone coordinate <modelFile> <resultFile> <nWorkers>
+ *   Splits the photon budget of the model file into nWorkers jobs, runs them as local worker processes that share the processors, and
+ *   reduces their results into the result file. With a time budget, every worker runs for the full time.
+ * To run on several computers, start one worker with a different stream index on each computer, with the model file and result files
+ * on a shared file system, and combine the result files with reduce.
+ *
+ * The result files contain the normalized outputs and the number of photons launched at each wavelength, from which the combined
+ * result is the photon-weighted mean of the workers' outputs. Since the normalization is linear in the accumulators, this is the same
+ * as adding up the workers' accumulators and normalizing once.
+ *
+ ** COMPILING
+ * On Linux or Mac, in the folder with the example files, run
+ * "gcc -Ofast -fno-finite-math-only -fopenmp -std=c11 -Wall -I./+MCmatlab/src/standalone -o ./+MCmatlab/@model/private/MCmatlab_standalone ./+MCmatlab/src/MCmatlab_standalone.c -lm"
+ * On Windows with MinGW-w64, run
+ * "gcc -Ofast -fno-finite-math-only -fopenmp -std=c11 -Wall -I.\+MCmatlab\src\standalone -o .\+MCmatlab\@model\private\MCmatlab_standalone.exe .\+MCmatlab\src\MCmatlab_standalone.c"
+ * To compile the library instead of the executable, define MCMATLAB_LIBRARY, for example on Linux
+ * "gcc -Ofast -fno-finite-math-only -fopenmp -std=c11 -Wall -fPIC -shared -DMCMATLAB_LIBRARY -I./+MCmatlab/src/standalone -o libMCmatlab.so ./+MCmatlab/src/MCmatlab_standalone.c -lm"
+ * and include MCmatlab_api.h in the program that uses it. To check a build of the library, link MCmatlab_benchmark.c against it with
+ * "gcc -Ofast -fno-finite-math-only -fopenmp -std=c11 -Wall -o MCmatlab_benchmark ./+MCmatlab/src/MCmatlab_benchmark.c -L. -lMCmatlab -lm"
+ * and run "LD_LIBRARY_PATH=. ./MCmatlab_benchmark 0.01 1 homogeneousSlab", which simulates a pencil beam in under a second and prints
+ * its results as JSON.
+ ********************************************/
+
+#define _POSIX_C_SOURCE 200809L // For clock_gettime, fork, execvp and waitpid
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#ifdef _WIN32
+  #include <process.h>
+#else
+  #include <sys/types.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+  #include <omp.h>
+  static int nThreadsOverride = 0; // If nonzero, the number of processors that MCmatlab.c sees, so that local workers share the processors
+  static int getNumProcs(void) {return nThreadsOverride? nThreadsOverride: omp_get_num_procs();}
+  #define omp_get_num_procs getNumProcs
+#endif
+static unsigned long streamIndex = 0;
+#define PRNGSTREAMOFFSET streamIndex
+
+static volatile sig_atomic_t interruptPending = false;
+bool utIsInterruptPending(void) {return interruptPending;}
+
+#include "MCmatlab.c"
+#include "MCmatlab_api.h"
+
+#define MODELFILEVERSION 1
+
+// ============================ MATLAB C API ========================
+// Numeric, logical and char arrays hold their data in the same layout as in MATLAB, except that chars are single bytes. Objects and
+// structs are both stored as a list of named fields; struct arrays and object arrays are represented by their first element.
+struct mxArray_tag {
+  bool isObject;
+  mxClassID classID;
+  mwSize nDims;
+  mwSize *dims;
+  void *data;
+  int nFields;
+  char **fieldNames;
+  mxArray **fieldValues;
+};
+
+static size_t getElementSize(mxClassID classID) {
+  switch(classID) {
+    case mxDOUBLE_CLASS: case mxINT64_CLASS: case mxUINT64_CLASS: return 8;
+    case mxSINGLE_CLASS: case mxINT32_CLASS: case mxUINT32_CLASS: return 4;
+    case mxINT16_CLASS: case mxUINT16_CLASS: return 2;
+    case mxLOGICAL_CLASS: case mxCHAR_CLASS: case mxINT8_CLASS: case mxUINT8_CLASS: return 1;
+    default: mexErrMsgIdAndTxt("MCmatlab:FileError","Error: Unsupported array class %d",(int)classID); return 0;
+  }
+}
+
+mwSize mxGetNumberOfElements(mxArray const *a) {
+  mwSize n = 1;
+  for(mwSize i=0;i<a->nDims;i++) n *= a->dims[i];
+  return n;
+}
+
+static void *allocOrFail(size_t nBytes) {
+  void *p = calloc(max(nBytes,(size_t)1),1);
+  if(!p) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+  return p;
+}
+
+mxArray *mxCreateNumericArray(mwSize ndim, mwSize const *dims, mxClassID classID, mxComplexity flag) {
+  (void)flag;
+  mxArray *a = (mxArray *)allocOrFail(sizeof(mxArray));
+  a->classID = classID;
+  a->nDims = max(ndim,(mwSize)2); // Like in MATLAB, arrays have at least two dimensions
+  a->dims = (mwSize *)allocOrFail(a->nDims*sizeof(mwSize));
+  a->dims[1] = 1;
+  for(mwSize i=0;i<ndim;i++) a->dims[i] = dims[i];
+  a->data = allocOrFail(mxGetNumberOfElements(a)*getElementSize(classID));
+  return a;
+}
+
+mxArray *mxCreateNumericMatrix(mwSize m, mwSize n, mxClassID classID, mxComplexity flag) {
+  mwSize dims[2] = {m,n};
+  return mxCreateNumericArray(2,dims,classID,flag);
+}
+
+mxArray *mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity flag) {return mxCreateNumericMatrix(m,n,mxDOUBLE_CLASS,flag);}
+
+static mxArray *createObject(void) {
+  mxArray *a = (mxArray *)allocOrFail(sizeof(mxArray));
+  a->isObject = true;
+  return a;
+}
+
+mxArray *mxCreateDoubleScalar(double x) {
+  mxArray *a = mxCreateDoubleMatrix(1,1,mxREAL);
+  *mxGetPr(a) = x;
+  return a;
+}
+
+mxArray *mxCreateStructMatrix(mwSize m, mwSize n, int nFields, char const **fieldNames) {
+  (void)m; (void)n;
+  mxArray *a = createObject();
+  for(int i=0;i<nFields;i++) mxSetPropertyShared(a,0,fieldNames[i],mxCreateDoubleMatrix(0,0,mxREAL)); // Unset fields are empty, as in MATLAB
+  return a;
+}
+
+mxArray *mxDuplicateArray(mxArray const *a) {
+  mxArray *b;
+  if(a->isObject) {
+    b = createObject();
+    for(int i=0;i<a->nFields;i++) mxSetPropertyShared(b,0,a->fieldNames[i],mxDuplicateArray(a->fieldValues[i]));
+  } else {
+    b = mxCreateNumericArray(a->nDims,a->dims,a->classID,mxREAL);
+    memcpy(b->data,a->data,mxGetNumberOfElements(a)*getElementSize(a->classID));
+  }
+  return b;
+}
+
+void mxDestroyArray(mxArray *a) {
+  if(!a) return;
+  for(int i=0;i<a->nFields;i++) {
+    free(a->fieldNames[i]);
+    mxDestroyArray(a->fieldValues[i]);
+  }
+  free(a->fieldNames);
+  free(a->fieldValues);
+  free(a->dims);
+  free(a->data);
+  free(a);
+}
+
+static int findField(mxArray const *a, char const *name) {
+  for(int i=0;i<a->nFields;i++) if(!strcmp(a->fieldNames[i],name)) return i;
+  return -1;
+}
+
+mxArray *mxGetField(mxArray const *a, mwIndex index, char const *name) {
+  (void)index;
+  int i = a->isObject? findField(a,name): -1;
+  return i < 0? NULL: a->fieldValues[i];
+}
+
+mxArray *mxGetPropertyShared(mxArray const *a, mwIndex index, char const *name) {
+  mxArray *value = mxGetField(a,index,name);
+  if(!value) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: The model file has no property %s",name);
+  return value;
+}
+
+mxArray *mxGetProperty(mxArray const *a, mwIndex index, char const *name) {
+  return mxGetPropertyShared(a,index,name); // MCmatlab.c never modifies or destroys the copies, so the arrays can be shared
+}
+
+void mxSetPropertyShared(mxArray *a, mwIndex index, char const *name, mxArray const *value) {
+  (void)index;
+  int i = findField(a,name);
+  if(i < 0) {
+    i = a->nFields++;
+    a->fieldNames = (char **)realloc(a->fieldNames,a->nFields*sizeof(char *));
+    a->fieldValues = (mxArray **)realloc(a->fieldValues,a->nFields*sizeof(mxArray *));
+    if(!a->fieldNames || !a->fieldValues) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+    a->fieldNames[i] = (char *)allocOrFail(strlen(name) + 1);
+    strcpy(a->fieldNames[i],name);
+  } else if(a->fieldValues[i] != value) mxDestroyArray(a->fieldValues[i]);
+  a->fieldValues[i] = (mxArray *)value;
+}
+
+void mxSetProperty(mxArray *a, mwIndex index, char const *name, mxArray const *value) {
+  mxSetPropertyShared(a,index,name,mxDuplicateArray(value));
+}
+
+void mxSetField(mxArray *a, mwIndex index, char const *name, mxArray *value) {mxSetPropertyShared(a,index,name,value);}
+
+double *mxGetPr(mxArray const *a) {return (double *)a->data;}
+void *mxGetData(mxArray const *a) {return a->data;}
+mwSize mxGetM(mxArray const *a) {return a->dims? a->dims[0]: 1;}
+mwSize mxGetN(mxArray const *a) {return a->dims? mxGetNumberOfElements(a)/max(a->dims[0],(mwSize)1): 1;}
+mwSize const *mxGetDimensions(mxArray const *a) {return a->dims;}
+bool mxIsSingle(mxArray const *a) {return !a->isObject && a->classID == mxSINGLE_CLASS;}
+bool mxIsLogicalScalarTrue(mxArray const *a) {
+  return !a->isObject && a->classID == mxLOGICAL_CLASS && mxGetNumberOfElements(a) == 1 && *(unsigned char *)a->data;
+}
+
+char *mxArrayToString(mxArray const *a) {
+  size_t n = a->isObject? 0: mxGetNumberOfElements(a);
+  char *s = (char *)allocOrFail(n + 1);
+  memcpy(s,a->data,n);
+  return s;
+}
+
+void mxFree(void *p) {free(p);}
+// The NaN and Inf tests look at the IEEE 754 bits, since -ffinite-math-only (part of -Ofast) lets the compiler fold isnan, isinf and
+// isfinite to constants, and MCmatlab.c uses NaN and Inf as sentinels for unset inputs
+static uint64_t doubleBits(double x) {uint64_t b; memcpy(&b,&x,sizeof b); return b;}
+#define EXPONENTMASK 0x7FF0000000000000ULL
+#define MANTISSAMASK 0x000FFFFFFFFFFFFFULL
+bool mxIsNaN(double x) {uint64_t b = doubleBits(x); return (b & EXPONENTMASK) == EXPONENTMASK && (b & MANTISSAMASK);}
+bool mxIsInf(double x) {uint64_t b = doubleBits(x); return (b & EXPONENTMASK) == EXPONENTMASK && !(b & MANTISSAMASK);}
+bool mxIsFinite(double x) {return (doubleBits(x) & EXPONENTMASK) != EXPONENTMASK;}
+
+static char lastError[1024] = "";
+static jmp_buf *errorJump = NULL; // Set while a function of the C interface is running, to return from it on errors
+
+void mexErrMsgIdAndTxt(char const *id, char const *format, ...) {
+  (void)id;
+  va_list args;
+  va_start(args,format);
+  vsnprintf(lastError,sizeof(lastError),format,args);
+  va_end(args);
+  #ifdef _OPENMP
+  bool inParallel = omp_in_parallel();
+  #else
+  bool inParallel = false;
+  #endif
+  if(errorJump && !inParallel) longjmp(*errorJump,1); // Errors in the simulation threads (running out of memory) cannot be returned from
+  fflush(stdout);
+  fprintf(stderr,"%s\n",lastError);
+  exit(EXIT_FAILURE);
+}
+
+int mexPrintf(char const *format, ...) {
+  va_list args;
+  va_start(args,format);
+  int n = vprintf(format,args);
+  va_end(args);
+  return n;
+}
+
+int mexEvalString(char const *command) {
+  (void)command; // Only used for "drawnow", to show the progress
+  fflush(stdout);
+  return 0;
+}
+
+// ============================ MODEL AND RESULT FILES ========================
+// A file consists of the characters "MCMD", the uint32 file version and the root node. A node starts with a uint8 that is 1 for objects
+// and structs and 0 for arrays. An object continues with the uint32 number of fields and, for each field, the uint32 length of the name,
+// the name and the field's node. An array continues with the uint8 class ID (as in MATLAB's mxClassID), the uint32 number of dimensions,
+// the uint64 dimensions and the data in MATLAB's column-major order. The file is written with the byte order of the computer.
+static void readBytes(FILE *file, char const *fileName, void *data, size_t nBytes) {
+  if(fread(data,1,nBytes,file) != nBytes) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: %s is truncated or is not an MCmatlab model or result file",fileName);
+}
+
+static mxArray *readNode(FILE *file, char const *fileName) {
+  unsigned char isObject;
+  readBytes(file,fileName,&isObject,1);
+  if(isObject) {
+    mxArray *a = createObject();
+    uint32_t nFields;
+    readBytes(file,fileName,&nFields,4);
+    for(uint32_t i=0;i<nFields;i++) {
+      uint32_t nameLength;
+      readBytes(file,fileName,&nameLength,4);
+      char *name = (char *)allocOrFail(nameLength + 1);
+      readBytes(file,fileName,name,nameLength);
+      mxSetPropertyShared(a,0,name,readNode(file,fileName));
+      free(name);
+    }
+    return a;
+  }
+  unsigned char classID;
+  uint32_t nDims;
+  readBytes(file,fileName,&classID,1);
+  readBytes(file,fileName,&nDims,4);
+  mwSize *dims = (mwSize *)allocOrFail(max(nDims,(uint32_t)1)*sizeof(mwSize));
+  for(uint32_t i=0;i<nDims;i++) {
+    uint64_t dim;
+    readBytes(file,fileName,&dim,8);
+    dims[i] = (mwSize)dim;
+  }
+  mxArray *a = mxCreateNumericArray(nDims,dims,(mxClassID)classID,mxREAL);
+  free(dims);
+  readBytes(file,fileName,a->data,mxGetNumberOfElements(a)*getElementSize(a->classID));
+  return a;
+}
+
+static void writeNode(FILE *file, mxArray const *a) {
+  unsigned char isObject = a->isObject;
+  fwrite(&isObject,1,1,file);
+  if(isObject) {
+    uint32_t nFields = (uint32_t)a->nFields;
+    fwrite(&nFields,4,1,file);
+    for(int i=0;i<a->nFields;i++) {
+      uint32_t nameLength = (uint32_t)strlen(a->fieldNames[i]);
+      fwrite(&nameLength,4,1,file);
+      fwrite(a->fieldNames[i],1,nameLength,file);
+      writeNode(file,a->fieldValues[i]);
+    }
+    return;
+  }
+  unsigned char classID = (unsigned char)a->classID;
+  uint32_t nDims = (uint32_t)a->nDims;
+  fwrite(&classID,1,1,file);
+  fwrite(&nDims,4,1,file);
+  for(mwSize i=0;i<a->nDims;i++) {
+    uint64_t dim = a->dims[i];
+    fwrite(&dim,8,1,file);
+  }
+  fwrite(a->data,getElementSize(a->classID),mxGetNumberOfElements(a),file);
+}
+
+static mxArray *readModelFile(char const *fileName) {
+  FILE *file = fopen(fileName,"rb");
+  if(!file) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: Could not open %s for reading",fileName);
+  char magic[4];
+  uint32_t version;
+  readBytes(file,fileName,magic,4);
+  readBytes(file,fileName,&version,4);
+  if(memcmp(magic,"MCMD",4)) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: %s is not an MCmatlab model or result file",fileName);
+  if(version != MODELFILEVERSION) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: Unsupported model file version %u in %s",version,fileName);
+  mxArray *a = readNode(file,fileName);
+  fclose(file);
+  return a;
+}
+
+static void writeModelFile(char const *fileName, mxArray const *a) {
+  FILE *file = fopen(fileName,"wb");
+  if(!file) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: Could not open %s for writing",fileName);
+  uint32_t version = MODELFILEVERSION;
+  fwrite("MCMD",1,4,file);
+  fwrite(&version,4,1,file);
+  writeNode(file,a);
+  if(ferror(file) | fclose(file)) mexErrMsgIdAndTxt("MCmatlab:FileError","Error: Could not write %s",fileName);
+}
+
+// ============================ C INTERFACE ========================
+#define NRESULTARRAYS 14
+static char const *resultArrayNames[NRESULTARRAYS] = {"NFR","image","farField","NI_xpos","NI_xneg","NI_ypos","NI_yneg","NI_zpos","NI_zneg",
+                                                      "jacobian","NFR_rz","NI_zpos_r","NI_zneg_r","NFR_grid"};
+
+struct mcContext {
+  mxArray *model; // The fields G, MC or FMC and simType
+  bool hasRun; // After the first run, the outputs are stored in model and later runs continue the simulation
+  unsigned long streamIndex;
+  int nThreads;
+};
+
+static char const *getSimulationName(mxArray const *model) {
+  return *mxGetPr(mxGetPropertyShared(model,0,"simType")) == 2? "FMC": "MC";
+}
+
+static mxArray *createLogicalScalar(bool x) {
+  mxArray *a = mxCreateNumericMatrix(1,1,mxLOGICAL_CLASS,mxREAL);
+  *(unsigned char *)mxGetData(a) = x;
+  return a;
+}
+
+// Each function of the interface runs its body between BEGINPROTECTED and ENDPROTECTED, so that errors raised with mexErrMsgIdAndTxt
+// return failValue instead of exiting the program
+#define BEGINPROTECTED(failValue) { \
+  jmp_buf jump; \
+  if(setjmp(jump)) {errorJump = NULL; return failValue;} \
+  errorJump = &jump;
+#define ENDPROTECTED errorJump = NULL;}
+
+mcObject *mc_object_create(void) {return createObject();}
+void mc_object_destroy(mcObject *object) {mxDestroyArray(object);}
+char const *mc_last_error(void) {return lastError;}
+void mc_interrupt(void) {interruptPending = true;}
+
+mcObject *mc_object_read(char const *fileName) {
+  mcObject *object;
+  BEGINPROTECTED(NULL)
+  object = readModelFile(fileName);
+  ENDPROTECTED
+  return object;
+}
+
+int mc_object_write(char const *fileName, mcObject const *object) {
+  BEGINPROTECTED(-1)
+  writeModelFile(fileName,object);
+  ENDPROTECTED
+  return 0;
+}
+
+int mc_object_set_array(mcObject *object, char const *name, mcClass classID, int nDims, size_t const *dims, void const *data) {
+  BEGINPROTECTED(-1)
+  if(!object->isObject) mexErrMsgIdAndTxt("MCmatlab:APIError","Error: Cannot set the field %s of an array",name);
+  mxArray *a = mxCreateNumericArray((mwSize)nDims,dims,(mxClassID)classID,mxREAL);
+  memcpy(a->data,data,mxGetNumberOfElements(a)*getElementSize(a->classID));
+  mxSetPropertyShared(object,0,name,a);
+  ENDPROTECTED
+  return 0;
+}
+
+int mc_object_set_double(mcObject *object, char const *name, double value) {
+  size_t dims[2] = {1,1};
+  return mc_object_set_array(object,name,MC_DOUBLE,2,dims,&value);
+}
+
+int mc_object_set_logical(mcObject *object, char const *name, int value) {
+  size_t dims[2] = {1,1};
+  unsigned char x = value != 0;
+  return mc_object_set_array(object,name,MC_LOGICAL,2,dims,&x);
+}
+
+int mc_object_set_string(mcObject *object, char const *name, char const *value) {
+  size_t dims[2] = {1,strlen(value)};
+  return mc_object_set_array(object,name,MC_CHAR,2,dims,value);
+}
+
+int mc_object_set_object(mcObject *object, char const *name, mcObject *child) {
+  BEGINPROTECTED(-1)
+  if(!object->isObject || !child->isObject) mexErrMsgIdAndTxt("MCmatlab:APIError","Error: Cannot set the field %s of an array",name);
+  mxSetPropertyShared(object,0,name,child);
+  ENDPROTECTED
+  return 0;
+}
+
+static mcContext *createContext(mxArray *model) {
+  if(!mxGetField(model,0,"G") || !mxGetField(model,0,getSimulationName(model)))
+    mexErrMsgIdAndTxt("MCmatlab:APIError","Error: The model must contain the geometry G and the simulation %s",getSimulationName(model));
+  mcContext *ctx = (mcContext *)allocOrFail(sizeof(mcContext));
+  ctx->model = model;
+  return ctx;
+}
+
+mcContext *mc_context_create(mcObject const *geometry, mcObject const *simulation, int simType) {
+  mcContext *ctx;
+  BEGINPROTECTED(NULL)
+  mxArray *model = createObject();
+  mxSetPropertyShared(model,0,"simType",mxCreateDoubleScalar(simType));
+  mxSetPropertyShared(model,0,"G",mxDuplicateArray(geometry));
+  mxSetPropertyShared(model,0,getSimulationName(model),mxDuplicateArray(simulation));
+  ctx = createContext(model);
+  ENDPROTECTED
+  return ctx;
+}
+
+mcContext *mc_context_create_from_file(char const *modelFileName) {
+  mcContext *ctx;
+  BEGINPROTECTED(NULL)
+  ctx = createContext(readModelFile(modelFileName));
+  ENDPROTECTED
+  return ctx;
+}
+
+mcObject *mc_context_get_simulation(mcContext *ctx) {
+  return mxGetField(ctx->model,0,getSimulationName(ctx->model));
+}
+
+void mc_context_set_stream(mcContext *ctx, unsigned long stream) {ctx->streamIndex = stream;}
+void mc_context_set_threads(mcContext *ctx, int nThreads) {ctx->nThreads = nThreads;}
+
+static void run(mcContext *ctx, double nPhotons, double simulationTime) {
+  mxArray *MC = mxGetPropertyShared(ctx->model,0,getSimulationName(ctx->model));
+  if(nPhotons > 0) {
+    mxSetPropertyShared(MC,0,"nPhotonsRequested",mxCreateDoubleScalar(nPhotons));
+  } else if(simulationTime > 0) {
+    mxSetPropertyShared(MC,0,"nPhotonsRequested",mxCreateDoubleScalar(NAN));
+    mxSetPropertyShared(MC,0,"simulationTimeRequested",mxCreateDoubleScalar(simulationTime));
+  }
+  if(ctx->hasRun) { // Continuing, which works like runMonteCarlo(model,'continue')
+    char *checkpointFile = mxArrayToString(mxGetPropertyShared(MC,0,"checkpointFile"));
+    bool isCheckpointing = *checkpointFile;
+    mxFree(checkpointFile);
+    if(isCheckpointing) mexErrMsgIdAndTxt("MCmatlab:APIError","Error: Continuing a simulation is not supported together with checkpointing");
+  }
+  streamIndex = ctx->streamIndex;
+  #ifdef _OPENMP
+  nThreadsOverride = ctx->nThreads;
+  if(ctx->nThreads > 0) mxSetPropertyShared(MC,0,"useAllCPUs",createLogicalScalar(true));
+  #endif
+  interruptPending = false;
+
+  mxArray *plhs[1];
+  mxArray *continuePrevious = createLogicalScalar(true), *noResumeFile = mxCreateNumericMatrix(1,0,mxCHAR_CLASS,mxREAL);
+  mxArray const *prhs[4] = {ctx->model,mxGetPropertyShared(ctx->model,0,"simType"),noResumeFile,continuePrevious};
+  mexFunction(1,plhs,ctx->hasRun? 4: 2,prhs);
+  mxDestroyArray(continuePrevious);
+  mxDestroyArray(noResumeFile);
+
+  // The outputs are moved into the model, as runMonteCarlo does. Outputs that were not calculated are empty.
+  mxArray *outputs = plhs[0];
+  mxArray *oldPaths = mxGetField(MC,0,"examplePaths"), *newPaths = mxGetField(outputs,0,"examplePaths");
+  if(ctx->hasRun && mxGetNumberOfElements(newPaths) && oldPaths && mxGetM(oldPaths) == 4) { // The example paths of the earlier runs are kept
+    mxArray *paths = mxCreateDoubleMatrix(4,mxGetN(oldPaths) + mxGetN(newPaths),mxREAL);
+    memcpy(mxGetPr(paths),mxGetPr(oldPaths),4*mxGetN(oldPaths)*sizeof(double));
+    memcpy(mxGetPr(paths) + 4*mxGetN(oldPaths),mxGetPr(newPaths),4*mxGetN(newPaths)*sizeof(double));
+    mxSetField(outputs,0,"examplePaths",paths);
+  }
+  for(int i=0;i<outputs->nFields;i++) {
+    if(!mxGetNumberOfElements(outputs->fieldValues[i])) continue;
+    mxSetPropertyShared(strcmp(outputs->fieldNames[i],"image")? MC: mxGetPropertyShared(MC,0,"LC"),0,outputs->fieldNames[i],outputs->fieldValues[i]);
+    outputs->fieldValues[i] = NULL;
+  }
+  mxDestroyArray(outputs);
+  ctx->hasRun = true;
+}
+
+int mc_run(mcContext *ctx, double nPhotons, double simulationTime) {
+  BEGINPROTECTED(-1)
+  run(ctx,nPhotons,simulationTime);
+  ENDPROTECTED
+  return 0;
+}
+
+static mxArray *getOutput(mcContext const *ctx, char const *name) {
+  if(!ctx->hasRun) return NULL;
+  mxArray *MCout = mxGetPropertyShared(ctx->model,0,getSimulationName(ctx->model));
+  return mxGetField(strcmp(name,"image")? MCout: mxGetPropertyShared(MCout,0,"LC"),0,name);
+}
+
+int mc_get_output(mcContext const *ctx, char const *name, mcOutput *output) {
+  mxArray *a = getOutput(ctx,name);
+  bool isCalculated = a && (mxIsSingle(a) || (!strcmp(name,"examplePaths") && mxGetM(a) == 4)); // Outputs that were not calculated keep their default value
+  if(!isCalculated) {
+    snprintf(lastError,sizeof(lastError),"Error: The output %s has not been calculated",name);
+    return -1;
+  }
+  output->classID = (mcClass)a->classID;
+  output->nDims = (int)a->nDims;
+  output->dims = a->dims;
+  output->data = a->data;
+  return 0;
+}
+
+double mc_get_scalar(mcContext const *ctx, char const *name) {
+  mxArray *a = getOutput(ctx,name);
+  return a && !a->isObject && a->classID == mxDOUBLE_CLASS && mxGetNumberOfElements(a)? *mxGetPr(a): NAN;
+}
+
+int mc_write_results(mcContext const *ctx, char const *resultFileName) {
+  BEGINPROTECTED(-1)
+  if(!ctx->hasRun) mexErrMsgIdAndTxt("MCmatlab:APIError","Error: There are no results before the simulation has run");
+  mxArray *result = createObject();
+  char const *counterNames[] = {"nPhotons","nPhotonsCollected","nPhotonsPerWavelength","simulationTime","nThreads"};
+  for(int k=0;k<5;k++) mxSetProperty(result,0,counterNames[k],getOutput(ctx,counterNames[k]));
+  mcOutput output;
+  for(int k=0;k<NRESULTARRAYS;k++) if(!mc_get_output(ctx,resultArrayNames[k],&output)) mxSetProperty(result,0,resultArrayNames[k],getOutput(ctx,resultArrayNames[k]));
+  if(*mxGetPr(mxGetPropertyShared(mc_context_get_simulation((mcContext *)ctx),0,"nExamplePaths")) && !mc_get_output(ctx,"examplePaths",&output))
+    mxSetProperty(result,0,"examplePaths",getOutput(ctx,"examplePaths"));
+  writeModelFile(resultFileName,result);
+  mxDestroyArray(result);
+  ENDPROTECTED
+  return 0;
+}
+
+void mc_context_destroy(mcContext *ctx) {
+  if(!ctx) return;
+  mxDestroyArray(ctx->model);
+  free(ctx);
+}
+
+// ============================ REDUCTION ========================
+static void reduceResults(char const *resultFileName, int nResults, char const * const *workerResultFileNames) {
+  mxArray **results = (mxArray **)allocOrFail(nResults*sizeof(mxArray *));
+  for(int w=0;w<nResults;w++) results[w] = readModelFile(workerResultFileNames[w]);
+  mxArray *combined = mxDuplicateArray(results[0]);
+  mwSize nL = mxGetNumberOfElements(mxGetPropertyShared(combined,0,"nPhotonsPerWavelength"));
+  double *nPhotonsPerWavelength = mxGetPr(mxGetPropertyShared(combined,0,"nPhotonsPerWavelength"));
+  for(int w=1;w<nResults;w++) {
+    if(mxGetNumberOfElements(mxGetPropertyShared(results[w],0,"nPhotonsPerWavelength")) != nL)
+      mexErrMsgIdAndTxt("MCmatlab:FileError","Error: %s is not a result of the same model as %s",workerResultFileNames[w],workerResultFileNames[0]);
+    for(mwSize iL=0;iL<nL;iL++) nPhotonsPerWavelength[iL] += mxGetPr(mxGetPropertyShared(results[w],0,"nPhotonsPerWavelength"))[iL];
+    *mxGetPr(mxGetPropertyShared(combined,0,"nPhotons")) += *mxGetPr(mxGetPropertyShared(results[w],0,"nPhotons"));
+    *mxGetPr(mxGetPropertyShared(combined,0,"nPhotonsCollected")) += *mxGetPr(mxGetPropertyShared(results[w],0,"nPhotonsCollected"));
+    *mxGetPr(mxGetPropertyShared(combined,0,"nThreads")) += *mxGetPr(mxGetPropertyShared(results[w],0,"nThreads"));
+    double *simulationTime = mxGetPr(mxGetPropertyShared(combined,0,"simulationTime")); // The workers run at the same time
+    *simulationTime = max(*simulationTime,*mxGetPr(mxGetPropertyShared(results[w],0,"simulationTime")));
+  }
+
+  // Each wavelength's outputs are the photon-weighted mean of the workers' outputs
+  for(int k=0;k<NRESULTARRAYS;k++) {
+    mxArray *output = mxGetField(combined,0,resultArrayNames[k]);
+    if(!output) continue;
+    mwSize n = mxGetNumberOfElements(output)/max(nL,(mwSize)1);
+    float *data = (float *)mxGetData(output);
+    for(mwSize iL=0;iL<nL;iL++) {
+      double sum_w = 0;
+      for(int w=0;w<nResults;w++) sum_w += mxGetPr(mxGetPropertyShared(results[w],0,"nPhotonsPerWavelength"))[iL];
+      for(mwSize j=0;j<n;j++) {
+        double sum = 0;
+        for(int w=0;w<nResults;w++) {
+          mxArray *workerOutput = mxGetField(results[w],0,resultArrayNames[k]);
+          if(!workerOutput || mxGetNumberOfElements(workerOutput) != mxGetNumberOfElements(output))
+            mexErrMsgIdAndTxt("MCmatlab:FileError","Error: %s is not a result of the same model as %s",workerResultFileNames[w],workerResultFileNames[0]);
+          double weight = mxGetPr(mxGetPropertyShared(results[w],0,"nPhotonsPerWavelength"))[iL];
+          if(weight) sum += weight*((float *)mxGetData(workerOutput))[j + iL*n];
+        }
+        data[j + iL*n] = sum_w? (float)(sum/sum_w): 0;
+      }
+    }
+  }
+
+  // The example paths of the workers are concatenated
+  mwSize nPathColumns = 0;
+  for(int w=0;w<nResults;w++) if(mxGetField(results[w],0,"examplePaths")) nPathColumns += mxGetN(mxGetField(results[w],0,"examplePaths"));
+  if(nPathColumns) {
+    mxArray *paths = mxCreateDoubleMatrix(4,nPathColumns,mxREAL);
+    mwSize column = 0;
+    for(int w=0;w<nResults;w++) {
+      mxArray *workerPaths = mxGetField(results[w],0,"examplePaths");
+      if(!workerPaths) continue;
+      memcpy(mxGetPr(paths) + 4*column,mxGetPr(workerPaths),4*mxGetN(workerPaths)*sizeof(double));
+      column += mxGetN(workerPaths);
+    }
+    mxSetPropertyShared(combined,0,"examplePaths",paths);
+  }
+
+  writeModelFile(resultFileName,combined);
+  mxDestroyArray(combined);
+  for(int w=0;w<nResults;w++) mxDestroyArray(results[w]);
+  free(results);
+}
+
+int mc_reduce_result_files(char const *resultFileName, int nResults, char const * const *workerResultFileNames) {
+  BEGINPROTECTED(-1)
+  if(nResults < 1) mexErrMsgIdAndTxt("MCmatlab:APIError","Error: There are no result files to combine");
+  reduceResults(resultFileName,nResults,workerResultFileNames);
+  ENDPROTECTED
+  return 0;
+}
+
+#ifndef MCMATLAB_LIBRARY
+// ============================ EXECUTABLE ========================
+static void handleInterrupt(int signal) {(void)signal; mc_interrupt();}
+
+static int runWorker(char const *modelFileName, char const *resultFileName, unsigned long stream, double nPhotons, int nThreads) {
+  mcContext *ctx = mc_context_create_from_file(modelFileName);
+  if(!ctx) return -1;
+  mc_context_set_stream(ctx,stream);
+  mc_context_set_threads(ctx,nThreads);
+  if(stream) { // Only the first worker stores example paths and prints progress
+    mc_object_set_double(mc_context_get_simulation(ctx),"nExamplePaths",0);
+    mc_object_set_logical(mc_context_get_simulation(ctx),"silentMode",true);
+  }
+  int status = mc_run(ctx,nPhotons,0) || mc_write_results(ctx,resultFileName);
+  mc_context_destroy(ctx);
+  return status;
+}
+
+static void coordinate(char const *executable, char const *modelFileName, char const *resultFileName, int nWorkers) {
+  mxArray *model = readModelFile(modelFileName);
+  mxArray *MC = mxGetPropertyShared(model,0,getSimulationName(model));
+  char *checkpointFile = mxArrayToString(mxGetPropertyShared(MC,0,"checkpointFile"));
+  char *collectedPhotonsFile = mxArrayToString(mxGetPropertyShared(mxGetPropertyShared(MC,0,"LC"),0,"collectedPhotonsFile"));
+  if(*checkpointFile || (mxIsLogicalScalarTrue(mxGetPropertyShared(MC,0,"useLightCollector")) && *collectedPhotonsFile))
+    mexErrMsgIdAndTxt("MCmatlab:WorkerError","Error: Checkpointing and collected photons files are not supported with several workers");
+  mxFree(checkpointFile);
+  mxFree(collectedPhotonsFile);
+  double nPhotonsRequested = *mxGetPr(mxGetPropertyShared(MC,0,"nPhotonsRequested")); // NaN for a time budget, in which case all workers run for the full time
+  mxDestroyArray(model);
+
+  #ifdef _OPENMP
+  int nThreads = max(omp_get_num_procs()/nWorkers,1);
+  #else
+  int nThreads = 1;
+  #endif
+  size_t fileNameLength = strlen(resultFileName) + 32;
+  char **workerResultFileNames = (char **)allocOrFail(nWorkers*sizeof(char *));
+  #ifdef _WIN32
+  intptr_t *processes = (intptr_t *)allocOrFail(nWorkers*sizeof(intptr_t));
+  #else
+  pid_t *processes = (pid_t *)allocOrFail(nWorkers*sizeof(pid_t));
+  #endif
+  for(int w=0;w<nWorkers;w++) {
+    workerResultFileNames[w] = (char *)allocOrFail(fileNameLength);
+    snprintf(workerResultFileNames[w],fileNameLength,"%s.worker%d",resultFileName,w);
+    char streamArg[32], nPhotonsArg[32], nThreadsArg[32];
+    snprintf(streamArg,32,"%d",w);
+    snprintf(nPhotonsArg,32,"%.0f",mxIsNaN(nPhotonsRequested)? 0: floor(nPhotonsRequested/nWorkers) + (w < fmod(nPhotonsRequested,nWorkers)));
+    snprintf(nThreadsArg,32,"%d",nThreads);
+    char const *args[] = {executable,"worker",modelFileName,workerResultFileNames[w],streamArg,nPhotonsArg,nThreadsArg,NULL};
+    #ifdef _WIN32
+    processes[w] = _spawnv(_P_NOWAIT,executable,args);
+    if(processes[w] == -1) mexErrMsgIdAndTxt("MCmatlab:WorkerError","Error: Could not start worker %d",w);
+    #else
+    processes[w] = fork();
+    if(processes[w] == -1) mexErrMsgIdAndTxt("MCmatlab:WorkerError","Error: Could not start worker %d",w);
+    if(!processes[w]) {
+      execvp(executable,(char * const *)args);
+      fprintf(stderr,"Error: Could not run %s\n",executable);
+      _exit(EXIT_FAILURE);
+    }
+    #endif
+  }
+
+  // A worker that is interrupted with ctrl+c still writes the outputs of the photons it has simulated, so the coordinator waits for all
+  // workers in any case
+  bool failed = false;
+  for(int w=0;w<nWorkers;w++) {
+    #ifdef _WIN32
+    int status;
+    failed |= _cwait(&status,processes[w],0) == -1 || status != 0;
+    #else
+    int status;
+    while(waitpid(processes[w],&status,0) == -1 && errno == EINTR);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+    #endif
+  }
+  if(failed) mexErrMsgIdAndTxt("MCmatlab:WorkerError","Error: At least one of the workers failed");
+  reduceResults(resultFileName,nWorkers,(char const * const *)workerResultFileNames);
+  for(int w=0;w<nWorkers;w++) {
+    remove(workerResultFileNames[w]);
+    free(workerResultFileNames[w]);
+  }
+  free(workerResultFileNames);
+  free(processes);
+}
+
+int main(int argc, char *argv[]) {
+  signal(SIGINT,handleInterrupt);
+  int status = 0;
+  if(argc >= 4 && argc <= 7 && !strcmp(argv[1],"worker")) {
+    status = runWorker(argv[2],argv[3],argc > 4? strtoul(argv[4],NULL,10): 0,argc > 5? atof(argv[5]): 0,argc > 6? atoi(argv[6]): 0);
+  } else if(argc >= 4 && !strcmp(argv[1],"reduce")) {
+    status = mc_reduce_result_files(argv[2],argc - 3,(char const * const *)argv + 3);
+  } else if(argc == 5 && !strcmp(argv[1],"coordinate") && atoi(argv[4]) > 0) {
+    coordinate(argv[0],argv[2],argv[3],atoi(argv[4]));
+  } else {
+    fprintf(stderr,"Usage:\n"
+                   "  %s worker <modelFile> <resultFile> [streamIndex [nPhotons [nThreads]]]\n"
+                   "  %s reduce <resultFile> <workerResultFile1> [<workerResultFile2> ...]\n"
+                   "  %s coordinate <modelFile> <resultFile> <nWorkers>\n",argv[0],argv[0],argv[0]);
+    return EXIT_FAILURE;
+  }
+  if(status) {
+    fflush(stdout);
+    fprintf(stderr,"%s\n",mc_last_error());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+#endif
@@ -23,15 +23,32 @@ struct geometry { // Struct type for the constant geometry definitions, includin
   FLOATORDBL     d[3];
   long           n[3];
   long           farFieldRes;
+  long           nr; // Number of radial bins of width d[0] in the axisymmetric (r,z) outputs, zero if not calculating them
+  long           gridRes[3]; // Number of bins of the scoring grid along x, y and z, zeros if not calculating NFR_grid
+  FLOATORDBL     gridStart[3]; // Fractional voxel indices of the lower corner of the scoring grid
+  FLOATORDBL     gridStep[3]; // Bin sizes of the scoring grid in units of the voxel sizes
+  long           gridNt; // Number of time bins of the scoring grid, including the bins for the times before gridTStart and after gridTEnd, or 1 if it is not time-resolved
+  FLOATORDBL     gridTStart; // Start time for the interval used for the time-resolved scoring grid
+  FLOATORDBL     gridTEnd; // End time for the interval used for the time-resolved scoring grid
+  long           roiStart[3]; // First voxel index along x, y and z of the region of interest that NFR and the Jacobian are stored in (MC.NFRroi)
+  long           roiSize[3]; // Number of voxels of the region of interest along x, y and z, equal to n if not cropping
+  long           NIstart[6][2]; // For NI_xpos, NI_xneg, NI_ypos, NI_yneg, NI_zpos and NI_zneg, the first indices along the two axes of the uncropped array of the region of interest (MC.NIroi)
+  long           NIsize[6][2]; // Number of elements of the region of interest along the two axes of each NI array, zeros for arrays that are not calculated
+  int            nLC; // Number of light collectors in the light collector array, 0 if not using light collectors
   int            boundaryType;
+  int            mirrorSymmetry; // Bit 0 set: Geometry is mirror symmetric around x = 0, bit 1 set: around y = 0. Only the x >= 0 and/or y >= 0 part of the cuboid is then simulated.
   FLOATORDBL     *muav,*musv,*gv,*RIv;
   unsigned char  *CDFidxv;
   FLOATORDBL     *CDFs;
-  unsigned char  *M;
+  unsigned char  *M; // Media indices, 1-based as in MATLAB
   float          *interfaceNormals;
+  long           *layerStart,*layerEnd; // For each z slice, the z indices of the bottom and top interfaces of the layer it belongs to. NULL unless using the layered fast path.
+  int            nSpectral; // Number of wavelengths whose weights each photon carries in the spectral fast path, 0 unless using the spectral fast path
+  FLOATORDBL     *spectralMuav; // Absorption coefficients of each medium at each of the nSpectral wavelengths, with the wavelength index varying fastest. NULL unless using the spectral fast path.
+  bool           calcTelemetry; // If true, the transport events are counted in P->telemetry (MC.calcTelemetry). Always false on the GPU.
 };
 
-struct source { // Struct type for the constant beam definitions
+struct beam { // Struct type for the constant definitions of one light source
   int            beamType;
   FLOATORDBL     emitterLength;
   FLOATORDBL     *FPIDdist1; // Radial or X
@@ -46,12 +63,23 @@ struct source { // Struct type for the constant beam definitions
   FLOATORDBL     *AIDdist2; // Azimuthal or Y
   long           L_AID2;
   FLOATORDBL     AIDwidth2;
-  FLOATORDBL     *S;
-  FLOATORDBL     power;
   FLOATORDBL     focus[3];
   FLOATORDBL     u[3];
   FLOATORDBL     v[3];
   FLOATORDBL     w[3];
+  FLOATORDBL     aliasProbability; // Alias table entry of this light source, see initLightSourceAliasTable
+  int            alias;
+};
+
+struct source { // Struct type for the constant source definitions
+  int            nLS; // Number of light sources, each launching a share of the photons proportional to its relative power
+  struct beam    beams[MAXLIGHTSOURCES];
+  FLOATORDBL     *S;
+  FLOATORDBL     power;
+  bool           quasiRandomLaunch; // If true, the launch dimensions are drawn from a scrambled Sobol sequence instead of the PRNG
+  bool           clipLightSources; // If true, the light sources are sampled only where they launch photons inside the launch region, see launchPhoton
+  unsigned int   QMCseed; // Seed of the Owen scrambling of the Sobol sequence
+  unsigned int   sobolDirections[NQMCDIMS][32];
 };
 
 struct lightCollector { // Struct type for the constant light collector definitions. It can be either an objective lens (for 0<f<INFINITY) or a fiber tip or simple aperture (for f=INFINITY)
@@ -64,25 +92,59 @@ struct lightCollector { // Struct type for the constant light collector definiti
   long           res[2]; // Resolution of image plane in pixels along the spatial and time axes. For a fiber, spatial resolution is 1.
   FLOATORDBL     tStart; // Start time for the interval used for binned time-resolved detection
   FLOATORDBL     tEnd; // End time for the interval used for binned time-resolved detection
+  FLOATORDBL     basis[3][3]; // Unit vectors along the X, Y and Z axes of the light collector frame (see xyztoXYZ), in the (x,y,z) basis
+  long           imageStart; // Index of the first element of this light collector's image in the image output, which holds the images of all the light collectors after each other
 };
 
+struct depositionCacheEntry { // Entry of a thread's deposition cache, see depositNFR
+  float          *ptr; // Element of the single precision accumulator that the deposit belongs to, or NULL if the entry is unused
+  double         value; // Weight deposited since the entry was last flushed
+};
+
+struct telemetry { // Event counters of the photon transport, see MC.calcTelemetry. Each thread counts in its own photon struct, and the counts are added together when the thread returns.
+  unsigned long long photons; // Photons launched, including those that died at launch
+  unsigned long long steps; // Calls of propagatePhoton
+  unsigned long long boundaryCrossings; // Steps that ended on a voxel boundary (or, in the layered fast path and outside the cuboid, on a step plane)
+  unsigned long long scatterings;
+  unsigned long long refractions;
+  unsigned long long reflections; // Fresnel reflections, not including total internal reflections
+  unsigned long long totalInternalReflections;
+  unsigned long long rouletteKills;
+  unsigned long long rouletteSurvivals;
+  unsigned long long launchRejections; // Photons that were launched outside the launch region and counted, which only happens if source.clipLightSources is true
+  unsigned long long escapes; // Photons that left the cuboid through an absorbing boundary or went beyond the kill range, including those that were collected
+  unsigned long long timeLimitKills; // Photons killed with cyclic boundaries because they had travelled too long, see checkEscape
+  unsigned long long collections; // Photons collected by a light collector
+  unsigned long long recordReallocations; // Enlargements of a photon's deposition record, see P->recordSize
+};
+#define NTELEMETRYCOUNTERS 14
+
 struct photon { // Struct type for parameters describing the thread-specific current state of a photon
   FLOATORDBL     i[3],u[3],D[3]; // Fractional position indices i, ray trajectory unit vector u and distances D to next voxel boundary (yz, xz or xy) along current trajectory
   long           j; // Linear index of current voxel (or closest defined voxel if photon outside cuboid)
   FLOATORDBL     mua,mus,g,RI; // Absorption, scattering, anisotropy, refractive index values and a pointer to the phase function CDF array at current photon position
   unsigned char  CDFidx;
   FLOATORDBL     stepLeft,weight,time;
+  FLOATORDBL     launchWeight; // Weight of the photon at launch, which is less than 1 if only part of the light source could launch it inside the launch region (see launchPhoton)
+  long           rejectedLaunchesInARow; // Number of photons in a row that the thread has launched outside the launch region, used only if source.clipLightSources is true
   bool           insideVolume,alive,sameVoxel;
   PRNG_t         PRNGstate; // "State" of the Mersenne Twister pseudo-random number generator
-  long           recordSize; // Current size of the list of voxels in which power has been deposited, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true
-  long           recordElems; // Current number of elements used of the record. Starts at 0 every photon launch, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true
-  long           *j_record; // List of the indices of the voxels in which the current photon has deposited power, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true
-  FLOATORDBL     *weight_record; // List of the weights that have been deposited into the voxels, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true
+  long           recordSize; // Current size of the list of voxels in which power has been deposited, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true or the Jacobian is calculated
+  long           recordElems; // Current number of elements used of the record. Starts at 0 every photon launch, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true or the Jacobian is calculated
+  long           *j_record; // List of the NFR and Jacobian accumulator indices (see getNFRidx) of the voxels in which the current photon has deposited power, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true or the Jacobian is calculated
+  FLOATORDBL     *weight_record; // List of the weights that have been deposited into the voxels, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true or the Jacobian is calculated
+  FLOATORDBL     *pathlength_record; // List of the pathlengths travelled in the voxels, used only if depositionCriteria.evaluateCriteriaAtEndOfLife is true or the Jacobian is calculated
   unsigned long  scatterings;
   unsigned long  refractions;
   unsigned long  reflections;
   unsigned long  interfaceTransitions;
   char           killed_escaped_collected;
+  FLOATORDBL     *pathlengths; // Partial pathlengths travelled in each of the media, used only if a collected photons file has been requested
+  float          *collectedPhotonsBuffer; // Thread-local buffer of collected photon records waiting to be written to the collected photons file
+  long           collectedPhotonsBufferElems; // Number of records currently in the buffer
+  FLOATORDBL     *spectralWeights; // Weight of the photon at each wavelength, used only in the spectral fast path, in which P->weight is the largest of these
+  struct depositionCacheEntry *depositionCache; // Thread-local double precision partial sums of the NFR deposition, used only if MC.floatAccumulators is true
+  struct telemetry telemetry; // The thread's event counters, counted for all photons that the thread has simulated
 };
 
 struct paths { // Struct type for storing the paths taken by the nExamplePaths first photons simulated by the master thread
@@ -104,12 +166,19 @@ struct MATLABoutputs {
   float * NI_yneg;
   float * NI_zpos;
   float * NI_zneg;
+  float * J;
+  float * NFR_rz;
+  float * NI_zpos_r;
+  float * NI_zneg_r;
+  float * NFR_grid;
 };
 
 struct outputs {
   unsigned long long nPhotons;
   unsigned long long nPhotonsCollected;
+  unsigned long long nLaunches; // Number of launch attempts started, used as the index into the quasi-random launch sequence
   FLOATORDBL * NFR;
+  float *      NFR_float; // Single precision NFR accumulator used instead of NFR if MC.floatAccumulators is true, see depositNFR
   FLOATORDBL * image;
   FLOATORDBL * FF;
   FLOATORDBL * NI_xpos;
@@ -118,6 +187,46 @@ struct outputs {
   FLOATORDBL * NI_yneg;
   FLOATORDBL * NI_zpos;
   FLOATORDBL * NI_zneg;
+  FLOATORDBL * J; // Accumulated products of collected photon weights and voxel pathlengths, from which the Jacobian is calculated
+  FLOATORDBL * NFR_rz; // Fluence accumulated in (r,z) rings around the z axis
+  FLOATORDBL * NI_zpos_r;
+  FLOATORDBL * NI_zneg_r;
+  FLOATORDBL * NFR_grid; // Fluence accumulated in the bins of the scoring grid
+  struct telemetry *telemetry; // The event counters of all threads together, or NULL if MC.calcTelemetry is false. Shared by the outputs of all wavelengths.
+  FILE *       collectedPhotonsFile; // If not NULL, a binary record of every collected photon is appended to this file
+  long         collectedPhotonsRecordSize; // Number of 4-byte elements in each record, COLLECTEDPHOTONRECORDFIXEDSIZE plus one pathlength per medium
+  unsigned long long nCollectedPhotonsRecorded; // Number of records written to the file for the current wavelength
+  bool         launchedInside; // Set when a photon has been launched inside the launch region, used only if source.clipLightSources is true, see runThreads
+};
+
+struct wavelengthScheduler { // Struct type for simulating all wavelengths concurrently on the CPU, with one geometry, source and outputs struct per wavelength
+  int                nL;
+  struct geometry    *G;
+  struct source      *B;
+  struct outputs     *O;
+  unsigned long long *nPhotonsRequested; // Per wavelength, only used if the simulation is not timed
+  double             *timeFractions; // Fraction of the total thread time to spend on each wavelength, only used if the simulation is timed
+  FLOATORDBL         *threadTime; // [us] Thread time spent so far on each wavelength
+};
+
+struct checkpoint { // Struct type for periodically saving the state of the simulation to a file, from which the simulation can be resumed
+  char               *fileName;
+  long long          interval; // [us] Time between checkpoints
+  long long          nextTime; // [us] Time of the next checkpoint. The threads return from threadInitAndLoop at this time, so that a consistent snapshot can be taken.
+  int                nPRNGstates; // Number of threads whose PRNG state is stored in PRNGstates
+  PRNG_t             *PRNGstates; // PRNG state of each thread when it last returned from threadInitAndLoop. The threads continue from these states.
+  char               *buffer; // Serialized snapshot of the state of the simulation, waiting to be written to the file
+  size_t             bufferSize;
+  size_t             bufferElems; // Number of bytes of buffer in use
+  bool               pending; // True if buffer contains a snapshot that has not yet been written
+  bool               writeFailed;
+};
+
+struct checkpointReader { // Struct type for reading back the contents of a checkpoint file when resuming
+  char const         *fileName;
+  char               *data;
+  size_t             size;
+  size_t             pos;
 };
 
 #ifdef __NVCC__ // If compiling for CUDA
@@ -199,6 +308,68 @@ void atomicAddWrapper(FLOATORDBL *ptr, double val) {
   #endif
 }
 
+#ifndef __NVCC__
+void flushDepositionCacheEntry(struct depositionCacheEntry *e) {
+  if(!e->ptr) return;
+  #ifdef _OPENMP
+  #pragma omp atomic
+  #endif
+  *e->ptr += (float)e->value;
+  e->ptr = NULL;
+}
+
+void flushDepositionCache(struct photon *P) {
+  for(long k=0;k<DEPOSITIONCACHESIZE;k++) flushDepositionCacheEntry(&P->depositionCache[k]);
+}
+#endif
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void depositNFR(struct photon *P, struct outputs const *O, long k, double val) {
+  // Adds the weight val to element k of the NFR accumulator. With single precision accumulators, the deposits are first summed in double
+  // precision in the thread's deposition cache, a small direct-mapped table that stays in the CPU cache. An element is only added to the
+  // global array when its cache entry is needed for another element or at the end of the thread's loop. Since most of the deposits in a
+  // voxel then arrive as a few large partial sums instead of many small weights, the rounding of the single precision sums stays far
+  // below the statistical noise, while the accumulator takes half the memory. k is -1 for voxels outside the region of interest.
+  if(k < 0) return;
+  #ifndef __NVCC__
+  if(O->NFR_float) {
+    float *ptr = &O->NFR_float[k];
+    struct depositionCacheEntry *e = &P->depositionCache[((size_t)ptr/sizeof(float)) & (DEPOSITIONCACHESIZE-1)];
+    if(e->ptr != ptr) {
+      flushDepositionCacheEntry(e);
+      e->ptr = ptr;
+      e->value = 0;
+    }
+    e->value += val;
+    return;
+  }
+  #endif
+  atomicAddWrapper(&O->NFR[k],val);
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+unsigned long long atomicFetchAndIncrementULL(unsigned long long * ptr) { // Returns the value before incrementing
+  #ifdef __NVCC__ // If compiling for CUDA
+    return atomicAdd(ptr,1ULL);
+  #else
+    unsigned long long oldval;
+    #if defined(_OPENMP) && _OPENMP >= 201107 // atomic capture is OpenMP 3.1
+    #pragma omp atomic capture
+    oldval = (*ptr)++;
+    #elif defined(_OPENMP)
+    #pragma omp critical(fetchAndIncrement)
+    oldval = (*ptr)++;
+    #else
+    oldval = (*ptr)++;
+    #endif
+    return oldval;
+  #endif
+}
+
 long long getMicroSeconds() {
   #ifdef __GNUC__
   struct timespec time; clock_gettime(CLOCK_MONOTONIC, &time);
@@ -284,6 +455,147 @@ void getNewj(struct geometry const *G, struct photon *P) {
          ((P->i[0] < 0)? 0: ((P->i[0] >= G->n[0])? G->n[0]-1: (long)FLOOR(P->i[0]))); // Index values are restrained to integers in the interval [0,n-1]
 }
 
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+long getRadialIndex(struct geometry const *G, FLOATORDBL ix, FLOATORDBL iy) {
+  // Returns the index of the radial bin that the point with fractional x and y indices ix and iy falls in, or -1 if it is outside the outermost bin
+  long ir = (long)SQRT(SQR(ix - G->n[0]/2.0f) + SQR((iy - G->n[1]/2.0f)*G->d[1]/G->d[0]));
+  return ir < G->nr? ir: -1;
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+FLOATORDBL getStepPlane(struct geometry const *G, struct photon const *P, int idx) {
+  // Returns the fractional index of the next plane along dimension idx at which a step has to be stopped when stepsToPlanes is true,
+  // or +-INFINITY if there is none. These are the layer interfaces in z, the cuboid boundaries and the boundaries of the kill range.
+  FLOATORDBL i = P->i[idx];
+  FLOATORDBL n = (FLOATORDBL)G->n[idx];
+  if(idx == 2 && i >= 0 && i < n) return P->u[2] > 0? G->layerEnd[(long)i]: G->layerStart[(long)i];
+  FLOATORDBL lo = -(KILLRANGE-1)/2.0f*n, hi = (KILLRANGE+1)/2.0f*n;
+  if(P->u[idx] > 0) return i <  lo? lo: i <  0? 0: i <  n? n: i <  hi? hi:  INFINITY;
+  else              return i >= hi? hi: i >= n? n: i >= 0? 0: i >= lo? lo: -INFINITY;
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+bool stepsToPlanes(struct geometry const *G, struct photon const *P, int idx) {
+  // Whether steps along dimension idx are only stopped at the planes given by getStepPlane rather than at every voxel boundary. This is
+  // the case in the layered fast path, and with boundaryType 0 or 2 along a dimension in which the photon is outside the cuboid: Outside,
+  // the media are extruded from the closest boundary voxels (see getNewj), so they do not change across voxel boundaries along idx.
+  return G->layerStart || ((G->boundaryType == 0 || G->boundaryType == 2) && (P->i[idx] < 0 || P->i[idx] >= G->n[idx]));
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+FLOATORDBL getBoundaryDistance(struct photon const *P, struct geometry const *G, int idx) {
+  // Distance along the photon trajectory to the next voxel boundary (or plane given by getStepPlane) along dimension idx
+  if(!P->u[idx]) return INFINITY;
+  if(stepsToPlanes(G,P,idx)) return (getStepPlane(G,P,idx) - P->i[idx])*G->d[idx]/P->u[idx];
+  return (FLOOR(P->i[idx]) + (P->u[idx]>0) - P->i[idx])*G->d[idx]/P->u[idx];
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__ __host__
+#endif
+long getNFRidx(struct geometry const *G, long j) {
+  // Returns the index in the NFR accumulation array that voxel j is scored in, or -1 if voxel j is outside the region of interest. With
+  // mirror symmetry, only the simulated half or quadrant of the cuboid is stored and voxels in the other parts are mapped onto their
+  // mirror images. The region of interest is not used with mirror symmetry, which is checked in MATLAB.
+  long ix = j%G->n[0], iy = j/G->n[0]%G->n[1], iz = j/(G->n[0]*G->n[1]);
+  if(!G->mirrorSymmetry) {
+    ix -= G->roiStart[0];
+    iy -= G->roiStart[1];
+    iz -= G->roiStart[2];
+    if(ix < 0 || ix >= G->roiSize[0] || iy < 0 || iy >= G->roiSize[1] || iz < 0 || iz >= G->roiSize[2]) return -1;
+    return ix + G->roiSize[0]*(iy + G->roiSize[1]*iz);
+  }
+  long nx = G->n[0], ny = G->n[1];
+  if(G->mirrorSymmetry & 1) {
+    ix = (ix < G->n[0]/2? G->n[0] - 1 - ix: ix) - G->n[0]/2;
+    nx = G->n[0]/2;
+  }
+  if(G->mirrorSymmetry & 2) {
+    iy = (iy < G->n[1]/2? G->n[1] - 1 - iy: iy) - G->n[1]/2;
+    ny = G->n[1]/2;
+  }
+  return ix + nx*(iy + ny*iz);
+}
+
+long getNFRlength(struct geometry const *G) {
+  if(!G->mirrorSymmetry) return G->roiSize[0]*G->roiSize[1]*G->roiSize[2];
+  return ((G->mirrorSymmetry & 1)? G->n[0]/2: G->n[0])*((G->mirrorSymmetry & 2)? G->n[1]/2: G->n[1])*G->n[2];
+}
+
+long getROIlength(struct geometry const *G) { // Number of elements of the returned NFR and Jacobian arrays
+  return G->roiSize[0]*G->roiSize[1]*G->roiSize[2];
+}
+
+long getROIvoxel(struct geometry const *G, long k) { // Linear index in the cuboid of element k of the returned NFR and Jacobian arrays
+  return G->roiStart[0] + k%G->roiSize[0] + G->n[0]*(G->roiStart[1] + k/G->roiSize[0]%G->roiSize[1] + G->n[1]*(G->roiStart[2] + k/(G->roiSize[0]*G->roiSize[1])));
+}
+
+long getNIlength(struct geometry const *G, int iNI) { // Number of elements of NI array iNI, in the order NI_xpos, NI_xneg, NI_ypos, NI_yneg, NI_zpos, NI_zneg
+  return G->NIsize[iNI][0]*G->NIsize[iNI][1];
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void addToNI(FLOATORDBL *NI, struct geometry const * const G, int iNI, long i1, long i2, FLOATORDBL weight) {
+  // Adds weight to the element of NI array iNI that has the indices i1 and i2 in the uncropped array, if it is in the region of interest
+  i1 -= G->NIstart[iNI][0];
+  i2 -= G->NIstart[iNI][1];
+  if(i1 >= 0 && i1 < G->NIsize[iNI][0] && i2 >= 0 && i2 < G->NIsize[iNI][1]) atomicAddWrapper(&NI[i1 + G->NIsize[iNI][0]*i2],weight);
+}
+
+long getImageLength(struct geometry const *G, struct lightCollector const *LC) { // Number of elements of the images of all the light collectors together
+  return G->nLC? LC[G->nLC-1].imageStart + LC[G->nLC-1].res[0]*LC[G->nLC-1].res[0]*LC[G->nLC-1].res[1]: 0;
+}
+
+long getGridLength(struct geometry const *G) {
+  return G->gridRes[0]*G->gridRes[1]*G->gridRes[2]*G->gridNt;
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+long getGridIndex(struct geometry const * const G, FLOATORDBL const *iPos, FLOATORDBL time) {
+  // Returns the index of the scoring grid bin that contains the point with fractional voxel indices iPos at the given time, or -1 if the
+  // point is outside the scoring grid. As for the light collector, the first and last time bins collect all earlier and later times.
+  long ig = 0, stride = 1;
+  for(int k=0;k<3;k++) {
+    FLOATORDBL b = (iPos[k] - G->gridStart[k])/G->gridStep[k];
+    if(b < 0 || b >= G->gridRes[k]) return -1;
+    ig += stride*(long)b;
+    stride *= G->gridRes[k];
+  }
+  if(G->gridNt > 1) ig += stride*min(G->gridNt-1,max(0L,(long)(1+(G->gridNt-2)*(time - G->gridTStart)/(G->gridTEnd - G->gridTStart))));
+  return ig;
+}
+
+double getNFRaccumulator(struct outputs const *O, long k) { // Element k of the NFR accumulator, which is in single precision if MC.floatAccumulators is true
+  return O->NFR? O->NFR[k]: O->NFR_float[k];
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+bool foldIntoSimulatedPart(struct photon * const P, struct geometry const * const G) {
+  // If the photon is on the non-simulated side of a symmetry plane, it is replaced by its mirror image. Returns true if that happened.
+  bool folded = false;
+  for(int idx=0;idx<2;idx++) if(((G->mirrorSymmetry >> idx) & 1) && P->i[idx] < G->n[idx]/2.0f) {
+    P->i[idx] = G->n[idx] - P->i[idx];
+    P->u[idx] = -P->u[idx];
+    P->D[idx] = getBoundaryDistance(P,G,idx); // Recalculate voxel boundary distance
+    folded = true;
+  }
+  return folded;
+}
+
 #ifdef __NVCC__ // If compiling for CUDA
 void createDeviceStructs(struct geometry const *G, struct geometry **G_devptr,
                          struct source const *B, struct source **B_devptr,
@@ -322,9 +634,9 @@ void createDeviceStructs(struct geometry const *G, struct geometry **G_devptr,
   gpuErrchk(cudaMalloc(DC_devptr, sizeof(struct depositionCriteria)));
   gpuErrchk(cudaMemcpy(*DC_devptr,DC,sizeof(struct depositionCriteria),cudaMemcpyHostToDevice));
 
-  // Allocate and copy lightCollector struct
-  gpuErrchk(cudaMalloc(LC_devptr, sizeof(struct lightCollector)));
-  gpuErrchk(cudaMemcpy(*LC_devptr,LC,sizeof(struct lightCollector),cudaMemcpyHostToDevice));
+  // Allocate and copy lightCollector structs
+  gpuErrchk(cudaMalloc(LC_devptr, max(G->nLC,1)*sizeof(struct lightCollector)));
+  gpuErrchk(cudaMemcpy(*LC_devptr,LC,G->nLC*sizeof(struct lightCollector),cudaMemcpyHostToDevice));
 
   // Allocate and copy paths struct
   struct paths Pa_tempvar = *Pa;
@@ -336,40 +648,60 @@ void createDeviceStructs(struct geometry const *G, struct geometry **G_devptr,
   struct outputs O_tempvar = *O;
   // Note in the following that memset and cudaMemset is for integers (really, signed chars) and only works here because four signed char zeros after each other have the same bit representation as a double- or single-precision floating point zero
   if(O->NFR) {
-    gpuErrchk(cudaMalloc(&O_tempvar.NFR, L*sizeof(double)));
-    gpuErrchk(cudaMemset(O_tempvar.NFR,0,L*sizeof(double)));
+    gpuErrchk(cudaMalloc(&O_tempvar.NFR, getNFRlength(G)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NFR,0,getNFRlength(G)*sizeof(double)));
   }
   if(O->image) {
-    gpuErrchk(cudaMalloc(&O_tempvar.image, LC->res[0]*LC->res[0]*LC->res[1]*sizeof(double)));
-    gpuErrchk(cudaMemset(O_tempvar.image,0,LC->res[0]*LC->res[0]*LC->res[1]*sizeof(double)));
+    gpuErrchk(cudaMalloc(&O_tempvar.image, getImageLength(G,LC)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.image,0,getImageLength(G,LC)*sizeof(double)));
   }
   if(O->FF) {
     gpuErrchk(cudaMalloc(&O_tempvar.FF, G->farFieldRes*G->farFieldRes*sizeof(double)));
     gpuErrchk(cudaMemset(O_tempvar.FF,0,G->farFieldRes*G->farFieldRes*sizeof(double)));
   }
   if(O->NI_xpos) {
-    gpuErrchk(cudaMalloc(&O_tempvar.NI_xpos, G->n[1]*G->n[2]*sizeof(double)));
-    gpuErrchk(cudaMemset(O_tempvar.NI_xpos,0,G->n[1]*G->n[2]*sizeof(double)));
+    gpuErrchk(cudaMalloc(&O_tempvar.NI_xpos, getNIlength(G,0)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NI_xpos,0,getNIlength(G,0)*sizeof(double)));
   }
   if(O->NI_xneg) {
-    gpuErrchk(cudaMalloc(&O_tempvar.NI_xneg, G->n[1]*G->n[2]*sizeof(double)));
-    gpuErrchk(cudaMemset(O_tempvar.NI_xneg,0,G->n[1]*G->n[2]*sizeof(double)));
+    gpuErrchk(cudaMalloc(&O_tempvar.NI_xneg, getNIlength(G,1)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NI_xneg,0,getNIlength(G,1)*sizeof(double)));
   }
   if(O->NI_ypos) {
-    gpuErrchk(cudaMalloc(&O_tempvar.NI_ypos, G->n[0]*G->n[2]*sizeof(double)));
-    gpuErrchk(cudaMemset(O_tempvar.NI_ypos,0,G->n[0]*G->n[2]*sizeof(double)));
+    gpuErrchk(cudaMalloc(&O_tempvar.NI_ypos, getNIlength(G,2)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NI_ypos,0,getNIlength(G,2)*sizeof(double)));
   }
   if(O->NI_yneg) {
-    gpuErrchk(cudaMalloc(&O_tempvar.NI_yneg, G->n[0]*G->n[2]*sizeof(double)));
-    gpuErrchk(cudaMemset(O_tempvar.NI_yneg,0,G->n[0]*G->n[2]*sizeof(double)));
+    gpuErrchk(cudaMalloc(&O_tempvar.NI_yneg, getNIlength(G,3)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NI_yneg,0,getNIlength(G,3)*sizeof(double)));
   }
   if(O->NI_zpos) {
-    gpuErrchk(cudaMalloc(&O_tempvar.NI_zpos, G->n[0]*G->n[1]*sizeof(double)));
-    gpuErrchk(cudaMemset(O_tempvar.NI_zpos,0,G->n[0]*G->n[1]*sizeof(double)));
+    gpuErrchk(cudaMalloc(&O_tempvar.NI_zpos, getNIlength(G,4)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NI_zpos,0,getNIlength(G,4)*sizeof(double)));
   }
   if(O->NI_zneg) {
-    gpuErrchk(cudaMalloc(&O_tempvar.NI_zneg, (G->boundaryType == 2? KILLRANGE*KILLRANGE: 1)*G->n[0]*G->n[1]*sizeof(double)));
-    gpuErrchk(cudaMemset(O_tempvar.NI_zneg,0,(G->boundaryType == 2? KILLRANGE*KILLRANGE: 1)*G->n[0]*G->n[1]*sizeof(double)));
+    gpuErrchk(cudaMalloc(&O_tempvar.NI_zneg, getNIlength(G,5)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NI_zneg,0,getNIlength(G,5)*sizeof(double)));
+  }
+  if(O->J) {
+    gpuErrchk(cudaMalloc(&O_tempvar.J, getROIlength(G)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.J,0,getROIlength(G)*sizeof(double)));
+  }
+  if(O->NFR_rz) {
+    gpuErrchk(cudaMalloc(&O_tempvar.NFR_rz, G->nr*G->n[2]*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NFR_rz,0,G->nr*G->n[2]*sizeof(double)));
+  }
+  if(O->NI_zpos_r) {
+    gpuErrchk(cudaMalloc(&O_tempvar.NI_zpos_r, G->nr*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NI_zpos_r,0,G->nr*sizeof(double)));
+  }
+  if(O->NI_zneg_r) {
+    gpuErrchk(cudaMalloc(&O_tempvar.NI_zneg_r, G->nr*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NI_zneg_r,0,G->nr*sizeof(double)));
+  }
+  if(O->NFR_grid) {
+    gpuErrchk(cudaMalloc(&O_tempvar.NFR_grid, getGridLength(G)*sizeof(double)));
+    gpuErrchk(cudaMemset(O_tempvar.NFR_grid,0,getGridLength(G)*sizeof(double)));
   }
   gpuErrchk(cudaMalloc(O_devptr, sizeof(struct outputs)));
   gpuErrchk(cudaMemcpy(*O_devptr,&O_tempvar,sizeof(struct outputs),cudaMemcpyHostToDevice));
@@ -416,12 +748,13 @@ void retrieveAndFreeDeviceStructs(struct geometry const *G, struct geometry *G_d
   struct outputs O_temp; gpuErrchk(cudaMemcpy(&O_temp, O_dev, sizeof(struct outputs),cudaMemcpyDeviceToHost));
   O->nPhotons = O_temp.nPhotons;
   O->nPhotonsCollected = O_temp.nPhotonsCollected;
+  O->nLaunches = O_temp.nLaunches;
   if(O->NFR) {
-    gpuErrchk(cudaMemcpy(O->NFR, O_temp.NFR, L*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaMemcpy(O->NFR, O_temp.NFR, getNFRlength(G)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
     gpuErrchk(cudaFree(O_temp.NFR));
   }
   if(O->image) {
-    gpuErrchk(cudaMemcpy(O->image, O_temp.image, LC->res[0]*LC->res[0]*LC->res[1]*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaMemcpy(O->image, O_temp.image, getImageLength(G,LC)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
     gpuErrchk(cudaFree(O_temp.image));
   }
   if(O->FF) {
@@ -429,29 +762,49 @@ void retrieveAndFreeDeviceStructs(struct geometry const *G, struct geometry *G_d
     gpuErrchk(cudaFree(O_temp.FF));
   }
   if(O->NI_xpos) {
-    gpuErrchk(cudaMemcpy(O->NI_xpos, O_temp.NI_xpos, G->n[1]*G->n[2]*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaMemcpy(O->NI_xpos, O_temp.NI_xpos, getNIlength(G,0)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
     gpuErrchk(cudaFree(O_temp.NI_xpos));
   }
   if(O->NI_xneg) {
-    gpuErrchk(cudaMemcpy(O->NI_xneg, O_temp.NI_xneg, G->n[1]*G->n[2]*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaMemcpy(O->NI_xneg, O_temp.NI_xneg, getNIlength(G,1)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
     gpuErrchk(cudaFree(O_temp.NI_xneg));
   }
   if(O->NI_ypos) {
-    gpuErrchk(cudaMemcpy(O->NI_ypos, O_temp.NI_ypos, G->n[0]*G->n[2]*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaMemcpy(O->NI_ypos, O_temp.NI_ypos, getNIlength(G,2)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
     gpuErrchk(cudaFree(O_temp.NI_ypos));
   }
   if(O->NI_yneg) {
-    gpuErrchk(cudaMemcpy(O->NI_yneg, O_temp.NI_yneg, G->n[0]*G->n[2]*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaMemcpy(O->NI_yneg, O_temp.NI_yneg, getNIlength(G,3)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
     gpuErrchk(cudaFree(O_temp.NI_yneg));
   }
   if(O->NI_zpos) {
-    gpuErrchk(cudaMemcpy(O->NI_zpos, O_temp.NI_zpos, G->n[0]*G->n[1]*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaMemcpy(O->NI_zpos, O_temp.NI_zpos, getNIlength(G,4)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
     gpuErrchk(cudaFree(O_temp.NI_zpos));
   }
   if(O->NI_zneg) {
-    gpuErrchk(cudaMemcpy(O->NI_zneg, O_temp.NI_zneg, (G->boundaryType == 2? KILLRANGE*KILLRANGE: 1)*G->n[0]*G->n[1]*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaMemcpy(O->NI_zneg, O_temp.NI_zneg, getNIlength(G,5)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
     gpuErrchk(cudaFree(O_temp.NI_zneg));
   }
+  if(O->J) {
+    gpuErrchk(cudaMemcpy(O->J, O_temp.J, getROIlength(G)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaFree(O_temp.J));
+  }
+  if(O->NFR_rz) {
+    gpuErrchk(cudaMemcpy(O->NFR_rz, O_temp.NFR_rz, G->nr*G->n[2]*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaFree(O_temp.NFR_rz));
+  }
+  if(O->NI_zpos_r) {
+    gpuErrchk(cudaMemcpy(O->NI_zpos_r, O_temp.NI_zpos_r, G->nr*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaFree(O_temp.NI_zpos_r));
+  }
+  if(O->NI_zneg_r) {
+    gpuErrchk(cudaMemcpy(O->NI_zneg_r, O_temp.NI_zneg_r, G->nr*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaFree(O_temp.NI_zneg_r));
+  }
+  if(O->NFR_grid) {
+    gpuErrchk(cudaMemcpy(O->NFR_grid, O_temp.NFR_grid, getGridLength(G)*sizeof(FLOATORDBL),cudaMemcpyDeviceToHost));
+    gpuErrchk(cudaFree(O_temp.NFR_grid));
+  }
   gpuErrchk(cudaFree(O_dev));
   
   gpuErrchk(cudaMemcpy(D, D_dev, sizeof(struct debug),cudaMemcpyDeviceToHost));
@@ -513,176 +866,536 @@ void updatePaths(struct photon * const P, struct paths * const Pa, struct geomet
   }
 }
 
+void initSobolDirections(struct source *B) {
+  // Direction numbers of the first NQMCDIMS dimensions of the Sobol sequence, from S. Joe and F. Y. Kuo, "Constructing Sobol
+  // sequences with better two-dimensional projections", SIAM J. Sci. Comput. 30, 2635 (2008). Dimension 0 is the van der Corput sequence.
+  unsigned int const s[NQMCDIMS]    = {0,1,2,3,3,4,4,5};
+  unsigned int const a[NQMCDIMS]    = {0,0,1,1,2,1,4,2};
+  unsigned int const m[NQMCDIMS][5] = {{0},{1},{1,3},{1,3,1},{1,1,1},{1,1,3,3},{1,3,5,13},{1,1,5,5,17}};
+  for(int b=0;b<32;b++) B->sobolDirections[0][b] = 1u << (31-b);
+  for(int d=1;d<NQMCDIMS;d++) {
+    for(unsigned int b=0;b<32;b++) {
+      if(b < s[d]) {
+        B->sobolDirections[d][b] = m[d][b] << (31-b);
+      } else {
+        unsigned int V = B->sobolDirections[d][b-s[d]] ^ (B->sobolDirections[d][b-s[d]] >> s[d]);
+        for(unsigned int k=1;k<s[d];k++) if((a[d] >> (s[d]-1-k)) & 1) V ^= B->sobolDirections[d][b-k];
+        B->sobolDirections[d][b] = V;
+      }
+    }
+  }
+}
+
+void initLightSourceAliasTable(struct source *B, double const *relativePowers) {
+  // Walker's alias method, with the table built as described by M. D. Vose, "A linear algorithm for generating random numbers with a
+  // given distribution", IEEE Trans. Softw. Eng. 17, 972 (1991). launchPhoton draws a uniformly distributed light source index iLS and
+  // keeps it with probability beams[iLS].aliasProbability or otherwise uses beams[iLS].alias instead, which picks each light source with
+  // probability proportional to its relative power in constant time.
+  int small[MAXLIGHTSOURCES],large[MAXLIGHTSOURCES];
+  int nSmall = 0, nLarge = 0;
+  double q[MAXLIGHTSOURCES];
+  double totalPower = 0;
+  for(int iLS=0;iLS<B->nLS;iLS++) totalPower += relativePowers[iLS];
+  for(int iLS=0;iLS<B->nLS;iLS++) {
+    q[iLS] = relativePowers[iLS]*B->nLS/totalPower;
+    if(q[iLS] < 1) small[nSmall++] = iLS;
+    else           large[nLarge++] = iLS;
+  }
+  while(nSmall && nLarge) {
+    int iSmall = small[--nSmall];
+    int iLarge = large[--nLarge];
+    B->beams[iSmall].aliasProbability = (FLOATORDBL)q[iSmall];
+    B->beams[iSmall].alias = iLarge;
+    q[iLarge] -= 1 - q[iSmall];
+    if(q[iLarge] < 1) small[nSmall++] = iLarge;
+    else              large[nLarge++] = iLarge;
+  }
+  while(nLarge) {
+    int iLarge = large[--nLarge];
+    B->beams[iLarge].aliasProbability = 1;
+    B->beams[iLarge].alias = iLarge;
+  }
+  while(nSmall) { // Only reached because of rounding errors, for light sources whose q should have been 1
+    int iSmall = small[--nSmall];
+    B->beams[iSmall].aliasProbability = 1;
+    B->beams[iSmall].alias = iSmall;
+  }
+}
+
 #ifdef __NVCC__ // If compiling for CUDA
 __device__
 #endif
-void launchPhoton(struct photon * const P, struct source const * const B, struct geometry const * const G, struct paths * const Pa, struct depositionCriteria *DC, bool * abortingPtr, struct debug * D) {
-  FLOATORDBL X,Y,r,phi,tanphiX,tanphiY,costheta,sintheta;
+unsigned int reverseBits(unsigned int x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+  x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+unsigned int laineKarrasPermutation(unsigned int x, unsigned int seed) { // Hash that only lets each bit be affected by less significant bits
+  x += seed;
+  x ^= x*0x6c50b47cu;
+  x ^= x*0xb82f1e52u;
+  x ^= x*0xc7afe638u;
+  x ^= x*0x8d22f6e6u;
+  return x;
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void getScrambledSobolPoint(struct source const * const B, unsigned long long index, FLOATORDBL *q) {
+  // Fills q with the index'th point of the NQMCDIMS-dimensional Sobol sequence, Owen scrambled with the hash-based nested uniform
+  // scramble of B. Burley, "Practical hash-based Owen scrambling", JCGT 9, 1 (2020). Each dimension has its own scramble seed, so the
+  // points are randomized between simulations while keeping their stratification. Values are in (0,1], like RandomNum.
+  unsigned int i = (unsigned int)index; // The sequence repeats after 2^32 points, but with different scrambling of every repetition
+  unsigned int seedOffset = laineKarrasPermutation((unsigned int)(index >> 32),B->QMCseed);
+  for(int d=0;d<NQMCDIMS;d++) {
+    unsigned int x = 0;
+    for(int b=0;b<32;b++) if((i >> b) & 1) x ^= B->sobolDirections[d][b];
+    x = reverseBits(laineKarrasPermutation(reverseBits(x),laineKarrasPermutation((unsigned int)d,seedOffset)));
+    q[d] = (FLOATORDBL)((x + 1.0)/4294967296.0);
+  }
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void getLaunchRegion(struct geometry const * const G, int idx, FLOATORDBL *lo, FLOATORDBL *hi) {
+  // Range [*lo,*hi) of voxel coordinate idx in which photons may be launched, which is where they are allowed to propagate (see the end
+  // of launchPhoton)
+  bool cuboid = G->boundaryType == 1 || G->boundaryType == 3;
+  *lo = (cuboid || (idx == 2 && G->boundaryType == 2))? 0: G->n[idx]*(1 - KILLRANGE)/2.0f;
+  *hi = cuboid? G->n[idx]: G->n[idx]*(1 + KILLRANGE)/2.0f;
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void clipToLaunchRegion(struct geometry const * const G, FLOATORDBL const a[3], FLOATORDBL const b[3], int nDims, FLOATORDBL *sMin, FLOATORDBL *sMax) {
+  // Narrows [*sMin,*sMax] to the values of s for which the voxel coordinates a + s*b are inside the region in which photons may be
+  // launched in the first nDims dimensions. An empty interval is returned as *sMin > *sMax.
+  for(int idx=0;idx<nDims;idx++) {
+    FLOATORDBL lo,hi;
+    getLaunchRegion(G,idx,&lo,&hi);
+    if(b[idx]) {
+      FLOATORDBL s1 = (lo - a[idx])/b[idx], s2 = (hi - a[idx])/b[idx];
+      *sMin = max(*sMin,min(s1,s2));
+      *sMax = min(*sMax,max(s1,s2));
+    } else if(a[idx] < lo || a[idx] >= hi) {
+      *sMin = INFINITY;
+      *sMax = -INFINITY;
+    }
+  }
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void clipRayToLaunchRegion(struct geometry const * const G, FLOATORDBL const c[3], FLOATORDBL const e[3], FLOATORDBL const u[3], FLOATORDBL *sMin, FLOATORDBL *sMax) {
+  // Narrows [*sMin,*sMax] to the values of s for which the ray with direction u through the target point c + s*e crosses the z = 0
+  // surface inside the launch region
+  FLOATORDBL a[3],b[3];
+  for(int idx=0;idx<2;idx++) {
+    a[idx] = (c[idx] - c[2]*u[idx]/u[2])/G->d[idx] + G->n[idx]/2.0f;
+    b[idx] = (e[idx] - e[2]*u[idx]/u[2])/G->d[idx];
+  }
+  clipToLaunchRegion(G,a,b,2,sMin,sMax);
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void clipFocalPlaneToLaunchRegion(struct geometry const * const G, FLOATORDBL const c[3], FLOATORDBL const e1[3], FLOATORDBL const e2[3], FLOATORDBL const u[3], FLOATORDBL tMin, FLOATORDBL tMax, FLOATORDBL *sMin, FLOATORDBL *sMax) {
+  // Narrows [*sMin,*sMax] to the values of s for which there is a t in [tMin,tMax] such that the ray with direction u through the target
+  // point c + s*e1 + t*e2 crosses the z = 0 surface inside the launch region. The constraints alpha*s + beta*t <= gamma on the launch point
+  // and on t are combined pairwise to eliminate t (Fourier-Motzkin elimination).
+  FLOATORDBL alpha[6],beta[6],gamma[6];
+  int nC = 0;
+  for(int idx=0;idx<2;idx++) {
+    FLOATORDBL lo,hi;
+    getLaunchRegion(G,idx,&lo,&hi);
+    FLOATORDBL a  = (c[idx]  - c[2]*u[idx]/u[2])/G->d[idx] + G->n[idx]/2.0f; // Voxel coordinate of the launch point is a + s*b1 + t*b2
+    FLOATORDBL b1 = (e1[idx] - e1[2]*u[idx]/u[2])/G->d[idx];
+    FLOATORDBL b2 = (e2[idx] - e2[2]*u[idx]/u[2])/G->d[idx];
+    alpha[nC] = -b1; beta[nC] = -b2; gamma[nC++] = a - lo;
+    alpha[nC] =  b1; beta[nC] =  b2; gamma[nC++] = hi - a;
+  }
+  if(tMax <  INFINITY) {alpha[nC] = 0; beta[nC] =  1; gamma[nC++] =  tMax;}
+  if(tMin > -INFINITY) {alpha[nC] = 0; beta[nC] = -1; gamma[nC++] = -tMin;}
+  for(int i=0;i<nC;i++) for(int k=0;k<nC;k++) {
+    FLOATORDBL A,Gamma; // The constraint A*s <= Gamma
+    if(!beta[i]) { // Constraints without t bound s directly
+      if(k) continue;
+      A = alpha[i];
+      Gamma = gamma[i];
+    } else if(beta[i] > 0 && beta[k] < 0) { // An upper and a lower bound on t together bound s
+      A = beta[i]*alpha[k] - beta[k]*alpha[i];
+      Gamma = beta[i]*gamma[k] - beta[k]*gamma[i];
+    } else continue;
+    if(A > 0) *sMax = min(*sMax,Gamma/A);
+    else if(A < 0) *sMin = max(*sMin,Gamma/A);
+    else if(Gamma < 0) {*sMin = INFINITY; *sMax = -INFINITY;}
+  }
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+FLOATORDBL getLaunchAngleRange(struct geometry const * const G, FLOATORDBL const c[3], FLOATORDBL const e1[3], FLOATORDBL const e2[3], FLOATORDBL const u[3], FLOATORDBL *psiMin) {
+  // Finds the range of angles psi for which the ray with direction u through some target point c + r*(cos(psi)*e1 + sin(psi)*e2), r >= 0,
+  // crosses the z = 0 surface inside the launch region. Returns the size of the range as a fraction of 2*pi and sets *psiMin to its start.
+  // Since the launch region maps to a parallelogram in the focal plane, the range is the angle it subtends as seen from c, or all angles
+  // if c is inside it.
+  FLOATORDBL a[2],b1[2],b2[2],lo[2],hi[2];
+  bool inside = true;
+  *psiMin = 0;
+  for(int idx=0;idx<2;idx++) {
+    getLaunchRegion(G,idx,&lo[idx],&hi[idx]);
+    a[idx]  = (c[idx]  - c[2]*u[idx]/u[2])/G->d[idx] + G->n[idx]/2.0f;
+    b1[idx] = (e1[idx] - e1[2]*u[idx]/u[2])/G->d[idx];
+    b2[idx] = (e2[idx] - e2[2]*u[idx]/u[2])/G->d[idx];
+    inside = inside && a[idx] >= lo[idx] && a[idx] < hi[idx];
+  }
+  FLOATORDBL det = b1[0]*b2[1] - b1[1]*b2[0];
+  if(inside || !det) return 1;
+  FLOATORDBL X[4],Y[4],Xsum = 0,Ysum = 0;
+  for(int iC=0;iC<4;iC++) { // Corners of the parallelogram in focal plane coordinates
+    FLOATORDBL dx = ((iC & 1)? hi[0]: lo[0]) - a[0], dy = ((iC & 2)? hi[1]: lo[1]) - a[1];
+    X[iC] = (dx*b2[1] - dy*b2[0])/det;
+    Y[iC] = (dy*b1[0] - dx*b1[1])/det;
+    Xsum += X[iC];
+    Ysum += Y[iC];
+  }
+  FLOATORDBL psiCenter = ATAN2(Ysum,Xsum), dpsiMin = 0, dpsiMax = 0;
+  for(int iC=0;iC<4;iC++) {
+    FLOATORDBL dpsi = ATAN2(Y[iC],X[iC]) - psiCenter;
+    if(dpsi > PI) dpsi -= 2*PI;
+    else if(dpsi < -PI) dpsi += 2*PI;
+    dpsiMin = min(dpsiMin,dpsi);
+    dpsiMax = max(dpsiMax,dpsi);
+  }
+  *psiMin = psiCenter + dpsiMin;
+  return (dpsiMax - dpsiMin)/(2*PI);
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+FLOATORDBL inverseNormalCDF(FLOATORDBL p) {
+  // Quantile function of the standard normal distribution. P. J. Acklam's rational approximation, relative error below 1.2e-9
+  if(p < 0.02425f || p > 1 - 0.02425f) {
+    FLOATORDBL t = SQRT(-2*LOG(p < 0.5f? p: 1 - p));
+    FLOATORDBL x = (((((-7.784894002430293e-03f*t - 3.223964580411365e-01f)*t - 2.400758277161838e+00f)*t - 2.549732539343734e+00f)*t + 4.374664141464968e+00f)*t + 2.938163982698783e+00f)/
+                   ((((7.784695709041462e-03f*t + 3.224671290700398e-01f)*t + 2.445134137142996e+00f)*t + 3.754408661907416e+00f)*t + 1);
+    return p < 0.5f? x: -x;
+  }
+  FLOATORDBL t = p - 0.5f, r = t*t;
+  return (((((-3.969683028665376e+01f*r + 2.209460984245205e+02f)*r - 2.759285104469687e+02f)*r + 1.383577518672690e+02f)*r - 3.066479806614716e+01f)*r + 2.506628277459239e+00f)*t/
+         (((((-5.447609879822406e+01f*r + 1.615858368580409e+02f)*r - 1.556989798598866e+02f)*r + 6.680131188771972e+01f)*r - 1.328068155288572e+01f)*r + 1);
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+FLOATORDBL getCustomDistCDF(FLOATORDBL x, long L, FLOATORDBL const *D) {
+  // Cumulative probability at x, in units of the bins, of a custom distribution with the L-element CDF D, which is uniform within each bin
+  if(x <= 0) return 0;
+  if(x >= L-1) return 1;
+  long k = (long)x;
+  return D[k] + (x - k)*(D[k+1] - D[k]);
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+FLOATORDBL sampleClippedCustomDist(FLOATORDBL U1, FLOATORDBL U2, long L, FLOATORDBL *D, FLOATORDBL xMin, FLOATORDBL xMax, FLOATORDBL *q) {
+  // Samples x, in units of the bins, from the custom distribution with the L-element CDF D restricted to [xMin,xMax], using the uniform
+  // random numbers U1 (to choose the bin) and U2 (for the position within it). *q is set to the probability of the interval.
+  FLOATORDBL Fmin = getCustomDistCDF(xMin,L,D), Fmax = getCustomDistCDF(xMax,L,D);
+  *q = xMin <= xMax? Fmax - Fmin: 0;
+  FLOATORDBL U = min(Fmin + U1*(*q),Fmax);
+  if(!(*q > 0) || !(U > 0)) {*q = 0; return 0;}
+  long j = binaryTreeSearch(U,L-1,D);
+  FLOATORDBL xl = max((FLOATORDBL)j,xMin), xh = min((FLOATORDBL)(j+1),xMax);
+  return xl + U2*(xh - xl);
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+FLOATORDBL sampleClippedRadius(FLOATORDBL width, FLOATORDBL *dist, long L, FLOATORDBL U1, FLOATORDBL U2, FLOATORDBL rMin, FLOATORDBL rMax, FLOATORDBL *q) {
+  // Samples the focal plane radius of a radial beam (or of the LG01 beam, if dist is NULL) from the beam's distribution restricted to
+  // [rMin,rMax], by inverse transform sampling of the uniform random numbers U1 (and U2 for custom distributions) over the part of
+  // their range that maps into the interval. *q is set to the probability of the interval. If the interval contains the whole beam, the
+  // radius is the same as without the restriction.
+  if(!width) {*q = rMin <= 0 && rMax >= 0; return 0;}
+  rMin = max(rMin,(FLOATORDBL)0);
+  if(rMin > rMax) {*q = 0; return 0;}
+  FLOATORDBL Umin,Umax,U;
+  if(!dist) { // LG01, U decreases with r
+    FLOATORDBL tMin = SQR(1.50087f*rMin/width), tMax = SQR(1.50087f*rMax/width);
+    Umin = tMax < 1e4f? (1 + 2*tMax)*EXP(-2*tMax): 0;
+    Umax = (1 + 2*tMin)*EXP(-2*tMin);
+  } else if(*dist == -1) { // Top-hat, U increases with r
+    Umin = min(SQR(rMin/width),(FLOATORDBL)1);
+    Umax = min(SQR(rMax/width),(FLOATORDBL)1);
+  } else if(*dist == -2) { // Gaussian, U decreases with r
+    Umin = EXP(-2*SQR(rMax/width));
+    Umax = EXP(-2*SQR(rMin/width));
+  } else { // Custom
+    return width*sampleClippedCustomDist(U1,U2,L,dist,rMin/width*(L-1),rMax/width*(L-1),q)/(L-1);
+  }
+  *q = Umax - Umin;
+  U = Umin + U1*(*q);
+  if(!(*q > 0) || !(U > 0)) {*q = 0; return 0;}
+  if(!dist) return width*SQRT(((FLOATORDBL)gsl_sf_lambert_Wm1(-U*EXP(-1.0f))+1)/(-2))/1.50087f;
+  else if(*dist == -1) return width*SQRT(U);
+  else return width*SQRT(-0.5f*LOG(U));
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+FLOATORDBL sampleClippedCoordinate(FLOATORDBL width, FLOATORDBL *dist, long L, FLOATORDBL U1, FLOATORDBL U2, FLOATORDBL sMin, FLOATORDBL sMax, FLOATORDBL *q) {
+  // Samples the X or Y focal plane coordinate of an X/Y beam from its distribution restricted to [sMin,sMax], like sampleClippedRadius
+  if(!width) {*q = sMin <= 0 && sMax >= 0; return 0;}
+  if(sMin > sMax) {*q = 0; return 0;}
+  if(*dist == -1) { // Top-hat
+    FLOATORDBL Umin = min(max((sMin/width + 1)/2,(FLOATORDBL)0),(FLOATORDBL)1);
+    FLOATORDBL Umax = min(max((sMax/width + 1)/2,(FLOATORDBL)0),(FLOATORDBL)1);
+    *q = Umax - Umin;
+    return width*((Umin + U1*(*q))*2-1);
+  } else if(*dist == -2) { // Gaussian with standard deviation width/2
+    FLOATORDBL zMin = 2*sMin/width, zMax = 2*sMax/width;
+    bool mirrored = zMin > 0; // Intervals in the upper tail are sampled as their mirror images in the lower tail, where the CDF is more accurate
+    if(mirrored) {
+      FLOATORDBL z = zMin;
+      zMin = -zMax;
+      zMax = -z;
+    }
+    FLOATORDBL Fmin = ERFC(-zMin*(FLOATORDBL)0.7071067811865475)/2;
+    *q = (zMax > 0? 1 - ERFC(zMax*(FLOATORDBL)0.7071067811865475)/2: ERFC(-zMax*(FLOATORDBL)0.7071067811865475)/2) - Fmin;
+    if(*q == 1) return width*SQRT(-0.5f*LOG(U1))*COS(2*PI*U2); // Box-Muller transform
+    if(!(*q > 0)) {*q = 0; return 0;}
+    FLOATORDBL z = min(max(inverseNormalCDF(Fmin + U1*(*q)),zMin),zMax);
+    return width*(mirrored? -z: z)/2;
+  } else { // Custom
+    return width*(sampleClippedCustomDist(U1,U2,L,dist,(sMin/width + 1)/2*(L-1),(sMax/width + 1)/2*(L-1),q)/(L-1)*2-1);
+  }
+}
+
+#define LAUNCHRANDOM(k) (B->quasiRandomLaunch && !launchAttempts? q[k]: RandomNum) // The first launch attempt uses the quasi-random point, retries use the PRNG
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+bool launchPhoton(struct photon * const P, struct source const * const B, struct geometry const * const G, struct paths * const Pa, struct depositionCriteria *DC, bool * abortingPtr, unsigned long long * nLaunchesPtr, struct debug * D) {
+  // Launches a photon, returning false if the light source cannot launch photons inside the region in which they are allowed to travel.
+  // Photons launched outside that region are launched again. If B->clipLightSources is true, the beams are instead sampled only in the
+  // part of their focal plane distribution (or, for line sources, of the emitter) that gives launch points inside it, and the photon
+  // weight is set to the probability of that part. Such photons are counted as launched even if their weight is zero.
+  FLOATORDBL X,Y,r,phi,tanphiX,tanphiY,costheta,sintheta,U0,U1,U2=0,U3,U4=0,sMin,sMax,a[3],b[3],clippedProbability;
   long   j,idx;
-  FLOATORDBL target[3]={0},w0[3];
+  FLOATORDBL target[3]={0},w0[3],w1[3];
   
   P->sameVoxel = false;
-  P->weight = 1;
   P->recordElems = 0;
   P->killed_escaped_collected = 0; // Default state to killed
   long launchAttempts = 0;
+  FLOATORDBL q[NQMCDIMS]; // Quasi-random point for this photon
+  if(B->quasiRandomLaunch) getScrambledSobolPoint(B,atomicFetchAndIncrementULL(nLaunchesPtr),q);
+  struct beam const *LS = B->beams; // The light source that launches this photon
+  if(B->nLS > 1) { // Pick the light source with the alias table, see initLightSourceAliasTable
+    FLOATORDBL x = RandomNum*B->nLS;
+    int iLS = min((int)x,B->nLS - 1);
+    LS += x - iLS < B->beams[iLS].aliasProbability? iLS: B->beams[iLS].alias;
+  }
   do{
+    P->weight = 1;
     if(B->S) { // If a 3D source distribution was defined
       // ... then search the cumulative distribution function via binary tree method to find the voxel to start the photon in
-      j = binaryTreeSearch(RandomNum,G->n[0]*G->n[1]*G->n[2],B->S);
-      P->i[0] = j%G->n[0]         + 1 - RandomNum;
-      P->i[1] = j/G->n[0]%G->n[1] + 1 - RandomNum;
-      P->i[2] = j/G->n[0]/G->n[1] + 1 - RandomNum;
-      costheta = 1 - 2*RandomNum;
+      j = binaryTreeSearch(LAUNCHRANDOM(0),G->n[0]*G->n[1]*G->n[2],B->S);
+      P->i[0] = j%G->n[0]         + 1 - LAUNCHRANDOM(1);
+      P->i[1] = j/G->n[0]%G->n[1] + 1 - LAUNCHRANDOM(2);
+      P->i[2] = j/G->n[0]/G->n[1] + 1 - LAUNCHRANDOM(3);
+      costheta = 1 - 2*LAUNCHRANDOM(4);
       sintheta = SQRT(1 - costheta*costheta);
-      phi = 2*PI*RandomNum;
+      phi = 2*PI*LAUNCHRANDOM(5);
       P->u[0] = sintheta*COS(phi);
       P->u[1] = sintheta*SIN(phi);
       P->u[2] = costheta;
       getNewj(G,P);
-      P->RI = G->RIv[G->M[P->j]]; // Set the refractive index
+      P->RI = G->RIv[G->M[P->j] - 1]; // Set the refractive index
       P->time = 0;
-    } else switch (B->beamType) {
+    } else switch (LS->beamType) {
       case 0: // pencil beam
-        P->i[0] = (B->focus[0] - B->focus[2]*B->u[0]/B->u[2])/G->d[0] + G->n[0]/2.0f;
-        P->i[1] = (B->focus[1] - B->focus[2]*B->u[1]/B->u[2])/G->d[1] + G->n[1]/2.0f;
+        P->i[0] = (LS->focus[0] - LS->focus[2]*LS->u[0]/LS->u[2])/G->d[0] + G->n[0]/2.0f;
+        P->i[1] = (LS->focus[1] - LS->focus[2]*LS->u[1]/LS->u[2])/G->d[1] + G->n[1]/2.0f;
         P->i[2] = 0;
-        for(idx=0;idx<3;idx++) P->u[idx] = B->u[idx];
+        for(idx=0;idx<3;idx++) P->u[idx] = LS->u[idx];
         getNewj(G,P);
-        P->RI = G->RIv[G->M[P->j]]; // Set the refractive index
-        P->time = -P->RI/C*SQRT(SQR((P->i[0] - G->n[0]/2.0f)*G->d[0] - B->focus[0]) +
-                                SQR((P->i[1] - G->n[1]/2.0f)*G->d[1] - B->focus[1]) +
-                                SQR((P->i[2]               )*G->d[2] - B->focus[2])); // Starting time is set so that the wave crosses the focal plane at time = 0
+        P->RI = G->RIv[G->M[P->j] - 1]; // Set the refractive index
+        P->time = -P->RI/C*SQRT(SQR((P->i[0] - G->n[0]/2.0f)*G->d[0] - LS->focus[0]) +
+                                SQR((P->i[1] - G->n[1]/2.0f)*G->d[1] - LS->focus[1]) +
+                                SQR((P->i[2]               )*G->d[2] - LS->focus[2])); // Starting time is set so that the wave crosses the focal plane at time = 0
         break;
       case 1: // isotropically emitting point source
-        r = RandomNum;
-        P->i[0] = (B->focus[0] + B->u[0]*(r-0.5)*B->emitterLength)/G->d[0] + G->n[0]/2.0f;
-        P->i[1] = (B->focus[1] + B->u[1]*(r-0.5)*B->emitterLength)/G->d[1] + G->n[1]/2.0f;
-        P->i[2] = (B->focus[2] + B->u[2]*(r-0.5)*B->emitterLength)/G->d[2];
-        costheta = 1 - 2*RandomNum;
+        for(idx=0;idx<3;idx++) { // Voxel coordinates of the emitter are a + r*b for r in [0,1]
+          a[idx] = (LS->focus[idx] - 0.5f*LS->u[idx]*LS->emitterLength)/G->d[idx] + (idx < 2? G->n[idx]/2.0f: 0);
+          b[idx] = LS->u[idx]*LS->emitterLength/G->d[idx];
+        }
+        sMin = 0;
+        sMax = 1;
+        if(B->clipLightSources) clipToLaunchRegion(G,a,b,3,&sMin,&sMax);
+        P->weight = max(sMax - sMin,(FLOATORDBL)0); // Fraction of the emitter that is inside the launch region
+        r = sMin + LAUNCHRANDOM(0)*P->weight;
+        P->i[0] = (LS->focus[0] + LS->u[0]*(r-0.5)*LS->emitterLength)/G->d[0] + G->n[0]/2.0f;
+        P->i[1] = (LS->focus[1] + LS->u[1]*(r-0.5)*LS->emitterLength)/G->d[1] + G->n[1]/2.0f;
+        P->i[2] = (LS->focus[2] + LS->u[2]*(r-0.5)*LS->emitterLength)/G->d[2];
+        costheta = 1 - 2*LAUNCHRANDOM(1);
         sintheta = SQRT(1 - costheta*costheta);
-        phi = 2*PI*RandomNum;
+        phi = 2*PI*LAUNCHRANDOM(2);
         P->u[0] = sintheta*COS(phi);
         P->u[1] = sintheta*SIN(phi);
         P->u[2] = costheta;
         getNewj(G,P);
-        P->RI = G->RIv[G->M[P->j]]; // Set the refractive index
+        P->RI = G->RIv[G->M[P->j] - 1]; // Set the refractive index
         P->time = 0;
         break;
       case 2: // infinite plane wave
-        P->i[0] = ((G->boundaryType==1 || G->boundaryType==3)? 1: KILLRANGE)*G->n[0]*(RandomNum-0.5f) + G->n[0]/2.0f; // Generates a random ix coordinate within the cuboid
-        P->i[1] = ((G->boundaryType==1 || G->boundaryType==3)? 1: KILLRANGE)*G->n[1]*(RandomNum-0.5f) + G->n[1]/2.0f; // Generates a random iy coordinate within the cuboid
+        P->i[0] = ((G->boundaryType==1 || G->boundaryType==3)? 1: KILLRANGE)*G->n[0]*(LAUNCHRANDOM(0)-0.5f) + G->n[0]/2.0f; // Generates a random ix coordinate within the launch region
+        P->i[1] = ((G->boundaryType==1 || G->boundaryType==3)? 1: KILLRANGE)*G->n[1]*(LAUNCHRANDOM(1)-0.5f) + G->n[1]/2.0f; // Generates a random iy coordinate within the launch region
         P->i[2] = 0;
-        for(idx=0;idx<3;idx++) P->u[idx] = B->u[idx];
+        for(idx=0;idx<3;idx++) P->u[idx] = LS->u[idx];
         getNewj(G,P);
-        P->RI = G->RIv[G->M[P->j]]; // Set the refractive index
-        P->time = P->RI/C*((P->i[0] - G->n[0]/2.0f)*G->d[0]*B->u[0] +
-                           (P->i[1] - G->n[1]/2.0f)*G->d[1]*B->u[1] +
-                           (P->i[2]               )*G->d[2]*B->u[2]); // Starting time is set so that the wave crosses (x=0,y=0,z=0) at time = 0
+        P->RI = G->RIv[G->M[P->j] - 1]; // Set the refractive index
+        P->time = P->RI/C*((P->i[0] - G->n[0]/2.0f)*G->d[0]*LS->u[0] +
+                           (P->i[1] - G->n[1]/2.0f)*G->d[1]*LS->u[1] +
+                           (P->i[2]               )*G->d[2]*LS->u[2]); // Starting time is set so that the wave crosses (x=0,y=0,z=0) at time = 0
         break;
       case 3: // Laguerre-Gaussian LG01 beam
-        phi     = RandomNum*2*PI;
-        axisrotate(B->v,B->u,phi,w0); // w0 unit vector now points in the direction from focus center point to ray target point
-        r    = B->FPIDwidth1*SQRT(((FLOATORDBL)gsl_sf_lambert_Wm1(-RandomNum*EXP(-1.0f))+1)/(-2))/1.50087f; // for target calculation
-        for(idx=0;idx<3;idx++) target[idx] = B->focus[idx] + r*w0[idx];
-        phi     = B->AIDwidth1*SQRT(((FLOATORDBL)gsl_sf_lambert_Wm1(-RandomNum*EXP(-1.0f))+1)/(-2))/1.50087f; // for trajectory calculation. The sqrt is valid within paraxial approximation.
-        axisrotate(B->u,w0,phi,P->u); // ray propagation direction is found by rotating beam center axis an angle phi around w0
+        phi     = LAUNCHRANDOM(0)*2*PI;
+        axisrotate(LS->v,LS->u,phi,w0); // w0 unit vector now points in the direction from focus center point to ray target point
+        U1      = LAUNCHRANDOM(1); // for target calculation, once the ray direction is known
+        phi     = LS->AIDwidth1*SQRT(((FLOATORDBL)gsl_sf_lambert_Wm1(-LAUNCHRANDOM(2)*EXP(-1.0f))+1)/(-2))/1.50087f; // for trajectory calculation. The sqrt is valid within paraxial approximation.
+        axisrotate(LS->u,w0,phi,P->u); // ray propagation direction is found by rotating beam center axis an angle phi around w0
+        sMin = -INFINITY;
+        sMax = INFINITY;
+        if(B->clipLightSources) clipRayToLaunchRegion(G,LS->focus,w0,P->u,&sMin,&sMax);
+        r = sampleClippedRadius(LS->FPIDwidth1,NULL,0,U1,0,sMin,sMax,&P->weight);
+        for(idx=0;idx<3;idx++) target[idx] = LS->focus[idx] + r*w0[idx];
         P->i[0] = (target[0] - target[2]*P->u[0]/P->u[2])/G->d[0] + G->n[0]/2.0f; // the coordinates for the ray starting point is the intersection of the ray with the z = 0 surface
         P->i[1] = (target[1] - target[2]*P->u[1]/P->u[2])/G->d[1] + G->n[1]/2.0f;
         P->i[2] = 0;
         getNewj(G,P);
-        P->RI = G->RIv[G->M[P->j]]; // Set the refractive index
+        P->RI = G->RIv[G->M[P->j] - 1]; // Set the refractive index
         P->time = -P->RI/C*SQRT(SQR((P->i[0] - G->n[0]/2.0f)*G->d[0] - target[0]) +
                                 SQR((P->i[1] - G->n[1]/2.0f)*G->d[1] - target[1]) +
                                 SQR((P->i[2]               )*G->d[2] - target[2])); // Starting time is set so that the wave crosses the focal plane at time = 0
         break;
       case 4: // Radial
-        // Near Field
-        axisrotate(B->v,B->u,RandomNum*2*PI,w0); // w0 unit vector now points in the direction from focus center point to ray target point
-        if(*B->FPIDdist1 == -1) { // Top-hat radial distribution
-          r = B->FPIDwidth1*SQRT(RandomNum); // for target calculation
-        } else if(*B->FPIDdist1 == -2) { // Gaussian radial distribution
-          r = B->FPIDwidth1*SQRT(-0.5f*LOG(RandomNum)); // for target calculation
-        } else { // Custom distribution
-          r = B->FPIDwidth1*(binaryTreeSearch(RandomNum,B->L_FPID1-1,B->FPIDdist1)+RandomNum)/(B->L_FPID1-1);
-        }
-        for(idx=0;idx<3;idx++) target[idx] = B->focus[idx] + r*w0[idx];
-        
+        // Near Field, for target calculation once the ray direction is known
+        U0 = LAUNCHRANDOM(0);
+        U1 = LAUNCHRANDOM(1);
+        if(*LS->FPIDdist1 != -1 && *LS->FPIDdist1 != -2) U2 = LAUNCHRANDOM(2); // Custom distribution
+      
         // Far Field
-        axisrotate(B->v,B->u,RandomNum*2*PI,w0); // w0 unit vector is now normal to both beam center axis and to ray propagation direction. Angle from v0 to w0 is phi.
-
-        if(*B->AIDdist1 == -1) { // Top-hat radial distribution
-          phi = ATAN(TAN(B->AIDwidth1)*SQRT(RandomNum)); // for trajectory calculation. The sqrt is valid within paraxial approximation.
-        } else if(*B->AIDdist1 == -2) { // Gaussian radial distribution
-          phi = ATAN(TAN(B->AIDwidth1)*SQRT(-0.5f*LOG(RandomNum))); // for trajectory calculation. The sqrt is valid within paraxial approximation.
-        } else if(*B->AIDdist1 == -3) { // Lambertian
-          phi = ASIN(SQRT(RandomNum));
+        axisrotate(LS->v,LS->u,LAUNCHRANDOM(3)*2*PI,w0); // w0 unit vector is now normal to both beam center axis and to ray propagation direction. Angle from v0 to w0 is phi.
+
+        if(*LS->AIDdist1 == -1) { // Top-hat radial distribution
+          phi = ATAN(TAN(LS->AIDwidth1)*SQRT(LAUNCHRANDOM(4))); // for trajectory calculation. The sqrt is valid within paraxial approximation.
+        } else if(*LS->AIDdist1 == -2) { // Gaussian radial distribution
+          phi = ATAN(TAN(LS->AIDwidth1)*SQRT(-0.5f*LOG(LAUNCHRANDOM(4)))); // for trajectory calculation. The sqrt is valid within paraxial approximation.
+        } else if(*LS->AIDdist1 == -3) { // Lambertian
+          phi = ASIN(SQRT(LAUNCHRANDOM(4)));
         } else { // Custom distribution
-          phi = ATAN(TAN(B->AIDwidth1)*(binaryTreeSearch(RandomNum,B->L_AID1-1,B->AIDdist1)+RandomNum)/(B->L_AID1-1));
+          phi = ATAN(TAN(LS->AIDwidth1)*(binaryTreeSearch(LAUNCHRANDOM(4),LS->L_AID1-1,LS->AIDdist1)+LAUNCHRANDOM(5))/(LS->L_AID1-1));
         }
-        axisrotate(B->u,w0,phi,P->u); // ray propagation direction is found by rotating beam center axis an angle phi around w0
-        
+        axisrotate(LS->u,w0,phi,P->u); // ray propagation direction is found by rotating beam center axis an angle phi around w0
+
+        // With clipLightSources, the target point is sampled at the angles and radii that give launch points inside the launch region
+        for(idx=0;idx<3;idx++) w1[idx] = LS->u[(idx+1)%3]*LS->v[(idx+2)%3] - LS->u[(idx+2)%3]*LS->v[(idx+1)%3]; // w1 = u x v is the direction that v is rotated into at an angle of pi/2
+        if(B->clipLightSources) P->weight = getLaunchAngleRange(G,LS->focus,LS->v,w1,P->u,&phi);
+        else phi = 0;
+        axisrotate(LS->v,LS->u,phi + U0*P->weight*2*PI,w1); // w1 unit vector now points in the direction from focus center point to ray target point
+        sMin = -INFINITY;
+        sMax = INFINITY;
+        if(B->clipLightSources) clipRayToLaunchRegion(G,LS->focus,w1,P->u,&sMin,&sMax);
+        r = sampleClippedRadius(LS->FPIDwidth1,LS->FPIDdist1,LS->L_FPID1,U1,U2,sMin,sMax,&clippedProbability);
+        P->weight *= clippedProbability;
+        for(idx=0;idx<3;idx++) target[idx] = LS->focus[idx] + r*w1[idx];
+      
         P->i[0] = (target[0] - target[2]*P->u[0]/P->u[2])/G->d[0] + G->n[0]/2.0f; // the coordinates for the ray starting point is the intersection of the ray with the z = 0 surface
         P->i[1] = (target[1] - target[2]*P->u[1]/P->u[2])/G->d[1] + G->n[1]/2.0f;
         P->i[2] = 0;
         getNewj(G,P);
-        P->RI = G->RIv[G->M[P->j]]; // Set the refractive index
+        P->RI = G->RIv[G->M[P->j] - 1]; // Set the refractive index
         P->time = -P->RI/C*SQRT(SQR((P->i[0] - G->n[0]/2.0f)*G->d[0] - target[0]) +
                                 SQR((P->i[1] - G->n[1]/2.0f)*G->d[1] - target[1]) +
                                 SQR((P->i[2]               )*G->d[2] - target[2])); // Starting time is set so that the wave crosses the focal plane at time = 0
         break;
       case 5: // X/Y
-        // Near Field
-        if(*B->FPIDdist1 == -1) { // Top-hat X distribution
-          X = B->FPIDwidth1*(RandomNum*2-1); // for target calculation
-        } else if(*B->FPIDdist1 == -2) { // Gaussian X distribution
-          X = B->FPIDwidth1*SQRT(-0.5f*LOG(RandomNum))*COS(2*PI*RandomNum); // Box-Muller transform, for target calculation
-        } else { // Custom X distribution
-          X = B->FPIDwidth1*((binaryTreeSearch(RandomNum,B->L_FPID1-1,B->FPIDdist1)+RandomNum)/(B->L_FPID1-1)*2-1);
-        }
-        if(*B->FPIDdist2 == -1) { // Top-hat Y distribution
-          Y = B->FPIDwidth2*(RandomNum*2-1); // for target calculation
-        } else if(*B->FPIDdist1 == -2) { // Gaussian Y distribution
-          Y = B->FPIDwidth2*SQRT(-0.5f*LOG(RandomNum))*COS(2*PI*RandomNum); // Box-Muller transform, for target calculation
-        } else { // Custom distribution
-          Y = B->FPIDwidth2*((binaryTreeSearch(RandomNum,B->L_FPID2-1,B->FPIDdist2)+RandomNum)/(B->L_FPID2-1)*2-1);
-        }
-        for(idx=0;idx<3;idx++) target[idx] = B->focus[idx] + X*B->v[idx] + Y*B->w[idx];
+        // Near Field, for target calculation once the ray direction is known
+        U1 = LAUNCHRANDOM(0);
+        if(*LS->FPIDdist1 != -1) U2 = LAUNCHRANDOM(1); // Gaussian (Box-Muller transform) or custom X distribution
+        U3 = LAUNCHRANDOM(2);
+        if(*LS->FPIDdist2 != -1) U4 = LAUNCHRANDOM(3); // Gaussian (Box-Muller transform) or custom Y distribution
 
         // Far Field
-        if(*B->AIDdist1 == -3) { // Lambertian
-          axisrotate(B->v,B->u,RandomNum*2*PI,w0); // w0 unit vector is now normal to both beam center axis and to ray propagation direction
-          axisrotate(B->u,w0,ASIN(SQRT(RandomNum)),P->u); // ray propagation direction is found by rotating beam center axis around w0
+        if(*LS->AIDdist1 == -3) { // Lambertian
+          axisrotate(LS->v,LS->u,LAUNCHRANDOM(4)*2*PI,w0); // w0 unit vector is now normal to both beam center axis and to ray propagation direction
+          axisrotate(LS->u,w0,ASIN(SQRT(LAUNCHRANDOM(5))),P->u); // ray propagation direction is found by rotating beam center axis around w0
         } else {
-          if(*B->AIDdist1 == -1) { // Top-hat phiX distribution
-            tanphiX = TAN(B->AIDwidth1)*(RandomNum*2-1); // for trajectory calculation
-          } else if(*B->AIDdist1 == -2) { // Gaussian phiX distribution
-            tanphiX = TAN(B->AIDwidth1)*SQRT(-0.5f*LOG(RandomNum))*COS(2*PI*RandomNum); // Box-Muller transform, for trajectory calculation
+          if(*LS->AIDdist1 == -1) { // Top-hat phiX distribution
+            tanphiX = TAN(LS->AIDwidth1)*(LAUNCHRANDOM(4)*2-1); // for trajectory calculation
+          } else if(*LS->AIDdist1 == -2) { // Gaussian phiX distribution
+            tanphiX = TAN(LS->AIDwidth1)*SQRT(-0.5f*LOG(LAUNCHRANDOM(4)))*COS(2*PI*LAUNCHRANDOM(5)); // Box-Muller transform, for trajectory calculation
           } else { // Custom phi_X distribution
-            tanphiX = TAN(B->AIDwidth1)*((binaryTreeSearch(RandomNum,B->L_AID1,B->AIDdist1)+RandomNum)/B->L_AID1*2-1);
+            tanphiX = TAN(LS->AIDwidth1)*((binaryTreeSearch(LAUNCHRANDOM(4),LS->L_AID1,LS->AIDdist1)+LAUNCHRANDOM(5))/LS->L_AID1*2-1);
           }
-          if(*B->AIDdist2 == -1) { // Top-hat phiY distribution
-            tanphiY = TAN(B->AIDwidth2)*(RandomNum*2-1); // for trajectory calculation
-          } else if(*B->AIDdist2 == -2) { // Gaussian phiY distribution
-            tanphiY = TAN(B->AIDwidth2)*SQRT(-0.5f*LOG(RandomNum))*COS(2*PI*RandomNum); // Box-Muller transform, for trajectory calculation
+          if(*LS->AIDdist2 == -1) { // Top-hat phiY distribution
+            tanphiY = TAN(LS->AIDwidth2)*(LAUNCHRANDOM(6)*2-1); // for trajectory calculation
+          } else if(*LS->AIDdist2 == -2) { // Gaussian phiY distribution
+            tanphiY = TAN(LS->AIDwidth2)*SQRT(-0.5f*LOG(LAUNCHRANDOM(6)))*COS(2*PI*LAUNCHRANDOM(7)); // Box-Muller transform, for trajectory calculation
           } else { // Custom distribution
-            tanphiY = TAN(B->AIDwidth2)*((binaryTreeSearch(RandomNum,B->L_AID2,B->AIDdist2)+RandomNum)/B->L_AID2*2-1);
+            tanphiY = TAN(LS->AIDwidth2)*((binaryTreeSearch(LAUNCHRANDOM(6),LS->L_AID2,LS->AIDdist2)+LAUNCHRANDOM(7))/LS->L_AID2*2-1);
           }
-          axisrotate(B->v,B->u,ATAN2(tanphiX,tanphiY),w0); // w0 is now orthogonal to both beam propagation axis and ray propagation axis
-          axisrotate(B->u,w0,ATAN(SQRT(tanphiX*tanphiX + tanphiY*tanphiY)),P->u); // ray propagation direction is found by rotating beam center axis around w0
+          axisrotate(LS->v,LS->u,ATAN2(tanphiX,tanphiY),w0); // w0 is now orthogonal to both beam propagation axis and ray propagation axis
+          axisrotate(LS->u,w0,ATAN(SQRT(tanphiX*tanphiX + tanphiY*tanphiY)),P->u); // ray propagation direction is found by rotating beam center axis around w0
         }
+
+        // With clipLightSources, Y is sampled where some X of the X distribution gives a launch point inside the launch region, and X where Y does
+        sMin = -INFINITY;
+        sMax = INFINITY;
+        X = (LS->FPIDwidth1 && *LS->FPIDdist1 == -2)? INFINITY: LS->FPIDwidth1; // Half width of the X distribution
+        if(B->clipLightSources) clipFocalPlaneToLaunchRegion(G,LS->focus,LS->w,LS->v,P->u,-X,X,&sMin,&sMax);
+        Y = sampleClippedCoordinate(LS->FPIDwidth2,LS->FPIDdist2,LS->L_FPID2,U3,U4,sMin,sMax,&P->weight);
+        for(idx=0;idx<3;idx++) w1[idx] = LS->focus[idx] + Y*LS->w[idx];
+        sMin = -INFINITY;
+        sMax = INFINITY;
+        if(B->clipLightSources) clipRayToLaunchRegion(G,w1,LS->v,P->u,&sMin,&sMax);
+        X = sampleClippedCoordinate(LS->FPIDwidth1,LS->FPIDdist1,LS->L_FPID1,U1,U2,sMin,sMax,&clippedProbability);
+        P->weight *= clippedProbability;
+        for(idx=0;idx<3;idx++) target[idx] = LS->focus[idx] + X*LS->v[idx] + Y*LS->w[idx];
+
         P->i[0] = (target[0] - target[2]*P->u[0]/P->u[2])/G->d[0] + G->n[0]/2.0f; // the coordinates for the ray starting point is the intersection of the ray with the z = 0 surface
         P->i[1] = (target[1] - target[2]*P->u[1]/P->u[2])/G->d[1] + G->n[1]/2.0f;
         P->i[2] = 0;
         getNewj(G,P);
-        P->RI = G->RIv[G->M[P->j]]; // Set the refractive index
+        P->RI = G->RIv[G->M[P->j] - 1]; // Set the refractive index
         P->time = -P->RI/C*SQRT(SQR((P->i[0] - G->n[0]/2.0f)*G->d[0] - target[0]) +
                                 SQR((P->i[1] - G->n[1]/2.0f)*G->d[1] - target[1]) +
                                 SQR((P->i[2]               )*G->d[2] - target[2])); // Starting time is set so that the wave crosses the focal plane at time = 0
         break;
     }
+    if(G->mirrorSymmetry) foldIntoSimulatedPart(P,G); // Photons launched on the non-simulated side of a symmetry plane are replaced by their mirror images
 
-    switch (G->boundaryType) {
+    switch (G->boundaryType) { // With clipLightSources, this also catches the launch points that round to just outside the launch region
       case 0:
         P->alive = (FABS(P->i[0]/G->n[0] - 1.0f/2) <  KILLRANGE/2.0f &&
                     FABS(P->i[1]/G->n[1] - 1.0f/2) <  KILLRANGE/2.0f &&
@@ -705,12 +1418,20 @@ void launchPhoton(struct photon * const P, struct source const * const B, struct
                    P->i[2] < G->n[2] && P->i[2] >= 0;
         break;
     }
-  } while(!P->alive && ++launchAttempts < 1000000); // If photon happened to be initialized outside the volume in which it is allowed to travel, we try again unless it's happened a million times in a row.
-
-  if(launchAttempts >= 1000000) *abortingPtr = true;
+  } while(!B->clipLightSources && !P->alive && ++launchAttempts < 1000000); // If photon happened to be initialized outside the volume in which it is allowed to travel, we try again unless it's happened a million times in a row.
+  if(!P->weight) P->alive = false;
+  P->launchWeight = P->weight;
+  if(B->clipLightSources) { // Photons that are not launched inside the region are counted, but a million of them in a row means that the light source has no intensity there
+    P->rejectedLaunchesInARow = P->alive? 0: P->rejectedLaunchesInARow + 1;
+    launchAttempts = P->rejectedLaunchesInARow;
+  }
+  if(launchAttempts >= 1000000) {
+    *abortingPtr = true;
+    return false;
+  }
   
   // Calculate distances to next voxel boundary planes
-  for(idx=0;idx<3;idx++) P->D[idx] = P->u[idx]? (FLOOR(P->i[idx]) + (P->u[idx]>0) - P->i[idx])*G->d[idx]/P->u[idx] : INFINITY;
+  for(idx=0;idx<3;idx++) P->D[idx] = getBoundaryDistance(P,G,(int)idx);
 
   P->insideVolume = P->i[0] < G->n[0] && P->i[0] >= 0 &&
                     P->i[1] < G->n[1] && P->i[1] >= 0 &&
@@ -727,64 +1448,114 @@ void launchPhoton(struct photon * const P, struct source const * const B, struct
   #endif
   {
     Pa->pathStartedThisPhoton = false;
-    updatePaths(P,Pa,G,DC,false);
+    if(P->alive) updatePaths(P,Pa,G,DC,false);
   }
+  return true;
 }
+#undef LAUNCHRANDOM
+
+#ifndef __NVCC__ // Collected photon records are only supported on the CPU
+void flushCollectedPhotonsBuffer(struct photon * const P, struct outputs *O) {
+  if(!P->collectedPhotonsBufferElems) return;
+  #ifdef _OPENMP
+  #pragma omp critical(collectedPhotonsFile)
+  #endif
+  {
+    fwrite(P->collectedPhotonsBuffer,4*O->collectedPhotonsRecordSize,P->collectedPhotonsBufferElems,O->collectedPhotonsFile);
+    O->nCollectedPhotonsRecorded += P->collectedPhotonsBufferElems;
+  }
+  P->collectedPhotonsBufferElems = 0;
+}
+
+void addToCollectedPhotonsBuffer(struct photon * const P, struct geometry const * const G, struct outputs *O, FLOATORDBL timeAtCollector) {
+  // Each record consists of x, y, z, ux, uy, uz, weight and time as floats, followed by the scattering, refraction, reflection and
+  // interface transition counters as 32-bit unsigned integers and finally the pathlength travelled in each medium, also as floats
+  float *record = P->collectedPhotonsBuffer + P->collectedPhotonsBufferElems*O->collectedPhotonsRecordSize;
+  unsigned int counters[4] = {(unsigned int)P->scatterings,(unsigned int)P->refractions,(unsigned int)P->reflections,(unsigned int)P->interfaceTransitions};
+  record[0] = (float)((P->i[0] - G->n[0]/2.0f)*G->d[0]);
+  record[1] = (float)((P->i[1] - G->n[1]/2.0f)*G->d[1]);
+  record[2] = (float)((P->i[2]               )*G->d[2]);
+  record[3] = (float)P->u[0];
+  record[4] = (float)P->u[1];
+  record[5] = (float)P->u[2];
+  record[6] = (float)P->weight;
+  record[7] = (float)timeAtCollector;
+  memcpy(record + 8,counters,4*sizeof(unsigned int));
+  for(long iM=0;iM<O->collectedPhotonsRecordSize - COLLECTEDPHOTONRECORDFIXEDSIZE;iM++) record[COLLECTEDPHOTONRECORDFIXEDSIZE + iM] = (float)P->pathlengths[iM];
+  if(++P->collectedPhotonsBufferElems == COLLECTEDPHOTONSBUFFERSIZE) flushCollectedPhotonsBuffer(P,O);
+}
+#endif
 
 #ifdef __NVCC__ // If compiling for CUDA
 __device__
 #endif
-void formImage(struct photon * const P, struct geometry const * const G, struct lightCollector const * const LC, struct depositionCriteria *DC, struct outputs *O, unsigned long long * nPhotonsCollectedPtr) {
-  FLOATORDBL U[3];
-  xyztoXYZ(P->u,LC->theta,LC->phi,U); // U is now the photon trajectory in basis of detection frame (X,Y,Z)
+bool formImage(struct photon * const P, struct geometry const * const G, struct lightCollector const * const LC, struct depositionCriteria *DC, struct outputs *O) {
+  // Scores the escaping photon in the image of the light collector LC if it is collected. Returns true if the photon was added to the image.
+  FLOATORDBL resc[3] = {(P->i[0] - G->n[0]/2.0f)*G->d[0] - LC->r[0],
+                        (P->i[1] - G->n[1]/2.0f)*G->d[1] - LC->r[1],
+                        (P->i[2]               )*G->d[2] - LC->r[2]}; // Photon position relative to the light collector center when it escapes the cuboid, in the (x,y,z) basis
+
+  // Spatial pre-filter: The photon can only cross the light collector plane within the aperture if the straight line it escapes along
+  // passes within diam/2 of the light collector center. This is checked without any trigonometric functions or square roots, so that
+  // escaping photons can be tested against many light collectors cheaply.
+  FLOATORDBL along = -(resc[0]*P->u[0] + resc[1]*P->u[1] + resc[2]*P->u[2]); // Distance along the trajectory to the point closest to the light collector center
+  FLOATORDBL dist2 = resc[0]*resc[0] + resc[1]*resc[1] + resc[2]*resc[2] - (along > 0? along*along: 0); // Square of the smallest distance to the center
+  if(dist2 >= LC->diam*LC->diam/4) return false;
+
+  FLOATORDBL U[3],Resc[3]; // The photon trajectory and its position in the light collector frame (X,Y,Z) when it escapes the cuboid
+  for(int k=0;k<3;k++) {
+    U[k]    = LC->basis[k][0]*P->u[0] + LC->basis[k][1]*P->u[1] + LC->basis[k][2]*P->u[2];
+    Resc[k] = LC->basis[k][0]*resc[0] + LC->basis[k][1]*resc[1] + LC->basis[k][2]*resc[2];
+  }
   
-  if(U[2] < 0) { // If the Z component of U is negative then the photon is moving towards the light collector plane
-    FLOATORDBL resc[3] = {(P->i[0] - G->n[0]/2.0f)*G->d[0] - LC->r[0],
-                          (P->i[1] - G->n[1]/2.0f)*G->d[1] - LC->r[1],
-                          (P->i[2]               )*G->d[2] - LC->r[2]}; // Photon position relative to the light collector focal plane center when it escapes the cuboid, in the (x,y,z) basis
+  if(U[2] < 0 && Resc[2] > 0) { // If the Z component of U is negative then the photon is moving towards the light collector plane, and if the Z coordinate is negative the photon is already on the wrong side
+    FLOATORDBL RLCP[2]; // XY coordinates of the point where the photon crosses the light collector plane
+    RLCP[0] = Resc[0] - Resc[2]*U[0]/U[2];
+    RLCP[1] = Resc[1] - Resc[2]*U[1]/U[2];
     
-    FLOATORDBL Resc[3];
-    xyztoXYZ(resc,LC->theta,LC->phi,Resc); // Resc is now the photon position in the light collector frame (X,Y,Z) when it escapes the cuboid
+    FLOATORDBL distLCP = SQRT(RLCP[0]*RLCP[0] + RLCP[1]*RLCP[1]); // Distance between light collector center and the point where the photon crosses the light collector plane
     
-    if(Resc[2] > 0) { // If the Z coordinate in the light collector frame is positive (negative means the photon is already on the wrong side)
-      FLOATORDBL RLCP[2]; // XY coordinates of the point where the photon crosses the light collector plane
-      RLCP[0] = Resc[0] - Resc[2]*U[0]/U[2];
-      RLCP[1] = Resc[1] - Resc[2]*U[1]/U[2];
-      
-      FLOATORDBL distLCP = SQRT(RLCP[0]*RLCP[0] + RLCP[1]*RLCP[1]); // Distance between light collector center and the point where the photon crosses the light collector plane
-      
-      if(distLCP < LC->diam/2) { // If the distance is less than the radius of the light collector
-        if(ISFINITE(LC->f)) { // If the light collector is an objective lens
-          FLOATORDBL RImP[2]; // Back-propagated position that the photon would have had in the object plane if propagating freely. This corresponds to where the photon will end up in the image plane for magnification 1x.
-          RImP[0] = RLCP[0] + LC->f*U[0]/U[2];
-          RImP[1] = RLCP[1] + LC->f*U[1]/U[2];
-          FLOATORDBL distImP = SQRT(RImP[0]*RImP[0] + RImP[1]*RImP[1]);
-          if(distImP < LC->FSorNA/2) { // If the photon is coming from the area within the Field Size
-            long Xindex = (long)(LC->res[0]*(RImP[0]/LC->FSorNA + 1.0f/2));
-            long Yindex = (long)(LC->res[0]*(RImP[1]/LC->FSorNA + 1.0f/2));
-            long timeindex = LC->res[1] > 1? min(LC->res[1]-1,max(0L,(long)(1+(LC->res[1]-2)*(P->time - (Resc[2] - LC->f)/U[2]*P->RI/C - LC->tStart)/(LC->tEnd - LC->tStart)))): 0; // If we are not measuring time-resolved, LC->res[1] == 1
-            P->killed_escaped_collected = 2; // Collected
-            if(depositionCriteriaMet(P,DC)) {
-              atomicAddWrapper(&O->image[Xindex               +
-                                         Yindex   *LC->res[0] +
-                                         timeindex*LC->res[0]*LC->res[0]],P->weight);
-              atomicAddWrapperULL(nPhotonsCollectedPtr,1);
-            }
+    if(distLCP < LC->diam/2) { // If the distance is less than the radius of the light collector
+      if(ISFINITE(LC->f)) { // If the light collector is an objective lens
+        FLOATORDBL RImP[2]; // Back-propagated position that the photon would have had in the object plane if propagating freely. This corresponds to where the photon will end up in the image plane for magnification 1x.
+        RImP[0] = RLCP[0] + LC->f*U[0]/U[2];
+        RImP[1] = RLCP[1] + LC->f*U[1]/U[2];
+        FLOATORDBL distImP = SQRT(RImP[0]*RImP[0] + RImP[1]*RImP[1]);
+        if(distImP < LC->FSorNA/2) { // If the photon is coming from the area within the Field Size
+          long Xindex = (long)(LC->res[0]*(RImP[0]/LC->FSorNA + 1.0f/2));
+          long Yindex = (long)(LC->res[0]*(RImP[1]/LC->FSorNA + 1.0f/2));
+          FLOATORDBL timeAtCollector = P->time - (Resc[2] - LC->f)/U[2]*P->RI/C;
+          long timeindex = LC->res[1] > 1? min(LC->res[1]-1,max(0L,(long)(1+(LC->res[1]-2)*(timeAtCollector - LC->tStart)/(LC->tEnd - LC->tStart)))): 0; // If we are not measuring time-resolved, LC->res[1] == 1
+          P->killed_escaped_collected = 2; // Collected
+          if(depositionCriteriaMet(P,DC)) {
+            atomicAddWrapper(&O->image[LC->imageStart       +
+                                       Xindex               +
+                                       Yindex   *LC->res[0] +
+                                       timeindex*LC->res[0]*LC->res[0]],P->weight);
+            #ifndef __NVCC__
+            if(P->collectedPhotonsBuffer) addToCollectedPhotonsBuffer(P,G,O,timeAtCollector);
+            #endif
+            return true;
           }
-        } else { // If the light collector is a fiber tip
-          FLOATORDBL thetaLCFF = ATAN(-SQRT(U[0]*U[0] + U[1]*U[1])/U[2]); // Light collector far field polar angle
-          if(thetaLCFF < ASIN(min(1.0f,LC->FSorNA))) { // If the photon has an angle within the fiber's NA acceptance
-            long timeindex = LC->res[1] > 1? min(LC->res[1]-1,max(0L,(long)(1+(LC->res[1]-2)*(P->time - Resc[2]/U[2]*P->RI/C - LC->tStart)/(LC->tEnd - LC->tStart)))): 0; // If we are not measuring time-resolved, LC->res[1] == 1
-            P->killed_escaped_collected = 2; // Collected
-            if(depositionCriteriaMet(P,DC)) {
-              atomicAddWrapper(&O->image[timeindex],P->weight);
-              atomicAddWrapperULL(nPhotonsCollectedPtr,1);
-            }
+        }
+      } else { // If the light collector is a fiber tip
+        FLOATORDBL thetaLCFF = ATAN(-SQRT(U[0]*U[0] + U[1]*U[1])/U[2]); // Light collector far field polar angle
+        if(thetaLCFF < ASIN(min(1.0f,LC->FSorNA))) { // If the photon has an angle within the fiber's NA acceptance
+          FLOATORDBL timeAtCollector = P->time - Resc[2]/U[2]*P->RI/C;
+          long timeindex = LC->res[1] > 1? min(LC->res[1]-1,max(0L,(long)(1+(LC->res[1]-2)*(timeAtCollector - LC->tStart)/(LC->tEnd - LC->tStart)))): 0; // If we are not measuring time-resolved, LC->res[1] == 1
+          P->killed_escaped_collected = 2; // Collected
+          if(depositionCriteriaMet(P,DC)) {
+            atomicAddWrapper(&O->image[LC->imageStart + timeindex],P->weight);
+            #ifndef __NVCC__
+            if(P->collectedPhotonsBuffer) addToCollectedPhotonsBuffer(P,G,O,timeAtCollector);
+            #endif
+            return true;
           }
         }
       }
     }
   }
+  return false;
 }
 
 #ifdef __NVCC__ // If compiling for CUDA
@@ -801,17 +1572,76 @@ __device__
 #endif
 void formEdgeFluxes(struct photon const * const P, struct geometry const * const G, struct outputs const *O) {
   if(G->boundaryType == 1) {
-    if(P->i[2] < 0)             atomicAddWrapper(&O->NI_zneg[(long)P->i[0] + G->n[0]*(long)P->i[1]],P->weight);
-    else if(P->i[2] >= G->n[2]) atomicAddWrapper(&O->NI_zpos[(long)P->i[0] + G->n[0]*(long)P->i[1]],P->weight);
-    else if(P->i[1] < 0)        atomicAddWrapper(&O->NI_yneg[(long)P->i[0] + G->n[0]*(long)P->i[2]],P->weight);
-    else if(P->i[1] >= G->n[1]) atomicAddWrapper(&O->NI_ypos[(long)P->i[0] + G->n[0]*(long)P->i[2]],P->weight);
-    else if(P->i[0] < 0)        atomicAddWrapper(&O->NI_xneg[(long)P->i[1] + G->n[1]*(long)P->i[2]],P->weight);
-    else if(P->i[0] >= G->n[0]) atomicAddWrapper(&O->NI_xpos[(long)P->i[1] + G->n[1]*(long)P->i[2]],P->weight);
+    if(P->i[2] < 0)             addToNI(O->NI_zneg,G,5,(long)P->i[0],(long)P->i[1],P->weight);
+    else if(P->i[2] >= G->n[2]) addToNI(O->NI_zpos,G,4,(long)P->i[0],(long)P->i[1],P->weight);
+    else if(P->i[1] < 0)        addToNI(O->NI_yneg,G,3,(long)P->i[0],(long)P->i[2],P->weight);
+    else if(P->i[1] >= G->n[1]) addToNI(O->NI_ypos,G,2,(long)P->i[0],(long)P->i[2],P->weight);
+    else if(P->i[0] < 0)        addToNI(O->NI_xneg,G,1,(long)P->i[1],(long)P->i[2],P->weight);
+    else if(P->i[0] >= G->n[0]) addToNI(O->NI_xpos,G,0,(long)P->i[1],(long)P->i[2],P->weight);
+    if(G->nr && (P->i[2] < 0 || P->i[2] >= G->n[2])) {
+      long ir = getRadialIndex(G,P->i[0],P->i[1]);
+      if(ir >= 0) atomicAddWrapper(P->i[2] < 0? &O->NI_zneg_r[ir]: &O->NI_zpos_r[ir],P->weight);
+    }
   } else if(G->boundaryType == 2) {
-    if(P->i[2] < 0)             atomicAddWrapper(&O->NI_zneg[(long)(P->i[0] + G->n[0]*(KILLRANGE-1)/2.0f) + (KILLRANGE*G->n[0])*((long)(P->i[1] + G->n[1]*(KILLRANGE-1)/2.0f))],P->weight);
+    if(P->i[2] < 0)             addToNI(O->NI_zneg,G,5,(long)(P->i[0] + G->n[0]*(KILLRANGE-1)/2.0f),(long)(P->i[1] + G->n[1]*(KILLRANGE-1)/2.0f),P->weight);
+    if(G->nr && P->i[2] < 0) {
+      long ir = getRadialIndex(G,P->i[0],P->i[1]);
+      if(ir >= 0) atomicAddWrapper(&O->NI_zneg_r[ir],P->weight);
+    }
   } else { // boundaryType == 3
-    if(P->i[2] < 0)             atomicAddWrapper(&O->NI_zneg[(long)P->i[0] + G->n[0]*(long)P->i[1]],P->weight);
-    else if(P->i[2] >= G->n[2]) atomicAddWrapper(&O->NI_zpos[(long)P->i[0] + G->n[0]*(long)P->i[1]],P->weight);
+    if(P->i[2] < 0)             addToNI(O->NI_zneg,G,5,(long)P->i[0],(long)P->i[1],P->weight);
+    else if(P->i[2] >= G->n[2]) addToNI(O->NI_zpos,G,4,(long)P->i[0],(long)P->i[1],P->weight);
+  }
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void formFarFieldAndEdgeFluxesAtMirrorImages(struct photon * const P, struct geometry const * const G, struct outputs const *O, bool scoreFF, bool scoreNI) {
+  // With mirror symmetry, an escaping or killed photon is scored at all its mirror images with correspondingly reduced weights,
+  // so that the far field and the boundary irradiances on the non-simulated sides come out as well
+  FLOATORDBL i_orig[2] = {P->i[0],P->i[1]};
+  FLOATORDBL u_orig[2] = {P->u[0],P->u[1]};
+  FLOATORDBL weight_orig = P->weight;
+  P->weight /= ((G->mirrorSymmetry & 1)? 2: 1)*((G->mirrorSymmetry & 2)? 2: 1);
+  for(int image=0;image<4;image++) {
+    if(image & ~G->mirrorSymmetry) continue;
+    for(int idx=0;idx<2;idx++) {
+      bool mirrored = (image >> idx) & 1;
+      P->i[idx] = mirrored? G->n[idx] - i_orig[idx] - FLOATORDBLEPS*(G->n[idx] + 1): i_orig[idx]; // The small shift keeps mirrored boundary positions on the correct side of the boundary
+      P->u[idx] = mirrored? -u_orig[idx]: u_orig[idx];
+    }
+    if(scoreFF) formFarField(P,G,O);
+    if(scoreNI) formEdgeFluxes(P,G,O);
+  }
+  for(int idx=0;idx<2;idx++) {
+    P->i[idx] = i_orig[idx];
+    P->u[idx] = u_orig[idx];
+  }
+  P->weight = weight_orig;
+}
+
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void scoreEscapedPhoton(struct photon * const P, struct geometry const * const G, struct lightCollector const * const LC,
+        struct outputs *O, struct depositionCriteria *DC, unsigned long long * nPhotonsCollectedPtr, bool escaped) {
+  if(escaped) {
+    P->killed_escaped_collected = 1; // Escaped, may be overwritten by collected in formImage
+    // We have to check formImage first because that's where we find out if the photon is collected
+    if(O->image) { // If image is not NULL then that's because useLightCollector was set to true (non-zero)
+      bool scored = false;
+      for(int iLC=0;iLC<G->nLC;iLC++) scored |= formImage(P,G,&LC[iLC],DC,O); // A photon may be collected by several light collectors, but is counted once
+      if(scored) atomicAddWrapperULL(nPhotonsCollectedPtr,1);
+    }
+  }
+  bool scoreFF = escaped && O->FF && depositionCriteriaMet(P,DC);
+  bool scoreNI = !P->alive && G->boundaryType && depositionCriteriaMet(P,DC);
+  if(G->mirrorSymmetry && (scoreFF || scoreNI)) {
+    formFarFieldAndEdgeFluxesAtMirrorImages(P,G,O,scoreFF,scoreNI);
+  } else {
+    if(scoreFF) formFarField(P,G,O);
+    if(scoreNI) formEdgeFluxes(P,G,O);
   }
 }
 
@@ -821,6 +1651,8 @@ __device__
 void checkEscape(struct photon * const P, struct paths *Pa, struct geometry const * const G, struct lightCollector const * const LC,
         struct outputs *O, struct depositionCriteria *DC, unsigned long long * nPhotonsCollectedPtr) {
   bool escaped = false;
+  bool tooOld = false;
+  if(G->mirrorSymmetry) foldIntoSimulatedPart(P,G); // Photons crossing a symmetry plane are reflected back into the simulated part
   switch (G->boundaryType) {
     case 0:
       P->alive = (FABS(P->i[0]/G->n[0] - 1.0f/2) <  KILLRANGE/2.0f &&
@@ -841,7 +1673,7 @@ void checkEscape(struct photon * const P, struct paths *Pa, struct geometry cons
       escaped = (P->i[2] < 0) && P->RI == 1;
       break;
     case 3:; // A semicolon is necessary here because C is a wonderful language :-)
-      bool tooOld = P->time > 1000/C*SQRT(SQR(G->d[0]*G->n[0]) + SQR(G->d[1]*G->n[1]));  // Photon is "too old" if it has traveled more than 1000 times the diagonal xy box distance (may be in an infinite or near-infinite loop of cycling)
+      tooOld = P->time > 1000/C*SQRT(SQR(G->d[0]*G->n[0]) + SQR(G->d[1]*G->n[1]));  // Photon is "too old" if it has traveled more than 1000 times the diagonal xy box distance (may be in an infinite or near-infinite loop of cycling)
       P->alive = P->i[2] < G->n[2] && P->i[2] >= 0 && !tooOld;
       escaped = !P->alive && P->RI == 1 && !tooOld;
       bool photonTeleported = false;
@@ -861,6 +1693,7 @@ void checkEscape(struct photon * const P, struct paths *Pa, struct geometry cons
         P->i[1] = G->n[1]*(1-FLOATORDBLEPS); // Wrap y
         photonTeleported = true;
       }
+      if(photonTeleported && G->layerStart) for(int idx=0;idx<2;idx++) P->D[idx] = getBoundaryDistance(P,G,idx); // In the layered fast path, the distances are to the cuboid boundaries rather than to the next voxel
 
       #ifdef __NVCC__ // If compiling for CUDA
       if(!threadIdx.x && !blockIdx.x)
@@ -878,14 +1711,22 @@ void checkEscape(struct photon * const P, struct paths *Pa, struct geometry cons
   P->insideVolume = P->i[0] < G->n[0] && P->i[0] >= 0 &&
                     P->i[1] < G->n[1] && P->i[1] >= 0 &&
                     P->i[2] < G->n[2] && P->i[2] >= 0;
-  
-  if(escaped) {
-    P->killed_escaped_collected = 1; // Escaped, may be overwritten by collected in formImage
-    // We have to check formImage first because that's where we find out if the photon is collected
-    if(O->image) formImage(P,G,LC,DC,O,nPhotonsCollectedPtr); // If image is not NULL then that's because useLightCollector was set to true (non-zero)
-    if(O->FF && depositionCriteriaMet(P,DC)) formFarField(P,G,O);
+
+  if(!G->nSpectral) {
+    scoreEscapedPhoton(P,G,LC,O,DC,nPhotonsCollectedPtr,escaped);
+  } else if(!P->alive) { // In the spectral fast path, O is the array of the outputs of all the wavelengths, and each wavelength's weight is scored in its own outputs
+    FLOATORDBL weight = P->weight;
+    for(int iL=0;iL<G->nSpectral;iL++) {
+      P->weight = P->spectralWeights[iL];
+      scoreEscapedPhoton(P,G,LC,&O[iL],DC,&O[iL].nPhotonsCollected,escaped);
+    }
+    P->weight = weight;
+  }
+
+  if(G->calcTelemetry && !P->alive) {
+    if(tooOld) P->telemetry.timeLimitKills++;
+    else P->telemetry.escapes++;
   }
-  if(!P->alive && G->boundaryType && depositionCriteriaMet(P,DC)) formEdgeFluxes(P,G,O);
 }
 
 #ifdef __NVCC__ // If compiling for CUDA
@@ -896,10 +1737,10 @@ void getNewVoxelProperties(struct photon * const P, struct geometry const * cons
    * If photon is outside cuboid, properties are those of
    * the closest defined voxel. */
   getNewj(G,P);
-  P->mua    = G->muav   [G->M[P->j]];
-  P->mus    = G->musv   [G->M[P->j]];
-  P->g      = G->gv     [G->M[P->j]];
-  P->CDFidx = G->CDFidxv[G->M[P->j]];
+  P->mua    = G->muav   [G->M[P->j] - 1];
+  P->mus    = G->musv   [G->M[P->j] - 1];
+  P->g      = G->gv     [G->M[P->j] - 1];
+  P->CDFidx = G->CDFidxv[G->M[P->j] - 1];
   // Refractive index is not retrieved here, but only when we refract in through a surface
 }
 
@@ -937,7 +1778,7 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   FLOATORDBL nx,ny,nz;
   if(ix >= 0          && iy >= 0          && iz >= 0         ) {
     long jcorner = ix      +  iy     *G->n[0] +  iz     *G->n[0]*G->n[1];
-    if(G->RIv[G->M[jcorner]] == G->RIv[G->M[j]]) {
+    if(G->RIv[G->M[jcorner] - 1] == G->RIv[G->M[j] - 1]) {
       getNormal(G,&nx,&ny,&nz,jcorner);
       *nxPtr += (1-wx)*(1-wy)*(1-wz)*nx;
       *nyPtr += (1-wx)*(1-wy)*(1-wz)*ny;
@@ -946,7 +1787,7 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   }
   if(ix >= 0          && iy >= 0          && iz < G->n[2] - 1) {
     long jcorner = ix      +  iy     *G->n[0] + (iz + 1)*G->n[0]*G->n[1];
-    if(G->RIv[G->M[jcorner]] == G->RIv[G->M[j]]) {
+    if(G->RIv[G->M[jcorner] - 1] == G->RIv[G->M[j] - 1]) {
       getNormal(G,&nx,&ny,&nz,jcorner);
       *nxPtr += (1-wx)*(1-wy)*wz*nx;
       *nyPtr += (1-wx)*(1-wy)*wz*ny;
@@ -955,7 +1796,7 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   }
   if(ix >= 0          && iy < G->n[1] - 1 && iz >= 0         ) {
     long jcorner = ix      + (iy + 1)*G->n[0] +  iz     *G->n[0]*G->n[1];
-    if(G->RIv[G->M[jcorner]] == G->RIv[G->M[j]]) {
+    if(G->RIv[G->M[jcorner] - 1] == G->RIv[G->M[j] - 1]) {
       getNormal(G,&nx,&ny,&nz,jcorner);
       *nxPtr += (1-wx)*wy*(1-wz)*nx;
       *nyPtr += (1-wx)*wy*(1-wz)*ny;
@@ -964,7 +1805,7 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   }
   if(ix >= 0          && iy < G->n[1] - 1 && iz < G->n[2] - 1) {
     long jcorner = ix      + (iy + 1)*G->n[0] + (iz + 1)*G->n[0]*G->n[1];
-    if(G->RIv[G->M[jcorner]] == G->RIv[G->M[j]]) {
+    if(G->RIv[G->M[jcorner] - 1] == G->RIv[G->M[j] - 1]) {
       getNormal(G,&nx,&ny,&nz,jcorner);
       *nxPtr += (1-wx)*wy*wz*nx;
       *nyPtr += (1-wx)*wy*wz*ny;
@@ -973,7 +1814,7 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   }
   if(ix < G->n[0] - 1 && iy >= 0          && iz >= 0         ) {
     long jcorner = (ix + 1) +  iy     *G->n[0] +  iz     *G->n[0]*G->n[1];
-    if(G->RIv[G->M[jcorner]] == G->RIv[G->M[j]]) {
+    if(G->RIv[G->M[jcorner] - 1] == G->RIv[G->M[j] - 1]) {
       getNormal(G,&nx,&ny,&nz,jcorner);
       *nxPtr += wx*(1-wy)*(1-wz)*nx;
       *nyPtr += wx*(1-wy)*(1-wz)*ny;
@@ -982,7 +1823,7 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   }
   if(ix < G->n[0] - 1 && iy >= 0          && iz < G->n[2] - 1) {
     long jcorner = (ix + 1) +  iy     *G->n[0] + (iz + 1)*G->n[0]*G->n[1];
-    if(G->RIv[G->M[jcorner]] == G->RIv[G->M[j]]) {
+    if(G->RIv[G->M[jcorner] - 1] == G->RIv[G->M[j] - 1]) {
       getNormal(G,&nx,&ny,&nz,jcorner);
       *nxPtr += wx*(1-wy)*wz*nx;
       *nyPtr += wx*(1-wy)*wz*ny;
@@ -991,7 +1832,7 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   }
   if(ix < G->n[0] - 1 && iy < G->n[1] - 1 && iz >= 0         ) {
     long jcorner = (ix + 1) + (iy + 1)*G->n[0] +  iz     *G->n[0]*G->n[1];
-    if(G->RIv[G->M[jcorner]] == G->RIv[G->M[j]]) {
+    if(G->RIv[G->M[jcorner] - 1] == G->RIv[G->M[j] - 1]) {
       getNormal(G,&nx,&ny,&nz,jcorner);
       *nxPtr += wx*wy*(1-wz)*nx;
       *nyPtr += wx*wy*(1-wz)*ny;
@@ -1000,7 +1841,7 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   }
   if(ix < G->n[0] - 1 && iy < G->n[1] - 1 && iz < G->n[2] - 1) {
     long jcorner = (ix + 1) + (iy + 1)*G->n[0] + (iz + 1)*G->n[0]*G->n[1];
-    if(G->RIv[G->M[jcorner]] == G->RIv[G->M[j]]) {
+    if(G->RIv[G->M[jcorner] - 1] == G->RIv[G->M[j] - 1]) {
       getNormal(G,&nx,&ny,&nz,jcorner);
       *nxPtr += wx*wy*wz*nx;
       *nyPtr += wx*wy*wz*ny;
@@ -1013,6 +1854,27 @@ void getInterpolatedNormal(struct geometry const * const G, struct photon *P, FL
   *nzPtr /= norm;
 }
 
+#ifdef __NVCC__ // If compiling for CUDA
+__device__
+#endif
+void scoreSpectralStep(struct photon * const P, struct geometry const * const G, struct outputs const *O, struct depositionCriteria *DC, FLOATORDBL s, long jScore, FLOATORDBL const *iMid, FLOATORDBL tMid) {
+  // Spectral fast path. When only the absorption coefficients depend on wavelength, the photon paths are statistically the same at all
+  // wavelengths, so one path is traced with a weight for each wavelength. O is the array of the outputs of all the wavelengths.
+  bool score = P->insideVolume && depositionCriteriaMet(P,DC);
+  long ir = score && O->NFR_rz? getRadialIndex(G,iMid[0],iMid[1]): -1;
+  long ig = score && O->NFR_grid? getGridIndex(G,iMid,tMid): -1;
+  FLOATORDBL const *muav = G->spectralMuav + (G->M[P->j] - 1)*G->nSpectral;
+  P->weight = 0;
+  for(int iL=0;iL<G->nSpectral;iL++) {
+    FLOATORDBL absorb = -P->spectralWeights[iL]*EXPM1(-muav[iL]*s);
+    if(ir >= 0) atomicAddWrapper(&O[iL].NFR_rz[ir + G->nr*(jScore/(G->n[0]*G->n[1]))],muav[iL]? absorb/muav[iL]: P->spectralWeights[iL]*s);
+    if(ig >= 0) atomicAddWrapper(&O[iL].NFR_grid[ig],muav[iL]? absorb/muav[iL]: P->spectralWeights[iL]*s);
+    if(score && (O[iL].NFR || O[iL].NFR_float)) depositNFR(P,&O[iL],getNFRidx(G,jScore),absorb);
+    P->spectralWeights[iL] -= absorb;
+    if(P->spectralWeights[iL] > P->weight) P->weight = P->spectralWeights[iL];
+  }
+}
+
 #ifdef __NVCC__ // If compiling for CUDA
 __device__
 #endif
@@ -1020,17 +1882,47 @@ void propagatePhoton(struct photon * const P, struct geometry const * const G, s
   long idx;
 
   P->sameVoxel = true;
+  if(G->calcTelemetry) P->telemetry.steps++;
   
   FLOATORDBL s = min(P->stepLeft/P->mus,min(P->D[0],min(P->D[1],P->D[2])));
+  FLOATORDBL iMid[3] = {P->i[0] + s*P->u[0]/(2*G->d[0]), P->i[1] + s*P->u[1]/(2*G->d[1]), P->i[2] + s*P->u[2]/(2*G->d[2])}; // Fractional indices of the middle of the step, used for the axisymmetric outputs and the scoring grid
+  FLOATORDBL tMid = P->time + s/2*P->RI/C; // Time at the middle of the step, used for the time-resolved scoring grid
 
   P->stepLeft  = s==P->stepLeft/P->mus? 0: P->stepLeft - s*P->mus; // zero case is to avoid rounding errors
   P->time     += s*P->RI/C;
   
+  long jScore = P->j; // Voxel to score the absorbed weight in
+  if(G->layerStart && P->insideVolume && (O->NFR || O->NFR_float || O->NFR_rz || O->NFR_grid)) {
+    // In the layered fast path, a step may span many voxels, so the weight absorbed along the step is scored at a single point sampled
+    // from the distribution of absorption events along the step. This makes the voxel-binned outputs unbiased.
+    FLOATORDBL t = P->mua? -LOG(1 + RandomNum*EXPM1(-P->mua*s))/P->mua: RandomNum*s;
+    FLOATORDBL iScore[3];
+    for(idx=0;idx<3;idx++) iScore[idx] = P->i[idx] + t*P->u[idx]/G->d[idx];
+    for(idx=0;idx<3;idx++) iMid[idx] = iScore[idx];
+    tMid += (t - s/2)*P->RI/C;
+    jScore = ((iScore[2] < 0)? 0: ((iScore[2] >= G->n[2])? G->n[2]-1: (long)FLOOR(iScore[2])))*G->n[0]*G->n[1] +
+             ((iScore[1] < 0)? 0: ((iScore[1] >= G->n[1])? G->n[1]-1: (long)FLOOR(iScore[1])))*G->n[0]         +
+             ((iScore[0] < 0)? 0: ((iScore[0] >= G->n[0])? G->n[0]-1: (long)FLOOR(iScore[0])));
+  }
+
   for(idx=0;idx<3;idx++) { // Propagate photon
+    if(stepsToPlanes(G,P,(int)idx)) { // Layered fast path or outside the cuboid, where steps are only stopped at the planes given by getStepPlane
+      FLOATORDBL plane = getStepPlane(G,P,(int)idx);
+      if(s == P->D[idx]) {
+        P->i[idx] = (P->u[idx] > 0)? plane: plane - FLOATORDBLEPS*(FABS(plane)+1);
+        P->D[idx] = getBoundaryDistance(P,G,(int)idx);
+        P->sameVoxel = false;
+      } else {
+        P->i[idx] += s*P->u[idx]/G->d[idx];
+        if(P->u[idx] > 0? P->i[idx] >= plane: P->i[idx] < plane) P->i[idx] = (P->u[idx] > 0)? plane - FLOATORDBLEPS*(FABS(plane)+1): plane; // If photon due to rounding errors actually crossed the plane, set it to be barely in front of it
+        P->D[idx] -= s;
+      }
+      continue;
+    }
     long i_old = (long)FLOOR(P->i[idx]);
     if(s == P->D[idx]) { // If we're supposed to go to the voxel boundary along this dimension
       P->i[idx] = (P->u[idx] > 0)? i_old + 1: i_old - FLOATORDBLEPS*(labs(i_old)+1);
-      P->D[idx] = G->d[idx]/FABS(P->u[idx]); // Reset voxel boundary distance
+      P->D[idx] = stepsToPlanes(G,P,(int)idx)? getBoundaryDistance(P,G,(int)idx): G->d[idx]/FABS(P->u[idx]); // Reset voxel boundary distance, or if the photon just left the cuboid, get the distance to the next plane
       P->sameVoxel = false;
     } else { // We're supposed to remain in the same voxel along this dimension
       P->i[idx] += s*P->u[idx]/G->d[idx]; // First take the expected step (including various rounding errors)
@@ -1040,15 +1932,19 @@ void propagatePhoton(struct photon * const P, struct geometry const * const G, s
   }
 
   if(!P->sameVoxel) {
+    if(G->calcTelemetry) P->telemetry.boundaryCrossings++;
     long j_new = ((P->i[2] < 0)? 0: ((P->i[2] >= G->n[2])? G->n[2]-1: (long)FLOOR(P->i[2])))*G->n[0]*G->n[1] +
                  ((P->i[1] < 0)? 0: ((P->i[1] >= G->n[1])? G->n[1]-1: (long)FLOOR(P->i[1])))*G->n[0]         +
                  ((P->i[0] < 0)? 0: ((P->i[0] >= G->n[0])? G->n[0]-1: (long)FLOOR(P->i[0]))); // Index values are restrained to integers in the interval [0,n-1]
     // https://physics.stackexchange.com/questions/435512/snells-law-in-vector-form  or  http://www.starkeffects.com/snells-law-vector.shtml#:~:text=Snell's%20Law%20in%20Vector%20Form&text=Since%20the%20incident%20ray%2C%20the,yourself%20to%20fit%20the%20equation.
-    FLOATORDBL mu = P->RI/G->RIv[G->M[j_new]]; // RI ratio
+    FLOATORDBL mu = P->RI/G->RIv[G->M[j_new] - 1]; // RI ratio
     if(mu != 1) { // If there's a refractive index change
       bool photonReflected = false;
       FLOATORDBL nx,ny,nz;
-      getInterpolatedNormal(G,P,&nx,&ny,&nz,j_new);
+      if(G->layerStart) { // Layer interfaces are exactly orthogonal to z
+        nx = ny = 0;
+        nz = (FLOATORDBL)SIGN(P->u[2]);
+      } else getInterpolatedNormal(G,P,&nx,&ny,&nz,j_new);
       FLOATORDBL cos_in = nx*P->u[0] + ny*P->u[1] + nz*P->u[2]; // dot product of n and u
       if(cos_in > 0) { // If cos_in is negative, we're dealing with a case in which the photon is headed in a direction that, according to the surface normal, is actually away from the medium. Then we choose not to do any reflection or refraction.
         FLOATORDBL cos_out_sqr = 1 - SQR(mu)*(1 - SQR(cos_in));
@@ -1057,14 +1953,16 @@ void propagatePhoton(struct photon * const P, struct geometry const * const G, s
           FLOATORDBL R = SQR((mu*cos_in  - cos_out)/(mu*cos_in  + cos_out))/2 +
                          SQR((mu*cos_out - cos_in )/(mu*cos_out + cos_in ))/2; // R is the reflectivity assuming equal probability of p or s polarization (unpolarized light at all times)
           photonReflected = RandomNum <= R;
-        } else photonReflected = true;
+          if(G->calcTelemetry) P->telemetry.reflections += photonReflected;
+        } else {
+          photonReflected = true;
+          if(G->calcTelemetry) P->telemetry.totalInternalReflections++;
+        }
         if(photonReflected) { // u_refl = u - 2*n*(u dot n) = u - 2*n*cos(theta_in)
           P->u[0] -= 2*nx*cos_in;
           P->u[1] -= 2*ny*cos_in;
           P->u[2] -= 2*nz*cos_in;
-          P->D[0] = P->u[0]? (FLOOR(P->i[0]) + (P->u[0]>0) - P->i[0])*G->d[0]/P->u[0]: INFINITY; // Recalculate voxel boundary distance for x
-          P->D[1] = P->u[1]? (FLOOR(P->i[1]) + (P->u[1]>0) - P->i[1])*G->d[1]/P->u[1]: INFINITY; // Recalculate voxel boundary distance for y
-          P->D[2] = P->u[2]? (FLOOR(P->i[2]) + (P->u[2]>0) - P->i[2])*G->d[2]/P->u[2]: INFINITY; // Recalculate voxel boundary distance for z
+          for(idx=0;idx<3;idx++) P->D[idx] = getBoundaryDistance(P,G,(int)idx); // Recalculate voxel boundary distances
           // We deliberately do not get the refractive index of the new voxel here, since a reflection means the photon is effectively still in the same medium, despite perhaps temporarily traveling in the new medium's voxel
           if(G->M[j_new] >= DC->minIdx && G->M[j_new] <= DC->maxIdx)
             P->reflections++;
@@ -1073,38 +1971,55 @@ void propagatePhoton(struct photon * const P, struct geometry const * const G, s
           P->u[0] = ncoeff*nx + mu*P->u[0];
           P->u[1] = ncoeff*ny + mu*P->u[1];
           P->u[2] = ncoeff*nz + mu*P->u[2];
-          P->D[0] = P->u[0]? (FLOOR(P->i[0]) + (P->u[0]>0) - P->i[0])*G->d[0]/P->u[0]: INFINITY; // Recalculate voxel boundary distance for x
-          P->D[1] = P->u[1]? (FLOOR(P->i[1]) + (P->u[1]>0) - P->i[1])*G->d[1]/P->u[1]: INFINITY; // Recalculate voxel boundary distance for y
-          P->D[2] = P->u[2]? (FLOOR(P->i[2]) + (P->u[2]>0) - P->i[2])*G->d[2]/P->u[2]: INFINITY; // Recalculate voxel boundary distance for z
-          P->RI = G->RIv[G->M[j_new]]; // Since we have refracted into the new medium, we retrieve the new refractive index
+          for(idx=0;idx<3;idx++) P->D[idx] = getBoundaryDistance(P,G,(int)idx); // Recalculate voxel boundary distances
+          P->RI = G->RIv[G->M[j_new] - 1]; // Since we have refracted into the new medium, we retrieve the new refractive index
+          if(G->calcTelemetry) P->telemetry.refractions++;
           if(G->M[j_new] >= DC->minIdx && G->M[j_new] <= DC->maxIdx) {
             P->refractions++;
             P->interfaceTransitions++;
           }
         }
       }
-    } else if(G->M[j_new] != G->M[P->j] && G->RIv[G->M[P->j]] == P->RI) { // No refraction or reflection, but we are in a new medium. The G->RIv[G->M[P->j]] == P->RI check is to ensure that we are not just coming out from a reflection event, because in that case the RI of the old voxel will not correspond to the P->RI value.
+    } else if(G->M[j_new] != G->M[P->j] && G->RIv[G->M[P->j] - 1] == P->RI) { // No refraction or reflection, but we are in a new medium. The G->RIv[G->M[P->j] - 1] == P->RI check is to ensure that we are not just coming out from a reflection event, because in that case the RI of the old voxel will not correspond to the P->RI value.
       if(G->M[j_new] >= DC->minIdx && G->M[j_new] <= DC->maxIdx)
         P->interfaceTransitions++;
     }
   }
   
-  FLOATORDBL absorb = -P->weight*EXPM1(-P->mua*s);   // photon weight absorbed at this step. expm1(x) = exp(x) - 1, accurate even for very small x 
-  P->weight -= absorb;             // decrement WEIGHT by amount absorbed
+  FLOATORDBL absorb = 0;
+  if(G->nSpectral) {
+    scoreSpectralStep(P,G,O,DC,s,jScore,iMid,tMid);
+  } else {
+    absorb = -P->weight*EXPM1(-P->mua*s);   // photon weight absorbed at this step. expm1(x) = exp(x) - 1, accurate even for very small x 
+    if(O->NFR_rz && P->insideVolume && depositionCriteriaMet(P,DC)) { // Axisymmetric outputs are scored at the middle of the step, in the z slice of the current voxel
+      long ir = getRadialIndex(G,iMid[0],iMid[1]);
+      if(ir >= 0) atomicAddWrapper(&O->NFR_rz[ir + G->nr*(jScore/(G->n[0]*G->n[1]))],P->mua? absorb/P->mua: P->weight*s); // absorb/mua tends to weight*s for mua -> 0
+    }
+    if(O->NFR_grid && P->insideVolume && depositionCriteriaMet(P,DC)) { // The scoring grid is also scored at the middle of the step
+      long ig = getGridIndex(G,iMid,tMid);
+      if(ig >= 0) atomicAddWrapper(&O->NFR_grid[ig],P->mua? absorb/P->mua: P->weight*s);
+    }
+    P->weight -= absorb;             // decrement WEIGHT by amount absorbed
+  }
+  if(P->pathlengths) P->pathlengths[G->M[P->j] - 1] += s; // P->j still refers to the voxel that the step was taken in
 
   if(P->insideVolume) {  // only save data if the photon is inside simulation cuboid
-    if(!DC->evaluateCriteriaAtEndOfLife) {
-      if(O->NFR && depositionCriteriaMet(P,DC)) {
-        atomicAddWrapper(&O->NFR[P->j],absorb);
+    if(!DC->evaluateCriteriaAtEndOfLife && !G->nSpectral) {
+      if((O->NFR || O->NFR_float) && depositionCriteriaMet(P,DC)) {
+        depositNFR(P,O,getNFRidx(G,jScore),absorb);
       }
-    } else { // store indices and weights in pseudosparse array, to later add to NFR if photon ends up on the light collector
+    }
+    if(P->recordSize && getNFRidx(G,jScore) >= 0) { // store indices, weights and pathlengths in pseudosparse array, to later add to NFR and J if photon ends up on the light collector. Voxels outside the region of interest are not stored.
       if(P->recordElems == P->recordSize) {
         P->recordSize *= 2; // double the record's size
+        if(G->calcTelemetry) P->telemetry.recordReallocations++;
         P->j_record = (long *)reallocWrapper(P->j_record,P->recordSize/2*sizeof(long),P->recordSize*sizeof(long));
         P->weight_record = (FLOATORDBL *)reallocWrapper(P->weight_record,P->recordSize/2*sizeof(FLOATORDBL),P->recordSize*sizeof(FLOATORDBL));
+        P->pathlength_record = (FLOATORDBL *)reallocWrapper(P->pathlength_record,P->recordSize/2*sizeof(FLOATORDBL),P->recordSize*sizeof(FLOATORDBL));
       }
-      P->j_record[P->recordElems] = P->j;
+      P->j_record[P->recordElems] = getNFRidx(G,jScore);
       P->weight_record[P->recordElems] = absorb;
+      P->pathlength_record[P->recordElems] = s;
       P->recordElems++;
     }
   }
@@ -1121,14 +2036,20 @@ void propagatePhoton(struct photon * const P, struct geometry const * const G, s
 #ifdef __NVCC__ // If compiling for CUDA
 __device__
 #endif
-void checkRoulette(struct photon * const P) {
+void checkRoulette(struct photon * const P, struct geometry const * const G) {
   /**** CHECK ROULETTE
-   * If photon weight below THRESHOLD, then terminate photon using Roulette technique.
+   * If photon weight below THRESHOLD (relative to the weight at launch), then terminate photon using Roulette technique.
    * Photon has CHANCE probability of having its weight increased by factor of 1/CHANCE,
    * and 1-CHANCE probability of terminating. */
-  if(P->weight < THRESHOLD) {
-    if(RandomNum <= CHANCE) P->weight /= CHANCE;
-    else P->alive = false;
+  if(P->weight < THRESHOLD*P->launchWeight) {
+    if(RandomNum <= CHANCE) {
+      P->weight /= CHANCE;
+      for(int iL=0;iL<G->nSpectral;iL++) P->spectralWeights[iL] /= CHANCE;
+      if(G->calcTelemetry) P->telemetry.rouletteSurvivals++;
+    } else {
+      P->alive = false;
+      if(G->calcTelemetry) P->telemetry.rouletteKills++;
+    }
   }
 }
 
@@ -1137,6 +2058,7 @@ __device__
 #endif
 void scatterPhoton(struct photon * const P, struct geometry const * const G, struct paths *Pa, struct depositionCriteria *DC, struct debug *D) {
   FLOATORDBL costheta;
+  if(G->calcTelemetry) P->telemetry.scatterings++;
   if(ISNAN(P->g)) {
     // Sample for theta using the cumulative distribution function (CDF)
     long jTheta = binaryTreeSearch(RandomNum,CDFSIZE,G->CDFs + P->CDFidx*CDFSIZE);
@@ -1166,7 +2088,7 @@ void scatterPhoton(struct photon * const P, struct geometry const * const G, str
   }
 
   // Calculate distances to next voxel boundary planes
-  for(long idx=0;idx<3;idx++) P->D[idx] = P->u[idx]? (FLOOR(P->i[idx]) + (P->u[idx]>0) - P->i[idx])*G->d[idx]/P->u[idx] : INFINITY;
+  for(int idx=0;idx<3;idx++) P->D[idx] = getBoundaryDistance(P,G,idx);
   
   P->stepLeft  = -LOG(RandomNum);
 
@@ -1183,68 +2105,376 @@ void scatterPhoton(struct photon * const P, struct geometry const * const G, str
   }
 }
 
-void normalizeDepositionAndResetO(struct source const * const B, struct geometry const * const G, struct lightCollector const * const LC,
-        struct outputs *O, struct MATLABoutputs *O_MATLAB, long iWavelength, double Pfraction) {
-  long j;
+double normalizeDepositionAndResetO(struct source const * const B, struct geometry const * const G, struct lightCollector const * const LC,
+        struct outputs *O, struct MATLABoutputs *O_MATLAB, long iWavelength, double Pfraction, int nThreads) {
   double V = G->d[0]*G->d[1]*G->d[2]; // Voxel volume
   long L = G->n[0]*G->n[1]*G->n[2]; // Total number of voxels in cuboid
-  long L_LC = LC->res[0]*LC->res[0]; // Total number of spatial pixels in light collector planes
+  long L_NFR = getNFRlength(G); // Number of voxels in the simulated part of the cuboid or the region of interest
+  long L_ROI = getROIlength(G); // Number of voxels in the returned NFR and Jacobian arrays
+  double nMirrorImages = G->mirrorSymmetry? (double)L/L_NFR: 1;
+  long L_image = getImageLength(G,LC); // Total number of pixels in the light collector images
   long L_FF = G->farFieldRes*G->farFieldRes; // Total number of pixels in the far field array
+  FLOATORDBL *NI[6] = {O->NI_xpos,O->NI_xneg,O->NI_ypos,O->NI_yneg,O->NI_zpos,O->NI_zneg};
+  float *NI_MATLAB[6] = {O_MATLAB->NI_xpos,O_MATLAB->NI_xneg,O_MATLAB->NI_ypos,O_MATLAB->NI_yneg,O_MATLAB->NI_zpos,O_MATLAB->NI_zneg};
+  double NIarea[6] = {G->d[1]*G->d[2],G->d[1]*G->d[2],G->d[0]*G->d[2],G->d[0]*G->d[2],G->d[0]*G->d[1],G->d[0]*G->d[1]}; // Areas of the boundary pixels
   // Normalize deposition to yield normalized fluence rate (NFR). For fluorescence, the result is relative to
   // the incident excitation power (not emitted fluorescence power).
   double normfactor = (double)O->nPhotons/Pfraction;
   if(B->S) { // For a 3D source distribution (e.g., fluorescence)
     normfactor /= B->power;
-  } else if(B->beamType == 2 && (G->boundaryType == 0 || G->boundaryType == 2)) { // For infinite plane wave launched into volume without absorbing walls
+  } else if(B->beams[0].beamType == 2 && (G->boundaryType == 0 || G->boundaryType == 2)) { // For infinite plane waves launched into volume without absorbing walls (all or none of the light sources are plane waves, checked in MATLAB)
     normfactor /= KILLRANGE*KILLRANGE;
   }
   
   O->nPhotons = 0;
   O->nPhotonsCollected = 0;
-  if(O->NFR) for(j=0;j<L   ;j++) {
-    O_MATLAB->NFR[j + (unsigned long long)iWavelength*G->n[0]*G->n[1]*G->n[2]] = (float)(O->NFR[j]/(V*normfactor*G->muav[G->M[j]]));
-    O->NFR[j] = 0;
-  }
-  if(O->FF) for(j=0;j<L_FF;j++) {
-    O_MATLAB->FF[j + iWavelength*G->farFieldRes*G->farFieldRes] = (float)(O->FF[j]/normfactor);
-    O->FF[j] = 0;
-  }
-  if(O->image) {
-    if(L_LC > 1) for(j=0;j<L_LC*LC->res[1];j++) {
-      O_MATLAB->image[j + iWavelength*LC->res[0]*LC->res[0]*LC->res[1]] = (float)(O->image[j]/(LC->FSorNA*LC->FSorNA/L_LC*normfactor));
-      O->image[j] = 0;
+  O->launchedInside = false;
+  // The arrays are normalized and reset by all threads together. Each accumulator element is read, converted and zeroed in the same pass,
+  // except for the NFR with mirror symmetry or a region of interest, where the returned voxels do not map one-to-one to the accumulators.
+  #ifdef _OPENMP
+  #pragma omp parallel num_threads(nThreads)
+  #endif
+  {
+    if(O->NFR || O->NFR_float) { // With mirror symmetry, the simulated part is unfolded into the full cuboid. Each stored voxel then holds the deposition of all its L/L_NFR mirror images.
+      #ifdef _OPENMP
+      #pragma omp for schedule(static)
+      #endif
+      for(long j=0;j<L_ROI;j++) {
+        long jVoxel = getROIvoxel(G,j);
+        O_MATLAB->NFR[j + (unsigned long long)iWavelength*L_ROI] = (float)(getNFRaccumulator(O,getNFRidx(G,jVoxel))/(nMirrorImages*V*normfactor*G->muav[G->M[jVoxel] - 1]));
+      }
+      #ifdef _OPENMP
+      #pragma omp for schedule(static)
+      #endif
+      for(long j=0;j<L_NFR;j++) if(O->NFR) O->NFR[j] = 0; else O->NFR_float[j] = 0;
     }
-    else         for(j=0;j<     LC->res[1];j++) {
-      O_MATLAB->image[j + iWavelength*LC->res[0]*LC->res[0]*LC->res[1]] = (float)(O->image[j]/normfactor);
-      O->image[j] = 0;
+    if(O->NFR_rz) {
+      #ifdef _OPENMP
+      #pragma omp for schedule(static) nowait
+      #endif
+      for(long j=0;j<G->nr*G->n[2];j++) {
+        long ir = j%G->nr;
+        O_MATLAB->NFR_rz[j + iWavelength*G->nr*G->n[2]] = (float)(O->NFR_rz[j]/(PI*(2*ir+1)*G->d[0]*G->d[0]*G->d[2]*normfactor)); // Ring volume is pi*((ir+1)^2 - ir^2)*dr^2*dz
+        O->NFR_rz[j] = 0;
+      }
+    }
+    if(O->NI_zpos_r) {
+      #ifdef _OPENMP
+      #pragma omp for schedule(static) nowait
+      #endif
+      for(long j=0;j<G->nr;j++) {
+        O_MATLAB->NI_zpos_r[j + iWavelength*G->nr] = (float)(O->NI_zpos_r[j]/(PI*(2*j+1)*G->d[0]*G->d[0]*normfactor));
+        O->NI_zpos_r[j] = 0;
+      }
+    }
+    if(O->NI_zneg_r) {
+      #ifdef _OPENMP
+      #pragma omp for schedule(static) nowait
+      #endif
+      for(long j=0;j<G->nr;j++) {
+        O_MATLAB->NI_zneg_r[j + iWavelength*G->nr] = (float)(O->NI_zneg_r[j]/(PI*(2*j+1)*G->d[0]*G->d[0]*normfactor));
+        O->NI_zneg_r[j] = 0;
+      }
+    }
+    if(O->NFR_grid) {
+      #ifdef _OPENMP
+      #pragma omp for schedule(static) nowait
+      #endif
+      for(long j=0;j<getGridLength(G);j++) {
+        O_MATLAB->NFR_grid[j + iWavelength*getGridLength(G)] = (float)(O->NFR_grid[j]/(V*G->gridStep[0]*G->gridStep[1]*G->gridStep[2]*normfactor));
+        O->NFR_grid[j] = 0;
+      }
+    }
+    if(O->J) { // The collected weight W depends on the absorption coefficient of voxel j as exp(-mua_j*l_j), where l_j is the pathlength in the voxel, so dW/dmua_j = -l_j*W
+      #ifdef _OPENMP
+      #pragma omp for schedule(static) nowait
+      #endif
+      for(long j=0;j<L_ROI;j++) {
+        O_MATLAB->J[j + (unsigned long long)iWavelength*L_ROI] = (float)(-O->J[j]/normfactor);
+        O->J[j] = 0;
+      }
+    }
+    if(O->FF) {
+      #ifdef _OPENMP
+      #pragma omp for schedule(static) nowait
+      #endif
+      for(long j=0;j<L_FF;j++) {
+        O_MATLAB->FF[j + iWavelength*G->farFieldRes*G->farFieldRes] = (float)(O->FF[j]/normfactor);
+        O->FF[j] = 0;
+      }
+    }
+    if(O->image) for(int iLC=0;iLC<G->nLC;iLC++) {
+      long L_LC = LC[iLC].res[0]*LC[iLC].res[0]; // Total number of spatial pixels in the light collector plane
+      double imageFactor = L_LC > 1? LC[iLC].FSorNA*LC[iLC].FSorNA/L_LC*normfactor: normfactor;
+      #ifdef _OPENMP
+      #pragma omp for schedule(static) nowait
+      #endif
+      for(long j=LC[iLC].imageStart;j<LC[iLC].imageStart + L_LC*LC[iLC].res[1];j++) {
+        O_MATLAB->image[j + iWavelength*L_image] = (float)(O->image[j]/imageFactor);
+        O->image[j] = 0;
+      }
+    }
+    for(int iNI=0;iNI<6;iNI++) if(NI[iNI]) {
+      #ifdef _OPENMP
+      #pragma omp for schedule(static) nowait
+      #endif
+      for(long j=0;j<getNIlength(G,iNI);j++) {
+        NI_MATLAB[iNI][j + iWavelength*getNIlength(G,iNI)] = (float)(NI[iNI][j]/(NIarea[iNI]*normfactor));
+        NI[iNI][j] = 0;
+      }
     }
   }
-  if(G->boundaryType == 1) {
-    for(j=0;j<G->n[1]*G->n[2];j++) {
-      O_MATLAB->NI_xpos[j + iWavelength*G->n[1]*G->n[2]] = (float)(O->NI_xpos[j]/(G->d[1]*G->d[2]*normfactor));
-      O->NI_xpos[j] = 0;
-      O_MATLAB->NI_xneg[j + iWavelength*G->n[1]*G->n[2]] = (float)(O->NI_xneg[j]/(G->d[1]*G->d[2]*normfactor));
-      O->NI_xneg[j] = 0;
+  return normfactor;
+}
+
+void denormalizeDepositionIntoO(struct source const * const B, struct geometry const * const G, struct lightCollector const * const LC,
+        struct outputs *O, struct MATLABoutputs const *O_MATLAB, long iWavelength, double Pfraction, double nPhotonsPrevious) {
+  // The inverse of normalizeDepositionAndResetO. The normalized outputs of a previous simulation of nPhotonsPrevious photons are converted
+  // back into accumulator values, so that the simulation can be continued by adding more photons to them. The photon counters are not
+  // changed; the previous photons are added to O->nPhotons before the normalization.
+  long j;
+  double V = G->d[0]*G->d[1]*G->d[2]; // Voxel volume
+  long L = G->n[0]*G->n[1]*G->n[2]; // Total number of voxels in cuboid
+  long L_NFR = getNFRlength(G); // Number of voxels in the simulated part of the cuboid or the region of interest
+  long L_ROI = getROIlength(G); // Number of voxels in the returned NFR and Jacobian arrays
+  double nMirrorImages = G->mirrorSymmetry? (double)L/L_NFR: 1;
+  long L_image = getImageLength(G,LC); // Total number of pixels in the light collector images
+  long L_FF = G->farFieldRes*G->farFieldRes; // Total number of pixels in the far field array
+  FLOATORDBL *NI[6] = {O->NI_xpos,O->NI_xneg,O->NI_ypos,O->NI_yneg,O->NI_zpos,O->NI_zneg};
+  float const *NI_MATLAB[6] = {O_MATLAB->NI_xpos,O_MATLAB->NI_xneg,O_MATLAB->NI_ypos,O_MATLAB->NI_yneg,O_MATLAB->NI_zpos,O_MATLAB->NI_zneg};
+  double NIarea[6] = {G->d[1]*G->d[2],G->d[1]*G->d[2],G->d[0]*G->d[2],G->d[0]*G->d[2],G->d[0]*G->d[1],G->d[0]*G->d[1]}; // Areas of the boundary pixels
+  double normfactor = nPhotonsPrevious/Pfraction;
+  if(B->S) { // For a 3D source distribution (e.g., fluorescence)
+    normfactor /= B->power;
+  } else if(B->beams[0].beamType == 2 && (G->boundaryType == 0 || G->boundaryType == 2)) { // For infinite plane waves launched into volume without absorbing walls (all or none of the light sources are plane waves, checked in MATLAB)
+    normfactor /= KILLRANGE*KILLRANGE;
+  }
+
+  if(O->NFR || O->NFR_float) for(j=0;j<L_ROI;j++) { // All mirror images of a simulated voxel hold the same value. Voxels with mua = 0 have no deposition.
+    long jVoxel = getROIvoxel(G,j);
+    double NFRj = G->muav[G->M[jVoxel] - 1]? O_MATLAB->NFR[j + (unsigned long long)iWavelength*L_ROI]*(nMirrorImages*V*normfactor*G->muav[G->M[jVoxel] - 1]): 0;
+    if(O->NFR) O->NFR[getNFRidx(G,jVoxel)] = NFRj; else O->NFR_float[getNFRidx(G,jVoxel)] = (float)NFRj;
+  }
+  if(O->NFR_rz) for(j=0;j<G->nr*G->n[2];j++) O->NFR_rz[j] = O_MATLAB->NFR_rz[j + iWavelength*G->nr*G->n[2]]*(PI*(2*(j%G->nr)+1)*G->d[0]*G->d[0]*G->d[2]*normfactor);
+  if(O->NI_zpos_r) for(j=0;j<G->nr;j++) O->NI_zpos_r[j] = O_MATLAB->NI_zpos_r[j + iWavelength*G->nr]*(PI*(2*j+1)*G->d[0]*G->d[0]*normfactor);
+  if(O->NI_zneg_r) for(j=0;j<G->nr;j++) O->NI_zneg_r[j] = O_MATLAB->NI_zneg_r[j + iWavelength*G->nr]*(PI*(2*j+1)*G->d[0]*G->d[0]*normfactor);
+  if(O->NFR_grid) for(j=0;j<getGridLength(G);j++) O->NFR_grid[j] = O_MATLAB->NFR_grid[j + iWavelength*getGridLength(G)]*(V*G->gridStep[0]*G->gridStep[1]*G->gridStep[2]*normfactor);
+  if(O->J) for(j=0;j<L_ROI;j++) O->J[j] = -O_MATLAB->J[j + (unsigned long long)iWavelength*L_ROI]*normfactor;
+  if(O->FF) for(j=0;j<L_FF;j++) O->FF[j] = O_MATLAB->FF[j + iWavelength*G->farFieldRes*G->farFieldRes]*normfactor;
+  if(O->image) for(int iLC=0;iLC<G->nLC;iLC++) {
+    long L_LC = LC[iLC].res[0]*LC[iLC].res[0]; // Total number of spatial pixels in the light collector plane
+    double imageFactor = L_LC > 1? LC[iLC].FSorNA*LC[iLC].FSorNA/L_LC*normfactor: normfactor;
+    for(j=LC[iLC].imageStart;j<LC[iLC].imageStart + L_LC*LC[iLC].res[1];j++) O->image[j] = O_MATLAB->image[j + iWavelength*L_image]*imageFactor;
+  }
+  for(int iNI=0;iNI<6;iNI++) if(NI[iNI]) for(j=0;j<getNIlength(G,iNI);j++) NI[iNI][j] = NI_MATLAB[iNI][j + iWavelength*getNIlength(G,iNI)]*(NIarea[iNI]*normfactor);
+}
+
+double getPilotNoise(struct geometry const * const G, struct lightCollector const * const LC, struct outputs const *O,
+        float const *NFR_firstHalf, FLOATORDBL const *image_firstHalf, unsigned long long nPhotonsFirstHalf) {
+  // Estimate the variance per photon of the deposition, summed over all voxels, from the difference between the two halves of a pilot
+  // run. The NFR deposition is divided by mua as in the normalization. If the NFR is not calculated, the light collector image is used.
+  double n1 = (double)nPhotonsFirstHalf;
+  double n2 = (double)(O->nPhotons - nPhotonsFirstHalf);
+  double noise = 0;
+  long j;
+  if(!n1 || !n2) return 0;
+  if(O->NFR || O->NFR_float) {
+    for(j=0;j<G->n[0]*G->n[1]*G->n[2];j++) if(G->muav[G->M[j] - 1] && getNFRidx(G,j) >= 0) {
+      long k = getNFRidx(G,j);
+      noise += sqr((NFR_firstHalf[k]/n1 - (getNFRaccumulator(O,k) - NFR_firstHalf[k])/n2)/G->muav[G->M[j] - 1]);
     }
-    for(j=0;j<G->n[0]*G->n[2];j++) {
-      O_MATLAB->NI_ypos[j + iWavelength*G->n[0]*G->n[2]] = (float)(O->NI_ypos[j]/(G->d[0]*G->d[2]*normfactor));
-      O->NI_ypos[j] = 0;
-      O_MATLAB->NI_yneg[j + iWavelength*G->n[0]*G->n[2]] = (float)(O->NI_yneg[j]/(G->d[0]*G->d[2]*normfactor));
-      O->NI_yneg[j] = 0;
+  } else if(O->image) {
+    for(j=0;j<getImageLength(G,LC);j++) noise += sqr(image_firstHalf[j]/n1 - (O->image[j] - image_firstHalf[j])/n2);
+  } else {
+    return 1; // Nothing to measure the noise on, so all wavelengths are assumed equally noisy
+  }
+  return noise/(1/n1 + 1/n2);
+}
+
+void getAllocationFractions(int nL, double const *weights, double const *costs, bool simulationTimed, double *fractions) {
+  // The fractions of the budget are proportional to the weights for a photon budget and to weight*sqrt(cost) for a time budget. No
+  // wavelength gets less than 1% of an equal share, so that all wavelengths get some photons and a normalization.
+  double sum = 0;
+  int iL;
+  for(iL=0;iL<nL;iL++) sum += fractions[iL] = simulationTimed? weights[iL]*sqrt(costs[iL]): weights[iL];
+  if(!(sum > 0) || !ISFINITE(sum)) {
+    for(iL=0;iL<nL;iL++) fractions[iL] = 1.0/nL;
+    return;
+  }
+  double sumFloored = 0;
+  for(iL=0;iL<nL;iL++) sumFloored += fractions[iL] = max(fractions[iL]/sum,0.01/nL);
+  for(iL=0;iL<nL;iL++) fractions[iL] /= sumFloored;
+}
+
+#ifndef __NVCC__
+int getNextWavelength(struct wavelengthScheduler *WS, bool simulationTimed, bool requestCollectedPhotons) {
+  // Returns the wavelength that is furthest behind its share of the budget, so that all wavelengths finish at the same time, or -1 if all
+  // wavelengths have received their requested number of photons. The shared counters are read without synchronization, which is
+  // harmless since they are only used for scheduling.
+  int iLnext = -1;
+  double leastProgress = INFINITY;
+  for(int iL=0;iL<WS->nL;iL++) {
+    double progress;
+    if(simulationTimed) {
+      progress = WS->timeFractions[iL]? WS->threadTime[iL]/WS->timeFractions[iL]: INFINITY;
+    } else {
+      unsigned long long n = requestCollectedPhotons? WS->O[iL].nPhotonsCollected: WS->O[iL].nPhotons;
+      if(n + THREADNUM >= WS->nPhotonsRequested[iL]) continue; // "+ THREADNUM" reduces the number of excess photons launched, as in threadInitAndLoop
+      progress = (double)n/WS->nPhotonsRequested[iL];
     }
-    for(j=0;j<G->n[0]*G->n[1];j++) {
-      O_MATLAB->NI_zpos[j + iWavelength*G->n[0]*G->n[1]] = (float)(O->NI_zpos[j]/(G->d[0]*G->d[1]*normfactor));
-      O->NI_zpos[j] = 0;
-      O_MATLAB->NI_zneg[j + iWavelength*G->n[0]*G->n[1]] = (float)(O->NI_zneg[j]/(G->d[0]*G->d[1]*normfactor));
-      O->NI_zneg[j] = 0;
+    if(progress < leastProgress) {
+      leastProgress = progress;
+      iLnext = iL;
     }
-  } else if(G->boundaryType == 2) for(j=0;j<KILLRANGE*G->n[0]*KILLRANGE*G->n[1];j++) {
-    O_MATLAB->NI_zneg[j + iWavelength*G->n[0]*G->n[1]*(G->boundaryType == 2? KILLRANGE*KILLRANGE: 1)] = (float)(O->NI_zneg[j]/(G->d[0]*G->d[1]*normfactor));
-    O->NI_zneg[j] = 0;
-  } else if(G->boundaryType == 3) for(j=0;j<G->n[0]*G->n[1];j++) {
-    O_MATLAB->NI_zpos[j + iWavelength*G->n[0]*G->n[1]] = (float)(O->NI_zpos[j]/(G->d[0]*G->d[1]*normfactor));
-    O->NI_zpos[j] = 0;
-    O_MATLAB->NI_zneg[j + iWavelength*G->n[0]*G->n[1]] = (float)(O->NI_zneg[j]/(G->d[0]*G->d[1]*normfactor));
-    O->NI_zneg[j] = 0;
   }
+  return iLnext;
+}
+
+double getSchedulerPhotonProgress(struct wavelengthScheduler const *WS, bool requestCollectedPhotons) {
+  double n = 0, nRequested = 0;
+  for(int iL=0;iL<WS->nL;iL++) {
+    n += (double)(requestCollectedPhotons? WS->O[iL].nPhotonsCollected: WS->O[iL].nPhotons);
+    nRequested += (double)WS->nPhotonsRequested[iL];
+  }
+  return n/nRequested;
+}
+
+FLOATORDBL *callocLike(FLOATORDBL const *ptr, long L) {
+  if(!ptr) return NULL;
+  FLOATORDBL *newPtr = (FLOATORDBL *)calloc(L,sizeof(FLOATORDBL));
+  if(!newPtr) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+  return newPtr;
+}
+
+void allocateOutputsLike(struct outputs *O_new, struct outputs const *O, struct geometry const *G, struct lightCollector const *LC) {
+  // Gives O_new its own zeroed accumulators for each of the outputs that O has
+  *O_new = *O;
+  O_new->nPhotons = O_new->nPhotonsCollected = O_new->nLaunches = 0;
+  O_new->launchedInside = false;
+  O_new->NFR       = callocLike(O->NFR,getNFRlength(G));
+  O_new->NFR_float = O->NFR_float? (float *)calloc(getNFRlength(G),sizeof(float)): NULL;
+  if(O->NFR_float && !O_new->NFR_float) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+  O_new->image     = callocLike(O->image,getImageLength(G,LC));
+  O_new->FF        = callocLike(O->FF,G->farFieldRes*G->farFieldRes);
+  O_new->NI_xpos   = callocLike(O->NI_xpos,getNIlength(G,0));
+  O_new->NI_xneg   = callocLike(O->NI_xneg,getNIlength(G,1));
+  O_new->NI_ypos   = callocLike(O->NI_ypos,getNIlength(G,2));
+  O_new->NI_yneg   = callocLike(O->NI_yneg,getNIlength(G,3));
+  O_new->NI_zpos   = callocLike(O->NI_zpos,getNIlength(G,4));
+  O_new->NI_zneg   = callocLike(O->NI_zneg,getNIlength(G,5));
+  O_new->J         = callocLike(O->J,getROIlength(G));
+  O_new->NFR_rz    = callocLike(O->NFR_rz,G->nr*G->n[2]);
+  O_new->NI_zpos_r = callocLike(O->NI_zpos_r,G->nr);
+  O_new->NI_zneg_r = callocLike(O->NI_zneg_r,G->nr);
+  O_new->NFR_grid  = callocLike(O->NFR_grid,getGridLength(G));
+}
+
+void freeOutputs(struct outputs *O) {
+  free(O->NFR);
+  free(O->NFR_float);
+  free(O->image);
+  free(O->FF);
+  free(O->NI_xpos);
+  free(O->NI_xneg);
+  free(O->NI_ypos);
+  free(O->NI_yneg);
+  free(O->NI_zpos);
+  free(O->NI_zneg);
+  free(O->J);
+  free(O->NFR_rz);
+  free(O->NI_zpos_r);
+  free(O->NI_zneg_r);
+  free(O->NFR_grid);
 }
+
+void getOutputArrays(struct outputs *O, struct geometry const *G, struct lightCollector const *LC, FLOATORDBL **arrays[NOUTPUTARRAYS], long lengths[NOUTPUTARRAYS]) {
+  // Pointers to each of the accumulator array pointers in O, in struct order, and their lengths
+  FLOATORDBL **a[NOUTPUTARRAYS] = {&O->NFR,&O->image,&O->FF,&O->NI_xpos,&O->NI_xneg,&O->NI_ypos,&O->NI_yneg,&O->NI_zpos,&O->NI_zneg,&O->J,&O->NFR_rz,&O->NI_zpos_r,&O->NI_zneg_r,&O->NFR_grid};
+  long l[NOUTPUTARRAYS] = {getNFRlength(G),getImageLength(G,LC),G->farFieldRes*G->farFieldRes,getNIlength(G,0),getNIlength(G,1),getNIlength(G,2),getNIlength(G,3),
+                           getNIlength(G,4),getNIlength(G,5),getROIlength(G),G->nr*G->n[2],G->nr,G->nr,getGridLength(G)};
+  for(int k=0;k<NOUTPUTARRAYS;k++) {
+    arrays[k] = a[k];
+    lengths[k] = l[k];
+  }
+}
+
+void getMATLABoutputArrays(struct MATLABoutputs *O_MATLAB, struct geometry const *G, struct lightCollector const *LC, int nL, float *arrays[NOUTPUTARRAYS], long lengths[NOUTPUTARRAYS]) {
+  // The MATLAB output arrays of all wavelengths and their total lengths. They are in the same order as the accumulators in struct outputs.
+  float *a[NOUTPUTARRAYS] = {O_MATLAB->NFR,O_MATLAB->image,O_MATLAB->FF,O_MATLAB->NI_xpos,O_MATLAB->NI_xneg,O_MATLAB->NI_ypos,O_MATLAB->NI_yneg,
+                             O_MATLAB->NI_zpos,O_MATLAB->NI_zneg,O_MATLAB->J,O_MATLAB->NFR_rz,O_MATLAB->NI_zpos_r,O_MATLAB->NI_zneg_r,O_MATLAB->NFR_grid};
+  long l[NOUTPUTARRAYS] = {getROIlength(G),getImageLength(G,LC),G->farFieldRes*G->farFieldRes,getNIlength(G,0),getNIlength(G,1),getNIlength(G,2),getNIlength(G,3),
+                           getNIlength(G,4),getNIlength(G,5),getROIlength(G),G->nr*G->n[2],G->nr,G->nr,getGridLength(G)};
+  for(int k=0;k<NOUTPUTARRAYS;k++) {
+    arrays[k] = a[k];
+    lengths[k] = a[k]? l[k]*nL: 0;
+  }
+}
+
+void appendToCheckpoint(struct checkpoint *CP, void const *data, size_t nBytes) {
+  if(CP->bufferElems + nBytes > CP->bufferSize) {
+    size_t newSize = max(2*CP->bufferSize,CP->bufferElems + nBytes);
+    char *newBuffer = (char *)realloc(CP->buffer,newSize);
+    if(!newBuffer) mexErrMsgIdAndTxt("MCmatlab:OutOfMemory","Error: Out of memory");
+    CP->buffer = newBuffer;
+    CP->bufferSize = newSize;
+  }
+  memcpy(CP->buffer + CP->bufferElems,data,nBytes);
+  CP->bufferElems += nBytes;
+}
+
+void readFromCheckpoint(struct checkpointReader *R, void *data, size_t nBytes) {
+  if(R->pos + nBytes > R->size) mexErrMsgIdAndTxt("MCmatlab:CheckpointError","Error: The checkpoint file %s is truncated or does not match the model",R->fileName);
+  memcpy(data,R->data + R->pos,nBytes);
+  R->pos += nBytes;
+}
+
+void appendOutputsToCheckpoint(struct checkpoint *CP, struct outputs *O, int nO, struct geometry const *G, struct lightCollector const *LC) {
+  for(int iO=0;iO<nO;iO++) {
+    FLOATORDBL **arrays[NOUTPUTARRAYS];
+    long lengths[NOUTPUTARRAYS];
+    getOutputArrays(&O[iO],G,LC,arrays,lengths);
+    appendToCheckpoint(CP,&O[iO].nPhotons,sizeof(unsigned long long));
+    appendToCheckpoint(CP,&O[iO].nPhotonsCollected,sizeof(unsigned long long));
+    appendToCheckpoint(CP,&O[iO].nLaunches,sizeof(unsigned long long));
+    for(int k=0;k<NOUTPUTARRAYS;k++) if(*arrays[k]) appendToCheckpoint(CP,*arrays[k],lengths[k]*sizeof(FLOATORDBL));
+    if(O[iO].NFR_float) appendToCheckpoint(CP,O[iO].NFR_float,getNFRlength(G)*sizeof(float));
+  }
+}
+
+void readOutputsFromCheckpoint(struct checkpointReader *R, struct outputs *O, int nO, struct geometry const *G, struct lightCollector const *LC) {
+  for(int iO=0;iO<nO;iO++) {
+    FLOATORDBL **arrays[NOUTPUTARRAYS];
+    long lengths[NOUTPUTARRAYS];
+    getOutputArrays(&O[iO],G,LC,arrays,lengths);
+    readFromCheckpoint(R,&O[iO].nPhotons,sizeof(unsigned long long));
+    readFromCheckpoint(R,&O[iO].nPhotonsCollected,sizeof(unsigned long long));
+    readFromCheckpoint(R,&O[iO].nLaunches,sizeof(unsigned long long));
+    O[iO].launchedInside = O[iO].nPhotons > 0; // Simulations in which no photon was launched inside the launch region are stopped before the checkpoint
+    for(int k=0;k<NOUTPUTARRAYS;k++) if(*arrays[k]) readFromCheckpoint(R,*arrays[k],lengths[k]*sizeof(FLOATORDBL));
+    if(O[iO].NFR_float) readFromCheckpoint(R,O[iO].NFR_float,getNFRlength(G)*sizeof(float));
+  }
+}
+
+void writeCheckpoint(struct checkpoint *CP) {
+  // Writes the pending snapshot to a temporary file that then replaces the checkpoint file, so that a crash during the writing leaves the
+  // previous checkpoint intact. May be called from a thread other than the master thread, so errors are only flagged here.
+  size_t fileNameLength = strlen(CP->fileName);
+  char *tempFileName = (char *)malloc(fileNameLength + 5);
+  if(!tempFileName) {
+    CP->writeFailed = true;
+    return;
+  }
+  memcpy(tempFileName,CP->fileName,fileNameLength);
+  memcpy(tempFileName + fileNameLength,".tmp",5);
+  FILE *file = fopen(tempFileName,"wb");
+  bool success = file && fwrite(CP->buffer,1,CP->bufferElems,file) == CP->bufferElems;
+  if(file) success = !fclose(file) && success;
+  if(success) {
+    remove(CP->fileName); // rename() does not replace existing files on Windows
+    success = !rename(tempFileName,CP->fileName);
+  }
+  if(!success) CP->writeFailed = true;
+  free(tempFileName);
+  CP->pending = false;
+}
+#endif
@@ -0,0 +1,81 @@
+/********************************************
+ *
+ * mex.h replacement for compiling MCmatlab.c into the standalone executable MCmatlab_standalone
+ * (see MCmatlab_standalone.c). It declares the small subset of the MATLAB C API that MCmatlab.c uses.
+ * The arrays are implemented in MCmatlab_standalone.c as a tree of numeric arrays and objects, read
+ * from and written to model and result files.
+ *
+ * This file is part of MCmatlab.
+ *
+ * MCmatlab is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MCmatlab is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MCmatlab.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ ********************************************/
+
+#ifndef MCMATLAB_STANDALONE_MEX_H
+#define MCMATLAB_STANDALONE_MEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+
+typedef size_t mwSize;
+typedef size_t mwIndex;
+typedef struct mxArray_tag mxArray;
+typedef enum {mxREAL, mxCOMPLEX} mxComplexity;
+typedef enum { // Same numbering as in MATLAB's matrix.h, which is also used in the model and result files
+  mxUNKNOWN_CLASS, mxCELL_CLASS, mxSTRUCT_CLASS, mxLOGICAL_CLASS, mxCHAR_CLASS, mxVOID_CLASS, mxDOUBLE_CLASS, mxSINGLE_CLASS,
+  mxINT8_CLASS, mxUINT8_CLASS, mxINT16_CLASS, mxUINT16_CLASS, mxINT32_CLASS, mxUINT32_CLASS, mxINT64_CLASS, mxUINT64_CLASS
+} mxClassID;
+
+mxArray *mxCreateNumericArray(mwSize ndim, mwSize const *dims, mxClassID classID, mxComplexity flag);
+mxArray *mxCreateNumericMatrix(mwSize m, mwSize n, mxClassID classID, mxComplexity flag);
+mxArray *mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity flag);
+mxArray *mxCreateDoubleScalar(double x);
+mxArray *mxCreateStructMatrix(mwSize m, mwSize n, int nFields, char const **fieldNames);
+mxArray *mxDuplicateArray(mxArray const *a);
+void mxDestroyArray(mxArray *a);
+
+mxArray *mxGetPropertyShared(mxArray const *a, mwIndex index, char const *name);
+mxArray *mxGetProperty(mxArray const *a, mwIndex index, char const *name);
+mxArray *mxGetField(mxArray const *a, mwIndex index, char const *name);
+void mxSetPropertyShared(mxArray *a, mwIndex index, char const *name, mxArray const *value);
+void mxSetProperty(mxArray *a, mwIndex index, char const *name, mxArray const *value);
+void mxSetField(mxArray *a, mwIndex index, char const *name, mxArray *value);
+
+double *mxGetPr(mxArray const *a);
+void *mxGetData(mxArray const *a);
+mwSize mxGetM(mxArray const *a);
+mwSize mxGetN(mxArray const *a);
+mwSize mxGetNumberOfElements(mxArray const *a);
+mwSize const *mxGetDimensions(mxArray const *a);
+bool mxIsSingle(mxArray const *a);
+bool mxIsLogicalScalarTrue(mxArray const *a);
+char *mxArrayToString(mxArray const *a);
+void mxFree(void *p);
+
+bool mxIsNaN(double x);
+bool mxIsInf(double x);
+bool mxIsFinite(double x);
+
+void mexErrMsgIdAndTxt(char const *id, char const *format, ...);
+int mexPrintf(char const *format, ...);
+int mexEvalString(char const *command);
+
+#endif